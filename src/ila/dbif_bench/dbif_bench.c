@@ -0,0 +1,935 @@
+/*
+ * dbif_bench.c - benchmark workloads through the dbif interface
+ *
+ * Copyright (c) 2018, Quantonium Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the Quantonium nor the names of its contributors
+ *     may be used to endorse or promote products derived from this software
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL QUANTONIUM BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Run standardized workloads through struct dbif_ops to compare backends
+ * and their options. Results are written as JSON to stdout.
+ *
+ * Workloads are:
+ *
+ *   write	Single key writes
+ *   read	Single key reads of random written keys
+ *   patch	Single key patches of random written keys
+ *   bulk	Pipelined writes, patches and deletes with submit
+ *   scan	Full scan of the benchmark keys at each of the scan sizes
+ *   watch	Notification throughput and latency of watch_all while a
+ *		writer thread on another connection updates keys
+ *
+ * Benchmark keys are tagged so scans and watches are filtered to them,
+ * but a scratch database should be used. Keys are deleted at the end
+ * unless asked to keep them.
+ */
+
+#include <errno.h>
+#include <event2/event.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "dbif.h"
+#include "dbif_redis.h"
+#include "json_writer.h"
+#include "qbench.h"
+#include "qmetrics.h"
+
+#define BENCH_DEFAULT_HOST	"::1"
+#define BENCH_DEFAULT_PORT	6379
+
+#define BENCH_DEFAULT_OPS	100000
+#define BENCH_DEFAULT_BATCH	1000
+#define BENCH_DEFAULT_VALUE_SIZE	40
+#define BENCH_MAX_VALUE_SIZE	4096
+#define BENCH_DEFAULT_SCAN_SIZES	"1000000,10000000"
+#define BENCH_MAX_SCAN_SIZES	8
+#define BENCH_DEFAULT_WATCH_TIMEOUT	5
+
+#define BENCH_KEY_TAG		"BNC"
+
+struct bench_key {
+	char tag[4];
+	__u32 rsvd;
+	__u64 num;
+};
+
+enum {
+	BENCH_WRITE = 0,
+	BENCH_READ,
+	BENCH_PATCH,
+	BENCH_BULK,
+	BENCH_SCAN,
+	BENCH_WATCH,
+
+	BENCH_NUM_WORKLOADS,
+};
+
+static const char *const workload_names[BENCH_NUM_WORKLOADS] = {
+	[BENCH_WRITE] = "write",
+	[BENCH_READ] = "read",
+	[BENCH_PATCH] = "patch",
+	[BENCH_BULK] = "bulk",
+	[BENCH_SCAN] = "scan",
+	[BENCH_WATCH] = "watch",
+};
+
+static const struct {
+	const char *name;
+	struct dbif_ops *(*get)(void);
+} backends[] = {
+	{ "redis", dbif_get_redis },
+};
+
+#define BENCH_NUM_BACKENDS	(sizeof(backends) / sizeof(backends[0]))
+
+#define ARGS "b:D:w:n:N:B:V:r:T:kp"
+
+static struct option long_options[] = {
+	{ "backend", required_argument, 0, 'b' },
+	{ "dbopts", required_argument, 0, 'D' },
+	{ "workloads", required_argument, 0, 'w' },
+	{ "ops", required_argument, 0, 'n' },
+	{ "scan-keys", required_argument, 0, 'N' },
+	{ "batch", required_argument, 0, 'B' },
+	{ "value-size", required_argument, 0, 'V' },
+	{ "rate", required_argument, 0, 'r' },
+	{ "timeout", required_argument, 0, 'T' },
+	{ "keep", no_argument, 0, 'k' },
+	{ "pretty", no_argument, 0, 'p' },
+	{ NULL, 0, 0, 0 },
+};
+
+static void usage(char *prog_name)
+{
+	fprintf(stderr, "Usage: dbif_bench [-b backend] [-D dbopts] "
+			"[-w workloads] [-n ops] [-N keys,...]\n"
+			"                  [-B batch] [-V bytes] [-r rate] "
+			"[-T secs] [-k] [-p]\n");
+	fprintf(stderr, "  -b, --backend      dbif backend (redis)\n");
+	fprintf(stderr, "  -D, --dbopts       database options\n");
+	fprintf(stderr, "  -w, --workloads    comma separated list of "
+			"write, read, patch, bulk,\n"
+			"                     scan and watch (default all)\n");
+	fprintf(stderr, "  -n, --ops          operations per workload "
+			"(default %u)\n", BENCH_DEFAULT_OPS);
+	fprintf(stderr, "  -N, --scan-keys    database sizes to scan "
+			"(default %s)\n", BENCH_DEFAULT_SCAN_SIZES);
+	fprintf(stderr, "  -B, --batch        requests per submit "
+			"(default %u)\n", BENCH_DEFAULT_BATCH);
+	fprintf(stderr, "  -V, --value-size   value bytes, at least 16 "
+			"(default %u)\n", BENCH_DEFAULT_VALUE_SIZE);
+	fprintf(stderr, "  -r, --rate         watch writer updates per "
+			"second (default unlimited)\n");
+	fprintf(stderr, "  -T, --timeout      seconds to wait for watch "
+			"notifications (default %u)\n",
+			BENCH_DEFAULT_WATCH_TIMEOUT);
+	fprintf(stderr, "  -k, --keep         keep the benchmark keys\n");
+	fprintf(stderr, "  -p, --pretty       pretty print the results\n");
+}
+
+struct bench_sys {
+	struct dbif_ops *db_ops;
+	void *db_ctx;
+	const char *backend;
+	char *db_subopts;
+	bool workloads[BENCH_NUM_WORKLOADS];
+	unsigned long ops;
+	unsigned long scan_sizes[BENCH_MAX_SCAN_SIZES];
+	int num_scan_sizes;
+	unsigned int batch;
+	size_t value_size;
+	unsigned long rate;
+	unsigned int watch_timeout;
+	bool keep;
+	bool pretty;
+
+	/* Keys 0..filled-1 exist, and none are above max_num */
+	__u64 filled;
+	__u64 max_num;
+
+	struct dbif_filter filter;
+	struct dbif_req *reqs;
+	struct bench_key *keys;
+	__u8 *values;
+	json_writer_t *jw;
+};
+
+static void bench_key_set(struct bench_key *key, __u64 num)
+{
+	memcpy(key->tag, BENCH_KEY_TAG, sizeof(key->tag));
+	key->rsvd = 0;
+	key->num = num;
+}
+
+/* Values start with the key number and a counter for patches */
+static void bench_value_set(__u8 *value, size_t value_size, __u64 num)
+{
+	memset(value, 0, value_size);
+	memcpy(value, &num, sizeof(num));
+}
+
+/* Start a result object, left open for fields of the workload. Ops are
+ * counted over usecs, latencies are per sample which is a request or a
+ * batch.
+ */
+static void bench_result(struct bench_sys *bs, const char *name,
+			 unsigned long ops, unsigned long errors,
+			 __u64 usecs, struct qbench_lat *lat)
+{
+	jsonw_start_object(bs->jw);
+	jsonw_string_field(bs->jw, "workload", name);
+	qbench_json_fields(bs->jw, ops, errors, usecs, lat);
+}
+
+static int bench_open_db(struct bench_sys *bs, void **ctxp)
+{
+	if (bs->db_ops->init(ctxp, stderr, BENCH_DEFAULT_HOST,
+			     BENCH_DEFAULT_PORT) < 0)
+		return -1;
+
+	if (bs->db_subopts &&
+	    bs->db_ops->parse_args(*ctxp, bs->db_subopts) < 0)
+		goto err;
+
+	if (bs->db_ops->start(*ctxp) < 0) {
+		fprintf(stderr, "Error initializing DB\n");
+		goto err;
+	}
+
+	return 0;
+
+err:
+	bs->db_ops->done(*ctxp);
+	return -1;
+}
+
+/* Submit keys first..first+count with op in batches. Latency samples
+ * are per batch.
+ */
+static unsigned long bench_submit(struct bench_sys *bs, void *ctx,
+				  enum dbif_req_op op, __u64 first,
+				  __u64 count, struct qbench_lat *lat)
+{
+	static const struct dbif_patch patches[1] = {
+		{ DBIF_PATCH_INC, sizeof(__u64), 0 },
+	};
+	unsigned long errors = 0;
+	__u64 done, start;
+	unsigned int i, n;
+
+	for (done = 0; done < count; done += n) {
+		n = count - done < bs->batch ? count - done : bs->batch;
+
+		for (i = 0; i < n; i++) {
+			struct dbif_req *req = &bs->reqs[i];
+			__u64 num = first + done + i;
+
+			bench_key_set(&bs->keys[i], num);
+			memset(req, 0, sizeof(*req));
+			req->op = op;
+			req->key = &bs->keys[i];
+			req->key_size = sizeof(bs->keys[i]);
+
+			if (op == DBIF_REQ_WRITE) {
+				req->value = &bs->values[i * bs->value_size];
+				req->value_size = bs->value_size;
+				bench_value_set(req->value, bs->value_size,
+						num);
+			} else if (op == DBIF_REQ_PATCH) {
+				req->patches = patches;
+				req->num_patches = 1;
+			}
+		}
+
+		start = qmetrics_now();
+		if (bs->db_ops->submit(ctx, bs->reqs, n) < 0) {
+			errors += n;
+			continue;
+		}
+		if (lat)
+			qbench_lat_add(lat, qmetrics_now() - start);
+
+		for (i = 0; i < n; i++)
+			if (bs->reqs[i].result < 0)
+				errors++;
+	}
+
+	if (op != DBIF_REQ_DELETE && first + count > bs->max_num)
+		bs->max_num = first + count;
+
+	return errors;
+}
+
+static int bench_write(struct bench_sys *bs)
+{
+	__u8 value[BENCH_MAX_VALUE_SIZE];
+	unsigned long errors = 0;
+	struct bench_key key;
+	struct qbench_lat lat;
+	__u64 start, t, num;
+
+	if (qbench_lat_init(&lat, bs->ops) < 0)
+		return -1;
+
+	start = qmetrics_now();
+	for (num = 0; num < bs->ops; num++) {
+		bench_key_set(&key, num);
+		bench_value_set(value, bs->value_size, num);
+
+		t = qmetrics_now();
+		if (bs->db_ops->write(bs->db_ctx, &key, sizeof(key),
+				      value, bs->value_size) < 0)
+			errors++;
+		qbench_lat_add(&lat, qmetrics_now() - t);
+	}
+
+	if (num > bs->max_num)
+		bs->max_num = num;
+	if (num > bs->filled)
+		bs->filled = num;
+
+	bench_result(bs, "write", bs->ops, errors, qmetrics_now() - start,
+		     &lat);
+	jsonw_end_object(bs->jw);
+	qbench_lat_free(&lat);
+
+	return 0;
+}
+
+/* Read and patch pick random keys among those written, loading them
+ * first if the write workload was not run.
+ */
+static void bench_fill(struct bench_sys *bs, __u64 count)
+{
+	if (bs->filled < count) {
+		bench_submit(bs, bs->db_ctx, DBIF_REQ_WRITE, bs->filled,
+			     count - bs->filled, NULL);
+		bs->filled = count;
+	}
+}
+
+static int bench_read(struct bench_sys *bs)
+{
+	__u8 value[BENCH_MAX_VALUE_SIZE];
+	unsigned long errors = 0;
+	struct bench_key key;
+	struct qbench_lat lat;
+	size_t value_size;
+	__u64 start, t, i;
+
+	bench_fill(bs, bs->ops);
+
+	if (qbench_lat_init(&lat, bs->ops) < 0)
+		return -1;
+
+	start = qmetrics_now();
+	for (i = 0; i < bs->ops; i++) {
+		bench_key_set(&key, random() % bs->ops);
+		value_size = sizeof(value);
+
+		t = qmetrics_now();
+		if (bs->db_ops->read(bs->db_ctx, &key, sizeof(key),
+				     value, &value_size) < 0)
+			errors++;
+		qbench_lat_add(&lat, qmetrics_now() - t);
+	}
+
+	bench_result(bs, "read", bs->ops, errors, qmetrics_now() - start,
+		     &lat);
+	jsonw_end_object(bs->jw);
+	qbench_lat_free(&lat);
+
+	return 0;
+}
+
+/* Set the key number and increment the counter as the identifier
+ * updates do
+ */
+static int bench_patch(struct bench_sys *bs)
+{
+	struct dbif_patch patches[3] = {
+		{ DBIF_PATCH_SIZE, 0, bs->value_size },
+		{ DBIF_PATCH_CMP, 0, 0 },
+		{ DBIF_PATCH_INC, sizeof(__u64), 0 },
+	};
+	unsigned long errors = 0;
+	struct bench_key key;
+	struct qbench_lat lat;
+	__u64 start, t, i;
+
+	bench_fill(bs, bs->ops);
+
+	if (qbench_lat_init(&lat, bs->ops) < 0)
+		return -1;
+
+	start = qmetrics_now();
+	for (i = 0; i < bs->ops; i++) {
+		bench_key_set(&key, random() % bs->ops);
+		patches[1].arg = key.num;
+
+		t = qmetrics_now();
+		if (bs->db_ops->patch(bs->db_ctx, &key, sizeof(key), patches,
+				      3, NULL, NULL) < 0)
+			errors++;
+		qbench_lat_add(&lat, qmetrics_now() - t);
+	}
+
+	bench_result(bs, "patch", bs->ops, errors, qmetrics_now() - start,
+		     &lat);
+	jsonw_end_object(bs->jw);
+	qbench_lat_free(&lat);
+
+	return 0;
+}
+
+/* Pipelined writes, patches and deletes of a fresh range of keys */
+static int bench_bulk(struct bench_sys *bs)
+{
+	static const struct {
+		const char *name;
+		enum dbif_req_op op;
+	} steps[] = {
+		{ "bulk_write", DBIF_REQ_WRITE },
+		{ "bulk_patch", DBIF_REQ_PATCH },
+		{ "bulk_delete", DBIF_REQ_DELETE },
+	};
+	__u64 first = bs->max_num, start;
+	unsigned long errors;
+	struct qbench_lat lat;
+	unsigned int i;
+
+	for (i = 0; i < sizeof(steps) / sizeof(steps[0]); i++) {
+		if (qbench_lat_init(&lat, bs->ops / bs->batch + 1) < 0)
+			return -1;
+
+		start = qmetrics_now();
+		errors = bench_submit(bs, bs->db_ctx, steps[i].op, first,
+				      bs->ops, &lat);
+		bench_result(bs, steps[i].name, bs->ops, errors,
+			     qmetrics_now() - start, &lat);
+		jsonw_uint_field(bs->jw, "batch", bs->batch);
+		jsonw_end_object(bs->jw);
+		qbench_lat_free(&lat);
+	}
+
+	return 0;
+}
+
+struct bench_scan {
+	__u8 *seen;
+	__u64 size;
+	unsigned long keys;
+	unsigned long other;
+	unsigned long dups;
+};
+
+static void bench_scan_cb(void *key, size_t key_size, void *data)
+{
+	struct bench_scan *scan = data;
+	struct bench_key bkey;
+
+	if (key_size != sizeof(bkey))
+		return;
+
+	/* Keys from the database may not be aligned */
+	memcpy(&bkey, key, sizeof(bkey));
+
+	if (bkey.num >= scan->size) {
+		scan->other++;
+		return;
+	}
+
+	if (scan->seen[bkey.num / 8] & (1 << (bkey.num % 8))) {
+		scan->dups++;
+		return;
+	}
+
+	scan->seen[bkey.num / 8] |= 1 << (bkey.num % 8);
+	scan->keys++;
+}
+
+/* Grow the database to each size and time a full scan of it. Keys above
+ * the size left by other workloads are counted as other keys.
+ */
+static int bench_scan(struct bench_sys *bs)
+{
+	struct bench_scan scan;
+	__u64 start, usecs;
+	int i, ret;
+
+	for (i = 0; i < bs->num_scan_sizes; i++) {
+		memset(&scan, 0, sizeof(scan));
+		scan.size = bs->scan_sizes[i];
+		scan.seen = calloc(scan.size / 8 + 1, 1);
+		if (!scan.seen)
+			return -1;
+
+		bench_fill(bs, scan.size);
+
+		start = qmetrics_now();
+		ret = bs->db_ops->scan(bs->db_ctx, &bs->filter,
+				       bench_scan_cb, &scan);
+		usecs = qmetrics_now() - start;
+
+		bench_result(bs, "scan", scan.keys + scan.other, ret < 0,
+			     usecs, NULL);
+		jsonw_uint_field(bs->jw, "db_keys", scan.size);
+		jsonw_uint_field(bs->jw, "other_keys", scan.other);
+		jsonw_uint_field(bs->jw, "missing", scan.size - scan.keys);
+		jsonw_uint_field(bs->jw, "duplicates", scan.dups);
+		jsonw_end_object(bs->jw);
+
+		free(scan.seen);
+	}
+
+	return 0;
+}
+
+/* Watch workload. The writer thread updates keys first..first+count on
+ * its own connection, recording the time of each update in sent, and
+ * the event loop takes the notifications and computes the latency from
+ * that.
+ */
+struct bench_watch {
+	struct bench_sys *bs;
+	struct event_base *event_base;
+	struct event *timer;
+	void *writer_ctx;
+	pthread_t writer;
+	bool writer_started;
+	__u64 first;
+	__u64 count;
+	__u64 *sent;
+	__u8 *seen;
+	struct qbench_lat lat;
+	unsigned long received;
+	unsigned long resyncs;
+	unsigned long errors;
+	__u64 write_start;
+	__u64 write_end;
+	__u64 last_received;
+	bool write_done;
+};
+
+static void *bench_watch_writer(void *arg)
+{
+	struct bench_watch *bw = arg;
+	struct bench_sys *bs = bw->bs;
+	__u8 value[BENCH_MAX_VALUE_SIZE];
+	struct bench_key key;
+	__u64 i, due, now;
+
+	bw->write_start = qmetrics_now();
+
+	for (i = 0; i < bw->count; i++) {
+		if (bs->rate) {
+			due = bw->write_start + i * 1000000 / bs->rate;
+			now = qmetrics_now();
+			if (due > now)
+				usleep(due - now);
+		}
+
+		bench_key_set(&key, bw->first + i);
+		bench_value_set(value, bs->value_size, key.num);
+
+		__atomic_store_n(&bw->sent[i], qmetrics_now(),
+				 __ATOMIC_RELEASE);
+		if (bs->db_ops->write(bw->writer_ctx, &key, sizeof(key),
+				      value, bs->value_size) < 0)
+			bw->errors++;
+	}
+
+	bw->write_end = qmetrics_now();
+	__atomic_store_n(&bw->write_done, true, __ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+static void bench_watch_cb(void *key, size_t key_size, void *data)
+{
+	struct bench_watch *bw = data;
+	__u64 i, sent, now = qmetrics_now();
+	struct bench_key bkey;
+
+	if (key_size != sizeof(bkey))
+		return;
+
+	memcpy(&bkey, key, sizeof(bkey));
+	if (bkey.num < bw->first || bkey.num >= bw->first + bw->count)
+		return;
+
+	i = bkey.num - bw->first;
+	sent = __atomic_load_n(&bw->sent[i], __ATOMIC_ACQUIRE);
+	if (!sent || (bw->seen[i / 8] & (1 << (i % 8))))
+		return;
+
+	bw->seen[i / 8] |= 1 << (i % 8);
+	bw->received++;
+	bw->last_received = now;
+	qbench_lat_add(&bw->lat, now - sent);
+}
+
+static void bench_watch_resync_cb(void *data)
+{
+	struct bench_watch *bw = data;
+
+	bw->resyncs++;
+}
+
+/* Start the writer once the watch has had time to subscribe, then stop
+ * when all notifications arrived or the timeout passed after the writer
+ * finished.
+ */
+static void bench_watch_timer_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct bench_watch *bw = arg;
+
+	if (!bw->writer_started) {
+		if (pthread_create(&bw->writer, NULL, bench_watch_writer,
+				   bw)) {
+			fprintf(stderr, "Unable to start writer\n");
+			event_base_loopbreak(bw->event_base);
+			return;
+		}
+		bw->writer_started = true;
+		return;
+	}
+
+	if (!__atomic_load_n(&bw->write_done, __ATOMIC_ACQUIRE))
+		return;
+
+	if (bw->received == bw->count ||
+	    qmetrics_now() - bw->write_end >
+	    bw->bs->watch_timeout * 1000000ULL)
+		event_base_loopbreak(bw->event_base);
+}
+
+static int bench_watch(struct bench_sys *bs)
+{
+	struct timeval tv = { 0, 100000 };
+	struct bench_watch bw;
+	void *handle = NULL;
+	__u64 usecs;
+	int ret = -1;
+
+	memset(&bw, 0, sizeof(bw));
+	bw.bs = bs;
+	bw.first = bs->max_num;
+	bw.count = bs->ops;
+
+	bw.sent = calloc(bw.count, sizeof(*bw.sent));
+	bw.seen = calloc(bw.count / 8 + 1, 1);
+	if (!bw.sent || !bw.seen || qbench_lat_init(&bw.lat, bw.count) < 0)
+		goto out;
+
+	bw.event_base = event_base_new();
+	if (!bw.event_base)
+		goto out;
+
+	if (bench_open_db(bs, &bw.writer_ctx) < 0)
+		goto out;
+
+	if (bs->db_ops->watch_all(bs->db_ctx, &bs->filter, bench_watch_cb,
+				  bench_watch_resync_cb, &bw, &handle,
+				  bw.event_base) < 0) {
+		fprintf(stderr, "Unable to start watch all\n");
+		goto out;
+	}
+
+	bw.timer = event_new(bw.event_base, -1, EV_PERSIST,
+			     bench_watch_timer_cb, &bw);
+	if (!bw.timer || event_add(bw.timer, &tv) < 0)
+		goto out;
+
+	event_base_dispatch(bw.event_base);
+
+	/* The watch connection and its reconnect timer are events on
+	 * event_base, so the watch is stopped before the base is freed
+	 */
+	bs->db_ops->stop_watch(bs->db_ctx, handle);
+	handle = NULL;
+
+	if (bw.writer_started)
+		pthread_join(bw.writer, NULL);
+
+	bs->max_num = bw.first + bw.count;
+
+	usecs = bw.last_received > bw.write_start ?
+		bw.last_received - bw.write_start : 0;
+	bench_result(bs, "watch", bw.received, bw.errors, usecs, &bw.lat);
+	jsonw_uint_field(bs->jw, "written", bw.count);
+	jsonw_uint_field(bs->jw, "lost", bw.count - bw.received);
+	jsonw_uint_field(bs->jw, "resyncs", bw.resyncs);
+	jsonw_float_field_fmt(bs->jw, "write_ops_per_sec", "%.1f",
+			      bw.write_end > bw.write_start ?
+			      bw.count * 1e6 /
+			      (bw.write_end - bw.write_start) : 0);
+	jsonw_end_object(bs->jw);
+
+	ret = 0;
+
+out:
+	if (handle)
+		bs->db_ops->stop_watch(bs->db_ctx, handle);
+	if (bw.timer)
+		event_free(bw.timer);
+	if (bw.writer_ctx)
+		bs->db_ops->done(bw.writer_ctx);
+	if (bw.event_base)
+		event_base_free(bw.event_base);
+	qbench_lat_free(&bw.lat);
+	free(bw.seen);
+	free(bw.sent);
+
+	return ret;
+}
+
+static int (*const workload_funcs[BENCH_NUM_WORKLOADS])(struct bench_sys *) = {
+	[BENCH_WRITE] = bench_write,
+	[BENCH_READ] = bench_read,
+	[BENCH_PATCH] = bench_patch,
+	[BENCH_BULK] = bench_bulk,
+	[BENCH_SCAN] = bench_scan,
+	[BENCH_WATCH] = bench_watch,
+};
+
+static int parse_workloads(struct bench_sys *bs, char *list)
+{
+	char *name, *saveptr = NULL;
+	int i;
+
+	for (name = strtok_r(list, ",", &saveptr); name;
+	     name = strtok_r(NULL, ",", &saveptr)) {
+		for (i = 0; i < BENCH_NUM_WORKLOADS; i++) {
+			if (!strcmp(name, workload_names[i])) {
+				bs->workloads[i] = true;
+				break;
+			}
+		}
+		if (i == BENCH_NUM_WORKLOADS) {
+			fprintf(stderr, "Unknown workload %s\n", name);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int parse_args(int argc, char *argv[], struct bench_sys *bs)
+{
+	const char *scan_sizes = BENCH_DEFAULT_SCAN_SIZES;
+	bool any_workload = false;
+	int option_index = 0;
+	unsigned long num;
+	int c, i;
+
+	while ((c = getopt_long(argc, argv, ARGS, long_options,
+				&option_index)) != EOF) {
+		switch (c) {
+		case 'b':
+			bs->backend = optarg;
+			break;
+		case 'D':
+			bs->db_subopts = optarg;
+			break;
+		case 'w':
+			if (parse_workloads(bs, optarg) < 0)
+				return -1;
+			any_workload = true;
+			break;
+		case 'n':
+			bs->ops = strtoul(optarg, NULL, 0);
+			if (!bs->ops) {
+				fprintf(stderr, "Bad ops %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'N':
+			scan_sizes = optarg;
+			break;
+		case 'B':
+			num = strtoul(optarg, NULL, 0);
+			if (!num || num > 1000000) {
+				fprintf(stderr, "Bad batch %s\n", optarg);
+				return -1;
+			}
+			bs->batch = num;
+			break;
+		case 'V':
+			num = strtoul(optarg, NULL, 0);
+			if (num < 2 * sizeof(__u64) ||
+			    num > BENCH_MAX_VALUE_SIZE) {
+				fprintf(stderr, "Bad value size %s\n", optarg);
+				return -1;
+			}
+			bs->value_size = num;
+			break;
+		case 'r':
+			bs->rate = strtoul(optarg, NULL, 0);
+			break;
+		case 'T':
+			bs->watch_timeout = strtoul(optarg, NULL, 0);
+			break;
+		case 'k':
+			bs->keep = true;
+			break;
+		case 'p':
+			bs->pretty = true;
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	if (!any_workload)
+		for (i = 0; i < BENCH_NUM_WORKLOADS; i++)
+			bs->workloads[i] = true;
+
+	bs->num_scan_sizes = qbench_parse_sizes(scan_sizes, bs->scan_sizes,
+						BENCH_MAX_SCAN_SIZES);
+	if (bs->num_scan_sizes < 0) {
+		fprintf(stderr, "Bad scan sizes %s\n", scan_sizes);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int start_db(struct bench_sys *bs)
+{
+	int i;
+
+	for (i = 0; i < BENCH_NUM_BACKENDS; i++)
+		if (!strcmp(bs->backend, backends[i].name))
+			break;
+
+	if (i == BENCH_NUM_BACKENDS) {
+		fprintf(stderr, "Unknown backend %s\n", bs->backend);
+		return -1;
+	}
+
+	bs->db_ops = backends[i].get();
+	if (!bs->db_ops) {
+		fprintf(stderr, "Unable to get %s dbif\n", bs->backend);
+		return -1;
+	}
+
+	if (!bs->db_ops->submit || !bs->db_ops->scan) {
+		fprintf(stderr, "Backend %s lacks submit or scan\n",
+			bs->backend);
+		return -1;
+	}
+
+	return bench_open_db(bs, &bs->db_ctx);
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_sys bs;
+	int i, ret = 0;
+
+	memset(&bs, 0, sizeof(bs));
+	bs.backend = "redis";
+	bs.ops = BENCH_DEFAULT_OPS;
+	bs.batch = BENCH_DEFAULT_BATCH;
+	bs.value_size = BENCH_DEFAULT_VALUE_SIZE;
+	bs.watch_timeout = BENCH_DEFAULT_WATCH_TIMEOUT;
+
+	if (parse_args(argc, argv, &bs) < 0)
+		exit(-1);
+
+	dbif_filter_add(&bs.filter, BENCH_KEY_TAG, sizeof(BENCH_KEY_TAG),
+			sizeof(struct bench_key));
+
+	bs.reqs = calloc(bs.batch, sizeof(*bs.reqs));
+	bs.keys = calloc(bs.batch, sizeof(*bs.keys));
+	bs.values = calloc(bs.batch, bs.value_size);
+	if (!bs.reqs || !bs.keys || !bs.values) {
+		fprintf(stderr, "Unable to allocate batch\n");
+		exit(-1);
+	}
+
+	if (start_db(&bs) < 0)
+		exit(-1);
+
+	srandom(qmetrics_now());
+
+	bs.jw = jsonw_new(stdout);
+	if (!bs.jw) {
+		fprintf(stderr, "Unable to allocate JSON writer\n");
+		exit(-1);
+	}
+	jsonw_pretty(bs.jw, bs.pretty);
+
+	jsonw_start_object(bs.jw);
+	jsonw_string_field(bs.jw, "backend", bs.backend);
+	jsonw_string_field(bs.jw, "dbopts", bs.db_subopts ? : "");
+	jsonw_uint_field(bs.jw, "ops", bs.ops);
+	jsonw_uint_field(bs.jw, "batch", bs.batch);
+	jsonw_uint_field(bs.jw, "value_size", bs.value_size);
+
+	jsonw_name(bs.jw, "results");
+	jsonw_start_array(bs.jw);
+	for (i = 0; i < BENCH_NUM_WORKLOADS; i++) {
+		if (!bs.workloads[i])
+			continue;
+		if (workload_funcs[i](&bs) < 0) {
+			fprintf(stderr, "Workload %s failed\n",
+				workload_names[i]);
+			ret = -1;
+			break;
+		}
+	}
+	jsonw_end_array(bs.jw);
+
+	if (bs.db_ops->stats) {
+		jsonw_name(bs.jw, "db");
+		jsonw_start_object(bs.jw);
+		bs.db_ops->stats(bs.db_ctx, bs.jw);
+		jsonw_end_object(bs.jw);
+	}
+
+	jsonw_end_object(bs.jw);
+	jsonw_destroy(&bs.jw);
+	fputc('\n', stdout);
+
+	if (!bs.keep)
+		bench_submit(&bs, bs.db_ctx, DBIF_REQ_DELETE, 0, bs.max_num,
+			     NULL);
+
+	bs.db_ops->done(bs.db_ctx);
+
+	free(bs.values);
+	free(bs.keys);
+	free(bs.reqs);
+
+	return ret;
+}
@@ -42,18 +42,30 @@ def usage_err(errstr):
 		print(errstr)
 		print("")
 
-	print("Usage:")
+	print("Usage: ilac [ -h HOST ] [ -p PORT ] [ -b BITS ] [ -l LEN ] [ -g BITS ]")
+	print("            DB CMD ...")
+	print("")
+	print("    -b BITS  Use bucketed layout with 2^BITS buckets")
+	print("    -l LEN   Log changes in a change log of about LEN entries")
+	print("    -g BITS  Maintain a digest with 2^BITS leaves")
+	print("")
 	print("    ilac map list")
 	print("    ilac map flush")
 	print("    ilac map { --csum-mode=CSUM } { --ident-type=IDENT }")
-	print("            { --hook-type=HOOK } ADDR ADDR64")
+	print("            { --hook-type=HOOK } { --sir-id=SIRID } ADDR ADDR64")
 	print("    ilac map del ADDR")
+	print("    ilac map check { --local-locator=ADDR64 } { --prefix=ADDR64 }")
+	print("            LOGFILE")
 	print("")
 	print("    ilac ident list")
 	print("    ilac ident flush")
-	print("    ilac ident make NUM ADDR")
+	print("    ilac ident make { --sir-id=SIRID } NUM ADDR")
 	print("    ilac ident attach NUM NUM")
-	print("    ilac ident unattach NUM")
+	print("    ilac ident unattach NUM { NUM }")
+	print("    ilac ident move NUM NUM NUM")
+	print("    ilac ident prepare NUM NUM")
+	print("    ilac ident commit NUM NUM NUM")
+	print("    ilac ident abort NUM")
 	print("    ilac ident destroy NUM")
 	print("")
 	print("    ilac loc list")
@@ -61,7 +73,14 @@ def usage_err(errstr):
 	print("    ilac loc make NUM ADDR64")
 	print("    ilac loc destroy NUM")
 	print("")
+	print("    ilac sir list")
+	print("    ilac sir flush")
+	print("    ilac sir get SIRID")
+	print("    ilac sir add SIRID ADDR64")
+	print("    ilac sir del SIRID")
+	print("")
 	print("NUM = 0..2^64")
+	print("SIRID = 0..65535")
 	print("ADDR = IPv6 address")
 	print("ADDR64 = WWWW:XXXX:YYYY:ZZZZ")
 	print("CSUM = adj-transport | neutral-map |")
@@ -73,7 +92,7 @@ def usage_err(errstr):
 	sys.exit(2)
 
 try:
-	mypopts, args = getopt.getopt(sys.argv[1:], "h:p:")
+	mypopts, args = getopt.getopt(sys.argv[1:], "h:p:b:l:g:")
 except getopt.GetoptError as e:
 	usage_err(str(e))
 	sys.exit(2)
@@ -88,6 +107,21 @@ try:
 		elif o == '-p':
 			port = a
 			port_set = True
+		elif o == '-b':
+			try:
+				ila.ila_set_bucketed(int(a))
+			except ValueError:
+				usage_err("Bad bucket bits %s" % a)
+		elif o == '-l':
+			try:
+				ila.ila_set_changelog(int(a))
+			except ValueError:
+				usage_err("Bad change log length %s" % a)
+		elif o == '-g':
+			try:
+				ila.ila_set_digest(int(a))
+			except ValueError:
+				usage_err("Bad digest bits %s" % a)
 
 	if len(args) < 2:
 		usage_err("Need at least two arguments")
@@ -110,6 +144,10 @@ try:
 		if not port_set:
 			port = DEFAULT_LOC_PORT
 		ila.ila_process_loc(host, port, cmd, args)
+	elif db == 'sir':
+		if not port_set:
+			port = DEFAULT_MAP_PORT
+		ila.ila_process_sir(host, port, cmd, args)
 	else:
 		usage_err("Unknown DB '%s'" % db)
 		sys.exit(2)
@@ -27,30 +27,49 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <endian.h>
 #include <errno.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
 #include <event2/event.h>
+#include <event2/listener.h>
+#include <event2/util.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <limits.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
 
 #include "dbif.h"
 #include "dbif_redis.h"
 #include "ila.h"
+#include "libila.h"
 #include "linux/ila.h"
+#include "qhash.h"
+#include "qctl.h"
+#include "qlog.h"
+#include "qmetrics.h"
+#include "qprobe.h"
 #include "qutils.h"
+#include "utils.h"
 
 #define ILA_REDIS_DEFAULT_MAP_PORT 6379
 #define ILA_REDIS_DEFAULT_IDENT_PORT 6380
 #define ILA_REDIS_DEFAULT_LOC_PORT 6381
 
-#define ARGS "vdR:M:I:L:"
+#define ILA_IDENT_BATCH_MAX 1024
+
+#define ILA_DUMP_BUCKETS	64
+
+#define ARGS "vdR:M:I:L:S:E:r:c:"
 
 static struct option long_options[] = {
 	{ "verbose", no_argument, 0, 'v' },
@@ -59,37 +78,169 @@ static struct option long_options[] = {
 	{ "mapopts", required_argument, 0, 'D' },
 	{ "identopts", required_argument, 0, 'I' },
 	{ "locopts", required_argument, 0, 'O' },
+	{ "listen", required_argument, 0, 'S' },
+	{ "metrics", required_argument, 0, 'E' },
+	{ "trace-sample", required_argument, 0, 'r' },
+	{ "control", required_argument, 0, 'c' },
 	{ NULL, 0, 0, 0 },
 };
 
 bool do_daemonize;
 FILE *logfile;
+struct qlog *qlog;
 
 static void usage(char *prog_name)
 {
 	fprintf(stderr, "Usage: ilactld [-dv] [-L logfile] [-D dbopts] "
-			"[-I identopts] [-O locopts][\n");
+			"[-I identopts] [-O locopts] [-S listen] "
+			"[-E metrics] [-r N] [-c control]\n");
+	fprintf(stderr, "  -v, --verbose      log mapping changes\n");
 	fprintf(stderr, "  -L, --logfile      log file\n");
 	fprintf(stderr, "  -D, --dbopts       map database options\n");
 	fprintf(stderr, "  -I, --identopts    ident database options\n");
 	fprintf(stderr, "  -O, --locopts       log database options\n");
+	fprintf(stderr, "  -S, --listen       ingestion socket, a Unix socket "
+			"path or [ADDR]:PORT\n");
+	fprintf(stderr, "  -E, --metrics      serve metrics over HTTP at a "
+			"Unix socket path or [ADDR]:PORT\n");
+	fprintf(stderr, "  -r, --trace-sample log a latency trace for one in "
+			"N identifier updates\n");
+	fprintf(stderr, "  -c, --control      control socket, a Unix socket "
+			"path or [ADDR]:PORT\n");
 }
 
 /* Instance of control mapping system. There are three databases
  * used, reference by db_*_ctx. There are the map (ILA mapping
  * database), ident (ILA identifiers) and loc (ILA locators).
+ * Identifiers that have been processed are tracked in ident_table
+ * with the generation number of the record and the map key, the map
+ * key is needed to remove the mapping when the identifier is
+ * destroyed. Locators are cached in loc_table, entries are removed
+ * when the locator database reports a change.
+ *
+ * Attach events can also be received on the ingestion socket. These
+ * are applied to the map database directly and the identifier
+ * database is then updated through ident_client off the critical path,
+ * the batch is acknowledged with the number of events written to the map
+ * database. If an identifier update fails the mapping is set back from
+ * the identifier record. An event must be for an existing identifier and,
+ * for an attach, a known locator, other events are rejected and counted.
+ *
+ * Counters and latency histograms are kept in metrics and can be
+ * served for scraping. Update latency is measured from when an
+ * identifier change notification is received to when the map record
+ * is written.
+ *
+ * Map records carry the time of the identifier write that caused them
+ * as their origin (see ila.h) so that the latency of a handover can be
+ * traced through to ilad. Latency from the origin is recorded per stage
+ * and one in trace_sample updates is logged as a trace record. Traces
+ * are sampled by origin time so ilad samples the same updates.
+ *
+ * The control socket (see qctl.h) reports the state of the daemon and
+ * streams dumps of ident_table and loc_table, and the batch size and
+ * coalescing window of ident_client, tracing and logging can be changed
+ * through it while the daemon runs.
  */
+
+enum ila_ctl_db {
+	ILA_CTL_DB_MAP,
+	ILA_CTL_DB_IDENT,
+	ILA_CTL_DB_LOC,
+	ILA_CTL_DB_MAX,
+};
+
+enum ila_ctl_result {
+	ILA_CTL_RES_OK,
+	ILA_CTL_RES_MISSING,
+	ILA_CTL_RES_ERROR,
+	ILA_CTL_RES_MAX,
+};
+
+struct ila_ctl_metrics {
+	struct qmetric *notifications;
+	struct qmetric *loc_notifications;
+	struct qmetric *resyncs;
+	struct qmetric *db_reads[ILA_CTL_DB_MAX][ILA_CTL_RES_MAX];
+	struct qmetric *db_read_time[ILA_CTL_DB_MAX];
+	struct qmetric *map_writes[ILA_CTL_RES_MAX];
+	struct qmetric *map_deletes[ILA_CTL_RES_MAX];
+	struct qmetric *map_write_time;
+	struct qmetric *map_delete_time;
+	struct qmetric *update_time;
+	struct qmetric *ingest_events;
+	struct qmetric *ingest_applied;
+	struct qmetric *ingest_failed;
+	struct qmetric *ingest_rejected;
+	struct qmetric *ingest_batch_time;
+	struct qmetric *trace_notify;
+	struct qmetric *trace_map;
+};
+
 struct ila_ctl_sys {
 	struct dbif_ops *db_ops;
 	void *db_map_ctx;
 	void *db_ident_ctx;
 	void *db_loc_ctx;
 	void *watch_handle;
+	void *loc_watch_handle;
 	struct event_base *event_base;
+	struct qhash ident_table;
+	struct qhash loc_table;
+	struct ila_client *ident_client;
+	struct evconnlistener *listener;
+	__u64 notify_time;
+	__u64 notify_ns;
+	unsigned int trace_sample;
+	unsigned int verbose;
+	unsigned int ident_batch;
+	unsigned int ident_window;
+	struct qmetrics *metrics;
+	struct ila_ctl_metrics m;
+	struct qctl *ctl;
+};
+
+/* Map key in either the full address or compact SIR encoding. An
+ * identifier in the compact encoding has a compact map key.
+ */
+struct ila_mkey {
+	union {
+		struct IlaMapKey full;
+		struct IlaMapKeySir sir;
+	};
+	size_t size;
+};
+
+/* loc_num is the locator number that was last mapped and map_gen the
+ * generation number the database stamped in the last map record written,
+ * zero if none was.
+ * prep_loc_num is the target locator of a prepared handover,
+ * prep_aborted is set while an aborted prepared mapping is left in the
+ * map database.
+ */
+struct ila_ident_entry {
+	struct qhash_node node;
+	struct IlaIdentKey key;
+	struct ila_mkey mkey;
+	__u64 gen;
+	__u64 loc_num;
+	__u64 map_gen;
+	__u64 prep_loc_num;
+	bool seen;
+	bool prep_seen;
+	bool prep_aborted;
 };
 
-static int parse_args(int argc, char *argv[], char **map_subopts,
-		      char **ident_subopts, char **loc_subopts)
+struct ila_loc_entry {
+	struct qhash_node node;
+	__u64 num;
+	Locator locator;
+};
+
+static int parse_args(int argc, char *argv[], struct ila_ctl_sys *ics,
+		      char **map_subopts, char **ident_subopts,
+		      char **loc_subopts, char **listen_addr,
+		      char **metrics_addr, char **ctl_addr)
 {
 	int option_index = 0;
 	int c;
@@ -97,6 +248,9 @@ static int parse_args(int argc, char *argv[], char **map_subopts,
 	while ((c = getopt_long(argc, argv, ARGS, long_options,
 				&option_index)) != EOF) {
 		switch (c) {
+		case 'v':
+			ics->verbose++;
+			break;
 		case 'd':
 			do_daemonize = true;
 			break;
@@ -118,6 +272,22 @@ static int parse_args(int argc, char *argv[], char **map_subopts,
 		case 'O':
 			*loc_subopts = optarg;
 			break;
+		case 'S':
+			*listen_addr = optarg;
+			break;
+		case 'E':
+			*metrics_addr = optarg;
+			break;
+		case 'r':
+			if (get_unsigned(&ics->trace_sample, optarg, 0) < 0) {
+				fprintf(stderr, "Bad trace sample %s\n",
+					optarg);
+				return -1;
+			}
+			break;
+		case 'c':
+			*ctl_addr = optarg;
+			break;
 		default:
 			usage(argv[0]);
 			return -1;
@@ -130,88 +300,1047 @@ static int parse_args(int argc, char *argv[], char **map_subopts,
 	return 0;
 }
 
-static void set_entry(struct ila_ctl_sys *ics, struct IlaIdentKey *ikey,
-		      struct IlaIdentValue *ival)
+static enum ila_ctl_result result_of(int res)
 {
-	struct IlaLocKey lkey;
-	struct IlaMapKey mkey;
-	struct IlaLocValue lval;
-	struct IlaMapValue mval;
-	size_t lval_size = sizeof(lval);
+	switch (res) {
+	case 0:
+		return ILA_CTL_RES_OK;
+	case -2:
+		return ILA_CTL_RES_MISSING;
+	default:
+		return ILA_CTL_RES_ERROR;
+	}
+}
+
+/* Read from one of the databases and count the result */
+static int db_read(struct ila_ctl_sys *ics, enum ila_ctl_db db, void *key,
+		   size_t key_size, void *value, size_t *value_size)
+{
+	void *ctx[ILA_CTL_DB_MAX] = {
+		[ILA_CTL_DB_MAP] = ics->db_map_ctx,
+		[ILA_CTL_DB_IDENT] = ics->db_ident_ctx,
+		[ILA_CTL_DB_LOC] = ics->db_loc_ctx,
+	};
+	__u64 start = qmetrics_now();
+	int res;
+
+	res = ics->db_ops->read(ctx[db], key, key_size, value, value_size);
+
+	qmetric_observe_since(ics->m.db_read_time[db], start);
+	qmetric_inc(ics->m.db_reads[db][result_of(res)]);
+
+	return res;
+}
+
+/* Write a map record, the database stamps its generation number */
+static int map_write(struct ila_ctl_sys *ics, void *key, size_t key_size,
+		     struct IlaMapRec *mrec)
+{
+	__u64 start = qmetrics_now();
+	int res;
+
+	res = dbif_write_gen(ics->db_ops, ics->db_map_ctx, key, key_size,
+			     mrec, sizeof(*mrec), ILA_REC_GEN_OFFSET);
+
+	qmetric_observe_since(ics->m.map_write_time, start);
+	qmetric_inc(ics->m.map_writes[result_of(res)]);
+
+	return res;
+}
+
+static int map_delete(struct ila_ctl_sys *ics, void *key, size_t key_size)
+{
+	__u64 start = qmetrics_now();
 	int res;
 
-	lkey.num = ival->loc_num;
+	res = ics->db_ops->delete(ics->db_map_ctx, key, key_size);
+
+	qmetric_observe_since(ics->m.map_delete_time, start);
+	qmetric_inc(ics->m.map_deletes[result_of(res)]);
+
+	return res;
+}
+
+static __u32 ident_hash(struct IlaIdentKey *key)
+{
+	return qhash_bytes(key, sizeof(*key), 0);
+}
+
+static struct ila_ident_entry *ident_lookup(struct ila_ctl_sys *ics,
+					    struct IlaIdentKey *key)
+{
+	struct ila_ident_entry *iie;
+	__u32 hash = ident_hash(key);
+
+	qhash_for_each_possible(&ics->ident_table, iie, node, hash)
+		if (iie->key.num == key->num)
+			return iie;
+
+	return NULL;
+}
+
+static struct ila_ident_entry *ident_add(struct ila_ctl_sys *ics,
+					 struct IlaIdentKey *key)
+{
+	struct ila_ident_entry *iie;
+
+	iie = calloc(1, sizeof(*iie));
+	if (!iie)
+		return NULL;
+
+	iie->key = *key;
+	qhash_add(&ics->ident_table, &iie->node, ident_hash(key));
+
+	return iie;
+}
+
+static void ident_remove(struct ila_ctl_sys *ics, struct ila_ident_entry *iie)
+{
+	qhash_del(&ics->ident_table, &iie->node);
+	free(iie);
+}
+
+static struct ila_loc_entry *loc_lookup(struct ila_ctl_sys *ics,
+					__u64 num)
+{
+	struct ila_loc_entry *ile;
+
+	qhash_for_each_possible(&ics->loc_table, ile, node, (__u32)num)
+		if (ile->num == num)
+			return ile;
+
+	return NULL;
+}
+
+/* Get a locator from the cache or else from the locator database */
+static int get_locator(struct ila_ctl_sys *ics, __u64 loc_num,
+		       Locator *locator)
+{
+	struct ila_loc_entry *ile;
+	struct IlaLocKey lkey;
+	struct IlaLocRec lrec;
+	size_t lrec_size = sizeof(lrec);
+
+	ile = loc_lookup(ics, loc_num);
+	if (ile) {
+		*locator = ile->locator;
+		return 0;
+	}
+
+	lkey.num = loc_num;
+
+	if (db_read(ics, ILA_CTL_DB_LOC, &lkey, sizeof(lkey),
+		    &lrec, &lrec_size) < 0)
+		return -1;
+
+	if (ila_rec_normalize(&lrec, lrec_size, sizeof(lrec),
+			      ILA_REC_TYPE_LOC) < 0) {
+		QLOG(qlog, QLOG_WARN, "Unexpected loc record",
+		     "size=%zu", lrec_size);
+		return -1;
+	}
+
+	*locator = lrec.value.locator;
+
+	ile = calloc(1, sizeof(*ile));
+	if (ile) {
+		ile->num = loc_num;
+		ile->locator = *locator;
+		qhash_add(&ics->loc_table, &ile->node, (__u32)loc_num);
+	}
+
+	return 0;
+}
+
+static void loc_watch_cb(void *key, size_t key_size, void *data)
+{
+	struct ila_ctl_sys *ics = data;
+	struct ila_loc_entry *ile;
+	struct IlaLocKey lkey;
 
-	res = ics->db_ops->read(ics->db_loc_ctx, &lkey,
-				sizeof(lkey), &lval,
-				&lval_size);
-	if (res < 0)
+	qmetric_inc(ics->m.loc_notifications);
+
+	if (key_size != sizeof(lkey))
 		return;
 
+	memcpy(&lkey, key, sizeof(lkey));
+
+	ile = loc_lookup(ics, lkey.num);
+	if (ile) {
+		qhash_del(&ics->loc_table, &ile->node);
+		free(ile);
+	}
+}
+
+/* Locator changes may have been missed, drop the cache */
+static void loc_resync_cb(void *data)
+{
+	struct ila_ctl_sys *ics = data;
+	struct ila_loc_entry *ile;
+	struct hlist_node *tmp;
+	unsigned int bkt;
+
+	qhash_for_each_safe(&ics->loc_table, bkt, tmp, ile, node) {
+		qhash_del(&ics->loc_table, &ile->node);
+		free(ile);
+	}
+}
+
+static void make_map_rec(struct IlaMapRec *mrec, Locator locator,
+			 __u64 origin)
+{
+	ila_rec_hdr_init(&mrec->hdr, ILA_REC_TYPE_MAP, 0);
+	ila_rec_set_origin(&mrec->hdr, origin);
+	mrec->value.loc = locator;
+	mrec->value.ifindex = 0;
+	mrec->value.csum_mode = ILA_CSUM_NEUTRAL_MAP_AUTO;
+	mrec->value.ident_type = ILA_ATYPE_LUID;
+	mrec->value.hook_type = ILA_HOOK_ROUTE_OUTPUT;
+	mrec->value.rsvd = 0;
+}
+
+/* Returns zero if the mapping was written */
+static int set_entry(struct ila_ctl_sys *ics, struct ila_ident_entry *iie,
+		     struct ila_mkey *mkey, __u64 loc_num, __u64 origin)
+{
+	struct IlaMapRec mrec;
+	Locator locator;
+	int res;
+
+	if (get_locator(ics, loc_num, &locator) < 0)
+		return -1;
+
 	/* Have everything to write mapping now */
-	mkey.addr = ival->addr;
-	mval.loc = lval.locator;
-	mval.ifindex = 0;
-	mval.csum_mode = ILA_CSUM_NEUTRAL_MAP_AUTO;
-	mval.ident_type = ILA_ATYPE_LUID;
-	mval.hook_type = ILA_HOOK_ROUTE_OUTPUT;
+	make_map_rec(&mrec, locator, origin);
+
+	res = map_write(ics, mkey, mkey->size, &mrec);
+
+	if (res) {
+		QLOG(qlog, QLOG_ERR, "Mapping failed", "res=%d", res);
+		return -1;
+	}
+
+	if (iie)
+		iie->map_gen = mrec.hdr.gen;
 
-	res = ics->db_ops->write(ics->db_map_ctx, &mkey, sizeof(mkey),
-				 &mval, sizeof(mval));
+	if (ics->verbose)
+		QLOG(qlog, QLOG_DEBUG, "Mapped", "ident=%llu loc=%llu",
+		     iie ? iie->key.num : 0, loc_num);
 
-	if (res)
-		fprintf(stderr, "Mapping failed\n");
+	if (ics->notify_time)
+		qmetric_observe_since(ics->m.update_time, ics->notify_time);
+
+	return 0;
 }
 
-static void remove_entry(struct ila_ctl_sys *ics, struct IlaIdentKey *ikey,
-			 struct IlaIdentValue *ival)
+static __u64 trace_delta(__u64 from_ns, __u64 to_ns)
 {
-	struct IlaMapKey mkey;
+	/* Clocks of different hosts may be skewed */
+	return to_ns > from_ns ? (to_ns - from_ns) / 1000 : 0;
+}
 
-	mkey.addr = ival->addr;
+/* Identifier update written at origin was applied to the map */
+static void trace_update(struct ila_ctl_sys *ics, __u64 ident_num,
+			 __u64 origin)
+{
+	__u64 now = ila_time_ns(), to_notify, to_map;
 
-	if (ics->db_ops->delete(ics->db_map_ctx, &mkey, sizeof(mkey)) < 0 &&
-	    errno != ESRCH) {
-		fprintf(stderr, "Del failed\n");
+	if (!origin || !ics->notify_ns)
+		return;
+
+	to_notify = trace_delta(origin, ics->notify_ns);
+	to_map = trace_delta(origin, now);
+
+	qmetric_observe(ics->m.trace_notify, to_notify);
+	qmetric_observe(ics->m.trace_map, to_map);
+
+	if (ics->trace_sample && !(origin / 1000 % ics->trace_sample))
+		QLOG(qlog, QLOG_INFO, "Trace", "origin=%llu ident=%llu "
+		     "ident_to_notify=%llu ident_to_map=%llu",
+		     origin / 1000, ident_num, to_notify, to_map);
+}
+
+static void remove_entry(struct ila_ctl_sys *ics, struct ila_mkey *mkey)
+{
+	if (map_delete(ics, mkey, mkey->size) < 0 && errno != ESRCH) {
+		QLOG(qlog, QLOG_ERR, "Del failed", "errno=%d", errno);
 		return;
 	}
+
+	if (ics->notify_time)
+		qmetric_observe_since(ics->m.update_time, ics->notify_time);
 }
 
-static void watch_cb(void *key, size_t key_size, void *data)
+/* Parse an identifier record in either encoding. Returns the record
+ * generation number, the locator number and the map key for the
+ * identifier.
+ */
+static int parse_ident(void *rec, size_t size, __u64 *gen,
+		       __u64 *loc_num, struct ila_mkey *mkey)
+{
+	struct IlaIdentSirRec *srec = rec;
+	struct IlaIdentRec *frec = rec;
+
+	memset(mkey, 0, sizeof(*mkey));
+
+	if (size == sizeof(*srec)) {
+		if (ila_rec_normalize(srec, size, sizeof(*srec),
+				      ILA_REC_TYPE_IDENT_SIR) < 0)
+			return -1;
+
+		*gen = srec->hdr.gen;
+		*loc_num = srec->value.loc_num;
+		mkey->sir.sir_id = srec->value.sir_id;
+		mkey->sir.iid = srec->value.iid;
+		mkey->size = sizeof(mkey->sir);
+	} else {
+		if (ila_rec_normalize(frec, size, sizeof(*frec),
+				      ILA_REC_TYPE_IDENT) < 0)
+			return -1;
+
+		*gen = frec->hdr.gen;
+		*loc_num = frec->value.loc_num;
+		mkey->full.addr = frec->value.addr;
+		mkey->size = sizeof(mkey->full);
+	}
+
+	return 0;
+}
+
+/* Find the identifier entry, loading it from the identifier database if
+ * it hasn't been seen yet.
+ */
+static struct ila_ident_entry *load_ident(struct ila_ctl_sys *ics,
+					    struct IlaIdentKey *ikey)
+{
+	struct ila_ident_entry *iie;
+	union {
+		struct IlaIdentRec full;
+		struct IlaIdentSirRec sir;
+	} irec;
+	size_t irec_size = sizeof(irec);
+	struct ila_mkey mkey;
+	__u64 gen, loc_num;
+
+	iie = ident_lookup(ics, ikey);
+	if (iie)
+		return iie;
+
+	if (db_read(ics, ILA_CTL_DB_IDENT, ikey, sizeof(*ikey),
+		    &irec, &irec_size) < 0 ||
+	    parse_ident(&irec, irec_size, &gen, &loc_num, &mkey) < 0)
+		return NULL;
+
+	iie = ident_add(ics, ikey);
+	if (!iie)
+		return NULL;
+
+	iie->gen = gen;
+	iie->mkey = mkey;
+	iie->loc_num = loc_num;
+
+	return iie;
+}
+
+/* Remove the prepared mapping of a handover. ilad takes the deletion as
+ * the commit and switches to the staged route, so this is only done for
+ * a commit or once the mapping is gone.
+ */
+static void remove_prep(struct ila_ctl_sys *ics, struct ila_ident_entry *iie)
+{
+	struct IlaMapPrepKey pkey;
+	size_t pkey_size;
+
+	if (!iie->prep_loc_num && !iie->prep_aborted)
+		return;
+
+	pkey_size = ila_map_prep_key_init(&pkey, &iie->mkey, iie->mkey.size);
+	map_delete(ics, &pkey, pkey_size);
+	iie->prep_loc_num = 0;
+	iie->prep_aborted = false;
+}
+
+/* Abort a handover. The prepared mapping is overwritten with a zero
+ * locator for ilad to drop the staged route, a deletion could be read
+ * as a commit. The record is left until the next prepare or until the
+ * identifier is removed.
+ */
+static void abort_prep(struct ila_ctl_sys *ics, struct ila_ident_entry *iie)
+{
+	struct IlaMapPrepKey pkey;
+	struct IlaMapRec mrec;
+	size_t pkey_size;
+
+	if (!iie->prep_loc_num)
+		return;
+
+	make_map_rec(&mrec, 0, 0);
+	pkey_size = ila_map_prep_key_init(&pkey, &iie->mkey, iie->mkey.size);
+	if (map_write(ics, &pkey, pkey_size, &mrec) < 0) {
+		QLOG(qlog, QLOG_ERR, "Abort prepared mapping failed");
+		return;
+	}
+	iie->prep_loc_num = 0;
+	iie->prep_aborted = true;
+}
+
+/* A handover was prepared or aborted. For a prepare the map record the
+ * move will produce is written as a prepared mapping so ilad can stage
+ * it, this also loads the target locator into the cache.
+ */
+static void prep_watch_cb(struct ila_ctl_sys *ics, struct IlaIdentPrepKey *key)
+{
+	struct IlaIdentKey ikey = { .num = key->num };
+	struct ila_ident_entry *iie;
+	struct IlaIdentPrepRec prec;
+	size_t prec_size = sizeof(prec);
+	struct IlaMapPrepKey pkey;
+	struct IlaMapRec mrec;
+	size_t pkey_size;
+	Locator locator;
+	int res;
+
+	res = db_read(ics, ILA_CTL_DB_IDENT, key, sizeof(*key),
+		      &prec, &prec_size);
+
+	switch (res) {
+	case 0:
+		if (ila_rec_normalize(&prec, prec_size, sizeof(prec),
+				      ILA_REC_TYPE_PREP) < 0) {
+			QLOG(qlog, QLOG_WARN, "Unexpected prepare record",
+			     "size=%zu", prec_size);
+			return;
+		}
+
+		iie = load_ident(ics, &ikey);
+		if (!iie || !prec.loc_num ||
+		    get_locator(ics, prec.loc_num, &locator) < 0)
+			return;
+
+		make_map_rec(&mrec, locator, prec.hdr.timestamp);
+		pkey_size = ila_map_prep_key_init(&pkey, &iie->mkey,
+						  iie->mkey.size);
+
+		if (map_write(ics, &pkey, pkey_size, &mrec) < 0) {
+			QLOG(qlog, QLOG_ERR, "Prepared mapping failed");
+			return;
+		}
+		iie->prep_loc_num = prec.loc_num;
+		iie->prep_aborted = false;
+		break;
+	case -2:
+		/* A commit was already applied from the identifier
+		 * record, which is updated first
+		 */
+		iie = ident_lookup(ics, &ikey);
+		if (iie)
+			abort_prep(ics, iie);
+		break;
+	default:
+		QLOG(qlog, QLOG_ERR, "Read prepare record failed");
+	}
+}
+
+/* The identifier is gone, remove its mappings */
+static void ident_forget(struct ila_ctl_sys *ics, struct ila_ident_entry *iie)
+{
+	remove_entry(ics, &iie->mkey);
+	remove_prep(ics, iie);
+	ident_remove(ics, iie);
+}
+
+static void apply_ident(void *key, size_t key_size, void *data)
 {
 	struct IlaIdentKey *ikey = key;
 	struct ila_ctl_sys *ics = data;
-	struct IlaIdentValue ival;
-	size_t ival_size = sizeof(ival);
+	struct ila_ident_entry *iie;
+	union {
+		struct IlaIdentRec full;
+		struct IlaIdentSirRec sir;
+	} irec;
+	size_t irec_size = sizeof(irec);
+	struct ila_mkey mkey;
+	__u64 gen, loc_num;
 	int res;
 
-	res = ics->db_ops->read(ics->db_ident_ctx, key, key_size,
-				&ival, &ival_size);
+	if (key_size == sizeof(struct IlaIdentPrepKey) &&
+	    !memcmp(key, ILA_PREP_KEY_TAG, sizeof(ILA_PREP_KEY_TAG))) {
+		prep_watch_cb(ics, key);
+		return;
+	}
+
+	if (key_size != sizeof(*ikey))
+		return;
+
+	res = db_read(ics, ILA_CTL_DB_IDENT, key, key_size,
+		      &irec, &irec_size);
 
 	switch (res) {
 	case 0:
-		if (ival.loc_num)
-			set_entry(ics, ikey, &ival);
-		else
-			remove_entry(ics, ikey, &ival);
+		if (parse_ident(&irec, irec_size, &gen, &loc_num, &mkey) < 0) {
+			QLOG(qlog, QLOG_WARN, "Unexpected ident record",
+			     "size=%zu", irec_size);
+			return;
+		}
+
+		iie = ident_lookup(ics, ikey);
+		if (iie) {
+			if (ila_rec_is_stale(gen, iie->gen)) {
+				/* Already processed this or a later
+				 * record
+				 */
+				return;
+			}
+
+			if (iie->loc_num == loc_num &&
+			    iie->mkey.size == mkey.size &&
+			    !memcmp(&iie->mkey, &mkey, sizeof(mkey))) {
+				/* Mapping is current, e.g. was applied
+				 * from the ingestion socket
+				 */
+				iie->gen = gen;
+				return;
+			}
+		} else {
+			iie = ident_add(ics, ikey);
+		}
+
+		if (iie) {
+			iie->gen = gen;
+			iie->mkey = mkey;
+			iie->loc_num = loc_num;
+
+			/* Handover committed, ilad switches to the staged
+			 * route on the deletion without waiting for the
+			 * map record.
+			 */
+			if (loc_num && iie->prep_loc_num == loc_num)
+				remove_prep(ics, iie);
+		}
+
+		if (!loc_num)
+			remove_entry(ics, &mkey);
+		else if (!set_entry(ics, iie, &mkey, loc_num,
+				    irec.full.hdr.timestamp))
+			trace_update(ics, ikey->num, irec.full.hdr.timestamp);
 		break;
 	case -2:
-		/* Not in DB, probably was deleted. Remove from
-		 * forwarding table if possible.
+		/* Not in DB, probably was deleted. Remove the mapping
+		 * for the address it had if we know it.
 		 */
-		remove_entry(ics, ikey, &ival);
+		iie = ident_lookup(ics, ikey);
+		if (iie)
+			ident_forget(ics, iie);
 		break;
 	default:
 	case -1:
 		/* Each reading DB */
-		fprintf(stderr, "Read mapping failed\n");
+		QLOG(qlog, QLOG_ERR, "Read mapping failed");
 	}
 }
 
+static void watch_cb(void *key, size_t key_size, void *data)
+{
+	QPROBE2(ilactld, watch_entry, key, key_size);
+
+	apply_ident(key, key_size, data);
+
+	QPROBE2(ilactld, watch_return, key, key_size);
+}
+
+/* Apply an identifier or prepare record found by the resync scan and
+ * mark its entry as seen
+ */
+static void resync_scan_cb(void *key, size_t key_size, void *data)
+{
+	struct ila_ctl_sys *ics = data;
+	struct IlaIdentPrepKey *pkey = key;
+	struct ila_ident_entry *iie;
+	struct IlaIdentKey ikey;
+
+	apply_ident(key, key_size, data);
+
+	if (key_size == sizeof(ikey)) {
+		memcpy(&ikey, key, sizeof(ikey));
+		iie = ident_lookup(ics, &ikey);
+		if (iie)
+			iie->seen = true;
+	} else if (key_size == sizeof(*pkey) &&
+		   !memcmp(key, ILA_PREP_KEY_TAG, sizeof(ILA_PREP_KEY_TAG))) {
+		ikey.num = pkey->num;
+		iie = ident_lookup(ics, &ikey);
+		if (iie)
+			iie->prep_seen = true;
+	}
+}
+
+/* Identifier changes may have been missed, rescan the identifiers.
+ * Records are applied by generation so those already processed are
+ * skipped. Identifiers and prepared moves that weren't seen in the scan
+ * were deleted while changes were lost, their mappings are removed.
+ */
+static void resync_cb(void *data)
+{
+	struct ila_ctl_sys *ics = data;
+	struct ila_ident_entry *iie;
+	struct hlist_node *tmp;
+	unsigned int bkt;
+
+	qmetric_inc(ics->m.resyncs);
+
+	qhash_for_each_safe(&ics->ident_table, bkt, tmp, iie, node) {
+		iie->seen = false;
+		iie->prep_seen = false;
+	}
+
+	if (ics->db_ops->scan(ics->db_ident_ctx, NULL, resync_scan_cb,
+			      ics) < 0) {
+		QLOG(qlog, QLOG_ERR, "Resync scan failed");
+		return;
+	}
+
+	qhash_for_each_safe(&ics->ident_table, bkt, tmp, iie, node) {
+		if (!iie->seen)
+			ident_forget(ics, iie);
+		else if (!iie->prep_seen && iie->prep_loc_num)
+			abort_prep(ics, iie);
+	}
+}
+
+/* Ingestion socket */
+
+/* Identifier update of an ingested event. Operations still queued when
+ * ident_client is destroyed at exit are not freed.
+ */
+struct ila_ingest_op {
+	struct ila_ctl_sys *ics;
+	__u64 ident_num;
+};
+
+/* The identifier update failed after the map was written. Apply the
+ * identifier record again as if it was new so that the mapping matches
+ * it.
+ */
+static void ingest_rollback(struct ila_ctl_sys *ics, __u64 ident_num,
+			    int result)
+{
+	struct IlaIdentKey ikey = { .num = ident_num };
+	struct ila_ident_entry *iie;
+
+	QLOG(qlog, QLOG_ERR, "Ingest ident update failed",
+	     "ident=%llu result=%d", (unsigned long long)ident_num, result);
+	qmetric_inc(ics->m.ingest_failed);
+
+	iie = ident_lookup(ics, &ikey);
+	if (!iie)
+		return;
+
+	iie->gen = 0;
+	apply_ident(&ikey, sizeof(ikey), ics);
+}
+
+static void ingest_ident_done(int result, __u64 gen, void *data)
+{
+	struct ila_ingest_op *op = data;
+
+	if (result)
+		ingest_rollback(op->ics, op->ident_num, result);
+
+	free(op);
+}
+
+static void ingest_ident_update(struct ila_ctl_sys *ics,
+				struct ila_ident_entry *iie, __u64 loc_num)
+{
+	struct ila_ingest_op *op;
+	int ret = -1;
+
+	op = malloc(sizeof(*op));
+	if (op) {
+		op->ics = ics;
+		op->ident_num = iie->key.num;
+
+		if (loc_num)
+			ret = ila_ident_attach_async(ics->ident_client,
+						     iie->key.num, loc_num,
+						     ingest_ident_done, op);
+		else
+			ret = ila_ident_unattach_async(ics->ident_client,
+						       iie->key.num, 0,
+						       ingest_ident_done, op);
+		if (ret < 0)
+			free(op);
+	}
+
+	if (ret < 0)
+		ingest_rollback(ics, iie->key.num, ret);
+}
+
+static void ingest_reject(struct ila_ctl_sys *ics, __u64 ident_num,
+			  __u64 loc_num, const char *reason)
+{
+	QLOG(qlog, QLOG_WARN, "Ingest event rejected",
+	     "ident=%llu loc=%llu reason=\"%s\"",
+	     (unsigned long long)ident_num, (unsigned long long)loc_num,
+	     reason);
+	qmetric_inc(ics->m.ingest_rejected);
+}
+
+/* Apply a batch of events. The map updates are submitted as one
+ * pipelined batch and the identifier record updates are queued in
+ * ident_client. Returns the number of events written to the map
+ * database.
+ */
+static unsigned int ingest_batch(struct ila_ctl_sys *ics,
+				 struct IlaIngestEvent *events,
+				 unsigned int count)
+{
+	static const struct dbif_patch map_gen_patch = {
+		.op = DBIF_PATCH_GEN,
+		.offset = ILA_REC_GEN_OFFSET,
+	};
+	static struct dbif_req reqs[ILA_INGEST_MAX_EVENTS];
+	static struct IlaMapRec mrecs[ILA_INGEST_MAX_EVENTS];
+	static struct ila_ident_entry *iies[ILA_INGEST_MAX_EVENTS];
+	static __u64 loc_nums[ILA_INGEST_MAX_EVENTS];
+	unsigned int i, num = 0, applied = 0;
+	__u64 start = qmetrics_now();
+	__u64 origin = ila_time_ns();
+	struct ila_ident_entry *iie;
+	struct IlaIdentKey ikey;
+	Locator locator;
+	__u64 loc_num;
+
+	qmetric_add(ics->m.ingest_events, count);
+
+	for (i = 0; i < count; i++) {
+		ikey.num = be64toh(events[i].ident_num);
+		loc_num = be64toh(events[i].loc_num);
+
+		iie = load_ident(ics, &ikey);
+		if (!iie) {
+			ingest_reject(ics, ikey.num, loc_num,
+				      "unknown identifier");
+			continue;
+		}
+
+		memset(&reqs[num], 0, sizeof(reqs[num]));
+		reqs[num].key = &iie->mkey;
+		reqs[num].key_size = iie->mkey.size;
+
+		if (loc_num) {
+			if (get_locator(ics, loc_num, &locator) < 0) {
+				ingest_reject(ics, ikey.num, loc_num,
+					      "unknown locator");
+				continue;
+			}
+
+			make_map_rec(&mrecs[num], locator, origin);
+			reqs[num].op = DBIF_REQ_WRITE;
+			reqs[num].value = &mrecs[num];
+			reqs[num].value_size = sizeof(mrecs[num]);
+			reqs[num].patches = &map_gen_patch;
+			reqs[num].num_patches = 1;
+		} else {
+			reqs[num].op = DBIF_REQ_DELETE;
+		}
+
+		iies[num] = iie;
+		loc_nums[num] = loc_num;
+		num++;
+	}
+
+	if (!num || ics->db_ops->submit(ics->db_map_ctx, reqs, num) < 0)
+		return 0;
+
+	qmetric_observe_since(ics->m.ingest_batch_time, start);
+
+	for (i = 0; i < num; i++) {
+		if (reqs[i].result && reqs[i].result != -2)
+			continue;
+
+		applied++;
+
+		iie = iies[i];
+		iie->loc_num = loc_nums[i];
+		if (loc_nums[i])
+			iie->map_gen = mrecs[i].hdr.gen;
+
+		ingest_ident_update(ics, iie, loc_nums[i]);
+	}
+
+	qmetric_add(ics->m.ingest_applied, applied);
+
+	return applied;
+}
+
+static void ingest_read_cb(struct bufferevent *bev, void *arg)
+{
+	struct evbuffer *input = bufferevent_get_input(bev);
+	struct ila_ctl_sys *ics = arg;
+	struct IlaIngestHdr hdr;
+	struct IlaIngestEvent *events;
+	unsigned int count;
+	size_t len;
+
+	while (evbuffer_get_length(input) >= sizeof(hdr)) {
+		evbuffer_copyout(input, &hdr, sizeof(hdr));
+
+		count = ntohl(hdr.count);
+		if (ntohs(hdr.version) != ILA_INGEST_VERSION ||
+		    count > ILA_INGEST_MAX_EVENTS) {
+			QLOG(qlog, QLOG_WARN, "Bad ingest batch");
+			bufferevent_free(bev);
+			return;
+		}
+
+		len = sizeof(hdr) + count * sizeof(*events);
+		if (evbuffer_get_length(input) < len)
+			break;
+
+		events = (struct IlaIngestEvent *)
+				(evbuffer_pullup(input, len) + sizeof(hdr));
+
+		hdr.count = htonl(ingest_batch(ics, events, count));
+		hdr.flags = 0;
+
+		evbuffer_drain(input, len);
+
+		bufferevent_write(bev, &hdr, sizeof(hdr));
+	}
+}
+
+static void ingest_event_cb(struct bufferevent *bev, short events, void *arg)
+{
+	if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR))
+		bufferevent_free(bev);
+}
+
+static void ingest_accept_cb(struct evconnlistener *listener,
+			     evutil_socket_t fd, struct sockaddr *addr,
+			     int socklen, void *arg)
+{
+	struct ila_ctl_sys *ics = arg;
+	struct bufferevent *bev;
+
+	bev = bufferevent_socket_new(ics->event_base, fd,
+				     BEV_OPT_CLOSE_ON_FREE);
+	if (!bev) {
+		close(fd);
+		return;
+	}
+
+	bufferevent_setcb(bev, ingest_read_cb, NULL, ingest_event_cb, ics);
+	bufferevent_enable(bev, EV_READ | EV_WRITE);
+}
+
+/* Listen on a Unix socket if the address is a path, else on TCP */
+static int start_ingest(struct ila_ctl_sys *ics, char *listen_addr)
+{
+	struct sockaddr_storage ss;
+	struct sockaddr_un *sun = (struct sockaddr_un *)&ss;
+	int sslen = sizeof(ss);
+
+	memset(&ss, 0, sizeof(ss));
+
+	if (listen_addr[0] == '/') {
+		if (strlen(listen_addr) >= sizeof(sun->sun_path)) {
+			fprintf(stderr, "Listen path too long\n");
+			return -1;
+		}
+		sun->sun_family = AF_UNIX;
+		strcpy(sun->sun_path, listen_addr);
+		sslen = sizeof(*sun);
+		unlink(listen_addr);
+	} else if (evutil_parse_sockaddr_port(listen_addr,
+					      (struct sockaddr *)&ss,
+					      &sslen) < 0) {
+		fprintf(stderr, "Bad listen address %s\n", listen_addr);
+		return -1;
+	}
+
+	ics->ident_client = ila_client_create(ics->db_ops, ics->db_ident_ctx,
+					      ics->event_base,
+					      ILA_IDENT_BATCH_MAX);
+	if (!ics->ident_client) {
+		fprintf(stderr, "Unable to create ident client\n");
+		return -1;
+	}
+
+	ics->listener = evconnlistener_new_bind(ics->event_base,
+						ingest_accept_cb, ics,
+						LEV_OPT_CLOSE_ON_FREE |
+						LEV_OPT_REUSEABLE, -1,
+						(struct sockaddr *)&ss, sslen);
+	if (!ics->listener) {
+		fprintf(stderr, "Listen on %s: %s\n", listen_addr,
+			strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Identifier change notification */
+static void notify_cb(void *key, size_t key_size, void *data)
+{
+	struct ila_ctl_sys *ics = data;
+
+	qmetric_inc(ics->m.notifications);
+
+	ics->notify_time = qmetrics_now();
+	ics->notify_ns = ila_time_ns();
+	watch_cb(key, key_size, data);
+	ics->notify_time = 0;
+	ics->notify_ns = 0;
+}
+
+static __u64 ident_entries_get(void *data)
+{
+	struct ila_ctl_sys *ics = data;
+
+	return ics->ident_table.count;
+}
+
+static __u64 loc_entries_get(void *data)
+{
+	struct ila_ctl_sys *ics = data;
+
+	return ics->loc_table.count;
+}
+
+static __u64 ident_queue_get(void *data)
+{
+	struct ila_ctl_sys *ics = data;
+
+	return ics->ident_client ? ila_client_pending(ics->ident_client) : 0;
+}
+
+static const char * const db_names[ILA_CTL_DB_MAX] = {
+	[ILA_CTL_DB_MAP] = "db=\"map\"",
+	[ILA_CTL_DB_IDENT] = "db=\"ident\"",
+	[ILA_CTL_DB_LOC] = "db=\"loc\"",
+};
+
+static const char * const db_read_labels[ILA_CTL_DB_MAX][ILA_CTL_RES_MAX] = {
+	[ILA_CTL_DB_MAP] = {
+		"db=\"map\",result=\"ok\"",
+		"db=\"map\",result=\"missing\"",
+		"db=\"map\",result=\"error\"",
+	},
+	[ILA_CTL_DB_IDENT] = {
+		"db=\"ident\",result=\"ok\"",
+		"db=\"ident\",result=\"missing\"",
+		"db=\"ident\",result=\"error\"",
+	},
+	[ILA_CTL_DB_LOC] = {
+		"db=\"loc\",result=\"ok\"",
+		"db=\"loc\",result=\"missing\"",
+		"db=\"loc\",result=\"error\"",
+	},
+};
+
+static const char * const result_labels[ILA_CTL_RES_MAX] = {
+	[ILA_CTL_RES_OK] = "result=\"ok\"",
+	[ILA_CTL_RES_MISSING] = "result=\"missing\"",
+	[ILA_CTL_RES_ERROR] = "result=\"error\"",
+};
+
+static int init_metrics(struct ila_ctl_sys *ics)
+{
+	struct ila_ctl_metrics *m = &ics->m;
+	struct qmetrics *qms;
+	int i, j;
+
+	qms = qmetrics_create();
+	if (!qms)
+		return -1;
+
+	ics->metrics = qms;
+
+	m->notifications = qmetrics_counter(qms,
+			"ilactld_notifications_total", "db=\"ident\"",
+			"Change notifications received");
+	m->loc_notifications = qmetrics_counter(qms,
+			"ilactld_notifications_total", "db=\"loc\"",
+			"Change notifications received");
+	m->resyncs = qmetrics_counter(qms, "ilactld_resyncs_total", NULL,
+			"Resynchronizations with the identifier database");
+
+	for (i = 0; i < ILA_CTL_DB_MAX; i++)
+		for (j = 0; j < ILA_CTL_RES_MAX; j++)
+			m->db_reads[i][j] = qmetrics_counter(qms,
+					"ilactld_db_reads_total",
+					db_read_labels[i][j],
+					"Database reads");
+
+	for (i = 0; i < ILA_CTL_DB_MAX; i++)
+		m->db_read_time[i] = qmetrics_histogram(qms,
+				"ilactld_db_read_seconds", db_names[i],
+				"Database read latency");
+
+	for (j = 0; j < ILA_CTL_RES_MAX; j++)
+		m->map_writes[j] = qmetrics_counter(qms,
+				"ilactld_map_writes_total", result_labels[j],
+				"Map records written");
+
+	for (j = 0; j < ILA_CTL_RES_MAX; j++)
+		m->map_deletes[j] = qmetrics_counter(qms,
+				"ilactld_map_deletes_total", result_labels[j],
+				"Map records deleted");
+
+	m->map_write_time = qmetrics_histogram(qms, "ilactld_map_seconds",
+			"op=\"write\"", "Map database write latency");
+	m->map_delete_time = qmetrics_histogram(qms, "ilactld_map_seconds",
+			"op=\"delete\"", "Map database write latency");
+	m->update_time = qmetrics_histogram(qms, "ilactld_update_seconds",
+			NULL, "Identifier change notification to map update");
+	m->ingest_events = qmetrics_counter(qms,
+			"ilactld_ingest_events_total", NULL,
+			"Attach events received on the ingestion socket");
+	m->ingest_applied = qmetrics_counter(qms,
+			"ilactld_ingest_applied_total", NULL,
+			"Attach events applied to the map database");
+	m->ingest_failed = qmetrics_counter(qms,
+			"ilactld_ingest_failed_total", NULL,
+			"Attach events rolled back after the ident update failed");
+	m->ingest_rejected = qmetrics_counter(qms,
+			"ilactld_ingest_rejected_total", NULL,
+			"Attach events for unknown identifiers or locators");
+	m->ingest_batch_time = qmetrics_histogram(qms,
+			"ilactld_ingest_batch_seconds", NULL,
+			"Ingest batch to map database submit completed");
+	m->trace_notify = qmetrics_histogram(qms, "ilactld_trace_seconds",
+			"stage=\"ident_to_notify\"",
+			"Latency from the identifier write by stage");
+	m->trace_map = qmetrics_histogram(qms, "ilactld_trace_seconds",
+			"stage=\"ident_to_map\"",
+			"Latency from the identifier write by stage");
+	qmetrics_gauge_func(qms, "ilactld_ident_entries", NULL,
+			    "Identifiers held", ident_entries_get, ics);
+	qmetrics_gauge_func(qms, "ilactld_loc_entries", NULL,
+			    "Locators cached", loc_entries_get, ics);
+	qmetrics_gauge_func(qms, "ilactld_ident_queue", NULL,
+			    "Identifier updates queued for the database",
+			    ident_queue_get, ics);
+
+	return qmetrics_failed(qms) ? -1 : 0;
+}
+
 extern struct ila_db_ops ila_db_ops;
 
 #define ILA_REDIS_DEFAULT_HOST "::1"
 
+/* Stream for a component that logs to a FILE, or the log file itself if
+ * one can't be allocated
+ */
+static FILE *log_file(const char *src)
+{
+	FILE *f = qlog_file(qlog, QLOG_INFO, src);
+
+	return f ? : logfile;
+}
+
 static int start_db(const struct ila_ctl_sys *ics, FILE *logfile, void **ctx,
 		    char *subopts, char *def_host, __u16 def_port,
 		    const char *name)
@@ -221,7 +1350,7 @@ static int start_db(const struct ila_ctl_sys *ics, FILE *logfile, void **ctx,
 		return -1;
 	}
 
-	if (subopts && ics->db_ops->parse_args(ctx, subopts) < 0) {
+	if (subopts && ics->db_ops->parse_args(*ctx, subopts) < 0) {
 		fprintf(stderr, "Parse arg DB %s: %s\n", name, strerror(errno));
 		return -1;
 	}
@@ -234,18 +1363,265 @@ static int start_db(const struct ila_ctl_sys *ics, FILE *logfile, void **ctx,
 	return 0;
 }
 
+static void json_mkey_field(json_writer_t *jw, struct ila_mkey *mkey)
+{
+	char buf[INET6_ADDRSTRLEN];
+
+	if (mkey->size == sizeof(mkey->full)) {
+		inet_ntop(AF_INET6, &mkey->full.addr, buf, sizeof(buf));
+		jsonw_string_field(jw, "addr", buf);
+	} else if (mkey->size == sizeof(mkey->sir)) {
+		jsonw_uint_field(jw, "sir_id", mkey->sir.sir_id);
+		addr64_n2a(mkey->sir.iid, buf, sizeof(buf));
+		jsonw_string_field(jw, "iid", buf);
+	}
+}
+
+static int ctl_status(struct qctl_conn *conn, int argc, char **argv,
+		      void *data)
+{
+	json_writer_t *jw = qctl_json(conn);
+	struct ila_ctl_sys *ics = data;
+
+	jsonw_uint_field(jw, "ident_entries", ics->ident_table.count);
+	jsonw_uint_field(jw, "loc_entries", ics->loc_table.count);
+
+	if (ics->ident_client) {
+		jsonw_name(jw, "ingest");
+		jsonw_start_object(jw);
+		jsonw_uint_field(jw, "pending",
+				 ila_client_pending(ics->ident_client));
+		jsonw_uint_field(jw, "batch", ics->ident_batch);
+		jsonw_uint_field(jw, "window", ics->ident_window);
+		jsonw_end_object(jw);
+	}
+
+	return 0;
+}
+
+static void ctl_db_stats(json_writer_t *jw, const char *name,
+			 struct dbif_ops *db_ops, void *db_ctx)
+{
+	jsonw_name(jw, name);
+	jsonw_start_object(jw);
+	db_ops->stats(db_ctx, jw);
+	jsonw_end_object(jw);
+}
+
+static int ctl_stats(struct qctl_conn *conn, int argc, char **argv,
+		     void *data)
+{
+	json_writer_t *jw = qctl_json(conn);
+	struct ila_ctl_sys *ics = data;
+
+	jsonw_name(jw, "metrics");
+	qmetrics_json(ics->metrics, jw);
+
+	if (ics->db_ops->stats) {
+		jsonw_name(jw, "db");
+		jsonw_start_object(jw);
+		ctl_db_stats(jw, "map", ics->db_ops, ics->db_map_ctx);
+		ctl_db_stats(jw, "ident", ics->db_ops, ics->db_ident_ctx);
+		ctl_db_stats(jw, "loc", ics->db_ops, ics->db_loc_ctx);
+		jsonw_end_object(jw);
+	}
+
+	return 0;
+}
+
+/* State of a dump in progress, bkt is the next bucket of the table */
+struct ila_dump {
+	struct ila_ctl_sys *ics;
+	unsigned int bkt;
+};
+
+static bool dump_idents_step(json_writer_t *jw, void *arg, bool stop)
+{
+	struct ila_dump *dump = arg;
+	struct qhash *qh = &dump->ics->ident_table;
+	struct ila_ident_entry *iie;
+	unsigned int i;
+
+	for (i = 0; !stop && i < ILA_DUMP_BUCKETS &&
+		    dump->bkt < qhash_size(qh); i++, dump->bkt++)
+		qhash_for_each_in_bucket(qh, dump->bkt, iie, node) {
+			jsonw_start_object(jw);
+			jsonw_lluint_field(jw, "num", iie->key.num);
+			json_mkey_field(jw, &iie->mkey);
+			jsonw_lluint_field(jw, "loc_num", iie->loc_num);
+			jsonw_lluint_field(jw, "gen", iie->gen);
+			jsonw_lluint_field(jw, "map_gen", iie->map_gen);
+			if (iie->prep_loc_num)
+				jsonw_lluint_field(jw, "prep_loc_num",
+						   iie->prep_loc_num);
+			jsonw_end_object(jw);
+		}
+
+	if (!stop && dump->bkt < qhash_size(qh))
+		return true;
+
+	jsonw_end_array(jw);
+	free(dump);
+
+	return false;
+}
+
+static bool dump_locators_step(json_writer_t *jw, void *arg, bool stop)
+{
+	struct ila_dump *dump = arg;
+	struct qhash *qh = &dump->ics->loc_table;
+	struct ila_loc_entry *ile;
+	char buf[ADDR64_BUF_SIZE];
+	unsigned int i;
+
+	for (i = 0; !stop && i < ILA_DUMP_BUCKETS &&
+		    dump->bkt < qhash_size(qh); i++, dump->bkt++)
+		qhash_for_each_in_bucket(qh, dump->bkt, ile, node) {
+			addr64_n2a(ile->locator, buf, sizeof(buf));
+			jsonw_start_object(jw);
+			jsonw_lluint_field(jw, "num", ile->num);
+			jsonw_string_field(jw, "locator", buf);
+			jsonw_end_object(jw);
+		}
+
+	if (!stop && dump->bkt < qhash_size(qh))
+		return true;
+
+	jsonw_end_array(jw);
+	free(dump);
+
+	return false;
+}
+
+static int ctl_dump(struct qctl_conn *conn, int argc, char **argv,
+		    void *data)
+{
+	json_writer_t *jw = qctl_json(conn);
+	struct ila_ctl_sys *ics = data;
+	const char *table = argc > 1 ? argv[1] : "idents";
+	qctl_stream_fn step;
+	struct ila_dump *dump;
+
+	if (!strcmp(table, "idents")) {
+		step = dump_idents_step;
+	} else if (!strcmp(table, "locators")) {
+		step = dump_locators_step;
+	} else {
+		qctl_error(conn, "Unknown table %s", table);
+		return -1;
+	}
+
+	dump = calloc(1, sizeof(*dump));
+	if (!dump) {
+		qctl_error(conn, "Out of memory");
+		return -1;
+	}
+	dump->ics = ics;
+
+	jsonw_name(jw, table);
+	jsonw_start_array(jw);
+	qctl_stream(conn, step, dump);
+
+	return 0;
+}
+
+static void ident_batch_set(void *data)
+{
+	struct ila_ctl_sys *ics = data;
+
+	ila_client_set_batch(ics->ident_client, ics->ident_batch);
+}
+
+static void ident_window_set(void *data)
+{
+	struct ila_ctl_sys *ics = data;
+
+	ila_client_set_window(ics->ident_client, ics->ident_window);
+}
+
+/* Mapping changes are logged at debug level */
+static void verbose_set(void *data)
+{
+	struct ila_ctl_sys *ics = data;
+
+	qlog_set_level(qlog, ics->verbose ? QLOG_DEBUG : QLOG_INFO);
+}
+
+static int init_control(struct ila_ctl_sys *ics, char *ctl_addr)
+{
+	struct qctl *qc;
+	int err = 0;
+
+	qc = qctl_create(ics->event_base, log_file("ctl"));
+	if (!qc)
+		return -1;
+
+	ics->ctl = qc;
+
+	err |= qctl_command(qc, "status", "Table sizes and ingest queue",
+			    ctl_status, ics);
+	err |= qctl_command(qc, "stats", "Metrics and database "
+			    "statistics", ctl_stats, ics);
+	err |= qctl_command(qc, "dump", "dump [idents|locators], stream a "
+			    "table", ctl_dump, ics);
+	if (ics->ident_client) {
+		err |= qctl_tunable(qc, "ingest_batch", "Identifier updates "
+				    "per batch from ingestion",
+				    &ics->ident_batch, 1, ILA_IDENT_BATCH_MAX,
+				    ident_batch_set, ics);
+		err |= qctl_tunable(qc, "ingest_window", "Microseconds to "
+				    "coalesce identifier updates",
+				    &ics->ident_window, 0, 1000000,
+				    ident_window_set, ics);
+	}
+	err |= qctl_tunable(qc, "trace_sample", "Log a trace for one in N "
+			    "updates, 0 is off", &ics->trace_sample, 0,
+			    UINT_MAX, NULL, NULL);
+	err |= qctl_tunable(qc, "verbose", "Log mapping changes",
+			    &ics->verbose, 0, 1, verbose_set, ics);
+	if (err)
+		return -1;
+
+	return qctl_serve(qc, ctl_addr);
+}
+
 int main(int argc, char *argv[])
 {
 	struct ila_ctl_sys ics;
 	char *map_subopts = NULL;
 	char *ident_subopts = NULL;
 	char *loc_subopts = NULL;
+	char *listen_addr = NULL;
+	char *metrics_addr = NULL;
+	char *ctl_addr = NULL;
 
 	memset(&ics, 0, sizeof(ics));
+	ics.ident_batch = ILA_IDENT_BATCH_MAX;
 
-	if (parse_args(argc, argv, &map_subopts, &ident_subopts,
-		       &loc_subopts) < 0)
+	if (qhash_init(&ics.ident_table, 10) < 0 ||
+	    qhash_init(&ics.loc_table, 6) < 0) {
+		fprintf(stderr, "Unable to allocate tables\n");
 		exit(-1);
+	}
+
+	if (parse_args(argc, argv, &ics, &map_subopts, &ident_subopts,
+		       &loc_subopts, &listen_addr, &metrics_addr,
+		       &ctl_addr) < 0)
+		exit(-1);
+
+	if (init_metrics(&ics) < 0) {
+		fprintf(stderr, "Unable to allocate metrics\n");
+		exit(-1);
+	}
+
+	qlog = qlog_create(logfile, QLOG_DEFAULT_RING);
+	if (!qlog) {
+		fprintf(stderr, "Unable to allocate log\n");
+		exit(-1);
+	}
+	if (ics.verbose > 1)
+		ics.verbose = 1;
+	verbose_set(&ics);
 
 	ics.db_ops = dbif_get_redis();
 	if (!ics.db_ops) {
@@ -259,36 +1635,62 @@ int main(int argc, char *argv[])
 		exit(-1);
 	}
 
-	if (start_db(&ics, logfile, &ics.db_map_ctx, map_subopts,
-		     ILA_REDIS_DEFAULT_HOST, ILA_REDIS_DEFAULT_MAP_PORT,
-		     "map") < 0)
+	if (metrics_addr &&
+	    qmetrics_serve(ics.metrics, ics.event_base, metrics_addr,
+			   log_file("metrics")) < 0)
 		exit(-1);
 
-	if (start_db(&ics, logfile, &ics.db_ident_ctx, ident_subopts,
-		     ILA_REDIS_DEFAULT_HOST, ILA_REDIS_DEFAULT_IDENT_PORT,
-		     "ident") < 0)
+	if (start_db(&ics, log_file("map"), &ics.db_map_ctx,
+		     map_subopts, ILA_REDIS_DEFAULT_HOST,
+		     ILA_REDIS_DEFAULT_MAP_PORT, "map") < 0)
 		exit(-1);
 
-	if (start_db(&ics, logfile, &ics.db_loc_ctx, loc_subopts,
-		     ILA_REDIS_DEFAULT_HOST, ILA_REDIS_DEFAULT_LOC_PORT,
-		     "ident") < 0)
+	if (start_db(&ics, log_file("ident"), &ics.db_ident_ctx,
+		     ident_subopts, ILA_REDIS_DEFAULT_HOST,
+		     ILA_REDIS_DEFAULT_IDENT_PORT, "ident") < 0)
 		exit(-1);
 
-	if (ics.db_ops->scan(ics.db_ident_ctx, watch_cb, &ics) < 0) {
+	if (start_db(&ics, log_file("loc"), &ics.db_loc_ctx,
+		     loc_subopts, ILA_REDIS_DEFAULT_HOST,
+		     ILA_REDIS_DEFAULT_LOC_PORT, "ident") < 0)
+		exit(-1);
+
+	if (ics.db_ops->watch_all(ics.db_loc_ctx, NULL, loc_watch_cb,
+				   loc_resync_cb, &ics, &ics.loc_watch_handle,
+				   ics.event_base) < 0) {
+		fprintf(stderr, "Watch loc failed\n");
+		exit(-1);
+	}
+
+	if (ics.db_ops->scan(ics.db_ident_ctx, NULL, watch_cb, &ics) < 0) {
 		fprintf(stderr, "Initial scan failed\n");
 		exit(-1);
 	}
 
-	if (ics.db_ops->watch_all(ics.db_ident_ctx, watch_cb,
-				   &ics, &ics.watch_handle,
+	if (ics.db_ops->watch_all(ics.db_ident_ctx, NULL, notify_cb,
+				   resync_cb, &ics, &ics.watch_handle,
 				   ics.event_base) < 0) {
 		fprintf(stderr, "Watch all failed\n");
 		exit(-1);
 	}
 
+	if (listen_addr && start_ingest(&ics, listen_addr) < 0)
+		exit(-1);
+
+	if (ctl_addr && init_control(&ics, ctl_addr) < 0) {
+		fprintf(stderr, "Unable to start control socket\n");
+		exit(-1);
+	}
+
 	if (do_daemonize)
 		daemonize(stderr);
 
+	/* The writer thread must be started after the fork */
+	if (qlog_start(qlog) < 0) {
+		perror("Start log writer");
+		exit(-1);
+	}
+
 	/* Event loop */
 	event_base_dispatch(ics.event_base);
 }
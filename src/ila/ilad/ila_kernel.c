@@ -45,6 +45,7 @@
 
 #include "ila.h"
 #include "libgenl.h"
+#include "qprobe.h"
 #include "utils.h"
 
 struct ila_kernel_context {
@@ -215,6 +216,7 @@ static int flush_cb(const struct sockaddr_nl *who,
 {
 	struct ila_kernel_context *ikc = arg;
 	struct rtmsg *r = NLMSG_DATA(n);
+	struct rtattr *tb[RTA_MAX + 1];
 	struct {
 		struct nlmsghdr n;
 		struct rtmsg            r;
@@ -224,6 +226,10 @@ static int flush_cb(const struct sockaddr_nl *who,
 	if (r->rtm_protocol != RTPROT_IDLOCD)
 		return 0;
 
+	parse_rtattr(tb, RTA_MAX, RTM_RTA(r), RTM_PAYLOAD(n));
+	QPROBE1(ila_kernel, flush,
+		tb[RTA_DST] ? RTA_DATA(tb[RTA_DST]) : NULL);
+
 	memcpy(&req, n, n->nlmsg_len);
 
 	req.n.nlmsg_type = RTM_DELROUTE;
@@ -256,40 +262,45 @@ static int flush_kernel(struct ila_kernel_context *ikc)
 	return 0;
 }
 
-static int modify_route_mapping(struct ila_kernel_context *ikc,
-				struct ila_route *irt, int cmd, int flags)
-{
-	struct {
-		struct nlmsghdr n;
-		struct rtmsg            r;
-		char                    buf[1024];
-	} req = {
-		.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg)),
-		.n.nlmsg_flags = NLM_F_REQUEST | flags,
-		.n.nlmsg_type = cmd,
-		.r.rtm_family = AF_INET6,
-		.r.rtm_table = RT_TABLE_MAIN,
-		.r.rtm_scope = RT_SCOPE_NOWHERE,
-	};
+/* Route request message. Staged routes are kept as a built message */
+struct ila_route_req {
+	struct nlmsghdr n;
+	struct rtmsg            r;
+	char                    buf[1024];
+};
 
+static int build_route_req(struct ila_kernel_context *ikc,
+			   struct ila_route *irt, int cmd, int flags,
+			   struct ila_route_req *req)
+{
 	char buf[1024];
 	struct rtattr *rta = (void *)buf;
 
+	memset(req, 0, sizeof(*req));
+
+	req->n.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
+	req->n.nlmsg_flags = NLM_F_REQUEST | flags;
+	req->n.nlmsg_type = cmd;
+	req->r.rtm_family = AF_INET6;
+	req->r.rtm_table = RT_TABLE_MAIN;
+	req->r.rtm_scope = RT_SCOPE_NOWHERE;
+
 	if (cmd != RTM_DELROUTE) {
-		req.r.rtm_protocol = RTPROT_BOOT;
-		req.r.rtm_scope = RT_SCOPE_UNIVERSE;
-		req.r.rtm_type = RTN_UNICAST;
+		req->r.rtm_protocol = RTPROT_BOOT;
+		req->r.rtm_scope = RT_SCOPE_UNIVERSE;
+		req->r.rtm_type = RTN_UNICAST;
 	}
 
-	req.r.rtm_family = AF_INET6;
-	req.r.rtm_dst_len = 128;
-	req.r.rtm_protocol = RTPROT_IDLOCD;
-	addattr_l(&req.n, sizeof(req), RTA_DST, &irt->addr, sizeof(irt->addr));
+	req->r.rtm_family = AF_INET6;
+	req->r.rtm_dst_len = 128;
+	req->r.rtm_protocol = RTPROT_IDLOCD;
+	addattr_l(&req->n, sizeof(*req), RTA_DST, &irt->addr,
+		  sizeof(irt->addr));
 
 	/* rmap is NULL in case od RTM_DELROUTE */
 
 	if (cmd != RTM_DELROUTE) {
-		addattr_l(&req.n, sizeof(req), RTA_GATEWAY, &irt->via,
+		addattr_l(&req->n, sizeof(*req), RTA_GATEWAY, &irt->via,
 			  sizeof(irt->via));
 
 		/* Encap setup */
@@ -301,13 +312,44 @@ static int modify_route_mapping(struct ila_kernel_context *ikc,
 			return -1;
 
 		if (rta->rta_len > RTA_LENGTH(0))
-			addraw_l(&req.n, 1024, RTA_DATA(rta), RTA_PAYLOAD(rta));
+			addraw_l(&req->n, 1024, RTA_DATA(rta),
+				 RTA_PAYLOAD(rta));
 
 		if (irt->ifindex)
-			addattr32(&req.n, sizeof(req), RTA_OIF, irt->ifindex);
+			addattr32(&req->n, sizeof(*req), RTA_OIF,
+				  irt->ifindex);
 	}
 
-	if (rtnl_talk(&rth, &req.n, NULL, 0) < 0) {
+	return 0;
+}
+
+/* Send a route request and wait for the ACK. RTA_DST is the first
+ * attribute of a built request.
+ */
+static int talk_route_req(struct ila_route_req *req)
+{
+	int ret;
+
+	QPROBE2(ila_kernel, route_send, req->n.nlmsg_type,
+		RTA_DATA(RTM_RTA(&req->r)));
+
+	ret = rtnl_talk(&rth, &req->n, NULL, 0);
+
+	QPROBE3(ila_kernel, route_ack, req->n.nlmsg_type,
+		RTA_DATA(RTM_RTA(&req->r)), ret < 0 ? -errno : 0);
+
+	return ret;
+}
+
+static int modify_route_mapping(struct ila_kernel_context *ikc,
+				struct ila_route *irt, int cmd, int flags)
+{
+	struct ila_route_req req;
+
+	if (build_route_req(ikc, irt, cmd, flags, &req) < 0)
+		return -1;
+
+	if (talk_route_req(&req) < 0) {
 		IKPRINTF(ikc, "ila_kernel: Talk to kernel failed: %s",
 			 strerror(errno));
 
@@ -326,11 +368,12 @@ static int set_route(struct ila_kernel_context *ikc, struct ila_route *irt)
 		 */
 		modify_route_mapping(ikc, irt, RTM_DELROUTE, 0);
 
-		return 0;
+		return 1;
 	}
 
+	/* Replace so that a changed mapping is switched atomically */
 	return modify_route_mapping(ikc, irt, RTM_NEWROUTE,
-				    NLM_F_CREATE|NLM_F_EXCL);
+				    NLM_F_CREATE|NLM_F_REPLACE);
 }
 
 static int del_route_mapping(void *context, struct IlaMapKey *key)
@@ -345,25 +388,239 @@ static int del_route_mapping(void *context, struct IlaMapKey *key)
 	return modify_route_mapping(ikc, &irt, RTM_DELROUTE, 0);
 }
 
+static void make_route(struct ila_kernel_context *ikc, struct IlaMapKey *key,
+		       struct IlaMapValue *rmap, struct ila_route *irt)
+{
+	memset(irt, 0, sizeof(*irt));
+
+	irt->addr = key->addr;
+	irt->loc = rmap->loc;
+	irt->ifindex = rmap->ifindex ? rmap->ifindex : ikc->ifindex;
+	irt->csum_mode = rmap->csum_mode;
+	irt->ident_type = rmap->ident_type;
+	irt->hook_type = rmap->hook_type;
+	irt->via = ikc->via;
+}
+
 static int set_route_mapping(void *context, struct IlaMapKey *key,
 			     struct IlaMapValue *rmap)
 {
 	struct ila_kernel_context *ikc = context;
 	struct ila_route irt;
 
-	memset(&irt, 0, sizeof(irt));
-
-	irt.addr = key->addr;
-	irt.loc = rmap->loc;
-	irt.ifindex = rmap->ifindex ? rmap->ifindex : ikc->ifindex;
-	irt.csum_mode = rmap->csum_mode;
-	irt.ident_type = rmap->ident_type;
-	irt.hook_type = rmap->hook_type;
-	irt.via = ikc->via;
+	make_route(ikc, key, rmap, &irt);
 
 	return set_route(ikc, &irt);
 }
 
+/* A staged route is the complete netlink request so committing it is a
+ * single route replace (or delete when the locator is local).
+ */
+static int stage_route_mapping(void *context, struct IlaMapKey *key,
+			       struct IlaMapValue *rmap, void **stagedp)
+{
+	struct ila_kernel_context *ikc = context;
+	struct ila_route_req *req;
+	struct ila_route irt;
+	int ret;
+
+	req = malloc(sizeof(*req));
+	if (!req)
+		return -1;
+
+	make_route(ikc, key, rmap, &irt);
+
+	if (irt.loc == ikc->local_locator)
+		ret = build_route_req(ikc, &irt, RTM_DELROUTE, 0, req);
+	else
+		ret = build_route_req(ikc, &irt, RTM_NEWROUTE,
+				      NLM_F_CREATE|NLM_F_REPLACE, req);
+	if (ret < 0) {
+		free(req);
+		return -1;
+	}
+
+	*stagedp = req;
+
+	return 0;
+}
+
+static int commit_route_mapping(void *context, void *staged)
+{
+	struct ila_kernel_context *ikc = context;
+	struct ila_route_req *req = staged;
+	int ret = req->n.nlmsg_type == RTM_DELROUTE ? 1 : 0;
+
+	if (talk_route_req(req) < 0 &&
+	    req->n.nlmsg_type != RTM_DELROUTE) {
+		IKPRINTF(ikc, "ila_kernel: Talk to kernel failed: %s",
+			 strerror(errno));
+		ret = -2;
+	}
+
+	free(req);
+
+	return ret;
+}
+
+static void free_staged_mapping(void *context, void *staged)
+{
+	free(staged);
+}
+
+struct dump_arg {
+	void (*cb)(struct IlaMapKey *key, struct IlaMapValue *value,
+		   void *data);
+	void *data;
+};
+
+/* Report a host route that we set as its key and mapping */
+static int dump_cb(const struct sockaddr_nl *who,
+		   struct nlmsghdr *n, void *arg)
+{
+	struct rtattr *tb[RTA_MAX + 1], *etb[ILA_ATTR_MAX + 1];
+	struct rtmsg *r = NLMSG_DATA(n);
+	int len = n->nlmsg_len - NLMSG_LENGTH(sizeof(*r));
+	struct dump_arg *da = arg;
+	struct IlaMapValue value;
+	struct IlaMapKey key;
+
+	if (n->nlmsg_type != RTM_NEWROUTE || len < 0 ||
+	    r->rtm_family != AF_INET6 || r->rtm_protocol != RTPROT_IDLOCD ||
+	    r->rtm_dst_len != 128)
+		return 0;
+
+	parse_rtattr(tb, RTA_MAX, RTM_RTA(r), len);
+
+	if (!tb[RTA_DST] || !tb[RTA_ENCAP] || !tb[RTA_ENCAP_TYPE] ||
+	    rta_getattr_u16(tb[RTA_ENCAP_TYPE]) != LWTUNNEL_ENCAP_ILA)
+		return 0;
+
+	parse_rtattr_nested(etb, ILA_ATTR_MAX, tb[RTA_ENCAP]);
+
+	if (!etb[ILA_ATTR_LOCATOR])
+		return 0;
+
+	memset(&key, 0, sizeof(key));
+	memset(&value, 0, sizeof(value));
+
+	memcpy(&key.addr, RTA_DATA(tb[RTA_DST]), sizeof(key.addr));
+	value.loc = rta_getattr_u64(etb[ILA_ATTR_LOCATOR]);
+
+	if (etb[ILA_ATTR_CSUM_MODE])
+		value.csum_mode = rta_getattr_u8(etb[ILA_ATTR_CSUM_MODE]);
+	if (etb[ILA_ATTR_IDENT_TYPE])
+		value.ident_type = rta_getattr_u8(etb[ILA_ATTR_IDENT_TYPE]);
+	if (etb[ILA_ATTR_HOOK_TYPE])
+		value.hook_type = rta_getattr_u8(etb[ILA_ATTR_HOOK_TYPE]);
+	if (tb[RTA_OIF])
+		value.ifindex = rta_getattr_u32(tb[RTA_OIF]);
+
+	da->cb(&key, &value, da->data);
+
+	return 0;
+}
+
+static int dump_route_mappings(void *context,
+			       void (*cb)(struct IlaMapKey *key,
+					  struct IlaMapValue *value,
+					  void *data),
+			       void *data)
+{
+	struct ila_kernel_context *ikc = context;
+	struct dump_arg da = { .cb = cb, .data = data };
+
+	if (rtnl_wilddump_request(&rth, AF_INET6, RTM_GETROUTE) < 0) {
+		IKPRINTF(ikc, "ila_kernel: Failed to send dump request: %s",
+			 strerror(errno));
+		return -1;
+	}
+
+	if (rtnl_dump_filter(&rth, dump_cb, &da) < 0) {
+		IKPRINTF(ikc, "ila_kernel: Dump filter exited %s",
+			 strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+struct dump_use_arg {
+	void (*cb)(struct IlaMapKey *key, unsigned int age, void *data);
+	void *data;
+	long hz;
+};
+
+/* Report the last use of a host route that we set. A route without a
+ * dst, i.e. the FIB entry of an IPv6 route, has zero cache info and its
+ * use isn't known.
+ */
+static int dump_use_cb(const struct sockaddr_nl *who,
+		       struct nlmsghdr *n, void *arg)
+{
+	struct rtmsg *r = NLMSG_DATA(n);
+	int len = n->nlmsg_len - NLMSG_LENGTH(sizeof(*r));
+	struct dump_use_arg *da = arg;
+	struct rtattr *tb[RTA_MAX + 1];
+	struct rta_cacheinfo *ci;
+	struct IlaMapKey key;
+
+	if (n->nlmsg_type != RTM_NEWROUTE || len < 0 ||
+	    r->rtm_family != AF_INET6 || r->rtm_protocol != RTPROT_IDLOCD ||
+	    r->rtm_dst_len != 128)
+		return 0;
+
+	parse_rtattr(tb, RTA_MAX, RTM_RTA(r), len);
+
+	if (!tb[RTA_DST] || !tb[RTA_CACHEINFO] ||
+	    RTA_PAYLOAD(tb[RTA_CACHEINFO]) < sizeof(*ci))
+		return 0;
+
+	ci = RTA_DATA(tb[RTA_CACHEINFO]);
+	if (!ci->rta_used && !ci->rta_lastuse)
+		return 0;
+
+	memset(&key, 0, sizeof(key));
+	memcpy(&key.addr, RTA_DATA(tb[RTA_DST]), sizeof(key.addr));
+
+	da->cb(&key, ci->rta_lastuse / da->hz, da->data);
+
+	return 0;
+}
+
+static int dump_route_use(void *context,
+			  void (*cb)(struct IlaMapKey *key, unsigned int age,
+				     void *data),
+			  void *data)
+{
+	struct ila_kernel_context *ikc = context;
+	struct dump_use_arg da = { .cb = cb, .data = data };
+
+	/* rta_lastuse is in clock ticks */
+	da.hz = sysconf(_SC_CLK_TCK);
+	if (da.hz <= 0)
+		da.hz = 100;
+
+	if (rtnl_wilddump_request(&rth, AF_INET6, RTM_GETROUTE) < 0) {
+		IKPRINTF(ikc, "ila_kernel: Failed to send dump request: %s",
+			 strerror(errno));
+		return -1;
+	}
+
+	if (rtnl_dump_filter(&rth, dump_use_cb, &da) < 0) {
+		IKPRINTF(ikc, "ila_kernel: Dump filter exited %s",
+			 strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int flush_route_mappings(void *context)
+{
+	return flush_kernel(context);
+}
+
 struct ila_route_ops ila_kernel_ops = {
 	.init = ila_kernel_init,
 	.parse_args = ila_kernel_parse_args,
@@ -371,6 +628,12 @@ struct ila_route_ops ila_kernel_ops = {
 	.done = ila_kernel_done,
 	.set_route = set_route_mapping,
 	.del_route = del_route_mapping,
+	.stage_route = stage_route_mapping,
+	.commit_route = commit_route_mapping,
+	.free_staged = free_staged_mapping,
+	.dump_routes = dump_route_mappings,
+	.dump_use = dump_route_use,
+	.flush_routes = flush_route_mappings,
 };
 
 struct ila_route_ops *ila_get_kernel(void)
@@ -0,0 +1,450 @@
+/*
+ * ila_record.c - Null and recording ILA route backends
+ *
+ * Copyright (c) 2018, Quantonium Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the Quantonium nor the names of its contributors
+ *     may be used to endorse or promote products derived from this software
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL QUANTONIUM BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Route backends that don't touch the kernel, so that ilad can be run and
+ * profiled without privileges or the ila module.
+ *
+ * The null backend accepts every operation and does nothing.
+ *
+ * The record backend keeps the routes in a table, so that they can be
+ * dumped for anti-entropy, and appends each change to a route log (see
+ * struct ila_route_log_hdr in ila.h). Replaying the log gives the routes
+ * that ilad set, which "ilac map check" compares with the map database.
+ * The log is block buffered, it is written out when ilad exits or with
+ * the sync option after each record.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ila.h"
+#include "qhash.h"
+#include "qmetrics.h"
+#include "utils.h"
+
+#define ILA_RECORD_BUFSIZ	(1 << 20)
+
+struct ila_record_context {
+	Locator local_locator;
+	bool record;
+	bool sync;
+	char *path;
+	FILE *file;
+	char *buf;
+	__u64 start;
+	struct qhash table;
+	FILE *logf;
+};
+
+#define IRPRINTF(irc, format, ...) do {				\
+	if (irc->logf)						\
+		fprintf(irc->logf, format, ##__VA_ARGS__);	\
+} while (0)
+
+struct ila_record_route {
+	struct qhash_node node;
+	struct IlaMapKey key;
+	struct IlaMapValue value;
+};
+
+/* A staged route is the mapping to set when it is committed */
+struct ila_record_staged {
+	struct IlaMapKey key;
+	struct IlaMapValue value;
+};
+
+static int ila_record_init_common(void **context, FILE *logf, bool record)
+{
+	struct ila_record_context *irc;
+
+	irc = calloc(1, sizeof(*irc));
+	if (!irc) {
+		if (logf)
+			fprintf(logf, "ila_record: Malloc context failed\n");
+		return -1;
+	}
+
+	irc->logf = logf;
+	irc->record = record;
+
+	if (record && qhash_init(&irc->table, 10) < 0) {
+		IRPRINTF(irc, "ila_record: Malloc table failed\n");
+		free(irc);
+		return -1;
+	}
+
+	*context = irc;
+
+	return 0;
+}
+
+static int ila_null_init(void **context, FILE *logf)
+{
+	return ila_record_init_common(context, logf, false);
+}
+
+static int ila_record_init(void **context, FILE *logf)
+{
+	return ila_record_init_common(context, logf, true);
+}
+
+enum {
+	OPT_FILE = 0,
+	OPT_SYNC,
+	OPT_LOCAL_LOCATOR,
+	THE_END
+};
+
+static char *token[] = {
+	[OPT_FILE] = "file",
+	[OPT_SYNC] = "sync",
+	[OPT_LOCAL_LOCATOR] = "local-locator",
+	[THE_END] = NULL
+};
+
+static int ila_record_parse_args(void *context, char *subopts)
+{
+	struct ila_record_context *irc = context;
+	char *value;
+
+	if (!subopts)
+		return 0;
+
+	while (*subopts != '\0') {
+		switch (getsubopt((char **__restrict)&subopts, token, &value)) {
+		case OPT_FILE:
+			if (!irc->record || !value) {
+				IRPRINTF(irc, "ila_record: Bad file option\n");
+				return -1;
+			}
+			irc->path = value;
+			break;
+		case OPT_SYNC:
+			irc->sync = true;
+			break;
+		case OPT_LOCAL_LOCATOR:
+			if (!value ||
+			    get_addr64(&irc->local_locator, value) < 0) {
+				IRPRINTF(irc, "ila_record: Bad locator '%s'\n",
+					 value ? : "");
+				return -1;
+			}
+			break;
+		default:
+			IRPRINTF(irc, "ila_record: Bad ILA record opt '%s'\n",
+				 value);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int ila_record_start(void *context)
+{
+	struct ila_record_context *irc = context;
+	struct ila_route_log_hdr hdr;
+	struct timespec ts;
+
+	if (!irc->record)
+		return 0;
+
+	if (!irc->path) {
+		IRPRINTF(irc, "ila_record: Need a file option\n");
+		return -1;
+	}
+
+	irc->file = fopen(irc->path, "w");
+	if (!irc->file) {
+		IRPRINTF(irc, "ila_record: Open %s failed: %s\n", irc->path,
+			 strerror(errno));
+		return -1;
+	}
+
+	irc->buf = malloc(ILA_RECORD_BUFSIZ);
+	if (irc->buf)
+		setvbuf(irc->file, irc->buf, _IOFBF, ILA_RECORD_BUFSIZ);
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	irc->start = qmetrics_now();
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = ILA_ROUTE_LOG_MAGIC;
+	hdr.version = ILA_ROUTE_LOG_VERSION;
+	hdr.rec_size = sizeof(struct ila_route_log_rec);
+	hdr.start_ns = (__u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, irc->file) != 1 ||
+	    fflush(irc->file)) {
+		IRPRINTF(irc, "ila_record: Write %s failed: %s\n", irc->path,
+			 strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static void ila_record_done(void *context)
+{
+	struct ila_record_context *irc = context;
+	struct ila_record_route *irr;
+	struct hlist_node *tmp;
+	unsigned int bkt;
+
+	if (irc->file && fclose(irc->file))
+		IRPRINTF(irc, "ila_record: Write %s failed: %s\n", irc->path,
+			 strerror(errno));
+	free(irc->buf);
+
+	if (irc->record) {
+		qhash_for_each_safe(&irc->table, bkt, tmp, irr, node) {
+			qhash_del(&irc->table, &irr->node);
+			free(irr);
+		}
+		qhash_destroy(&irc->table);
+	}
+
+	free(irc);
+}
+
+static void log_route(struct ila_record_context *irc, __u8 op, __u8 flags,
+		      struct IlaMapKey *key, struct IlaMapValue *value)
+{
+	struct ila_route_log_rec rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.usecs = qmetrics_now() - irc->start;
+	rec.op = op;
+	rec.flags = flags;
+	if (key)
+		rec.addr = key->addr;
+	if (value)
+		rec.value = *value;
+
+	if (fwrite(&rec, sizeof(rec), 1, irc->file) != 1 ||
+	    (irc->sync && fflush(irc->file)))
+		IRPRINTF(irc, "ila_record: Write %s failed: %s\n", irc->path,
+			 strerror(errno));
+}
+
+static struct ila_record_route *route_lookup(struct ila_record_context *irc,
+					     struct IlaMapKey *key, __u32 hash)
+{
+	struct ila_record_route *irr;
+
+	qhash_for_each_possible(&irc->table, irr, node, hash)
+		if (!memcmp(&irr->key, key, sizeof(*key)))
+			return irr;
+
+	return NULL;
+}
+
+/* Remove a route, fails with ESRCH as the kernel does if there is none */
+static int remove_route(struct ila_record_context *irc, struct IlaMapKey *key,
+			__u8 flags)
+{
+	__u32 hash = qhash_bytes(key, sizeof(*key), 0);
+	struct ila_record_route *irr;
+
+	if (!irc->record)
+		return 0;
+
+	log_route(irc, ILA_ROUTE_LOG_DEL, flags, key, NULL);
+
+	irr = route_lookup(irc, key, hash);
+	if (!irr) {
+		errno = ESRCH;
+		return -1;
+	}
+
+	qhash_del(&irc->table, &irr->node);
+	free(irr);
+
+	return 0;
+}
+
+static int set_route(struct ila_record_context *irc, struct IlaMapKey *key,
+		     struct IlaMapValue *value, __u8 flags)
+{
+	__u32 hash = qhash_bytes(key, sizeof(*key), 0);
+	struct ila_record_route *irr;
+
+	if (value->loc == irc->local_locator) {
+		/* No route for a local locator, remove any previous one */
+		remove_route(irc, key, flags);
+
+		return 1;
+	}
+
+	if (!irc->record)
+		return 0;
+
+	irr = route_lookup(irc, key, hash);
+	if (!irr) {
+		irr = malloc(sizeof(*irr));
+		if (!irr) {
+			IRPRINTF(irc, "ila_record: Malloc route failed\n");
+			return -1;
+		}
+		irr->key = *key;
+		qhash_add(&irc->table, &irr->node, hash);
+	}
+	irr->value = *value;
+
+	log_route(irc, ILA_ROUTE_LOG_SET, flags, key, value);
+
+	return 0;
+}
+
+static int set_route_mapping(void *context, struct IlaMapKey *key,
+			     struct IlaMapValue *value)
+{
+	return set_route(context, key, value, 0);
+}
+
+static int del_route_mapping(void *context, struct IlaMapKey *key)
+{
+	return remove_route(context, key, 0);
+}
+
+static int stage_route_mapping(void *context, struct IlaMapKey *key,
+			       struct IlaMapValue *value, void **stagedp)
+{
+	struct ila_record_staged *irs;
+
+	irs = malloc(sizeof(*irs));
+	if (!irs)
+		return -1;
+
+	irs->key = *key;
+	irs->value = *value;
+
+	*stagedp = irs;
+
+	return 0;
+}
+
+static int commit_route_mapping(void *context, void *staged)
+{
+	struct ila_record_staged *irs = staged;
+	int ret;
+
+	ret = set_route(context, &irs->key, &irs->value,
+			ILA_ROUTE_LOG_F_STAGED);
+
+	free(irs);
+
+	return ret;
+}
+
+static void free_staged_mapping(void *context, void *staged)
+{
+	free(staged);
+}
+
+static int dump_route_mappings(void *context,
+			       void (*cb)(struct IlaMapKey *key,
+					  struct IlaMapValue *value,
+					  void *data),
+			       void *data)
+{
+	struct ila_record_context *irc = context;
+	struct ila_record_route *irr;
+	struct hlist_node *tmp;
+	unsigned int bkt;
+
+	qhash_for_each_safe(&irc->table, bkt, tmp, irr, node)
+		cb(&irr->key, &irr->value, data);
+
+	return 0;
+}
+
+static int flush_route_mappings(void *context)
+{
+	struct ila_record_context *irc = context;
+	struct ila_record_route *irr;
+	struct hlist_node *tmp;
+	unsigned int bkt;
+
+	if (!irc->record)
+		return 0;
+
+	log_route(irc, ILA_ROUTE_LOG_FLUSH, 0, NULL, NULL);
+
+	qhash_for_each_safe(&irc->table, bkt, tmp, irr, node) {
+		qhash_del(&irc->table, &irr->node);
+		free(irr);
+	}
+
+	return 0;
+}
+
+/* The null backend has no dump since it would report every route as
+ * missing to anti-entropy.
+ */
+struct ila_route_ops ila_null_ops = {
+	.init = ila_null_init,
+	.parse_args = ila_record_parse_args,
+	.start = ila_record_start,
+	.done = ila_record_done,
+	.set_route = set_route_mapping,
+	.del_route = del_route_mapping,
+	.stage_route = stage_route_mapping,
+	.commit_route = commit_route_mapping,
+	.free_staged = free_staged_mapping,
+	.flush_routes = flush_route_mappings,
+};
+
+struct ila_route_ops ila_record_ops = {
+	.init = ila_record_init,
+	.parse_args = ila_record_parse_args,
+	.start = ila_record_start,
+	.done = ila_record_done,
+	.set_route = set_route_mapping,
+	.del_route = del_route_mapping,
+	.stage_route = stage_route_mapping,
+	.commit_route = commit_route_mapping,
+	.free_staged = free_staged_mapping,
+	.dump_routes = dump_route_mappings,
+	.flush_routes = flush_route_mappings,
+};
+
+struct ila_route_ops *ila_get_null(void)
+{
+	return &ila_null_ops;
+}
+
+struct ila_route_ops *ila_get_record(void)
+{
+	return &ila_record_ops;
+}
@@ -0,0 +1,669 @@
+/*
+ * ila_route_bench.c - benchmark of ILA route backends
+ *
+ * Copyright (c) 2018, Quantonium Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the Quantonium nor the names of its contributors
+ *     may be used to endorse or promote products derived from this software
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL QUANTONIUM BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Drive an ila_route_ops backend directly and measure how fast routes are
+ * added, dumped, replaced, switched with a staged commit, deleted, and
+ * flushed as the table grows. Kernel routes are set in a throwaway network
+ * namespace with a dummy device that the routes point to, so the host's
+ * routing table isn't touched. Results are written as JSON to stdout.
+ *
+ * For each table size the phases are:
+ *
+ *   add	Set a route for each of size addresses
+ *   dump	Dump the routes and count them
+ *   replace	Set each route to another locator
+ *   stage	Stage a route to the first locator (off the forwarding path)
+ *   commit	Commit the staged route, staged and committed one by one
+ *   delete	Delete every other route
+ *   flush	Flush the remaining routes
+ *
+ * The kernel memory delta is the change in slab memory over the add phase.
+ * It is system wide so other activity shows up in it.
+ */
+
+#include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <getopt.h>
+#include <linux/ila.h>
+#include <linux/if_link.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ila.h"
+#include "json_writer.h"
+#include "libnetlink.h"
+#include "qbench.h"
+#include "qmetrics.h"
+#include "utils.h"
+
+#define BENCH_DEFAULT_SIZES	"10000,100000,1000000,5000000"
+#define BENCH_MAX_SIZES		16
+
+/* Throwaway namespace setup. Routes go via a neighbor on the dummy
+ * device.
+ */
+#define BENCH_DEV		"ilabench0"
+#define BENCH_DEV_ADDR		"fd00:ffff::1"
+#define BENCH_DEV_PLEN		64
+#define BENCH_VIA		"fd00:ffff::2"
+#define BENCH_DEFAULT_ROUTEOPTS	"via=" BENCH_VIA ",dev=" BENCH_DEV
+
+/* Addresses are the route number in a SIR prefix */
+#define BENCH_SIR_PREFIX	0x3333000000000000ULL
+#define BENCH_LOC1		"2017:0:0:1"
+#define BENCH_LOC2		"2017:0:0:2"
+
+/* Backends with their default route options. Only kernel routes need a
+ * namespace, the record backend writes its log to /dev/null by default.
+ */
+static const struct bench_backend {
+	const char *name;
+	struct ila_route_ops *(*get)(void);
+	const char *routeopts;
+	bool kernel;
+} backends[] = {
+	{ "kernel", ila_get_kernel, BENCH_DEFAULT_ROUTEOPTS, true },
+	{ "null", ila_get_null, NULL, false },
+	{ "record", ila_get_record, "file=/dev/null", false },
+};
+
+#define BENCH_NUM_BACKENDS	(sizeof(backends) / sizeof(backends[0]))
+
+#define ARGS "b:R:N:xvp"
+
+static struct option long_options[] = {
+	{ "backend", required_argument, 0, 'b' },
+	{ "routeopts", required_argument, 0, 'R' },
+	{ "routes", required_argument, 0, 'N' },
+	{ "no-netns", no_argument, 0, 'x' },
+	{ "verbose", no_argument, 0, 'v' },
+	{ "pretty", no_argument, 0, 'p' },
+	{ NULL, 0, 0, 0 },
+};
+
+static void usage(char *prog_name)
+{
+	fprintf(stderr, "Usage: ila_route_bench [-b backend] [-R routeopts] "
+			"[-N routes,...] [-x] [-v] [-p]\n");
+	fprintf(stderr, "  -b, --backend      route backend, kernel (default), "
+			"null, or record\n");
+	fprintf(stderr, "  -R, --routeopts    route options (kernel default "
+			"%s)\n", BENCH_DEFAULT_ROUTEOPTS);
+	fprintf(stderr, "  -N, --routes       table sizes (default %s)\n",
+		BENCH_DEFAULT_SIZES);
+	fprintf(stderr, "  -x, --no-netns     run in the current network "
+			"namespace\n");
+	fprintf(stderr, "  -v, --verbose      log backend errors\n");
+	fprintf(stderr, "  -p, --pretty       pretty print the results\n");
+}
+
+struct bench_sys {
+	const struct bench_backend *bb;
+	struct ila_route_ops *route_ops;
+	void *route_ctx;
+	const char *backend;
+	const char *route_subopts;
+	char *route_buf;
+	unsigned long sizes[BENCH_MAX_SIZES];
+	int num_sizes;
+	bool no_netns;
+	bool verbose;
+	bool pretty;
+	Locator loc1;
+	Locator loc2;
+	json_writer_t *jw;
+};
+
+static void bench_key(struct IlaMapKey *key, __u64 num)
+{
+	__u64 words[2] = { htobe64(BENCH_SIR_PREFIX), htobe64(num + 1) };
+
+	memcpy(&key->addr, words, sizeof(key->addr));
+}
+
+static void bench_value(struct IlaMapValue *value, Locator loc)
+{
+	memset(value, 0, sizeof(*value));
+	value->loc = loc;
+	value->csum_mode = ILA_CSUM_NEUTRAL_MAP_AUTO;
+	value->ident_type = ILA_ATYPE_LUID;
+	value->hook_type = ILA_HOOK_ROUTE_OUTPUT;
+}
+
+/* Slab memory in bytes from /proc/meminfo, zero if unknown */
+static __u64 slab_bytes(void)
+{
+	unsigned long long kb = 0;
+	char line[128];
+	FILE *f;
+
+	f = fopen("/proc/meminfo", "r");
+	if (!f)
+		return 0;
+
+	while (fgets(line, sizeof(line), f))
+		if (sscanf(line, "Slab: %llu kB", &kb) == 1)
+			break;
+
+	fclose(f);
+
+	return kb * 1024;
+}
+
+static void bench_phase(struct bench_sys *bs, const char *name,
+			unsigned long ops, unsigned long errors, __u64 usecs,
+			struct qbench_lat *lat)
+{
+	jsonw_start_object(bs->jw);
+	jsonw_string_field(bs->jw, "phase", name);
+	qbench_json_fields(bs->jw, ops, errors, usecs, lat);
+	jsonw_end_object(bs->jw);
+}
+
+/* Set or replace count routes to a locator */
+static int bench_set(struct bench_sys *bs, const char *name,
+		     __u64 count, Locator loc)
+{
+	struct IlaMapValue value;
+	struct IlaMapKey key;
+	unsigned long errors = 0;
+	struct qbench_lat lat;
+	__u64 i, start, t;
+
+	if (qbench_lat_init(&lat, count) < 0)
+		return -1;
+
+	bench_value(&value, loc);
+
+	start = qmetrics_now();
+	for (i = 0; i < count; i++) {
+		bench_key(&key, i);
+
+		t = qmetrics_now();
+		if (bs->route_ops->set_route(bs->route_ctx, &key, &value) < 0)
+			errors++;
+		qbench_lat_add(&lat, qmetrics_now() - t);
+	}
+
+	bench_phase(bs, name, count, errors, qmetrics_now() - start, &lat);
+	qbench_lat_free(&lat);
+
+	return 0;
+}
+
+static void bench_count_cb(struct IlaMapKey *key, struct IlaMapValue *value,
+			   void *data)
+{
+	unsigned long *count = data;
+
+	(*count)++;
+}
+
+static int bench_dump(struct bench_sys *bs, const char *name,
+		      unsigned long *count)
+{
+	int ret;
+	__u64 start;
+
+	*count = 0;
+
+	if (!bs->route_ops->dump_routes)
+		return 0;
+
+	start = qmetrics_now();
+	ret = bs->route_ops->dump_routes(bs->route_ctx, bench_count_cb,
+					 count);
+	if (name)
+		bench_phase(bs, name, *count, ret < 0, qmetrics_now() - start,
+			    NULL);
+
+	return ret;
+}
+
+/* The prepared handover path: stage the new route, then commit it */
+static int bench_stage_commit(struct bench_sys *bs, __u64 count)
+{
+	struct qbench_lat stage_lat, commit_lat;
+	unsigned long stage_errors = 0, commit_errors = 0;
+	__u64 i, t, stage_usecs = 0, commit_usecs = 0;
+	struct IlaMapValue value;
+	struct IlaMapKey key;
+	void *staged;
+
+	if (!bs->route_ops->stage_route)
+		return 0;
+
+	if (qbench_lat_init(&stage_lat, count) < 0)
+		return -1;
+	if (qbench_lat_init(&commit_lat, count) < 0) {
+		qbench_lat_free(&stage_lat);
+		return -1;
+	}
+
+	bench_value(&value, bs->loc1);
+
+	for (i = 0; i < count; i++) {
+		bench_key(&key, i);
+
+		t = qmetrics_now();
+		if (bs->route_ops->stage_route(bs->route_ctx, &key, &value,
+					       &staged) < 0) {
+			stage_errors++;
+			continue;
+		}
+		t = qmetrics_now() - t;
+		stage_usecs += t;
+		qbench_lat_add(&stage_lat, t);
+
+		t = qmetrics_now();
+		if (bs->route_ops->commit_route(bs->route_ctx, staged) < 0)
+			commit_errors++;
+		t = qmetrics_now() - t;
+		commit_usecs += t;
+		qbench_lat_add(&commit_lat, t);
+	}
+
+	bench_phase(bs, "stage", count, stage_errors, stage_usecs,
+		    &stage_lat);
+	bench_phase(bs, "commit", count - stage_errors, commit_errors,
+		    commit_usecs, &commit_lat);
+
+	qbench_lat_free(&commit_lat);
+	qbench_lat_free(&stage_lat);
+
+	return 0;
+}
+
+static int bench_delete(struct bench_sys *bs, __u64 count)
+{
+	unsigned long errors = 0;
+	struct qbench_lat lat;
+	struct IlaMapKey key;
+	__u64 i, start, t;
+
+	if (qbench_lat_init(&lat, count / 2 + 1) < 0)
+		return -1;
+
+	start = qmetrics_now();
+	for (i = 0; i < count; i += 2) {
+		bench_key(&key, i);
+
+		t = qmetrics_now();
+		if (bs->route_ops->del_route(bs->route_ctx, &key) < 0)
+			errors++;
+		qbench_lat_add(&lat, qmetrics_now() - t);
+	}
+
+	bench_phase(bs, "delete", (count + 1) / 2, errors,
+		    qmetrics_now() - start, &lat);
+	qbench_lat_free(&lat);
+
+	return 0;
+}
+
+static int bench_flush(struct bench_sys *bs, __u64 count)
+{
+	__u64 start;
+	int ret;
+
+	if (!bs->route_ops->flush_routes)
+		return 0;
+
+	start = qmetrics_now();
+	ret = bs->route_ops->flush_routes(bs->route_ctx);
+	bench_phase(bs, "flush", count / 2, ret < 0, qmetrics_now() - start,
+		    NULL);
+
+	return 0;
+}
+
+static int bench_size(struct bench_sys *bs, __u64 count)
+{
+	unsigned long dumped = 0, left = 0;
+	__u64 slab_before, slab_after;
+	int ret = -1;
+
+	jsonw_start_object(bs->jw);
+	jsonw_uint_field(bs->jw, "routes", count);
+
+	jsonw_name(bs->jw, "phases");
+	jsonw_start_array(bs->jw);
+
+	slab_before = slab_bytes();
+	if (bench_set(bs, "add", count, bs->loc1) < 0)
+		goto out;
+	slab_after = slab_bytes();
+
+	if (bench_dump(bs, "dump", &dumped) < 0 ||
+	    bench_set(bs, "replace", count, bs->loc2) < 0 ||
+	    bench_stage_commit(bs, count) < 0 ||
+	    bench_delete(bs, count) < 0 ||
+	    bench_flush(bs, count) < 0)
+		goto out;
+
+	ret = 0;
+
+out:
+	jsonw_end_array(bs->jw);
+
+	if (!ret) {
+		jsonw_uint_field(bs->jw, "dumped", dumped);
+		jsonw_int_field(bs->jw, "kernel_mem_delta_bytes",
+				(__s64)(slab_after - slab_before));
+		jsonw_int_field(bs->jw, "kernel_mem_per_route",
+				(__s64)(slab_after - slab_before) /
+				(__s64)count);
+
+		/* Anything not flushed is removed one by one so the next
+		 * size starts empty
+		 */
+		if (bench_dump(bs, NULL, &left) == 0 && left) {
+			struct IlaMapKey key;
+			__u64 i;
+
+			for (i = 0; i < count; i++) {
+				bench_key(&key, i);
+				bs->route_ops->del_route(bs->route_ctx, &key);
+			}
+		}
+		jsonw_uint_field(bs->jw, "left_after_flush", left);
+	}
+
+	jsonw_end_object(bs->jw);
+
+	return ret;
+}
+
+/* Throwaway network namespace with lo and a dummy device up, and an
+ * address on the dummy device so routes can go via a neighbor on it.
+ */
+static int bench_link_up(struct rtnl_handle *rth, const char *name,
+			 const char *kind)
+{
+	struct {
+		struct nlmsghdr n;
+		struct ifinfomsg i;
+		char buf[256];
+	} req = {
+		.n = {
+			.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg)),
+			.nlmsg_flags = NLM_F_REQUEST,
+			.nlmsg_type = RTM_NEWLINK,
+		},
+		.i = {
+			.ifi_family = AF_UNSPEC,
+			.ifi_flags = IFF_UP,
+			.ifi_change = IFF_UP,
+		},
+	};
+	struct rtattr *linkinfo;
+
+	if (kind) {
+		req.n.nlmsg_flags |= NLM_F_CREATE | NLM_F_EXCL;
+		addattr_l(&req.n, sizeof(req), IFLA_IFNAME, name,
+			  strlen(name) + 1);
+		linkinfo = addattr_nest(&req.n, sizeof(req), IFLA_LINKINFO);
+		addattr_l(&req.n, sizeof(req), IFLA_INFO_KIND, kind,
+			  strlen(kind));
+		addattr_nest_end(&req.n, linkinfo);
+	} else {
+		req.i.ifi_index = if_nametoindex(name);
+		if (!req.i.ifi_index)
+			return -1;
+	}
+
+	return rtnl_talk(rth, &req.n, NULL, 0);
+}
+
+static int bench_add_addr(struct rtnl_handle *rth, const char *name,
+			  const char *addr, int plen)
+{
+	struct {
+		struct nlmsghdr n;
+		struct ifaddrmsg ifa;
+		char buf[256];
+	} req = {
+		.n = {
+			.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifaddrmsg)),
+			.nlmsg_flags = NLM_F_REQUEST | NLM_F_CREATE |
+				       NLM_F_EXCL,
+			.nlmsg_type = RTM_NEWADDR,
+		},
+		.ifa = {
+			.ifa_family = AF_INET6,
+			.ifa_prefixlen = plen,
+		},
+	};
+	struct in6_addr in6;
+
+	req.ifa.ifa_index = if_nametoindex(name);
+	if (!req.ifa.ifa_index || inet_pton(AF_INET6, addr, &in6) != 1)
+		return -1;
+
+	addattr_l(&req.n, sizeof(req), IFA_LOCAL, &in6, sizeof(in6));
+	addattr_l(&req.n, sizeof(req), IFA_ADDRESS, &in6, sizeof(in6));
+	addattr32(&req.n, sizeof(req), IFA_FLAGS, IFA_F_NODAD);
+
+	return rtnl_talk(rth, &req.n, NULL, 0);
+}
+
+static int bench_netns(void)
+{
+	struct rtnl_handle rth = { .fd = -1 };
+	int ret = -1;
+
+	if (unshare(CLONE_NEWNET) < 0) {
+		fprintf(stderr, "Unable to create network namespace: %s\n",
+			strerror(errno));
+		return -1;
+	}
+
+	if (rtnl_open(&rth, 0) < 0) {
+		fprintf(stderr, "Cannot open rtnetlink: %s\n",
+			strerror(errno));
+		return -1;
+	}
+
+	if (bench_link_up(&rth, "lo", NULL) < 0) {
+		fprintf(stderr, "Unable to set lo up\n");
+		goto out;
+	}
+
+	if (bench_link_up(&rth, BENCH_DEV, "dummy") < 0) {
+		fprintf(stderr, "Unable to make dummy device\n");
+		goto out;
+	}
+
+	if (bench_add_addr(&rth, BENCH_DEV, BENCH_DEV_ADDR,
+			   BENCH_DEV_PLEN) < 0) {
+		fprintf(stderr, "Unable to add address to %s\n", BENCH_DEV);
+		goto out;
+	}
+
+	ret = 0;
+
+out:
+	rtnl_close(&rth);
+
+	return ret;
+}
+
+static int parse_args(int argc, char *argv[], struct bench_sys *bs)
+{
+	const char *sizes = BENCH_DEFAULT_SIZES;
+	int option_index = 0;
+	int c, i;
+
+	while ((c = getopt_long(argc, argv, ARGS, long_options,
+				&option_index)) != EOF) {
+		switch (c) {
+		case 'b':
+			bs->backend = optarg;
+			break;
+		case 'R':
+			bs->route_subopts = optarg;
+			break;
+		case 'N':
+			sizes = optarg;
+			break;
+		case 'x':
+			bs->no_netns = true;
+			break;
+		case 'v':
+			bs->verbose = true;
+			break;
+		case 'p':
+			bs->pretty = true;
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	bs->num_sizes = qbench_parse_sizes(sizes, bs->sizes,
+					   BENCH_MAX_SIZES);
+	if (bs->num_sizes < 0) {
+		fprintf(stderr, "Bad route counts %s\n", sizes);
+		return -1;
+	}
+
+	for (i = 0; i < BENCH_NUM_BACKENDS; i++)
+		if (!strcmp(bs->backend, backends[i].name))
+			bs->bb = &backends[i];
+
+	if (!bs->bb) {
+		fprintf(stderr, "Unknown backend %s\n", bs->backend);
+		return -1;
+	}
+
+	if (!bs->bb->kernel)
+		bs->no_netns = true;
+
+	/* Kernel routes go via the dummy device unless told otherwise */
+	if (!bs->route_subopts && !(bs->bb->kernel && bs->no_netns))
+		bs->route_subopts = bs->bb->routeopts;
+
+	return 0;
+}
+
+static int start_routes(struct bench_sys *bs)
+{
+	bs->route_ops = bs->bb->get();
+	if (!bs->route_ops) {
+		fprintf(stderr, "Unable to get %s route ops\n", bs->backend);
+		return -1;
+	}
+
+	if (bs->route_ops->init(&bs->route_ctx,
+				bs->verbose ? stderr : NULL) < 0) {
+		fprintf(stderr, "Unable to init %s routes\n", bs->backend);
+		return -1;
+	}
+
+	/* Parsing modifies the options and the backend may keep pointers
+	 * into them, so parse a copy that lives as long as the backend.
+	 */
+	if (bs->route_subopts) {
+		bs->route_buf = strdup(bs->route_subopts);
+		if (!bs->route_buf ||
+		    bs->route_ops->parse_args(bs->route_ctx,
+					      bs->route_buf) < 0)
+			return -1;
+	}
+
+	if (bs->route_ops->start(bs->route_ctx) < 0) {
+		fprintf(stderr, "Unable to start %s routes\n", bs->backend);
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_sys bs;
+	int i, ret = 0;
+
+	memset(&bs, 0, sizeof(bs));
+	bs.backend = "kernel";
+
+	if (parse_args(argc, argv, &bs) < 0)
+		exit(-1);
+
+	get_addr64(&bs.loc1, BENCH_LOC1);
+	get_addr64(&bs.loc2, BENCH_LOC2);
+
+	if (!bs.no_netns && bench_netns() < 0)
+		exit(-1);
+
+	if (start_routes(&bs) < 0)
+		exit(-1);
+
+	bs.jw = jsonw_new(stdout);
+	if (!bs.jw) {
+		fprintf(stderr, "Unable to allocate JSON writer\n");
+		exit(-1);
+	}
+	jsonw_pretty(bs.jw, bs.pretty);
+
+	jsonw_start_object(bs.jw);
+	jsonw_string_field(bs.jw, "backend", bs.backend);
+	jsonw_string_field(bs.jw, "routeopts",
+			   bs.route_subopts ? : "");
+	jsonw_bool_field(bs.jw, "netns", !bs.no_netns);
+
+	jsonw_name(bs.jw, "results");
+	jsonw_start_array(bs.jw);
+	for (i = 0; i < bs.num_sizes; i++) {
+		if (bench_size(&bs, bs.sizes[i]) < 0) {
+			fprintf(stderr, "Benchmark of %lu routes failed\n",
+				bs.sizes[i]);
+			ret = -1;
+			break;
+		}
+	}
+	jsonw_end_array(bs.jw);
+
+	jsonw_end_object(bs.jw);
+	jsonw_destroy(&bs.jw);
+	fputc('\n', stdout);
+
+	bs.route_ops->done(bs.route_ctx);
+	free(bs.route_buf);
+
+	return ret;
+}
@@ -0,0 +1,224 @@
+/*
+ * ila_trap.c - Trap for packets to unmapped ILA addresses
+ *
+ * Copyright (c) 2018, Quantonium Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the Quantonium nor the names of its contributors
+ *     may be used to endorse or promote products derived from this software
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL QUANTONIUM BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <event2/event.h>
+#include <fcntl.h>
+#include <linux/if_tun.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <netinet/ip6.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "ila.h"
+#include "ila_trap.h"
+#include "libnetlink.h"
+
+#define ILA_TRAP_PKT_MAX	65536
+
+#define RTPROT_IDLOCD	18	/* Identifier/locator daemon (idlocd) */
+
+struct ila_trap {
+	int fd;
+	int ifindex;
+	struct event *event;
+	struct rtnl_handle rth;
+	ila_trap_cb cb;
+	void *arg;
+	FILE *logf;
+	unsigned char pkt[ILA_TRAP_PKT_MAX];
+};
+
+#define ITPRINTF(trap, format, ...) do {			\
+	if (trap->logf)						\
+		fprintf(trap->logf, format, ##__VA_ARGS__);	\
+} while (0)
+
+static void ila_trap_read_cb(evutil_socket_t fd, short events, void *arg)
+{
+	struct ila_trap *trap = arg;
+	struct ip6_hdr *ip6h = (struct ip6_hdr *)trap->pkt;
+	ssize_t len;
+
+	/* Bounded so that a flood of misses can't starve the event loop */
+	for (int i = 0; i < 64; i++) {
+		len = read(fd, trap->pkt, sizeof(trap->pkt));
+		if (len < 0)
+			return;
+
+		if (len < sizeof(*ip6h) || (ip6h->ip6_vfc >> 4) != 6)
+			continue;
+
+		trap->cb(trap, &ip6h->ip6_dst, trap->pkt, len, trap->arg);
+	}
+}
+
+static int ila_trap_tun_open(struct ila_trap *trap, const char *name)
+{
+	struct ifreq ifr;
+	int sfd;
+
+	trap->fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (trap->fd < 0) {
+		ITPRINTF(trap, "ila_trap: Open tun: %s\n", strerror(errno));
+		return -1;
+	}
+
+	memset(&ifr, 0, sizeof(ifr));
+	ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+	strncpy(ifr.ifr_name, name, IFNAMSIZ - 1);
+
+	if (ioctl(trap->fd, TUNSETIFF, &ifr) < 0) {
+		ITPRINTF(trap, "ila_trap: Set tun %s: %s\n", name,
+			 strerror(errno));
+		return -1;
+	}
+
+	sfd = socket(AF_INET6, SOCK_DGRAM, 0);
+	if (sfd < 0)
+		return -1;
+
+	if (ioctl(sfd, SIOCGIFFLAGS, &ifr) < 0 ||
+	    (ifr.ifr_flags |= IFF_UP, ioctl(sfd, SIOCSIFFLAGS, &ifr) < 0) ||
+	    ioctl(sfd, SIOCGIFINDEX, &ifr) < 0) {
+		ITPRINTF(trap, "ila_trap: Bring up %s: %s\n", name,
+			 strerror(errno));
+		close(sfd);
+		return -1;
+	}
+
+	trap->ifindex = ifr.ifr_ifindex;
+
+	close(sfd);
+
+	return 0;
+}
+
+/* Route the SIR prefix to the tun device. This has the same protocol as
+ * the mapping routes so that it is flushed if ilad restarts.
+ */
+static int ila_trap_route(struct ila_trap *trap, Locator prefix)
+{
+	struct {
+		struct nlmsghdr n;
+		struct rtmsg            r;
+		char                    buf[256];
+	} req = {
+		.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg)),
+		.n.nlmsg_flags = NLM_F_REQUEST | NLM_F_CREATE | NLM_F_REPLACE,
+		.n.nlmsg_type = RTM_NEWROUTE,
+		.r.rtm_family = AF_INET6,
+		.r.rtm_table = RT_TABLE_MAIN,
+		.r.rtm_scope = RT_SCOPE_LINK,
+		.r.rtm_type = RTN_UNICAST,
+		.r.rtm_protocol = RTPROT_IDLOCD,
+		.r.rtm_dst_len = 64,
+	};
+	struct in6_addr dst;
+
+	memset(&dst, 0, sizeof(dst));
+	memcpy(&dst.s6_addr[0], &prefix, sizeof(prefix));
+
+	addattr_l(&req.n, sizeof(req), RTA_DST, &dst, sizeof(dst));
+	addattr32(&req.n, sizeof(req), RTA_OIF, trap->ifindex);
+
+	if (rtnl_talk(&trap->rth, &req.n, NULL, 0) < 0) {
+		ITPRINTF(trap, "ila_trap: Set prefix route: %s\n",
+			 strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+struct ila_trap *ila_trap_start(struct event_base *event_base,
+				const char *name, Locator prefix,
+				ila_trap_cb cb, void *arg, FILE *logf)
+{
+	struct ila_trap *trap;
+
+	trap = calloc(1, sizeof(*trap));
+	if (!trap)
+		return NULL;
+
+	trap->fd = -1;
+	trap->rth.fd = -1;
+	trap->cb = cb;
+	trap->arg = arg;
+	trap->logf = logf;
+
+	if (ila_trap_tun_open(trap, name) < 0)
+		goto err;
+
+	if (rtnl_open(&trap->rth, 0) < 0) {
+		ITPRINTF(trap, "ila_trap: Open rtnetlink: %s\n",
+			 strerror(errno));
+		goto err;
+	}
+
+	if (ila_trap_route(trap, prefix) < 0)
+		goto err;
+
+	trap->event = event_new(event_base, trap->fd, EV_READ | EV_PERSIST,
+				ila_trap_read_cb, trap);
+	if (!trap->event || event_add(trap->event, NULL) < 0)
+		goto err;
+
+	return trap;
+
+err:
+	ila_trap_stop(trap);
+	return NULL;
+}
+
+int ila_trap_reinject(struct ila_trap *trap, void *pkt, size_t len)
+{
+	if (write(trap->fd, pkt, len) != len)
+		return -1;
+
+	return 0;
+}
+
+/* Closing the tun device removes it and the prefix route */
+void ila_trap_stop(struct ila_trap *trap)
+{
+	if (trap->event)
+		event_free(trap->event);
+	if (trap->rth.fd >= 0)
+		rtnl_close(&trap->rth);
+	if (trap->fd >= 0)
+		close(trap->fd);
+	free(trap);
+}
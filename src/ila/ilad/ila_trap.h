@@ -0,0 +1,58 @@
+/*
+ * ila_trap.h - Trap for packets to unmapped ILA addresses
+ *
+ * Copyright (c) 2018, Quantonium Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the Quantonium nor the names of its contributors
+ *     may be used to endorse or promote products derived from this software
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL QUANTONIUM BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __ILA_TRAP_H__
+#define __ILA_TRAP_H__
+
+#include <event2/event.h>
+#include <linux/types.h>
+#include <netinet/in.h>
+#include <stdio.h>
+
+#include "ila.h"
+
+/* A trap is a tun device with a route for a SIR prefix. Packets to
+ * addresses in the prefix that have no more specific (/128) mapping
+ * route are delivered to the callback with their destination address.
+ * Once a mapping route has been installed a packet can be reinjected
+ * through the tun device and is then forwarded by the kernel.
+ */
+
+struct ila_trap;
+
+typedef void (*ila_trap_cb)(struct ila_trap *trap, struct in6_addr *dst,
+			    void *pkt, size_t len, void *arg);
+
+struct ila_trap *ila_trap_start(struct event_base *event_base,
+				const char *name, Locator prefix,
+				ila_trap_cb cb, void *arg, FILE *logf);
+int ila_trap_reinject(struct ila_trap *trap, void *pkt, size_t len);
+void ila_trap_stop(struct ila_trap *trap);
+
+#endif /* __ILA_TRAP_H__ */
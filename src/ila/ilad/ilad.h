@@ -0,0 +1,214 @@
+/*
+ * ilad.h - Shared state of the ILA daemon
+ *
+ * Copyright (c) 2018, Quantonium Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the Quantonium nor the names of its contributors
+ *     may be used to endorse or promote products derived from this software
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL QUANTONIUM BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __ILAD_H__
+#define __ILAD_H__
+
+#include <event2/event.h>
+#include <linux/types.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "dbif.h"
+#include "dbif_feed.h"
+#include "ila.h"
+#include "ila_trap.h"
+#include "list.h"
+#include "qctl.h"
+#include "qhash.h"
+#include "qlog.h"
+#include "qmerkle.h"
+#include "qmetrics.h"
+
+struct ila_map_metrics {
+	struct qmetric *notifications;
+	struct qmetric *resyncs;
+	struct qmetric *db_read_ok;
+	struct qmetric *db_read_missing;
+	struct qmetric *db_read_error;
+	struct qmetric *db_read_time;
+	struct qmetric *feed_values;
+	struct qmetric *routes_added;
+	struct qmetric *routes_deleted;
+	struct qmetric *route_failures;
+	struct qmetric *route_set_time;
+	struct qmetric *route_del_time;
+	struct qmetric *install_time;
+	struct qmetric *trapped;
+	struct qmetric *routes_kept;
+	struct qmetric *ae_repairs;
+	struct qmetric *trace_map;
+	struct qmetric *trace_notify;
+	struct qmetric *trace_read;
+	struct qmetric *trace_install;
+	struct qmetric *trace_total;
+};
+
+/* Instance of a mapping system. Mappings that have been set in the
+ * forwarding table are tracked in map_table along with the generation
+ * number of the record that was applied. SIR prefixes from the
+ * dictionary in the map database are held in sir_table and are used to
+ * expand compact map keys to full addresses. The resolve and demand
+ * modes are in ilad_cache.c and anti-entropy in ilad_anti_entropy.c.
+ */
+enum ila_map_mode {
+	ILA_MAP_MODE_FULL,
+	ILA_MAP_MODE_RESOLVE,
+	ILA_MAP_MODE_DEMAND,
+};
+
+struct ila_map_sys {
+	struct dbif_ops *db_ops;
+	void *db_ctx;
+	struct ila_route_ops *route_ops;
+	void *route_ctx;
+	void *watch_all_handle;
+	struct event_base *event_base;
+	struct qhash map_table;
+	struct qhash sir_table;
+	enum ila_map_mode mode;
+	struct ila_trap *trap;
+	Locator trap_prefix;
+	int trap_sir_id;
+	unsigned int map_count;
+	unsigned int cache_size;
+	unsigned int ttl;
+	unsigned int lifetime;
+	unsigned int use_reported;
+	time_t use_dump_next;
+	struct list_head lru;
+	struct event *expire_event;
+	struct dbif_filter filter;
+	struct dbif_feed *feed;
+	void *feed_key;
+	size_t feed_key_size;
+	int feed_res;
+	void *feed_value;
+	size_t feed_value_size;
+	unsigned int ae_interval;
+	unsigned int ae_bits;
+	unsigned int ae_round;
+	unsigned int ae_rescan_round;
+	unsigned int ae_rescan_backoff;
+	unsigned int *ae_diverged;
+	__u64 *ae_leaves;
+	struct event *ae_event;
+	struct qhash shadow_table;
+	struct qmerkle db_tree;
+	struct qmerkle route_tree;
+	unsigned int installed_count;
+	__u64 notify_time;
+	__u64 notify_ns;
+	__u64 read_ns;
+	unsigned int trace_sample;
+	unsigned int verbose;
+	struct qmetrics *metrics;
+	struct ila_map_metrics m;
+	struct qctl *ctl;
+};
+
+struct ila_sir_entry {
+	struct qhash_node node;
+	__u16 id;
+	__u64 prefix;
+};
+
+struct ila_map_entry {
+	struct qhash_node node;
+	struct IlaMapKey key;
+	__u64 gen;
+	void *staged;
+	struct IlaMapValue staged_value;
+	struct IlaMapValue value;
+	struct list_head lru;
+	time_t expires;
+	__u64 route_hash;
+	bool installed;
+	bool local;
+	bool routed;
+	bool seen;
+	bool prep_seen;
+};
+
+/* Hash of a record as read from the database */
+struct ila_shadow_entry {
+	struct qhash_node node;
+	__u64 hash;
+	bool seen;
+	size_t key_size;
+	__u8 key[sizeof(struct IlaMapPrepKey)];
+};
+
+extern FILE *logfile;
+extern struct qlog *qlog;
+
+static inline struct dbif_filter *map_filter(struct ila_map_sys *ims)
+{
+	return ims->filter.num_prefixes ? &ims->filter : NULL;
+}
+
+static inline time_t now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec;
+}
+
+/* ilad_main.c */
+struct ila_map_entry *map_lookup(struct ila_map_sys *ims,
+				 struct IlaMapKey *key);
+struct ila_map_entry *map_add(struct ila_map_sys *ims, struct IlaMapKey *key);
+void map_remove(struct ila_map_sys *ims, struct ila_map_entry *ime);
+void map_unstage(struct ila_map_sys *ims, struct ila_map_entry *ime);
+int map_install(struct ila_map_sys *ims, struct ila_map_entry *ime);
+void map_uninstall(struct ila_map_sys *ims, struct ila_map_entry *ime);
+int route_del(struct ila_map_sys *ims, struct IlaMapKey *key);
+FILE *log_file(const char *src);
+int db_read(struct ila_map_sys *ims, void *key, size_t key_size,
+	    void *value, size_t *value_size);
+void watch_cb(void *key, size_t key_size, void *data);
+void resync_cb(void *data);
+
+/* ilad_cache.c */
+void cache_evict(struct ila_map_sys *ims, struct ila_map_entry *ime);
+int start_trap(struct ila_map_sys *ims);
+
+/* ilad_anti_entropy.c */
+void route_tree_clear(struct ila_map_sys *ims, struct ila_map_entry *ime);
+void route_tree_set(struct ila_map_sys *ims, struct ila_map_entry *ime);
+void shadow_update(struct ila_map_sys *ims, void *key, size_t key_size,
+		   void *value, size_t value_size, int res);
+void shadow_remove(struct ila_map_sys *ims, struct ila_shadow_entry *ise);
+int init_anti_entropy(struct ila_map_sys *ims);
+int start_anti_entropy(struct ila_map_sys *ims);
+
+#endif /* __ILAD_H__ */
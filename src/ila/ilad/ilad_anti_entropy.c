@@ -0,0 +1,446 @@
+/*
+ * ilad_anti_entropy.c - Anti-entropy of the ILA daemon
+ *
+ * Copyright (c) 2018, Quantonium Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the Quantonium nor the names of its contributors
+ *     may be used to endorse or promote products derived from this software
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL QUANTONIUM BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* With anti-entropy the daemon periodically checks that it hasn't
+ * drifted from the database or the kernel without being told. Every
+ * record read from the database is recorded by its hash in
+ * shadow_table and summed into db_tree, which is compared against the
+ * digest the database keeps with the same leaves (see qmerkle.h). Keys
+ * in leaves that differ are read again, a leaf that still differs at
+ * the next check means a key is missing here and the database is
+ * rescanned. Rescans that don't make the difference go away, e.g. when
+ * the database keeps changing under the check, back off exponentially
+ * up to ILA_AE_RESCAN_BACKOFF_MAX checks. The database check needs the
+ * whole database, so it's off in resolve mode and with served prefixes.
+ * Routes that were set are summed into route_tree. The kernel keeps no
+ * digest so its routes are dumped and summed, and if the roots differ
+ * the routes in the leaves that differ are dumped again and repaired
+ * against map_table.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ilad.h"
+#include "qhash.h"
+#include "qmerkle.h"
+#include "utils.h"
+
+#define ILA_AE_DEFAULT_BITS	10
+#define ILA_AE_RESCAN_BACKOFF_MAX	64U
+
+/* Route read back from the kernel */
+struct ila_dump_route {
+	struct IlaMapKey key;
+	struct IlaMapValue value;
+};
+
+static __u64 route_hash(struct IlaMapKey *key, struct IlaMapValue *value)
+{
+	struct IlaMapValue v = *value;
+
+	/* Device comes from the route options, not the mapping */
+	v.ifindex = 0;
+	v.rsvd = 0;
+
+	return qmerkle_hash(key, sizeof(*key), &v, sizeof(v));
+}
+
+void route_tree_clear(struct ila_map_sys *ims, struct ila_map_entry *ime)
+{
+	if (!ime->routed)
+		return;
+
+	qmerkle_sub(&ims->route_tree,
+		    qmerkle_leaf(&ims->route_tree, &ime->key,
+				 sizeof(ime->key)), ime->route_hash);
+	ime->routed = false;
+}
+
+void route_tree_set(struct ila_map_sys *ims, struct ila_map_entry *ime)
+{
+	route_tree_clear(ims, ime);
+
+	if (!ims->route_tree.nodes)
+		return;
+
+	ime->route_hash = route_hash(&ime->key, &ime->value);
+	qmerkle_add(&ims->route_tree,
+		    qmerkle_leaf(&ims->route_tree, &ime->key,
+				 sizeof(ime->key)), ime->route_hash);
+	ime->routed = true;
+}
+
+static struct ila_shadow_entry *shadow_lookup(struct ila_map_sys *ims,
+					      void *key, size_t key_size,
+					      __u32 hash)
+{
+	struct ila_shadow_entry *ise;
+
+	qhash_for_each_possible(&ims->shadow_table, ise, node, hash)
+		if (ise->key_size == key_size &&
+		    !memcmp(ise->key, key, key_size))
+			return ise;
+
+	return NULL;
+}
+
+void shadow_remove(struct ila_map_sys *ims, struct ila_shadow_entry *ise)
+{
+	qmerkle_sub(&ims->db_tree,
+		    qmerkle_leaf(&ims->db_tree, ise->key, ise->key_size),
+		    ise->hash);
+	qhash_del(&ims->shadow_table, &ise->node);
+	free(ise);
+}
+
+/* Track a read of the database. Res is the result of the read */
+void shadow_update(struct ila_map_sys *ims, void *key, size_t key_size,
+		   void *value, size_t value_size, int res)
+{
+	__u32 hash = qhash_bytes(key, key_size, 0);
+	struct ila_shadow_entry *ise;
+
+	if (key_size > sizeof(ise->key))
+		return;
+
+	ise = shadow_lookup(ims, key, key_size, hash);
+
+	switch (res) {
+	case 0:
+		if (!ise) {
+			ise = malloc(sizeof(*ise));
+			if (!ise)
+				return;
+
+			ise->key_size = key_size;
+			memcpy(ise->key, key, key_size);
+			qhash_add(&ims->shadow_table, &ise->node, hash);
+		} else {
+			qmerkle_sub(&ims->db_tree,
+				    qmerkle_leaf(&ims->db_tree, key, key_size),
+				    ise->hash);
+		}
+
+		ise->hash = qmerkle_hash(key, key_size, value, value_size);
+		ise->seen = true;
+		qmerkle_add(&ims->db_tree,
+			    qmerkle_leaf(&ims->db_tree, key, key_size),
+			    ise->hash);
+		break;
+	case -2:
+		if (ise)
+			shadow_remove(ims, ise);
+		break;
+	}
+}
+
+struct ila_ae_diff {
+	struct ila_map_sys *ims;
+	unsigned int persist;
+};
+
+static void ae_db_diff_cb(unsigned int leaf, void *data)
+{
+	struct ila_ae_diff *iad = data;
+	struct ila_map_sys *ims = iad->ims;
+
+	if (ims->ae_diverged[leaf] == ims->ae_round - 1)
+		iad->persist++;
+
+	ims->ae_diverged[leaf] = ims->ae_round;
+}
+
+/* Compare db_tree with the digest kept by the database. Records in
+ * leaves that differ are read again, if a leaf differed in the
+ * previous check as well then a record was missed and the database is
+ * rescanned. Until the rescan backoff has passed the records are read
+ * again instead.
+ */
+static void ae_check_db(struct ila_map_sys *ims)
+{
+	struct ila_ae_diff iad = { .ims = ims };
+	struct ila_shadow_entry *hse, *keys;
+	struct hlist_node *tmp;
+	struct qmerkle remote;
+	unsigned int bkt, i, num = 0;
+
+	if (ims->db_ops->digest(ims->db_ctx, ims->ae_bits,
+				ims->ae_leaves) < 0) {
+		QLOG(qlog, QLOG_ERR, "Get database digest failed");
+		return;
+	}
+
+	if (qmerkle_init(&remote, ims->ae_bits) < 0)
+		return;
+
+	qmerkle_set_leaves(&remote, ims->ae_leaves);
+	i = qmerkle_diff(&remote, &ims->db_tree, ae_db_diff_cb, &iad);
+	qmerkle_destroy(&remote);
+
+	if (!i) {
+		ims->ae_rescan_backoff = 0;
+		return;
+	}
+
+	if (iad.persist && ims->ae_round >= ims->ae_rescan_round) {
+		QLOG(qlog, QLOG_WARN, "Database differs, rescanning",
+		     "leaves=%u backoff=%u", i, ims->ae_rescan_backoff);
+		resync_cb(ims);
+
+		/* The difference persisting after this rescan doubles the
+		 * checks to the next one
+		 */
+		ims->ae_rescan_backoff = ims->ae_rescan_backoff ?
+			min(ims->ae_rescan_backoff * 2,
+			    ILA_AE_RESCAN_BACKOFF_MAX) : 1;
+		ims->ae_rescan_round = ims->ae_round +
+				       ims->ae_rescan_backoff;
+		return;
+	}
+
+	QLOG(qlog, QLOG_WARN, "Database differs", "leaves=%u", i);
+
+	/* Reading a record can change other shadow entries, e.g. load a
+	 * SIR prefix, so take a copy of the keys first.
+	 */
+	qhash_for_each_safe(&ims->shadow_table, bkt, tmp, hse, node)
+		if (ims->ae_diverged[qmerkle_leaf(&ims->db_tree, hse->key,
+						  hse->key_size)] ==
+		    ims->ae_round)
+			num++;
+
+	if (!num)
+		return;
+
+	keys = calloc(num, sizeof(*keys));
+	if (!keys)
+		return;
+
+	num = 0;
+	qhash_for_each_safe(&ims->shadow_table, bkt, tmp, hse, node)
+		if (ims->ae_diverged[qmerkle_leaf(&ims->db_tree, hse->key,
+						  hse->key_size)] ==
+		    ims->ae_round)
+			keys[num++] = *hse;
+
+	for (i = 0; i < num; i++)
+		watch_cb(keys[i].key, keys[i].key_size, ims);
+
+	free(keys);
+}
+
+struct ila_ae_dump {
+	struct ila_map_sys *ims;
+	struct qmerkle tree;
+	unsigned char *leaves;
+	struct ila_dump_route *routes;
+	unsigned int num;
+	unsigned int max;
+};
+
+static void ae_sum_route_cb(struct IlaMapKey *key, struct IlaMapValue *value,
+			    void *data)
+{
+	struct ila_ae_dump *iad = data;
+
+	qmerkle_add(&iad->tree, qmerkle_leaf(&iad->tree, key, sizeof(*key)),
+		    route_hash(key, value));
+}
+
+static void ae_route_diff_cb(unsigned int leaf, void *data)
+{
+	struct ila_ae_dump *iad = data;
+
+	iad->leaves[leaf] = 1;
+}
+
+static void ae_collect_route_cb(struct IlaMapKey *key,
+				struct IlaMapValue *value, void *data)
+{
+	struct ila_ae_dump *iad = data;
+	struct ila_dump_route *routes;
+
+	if (!iad->leaves[qmerkle_leaf(&iad->tree, key, sizeof(*key))])
+		return;
+
+	if (iad->num == iad->max) {
+		routes = realloc(iad->routes, (iad->max ? 2 * iad->max : 64) *
+						  sizeof(*routes));
+		if (!routes)
+			return;
+
+		iad->routes = routes;
+		iad->max = iad->max ? 2 * iad->max : 64;
+	}
+
+	iad->routes[iad->num].key = *key;
+	iad->routes[iad->num].value = *value;
+	iad->num++;
+}
+
+/* Compare route_tree with the routes in the kernel and repair the
+ * routes in leaves that differ. Routes are changed after the dump
+ * completes since the netlink socket is busy during a dump.
+ */
+static void ae_check_routes(struct ila_map_sys *ims)
+{
+	struct ila_ae_dump iad = { .ims = ims };
+	struct ila_dump_route *idr;
+	struct ila_map_entry *ime;
+	struct hlist_node *tmp;
+	unsigned int bkt, i, num, fixed = 0;
+
+	if (qmerkle_init(&iad.tree, ims->ae_bits) < 0)
+		return;
+
+	if (ims->route_ops->dump_routes(ims->route_ctx, ae_sum_route_cb,
+					&iad) < 0) {
+		QLOG(qlog, QLOG_ERR, "Dump routes failed");
+		goto out;
+	}
+
+	if (qmerkle_root(&iad.tree) == qmerkle_root(&ims->route_tree))
+		goto out;
+
+	iad.leaves = calloc(qmerkle_num_leaves(&iad.tree), 1);
+	if (!iad.leaves)
+		goto out;
+
+	num = qmerkle_diff(&iad.tree, &ims->route_tree, ae_route_diff_cb,
+			   &iad);
+
+	if (ims->route_ops->dump_routes(ims->route_ctx, ae_collect_route_cb,
+					&iad) < 0) {
+		QLOG(qlog, QLOG_ERR, "Dump routes failed");
+		goto out;
+	}
+
+	qhash_for_each_safe(&ims->map_table, bkt, tmp, ime, node)
+		if (iad.leaves[qmerkle_leaf(&iad.tree, &ime->key,
+					    sizeof(ime->key))])
+			ime->seen = false;
+
+	for (i = 0; i < iad.num; i++) {
+		idr = &iad.routes[i];
+		ime = map_lookup(ims, &idr->key);
+		if (ime && ime->routed) {
+			if (ime->route_hash == route_hash(&idr->key,
+							  &idr->value))
+				ime->seen = true;
+			continue;
+		}
+
+		/* Route that we didn't set or that should be gone */
+		if (route_del(ims, &idr->key) < 0 && errno != ESRCH)
+			QLOG(qlog, QLOG_ERR, "Del failed", "errno=%d", errno);
+		fixed++;
+	}
+
+	/* Routes that are missing or have the wrong mapping */
+	qhash_for_each_safe(&ims->map_table, bkt, tmp, ime, node) {
+		if (!ime->routed || ime->seen ||
+		    !iad.leaves[qmerkle_leaf(&iad.tree, &ime->key,
+					     sizeof(ime->key))])
+			continue;
+
+		map_unstage(ims, ime);
+		if (map_install(ims, ime) < 0)
+			QLOG(qlog, QLOG_ERR, "Set failed", "errno=%d", errno);
+		fixed++;
+	}
+
+	QLOG(qlog, QLOG_WARN, "Routes differ", "leaves=%u repaired=%u",
+	     num, fixed);
+	qmetric_add(ims->m.ae_repairs, fixed);
+
+out:
+	free(iad.routes);
+	free(iad.leaves);
+	qmerkle_destroy(&iad.tree);
+}
+
+static void ae_cb(evutil_socket_t fd, short events, void *arg)
+{
+	struct ila_map_sys *ims = arg;
+
+	ims->ae_round++;
+
+	if (ims->db_tree.nodes)
+		ae_check_db(ims);
+
+	if (ims->route_tree.nodes)
+		ae_check_routes(ims);
+}
+
+/* Set up the trees before the database is read */
+int init_anti_entropy(struct ila_map_sys *ims)
+{
+	unsigned int num;
+
+	if (!ims->ae_bits)
+		ims->ae_bits = ILA_AE_DEFAULT_BITS;
+
+	/* Round numbers start above zero so that a leaf isn't taken to
+	 * have differed in the check before the first one.
+	 */
+	ims->ae_round = 1;
+	num = 1U << ims->ae_bits;
+
+	if (ims->route_ops->dump_routes &&
+	    qmerkle_init(&ims->route_tree, ims->ae_bits) < 0)
+		return -1;
+
+	if (!ims->db_ops->digest || ims->mode == ILA_MAP_MODE_RESOLVE ||
+	    map_filter(ims))
+		return 0;
+
+	ims->ae_leaves = calloc(num, sizeof(*ims->ae_leaves));
+	ims->ae_diverged = calloc(num, sizeof(*ims->ae_diverged));
+	if (!ims->ae_leaves || !ims->ae_diverged ||
+	    qhash_init(&ims->shadow_table, 10) < 0 ||
+	    qmerkle_init(&ims->db_tree, ims->ae_bits) < 0)
+		return -1;
+
+	return 0;
+}
+
+int start_anti_entropy(struct ila_map_sys *ims)
+{
+	struct timeval tv = { .tv_sec = ims->ae_interval };
+
+	ims->ae_event = event_new(ims->event_base, -1, EV_PERSIST, ae_cb, ims);
+	if (!ims->ae_event || event_add(ims->ae_event, &tv) < 0) {
+		fprintf(stderr, "Unable to start anti-entropy timer\n");
+		return -1;
+	}
+
+	return 0;
+}
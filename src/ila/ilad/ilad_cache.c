@@ -0,0 +1,294 @@
+/*
+ * ilad_cache.c - Resolve and demand modes of the ILA daemon
+ *
+ * Copyright (c) 2018, Quantonium Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the Quantonium nor the names of its contributors
+ *     may be used to endorse or promote products derived from this software
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL QUANTONIUM BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* In resolve mode the map database is not scanned. A route for the SIR
+ * prefix sends packets to addresses without a mapping to a trap, the
+ * mapping is read from the database when a packet is trapped and the
+ * packet is reinjected once the route is set. Resolved mappings are
+ * held in map_table bounded by cache_size and ordered in the lru list,
+ * they expire after ttl seconds and are only refreshed by watch events
+ * while they are cached. Addresses that have no mapping, or whose read
+ * failed, are cached as negative entries for a short time so that misses
+ * don't hammer the database. A mapping to the local locator has no route
+ * so packets trapped for it are dropped rather than reinjected.
+ *
+ * In demand mode the whole map database is replicated into map_table
+ * but routes are only set for addresses that see traffic. Packets are
+ * trapped the same way as in resolve mode, the route is set from the
+ * mapping in map_table and the entry is put on the lru list. A route
+ * expires lifetime seconds after it was set. If the route backend
+ * reports use, expired routes are checked against it and those used
+ * within the lifetime are kept for a lifetime from their last use, so
+ * only idle routes are removed. Otherwise, e.g. for IPv6 FIB routes that
+ * the kernel keeps no use for, an active flow has a packet trapped once
+ * per lifetime.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ilad.h"
+#include "list.h"
+
+#define ILA_TRAP_DEV "ila-trap"
+
+#define ILA_CACHE_NEG_TTL	5
+
+/* Drop a resolved mapping and its route */
+void cache_evict(struct ila_map_sys *ims, struct ila_map_entry *ime)
+{
+	map_uninstall(ims, ime);
+	map_remove(ims, ime);
+}
+
+static struct ila_map_entry *cache_add(struct ila_map_sys *ims,
+				       struct IlaMapKey *key)
+{
+	struct ila_map_entry *ime;
+
+	if (ims->map_count >= ims->cache_size)
+		cache_evict(ims, list_last_entry(&ims->lru,
+						 struct ila_map_entry, lru));
+
+	ime = map_add(ims, key);
+	if (ime)
+		list_add(&ime->lru, &ims->lru);
+
+	return ime;
+}
+
+static void cache_touch(struct ila_map_sys *ims, struct ila_map_entry *ime)
+{
+	list_del(&ime->lru);
+	list_add(&ime->lru, &ims->lru);
+}
+
+/* An expired demand route was used within its lifetime, keep it for a
+ * lifetime from the last use
+ */
+static void expire_use_cb(struct IlaMapKey *key, unsigned int age,
+			  void *data)
+{
+	struct ila_map_sys *ims = data;
+	struct ila_map_entry *ime;
+	time_t t = now();
+
+	ims->use_reported++;
+
+	if (age >= ims->lifetime)
+		return;
+
+	ime = map_lookup(ims, key);
+	if (!ime || !ime->installed || ime->expires > t)
+		return;
+
+	ime->expires = t - age + ims->lifetime;
+	cache_touch(ims, ime);
+	qmetric_inc(ims->m.routes_kept);
+}
+
+/* Entries are added at the head so the tail is roughly the oldest. A
+ * negative entry behind a positive one may outlive its TTL, that is
+ * harmless since the watch turns it positive if a mapping shows up.
+ * In demand mode only the route is removed, the mapping is kept, and
+ * if there are expired routes their use is dumped first. If no route
+ * has known use the dump is skipped for a lifetime.
+ */
+static void expire_cb(evutil_socket_t fd, short events, void *arg)
+{
+	struct ila_map_sys *ims = arg;
+	struct ila_map_entry *ime;
+	time_t t = now();
+
+	if (ims->mode == ILA_MAP_MODE_DEMAND && ims->route_ops->dump_use &&
+	    !list_empty(&ims->lru)) {
+		ime = list_last_entry(&ims->lru, struct ila_map_entry, lru);
+		if (ime->expires <= t && t >= ims->use_dump_next) {
+			ims->use_reported = 0;
+			if (ims->route_ops->dump_use(ims->route_ctx,
+						     expire_use_cb, ims) < 0)
+				QLOG(qlog, QLOG_ERR, "Route use dump failed");
+			if (!ims->use_reported)
+				ims->use_dump_next = t + ims->lifetime;
+		}
+	}
+
+	while (!list_empty(&ims->lru)) {
+		ime = list_last_entry(&ims->lru, struct ila_map_entry, lru);
+		if (ime->expires > t)
+			break;
+
+		if (ims->mode == ILA_MAP_MODE_DEMAND)
+			map_uninstall(ims, ime);
+		else
+			cache_evict(ims, ime);
+	}
+}
+
+/* Read the mapping for a trapped address, by full key and then by
+ * compact key if the trap has a SIR id. Returns zero if a route was set.
+ */
+static int map_resolve(struct ila_map_sys *ims, struct IlaMapKey *mkey)
+{
+	struct ila_map_entry *ime;
+	struct IlaMapKeySir skey;
+	struct IlaMapRec rec;
+	size_t rec_size = sizeof(rec);
+	int res;
+
+	res = db_read(ims, mkey, sizeof(*mkey), &rec, &rec_size);
+	if (res == -2 && ims->trap_sir_id >= 0) {
+		skey.sir_id = ims->trap_sir_id;
+		memcpy(&skey.iid, &mkey->addr.s6_addr[8], sizeof(skey.iid));
+		rec_size = sizeof(rec);
+		res = db_read(ims, &skey, sizeof(skey), &rec, &rec_size);
+	}
+
+	switch (res) {
+	case 0:
+		if (ila_rec_normalize(&rec, rec_size, sizeof(rec),
+				      ILA_REC_TYPE_MAP) < 0) {
+			QLOG(qlog, QLOG_WARN, "Unexpected map record",
+			     "size=%zu", rec_size);
+			return -1;
+		}
+
+		ime = cache_add(ims, mkey);
+		if (!ime)
+			return -1;
+
+		ime->value = rec.value;
+		ime->expires = now() + ims->ttl;
+
+		if (map_install(ims, ime) < 0) {
+			QLOG(qlog, QLOG_ERR, "Set failed", "errno=%d", errno);
+			map_remove(ims, ime);
+			return -1;
+		}
+
+		ime->gen = rec.hdr.gen;
+		return 0;
+	case -2:
+		/* Not installed is a negative entry */
+		ime = cache_add(ims, mkey);
+		if (ime)
+			ime->expires = now() + ILA_CACHE_NEG_TTL;
+		return -1;
+	default:
+		/* Cache the failure briefly too so that a database outage
+		 * doesn't turn each trapped packet into a read
+		 */
+		QLOG(qlog, QLOG_ERR, "Read mapping failed");
+		ime = cache_add(ims, mkey);
+		if (ime)
+			ime->expires = now() + ILA_CACHE_NEG_TTL;
+		return -1;
+	}
+}
+
+static void trap_cb(struct ila_trap *trap, struct in6_addr *dst,
+		    void *pkt, size_t len, void *arg)
+{
+	struct ila_map_sys *ims = arg;
+	struct ila_map_entry *ime;
+	struct IlaMapKey mkey;
+
+	mkey.addr = *dst;
+
+	qmetric_inc(ims->m.trapped);
+
+	ime = map_lookup(ims, &mkey);
+
+	switch (ims->mode) {
+	case ILA_MAP_MODE_RESOLVE:
+		if (ime) {
+			/* A negative entry drops the packet, otherwise the
+			 * packet was queued before the route was set.
+			 */
+			if (!ime->installed)
+				return;
+			cache_touch(ims, ime);
+		} else if (map_resolve(ims, &mkey) < 0) {
+			return;
+		}
+		break;
+	case ILA_MAP_MODE_DEMAND:
+		if (!ime)
+			return;
+
+		/* The route was set after this packet was trapped */
+		if (ime->installed)
+			break;
+
+		if (map_install(ims, ime) < 0) {
+			QLOG(qlog, QLOG_ERR, "Set failed", "errno=%d", errno);
+			return;
+		}
+		ime->expires = now() + ims->lifetime;
+		cache_touch(ims, ime);
+		break;
+	default:
+		return;
+	}
+
+	/* A mapping to the local locator has no route, a reinjected
+	 * packet would come back to the trap. Such a packet is for an
+	 * address that isn't configured here, it is dropped.
+	 */
+	if (!ime)
+		ime = map_lookup(ims, &mkey);
+	if (!ime || ime->local)
+		return;
+
+	if (ila_trap_reinject(trap, pkt, len) < 0)
+		QLOG(qlog, QLOG_ERR, "Reinject failed", "errno=%d", errno);
+}
+
+int start_trap(struct ila_map_sys *ims)
+{
+	struct timeval tv = { .tv_sec = 1 };
+
+	ims->expire_event = event_new(ims->event_base, -1, EV_PERSIST,
+				      expire_cb, ims);
+	if (!ims->expire_event || event_add(ims->expire_event, &tv) < 0) {
+		fprintf(stderr, "Unable to start expiry timer\n");
+		return -1;
+	}
+
+	ims->trap = ila_trap_start(ims->event_base, ILA_TRAP_DEV,
+				   ims->trap_prefix, trap_cb, ims,
+				   log_file("trap"));
+	if (!ims->trap) {
+		fprintf(stderr, "Unable to start trap\n");
+		return -1;
+	}
+
+	return 0;
+}
@@ -27,9 +27,12 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <arpa/inet.h>
 #include <errno.h>
 #include <event2/event.h>
 #include <getopt.h>
+#include <limits.h>
+#include <signal.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdbool.h>
@@ -39,16 +42,41 @@
 #include <syslog.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 
 #include "dbif.h"
+#include "dbif_feed.h"
 #include "dbif_redis.h"
 #include "ila.h"
+#include "ila_trap.h"
+#include "ilad.h"
+#include "list.h"
+#include "qhash.h"
+#include "qmerkle.h"
+#include "qctl.h"
+#include "qlog.h"
+#include "qmetrics.h"
+#include "qprobe.h"
 #include "qutils.h"
+#include "utils.h"
 
 #define ILA_REDIS_DEFAULT_PORT 6379
 #define ILA_REDIS_DEFAULT_HOST "::1"
 
-#define ARGS "dLD:R:"
+#define ILA_CACHE_DEFAULT_SIZE	65536
+#define ILA_CACHE_DEFAULT_TTL	300
+#define ILA_DEMAND_DEFAULT_LIFETIME	60
+
+#define ILA_DUMP_BUCKETS	64
+
+/* A served prefix takes two filter entries for its map and prepared map
+ * keys and two more for those of its SIR id, one entry is taken by the
+ * SIR dictionary.
+ */
+#define ILA_FILTER_MAX_PREFIXES		((DBIF_FILTER_MAX - 1) / 2)
+#define ILA_FILTER_MAX_SIR_PREFIXES	((DBIF_FILTER_MAX - 1) / 4)
+
+#define ARGS "vdL:D:R:b:m:T:C:t:l:P:F:A:E:r:c:"
 
 static struct option long_options[] = {
 	{ "verbose", no_argument, 0, 'v' },
@@ -56,34 +84,175 @@ static struct option long_options[] = {
 	{ "logfile", required_argument, 0, 'L' },
 	{ "dbopts", required_argument, 0, 'D' },
 	{ "routeopts", required_argument, 0, 'R' },
+	{ "route-backend", required_argument, 0, 'b' },
+	{ "mode", required_argument, 0, 'm' },
+	{ "trap", required_argument, 0, 'T' },
+	{ "cache-size", required_argument, 0, 'C' },
+	{ "ttl", required_argument, 0, 't' },
+	{ "lifetime", required_argument, 0, 'l' },
+	{ "prefix", required_argument, 0, 'P' },
+	{ "feed", required_argument, 0, 'F' },
+	{ "anti-entropy", required_argument, 0, 'A' },
+	{ "metrics", required_argument, 0, 'E' },
+	{ "trace-sample", required_argument, 0, 'r' },
+	{ "control", required_argument, 0, 'c' },
 	{ NULL, 0, 0, 0 },
 };
 
 bool do_daemonize;
 FILE *logfile;
+struct qlog *qlog;
 
 static void usage(char *prog_name)
 {
 	fprintf(stderr, "Usage: ilad [-dv] [-L logfile] [-D dbopts] "
-			"[-R routeopts\n");
+			"[-R routeopts] [-b kernel|null|record] "
+			"[-m full|resolve|demand] "
+			"[-T ADDR64[,SIRID]] [-C size] [-t ttl] [-l lifetime] "
+			"[-P ADDR64[,SIRID]]... [-F feed] "
+			"[-A SECS[,BITS]] [-E metrics] [-r N] "
+			"[-c control]\n");
+	fprintf(stderr, "  -v, --verbose      log route changes\n");
 	fprintf(stderr, "  -L, --logfile      log file\n");
 	fprintf(stderr, "  -D, --dbopts       database options\n");
 	fprintf(stderr, "  -R, --routeopts    route options\n");
+	fprintf(stderr, "  -b, --route-backend\n"
+			"                     kernel routes, or discard or "
+			"record route changes\n");
+	fprintf(stderr, "  -m, --mode         full replication, on demand "
+			"resolution, or on demand routes\n");
+	fprintf(stderr, "  -T, --trap         SIR prefix to resolve misses "
+			"for and its id\n");
+	fprintf(stderr, "  -C, --cache-size   resolved mapping cache size\n");
+	fprintf(stderr, "  -t, --ttl          resolved mapping lifetime in "
+			"seconds\n");
+	fprintf(stderr, "  -l, --lifetime     seconds a route set on demand "
+			"is kept after its last use\n");
+	fprintf(stderr, "  -P, --prefix       SIR prefix and id served, "
+			"default is all\n"
+			"                     up to %d prefixes, or %d with "
+			"ids\n",
+		ILA_FILTER_MAX_PREFIXES, ILA_FILTER_MAX_SIR_PREFIXES);
+	fprintf(stderr, "  -F, --feed         watch changes from a relay at "
+			"a Unix socket path or [ADDR]:PORT\n");
+	fprintf(stderr, "  -A, --anti-entropy seconds between checks against "
+			"the database digest and routes, and\n"
+			"                     log2 of the digest leaves\n");
+	fprintf(stderr, "  -E, --metrics      serve metrics over HTTP at a "
+			"Unix socket path or [ADDR]:PORT\n");
+	fprintf(stderr, "  -r, --trace-sample log a latency trace for one in "
+			"N mapping updates\n");
+	fprintf(stderr, "  -c, --control      control socket, a Unix socket "
+			"path or [ADDR]:PORT\n");
 }
 
-/* Instance of a mapping system. */
+/* Parse ADDR64[,SIRID]. SIR id is set to -1 if it's not present */
+static int parse_sir_prefix(char *arg, Locator *prefix, int *sir_id)
+{
+	char *id = strchr(arg, ',');
+	__u16 num;
 
-struct ila_map_sys {
-	struct dbif_ops *db_ops;
-	void *db_ctx;
-	struct ila_route_ops *route_ops;
-	void *route_ctx;
-	void *watch_all_handle;
-	struct event_base *event_base;
-};
+	if (id)
+		*id++ = '\0';
 
-static int parse_args(int argc, char *argv[], char **db_subopts,
-		      char **route_subopts)
+	if (get_addr64(prefix, arg) < 0) {
+		fprintf(stderr, "Bad SIR prefix %s\n", arg);
+		return -1;
+	}
+
+	*sir_id = -1;
+	if (id) {
+		if (get_u16(&num, id, 0) < 0) {
+			fprintf(stderr, "Bad SIR id %s\n", id);
+			return -1;
+		}
+		*sir_id = num;
+	}
+
+	return 0;
+}
+
+/* Add a served prefix to the filter. Full map keys start with the
+ * prefix and compact keys with the SIR id, prepared mappings are the
+ * same keys following the prepare tag.
+ */
+static int filter_add_prefix(struct ila_map_sys *ims, char *arg)
+{
+	struct dbif_filter *filter = &ims->filter;
+	struct IlaMapPrepKey pkey;
+	struct IlaSirKey skey;
+	Locator prefix;
+	int sir_id;
+	__u16 id;
+
+	if (parse_sir_prefix(arg, &prefix, &sir_id) < 0)
+		return -1;
+
+	if (!filter->num_prefixes) {
+		/* SIR dictionary is needed to expand compact keys */
+		ila_sir_key_init(&skey, 0);
+		if (dbif_filter_add(filter, skey.tag, sizeof(skey.tag),
+				    sizeof(skey)) < 0)
+			goto full;
+	}
+
+	memcpy(pkey.tag, ILA_PREP_KEY_TAG, sizeof(ILA_PREP_KEY_TAG));
+	memcpy(pkey.key, &prefix, sizeof(prefix));
+
+	if (dbif_filter_add(filter, &prefix, sizeof(prefix),
+			    sizeof(struct IlaMapKey)) < 0 ||
+	    dbif_filter_add(filter, &pkey, sizeof(pkey.tag) + sizeof(prefix),
+			    sizeof(pkey.tag) + sizeof(struct IlaMapKey)) < 0)
+		goto full;
+
+	if (sir_id < 0)
+		return 0;
+
+	id = sir_id;
+	memcpy(pkey.key, &id, sizeof(id));
+
+	if (dbif_filter_add(filter, &id, sizeof(id),
+			    sizeof(struct IlaMapKeySir)) < 0 ||
+	    dbif_filter_add(filter, &pkey, sizeof(pkey.tag) + sizeof(id),
+			    sizeof(pkey.tag) +
+			    sizeof(struct IlaMapKeySir)) < 0)
+		goto full;
+
+	return 0;
+
+full:
+	fprintf(stderr, "Too many served prefixes, up to %d or %d with ids\n",
+		ILA_FILTER_MAX_PREFIXES, ILA_FILTER_MAX_SIR_PREFIXES);
+	return -1;
+}
+
+/* Parse SECS[,BITS] */
+static int parse_anti_entropy(struct ila_map_sys *ims, char *arg)
+{
+	char *bits = strchr(arg, ',');
+
+	if (bits)
+		*bits++ = '\0';
+
+	if (get_unsigned(&ims->ae_interval, arg, 0) < 0 ||
+	    !ims->ae_interval) {
+		fprintf(stderr, "Bad anti-entropy interval %s\n", arg);
+		return -1;
+	}
+
+	if (bits && (get_unsigned(&ims->ae_bits, bits, 0) < 0 ||
+		     !ims->ae_bits || ims->ae_bits > QMERKLE_MAX_BITS)) {
+		fprintf(stderr, "Bad anti-entropy bits %s\n", bits);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int parse_args(int argc, char *argv[], struct ila_map_sys *ims,
+		      char **db_subopts, char **route_subopts,
+		      char **feed_addr, char **metrics_addr,
+		      char **ctl_addr)
 {
 	int option_index = 0;
 	int c;
@@ -91,6 +260,9 @@ static int parse_args(int argc, char *argv[], char **db_subopts,
 	while ((c = getopt_long(argc, argv, ARGS, long_options,
 				&option_index)) != EOF) {
 		switch (c) {
+		case 'v':
+			ims->verbose++;
+			break;
 		case 'd':
 			do_daemonize = true;
 			break;
@@ -109,6 +281,81 @@ static int parse_args(int argc, char *argv[], char **db_subopts,
 		case 'R':
 			*route_subopts = optarg;
 			break;
+		case 'b':
+			if (!strcmp(optarg, "kernel")) {
+				ims->route_ops = ila_get_kernel();
+			} else if (!strcmp(optarg, "null")) {
+				ims->route_ops = ila_get_null();
+			} else if (!strcmp(optarg, "record")) {
+				ims->route_ops = ila_get_record();
+			} else {
+				fprintf(stderr, "Unknown route backend %s\n",
+					optarg);
+				return -1;
+			}
+			break;
+		case 'm':
+			if (!strcmp(optarg, "full")) {
+				ims->mode = ILA_MAP_MODE_FULL;
+			} else if (!strcmp(optarg, "resolve")) {
+				ims->mode = ILA_MAP_MODE_RESOLVE;
+			} else if (!strcmp(optarg, "demand")) {
+				ims->mode = ILA_MAP_MODE_DEMAND;
+			} else {
+				fprintf(stderr, "Unknown mode %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'T':
+			if (parse_sir_prefix(optarg, &ims->trap_prefix,
+					     &ims->trap_sir_id) < 0)
+				return -1;
+			break;
+		case 'C':
+			if (get_unsigned(&ims->cache_size, optarg, 0) < 0 ||
+			    !ims->cache_size) {
+				fprintf(stderr, "Bad cache size %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 't':
+			if (get_unsigned(&ims->ttl, optarg, 0) < 0 ||
+			    !ims->ttl) {
+				fprintf(stderr, "Bad TTL %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'l':
+			if (get_unsigned(&ims->lifetime, optarg, 0) < 0 ||
+			    !ims->lifetime) {
+				fprintf(stderr, "Bad lifetime %s\n", optarg);
+				return -1;
+			}
+			break;
+		case 'P':
+			if (filter_add_prefix(ims, optarg) < 0)
+				return -1;
+			break;
+		case 'F':
+			*feed_addr = optarg;
+			break;
+		case 'A':
+			if (parse_anti_entropy(ims, optarg) < 0)
+				return -1;
+			break;
+		case 'E':
+			*metrics_addr = optarg;
+			break;
+		case 'r':
+			if (get_unsigned(&ims->trace_sample, optarg, 0) < 0) {
+				fprintf(stderr, "Bad trace sample %s\n",
+					optarg);
+				return -1;
+			}
+			break;
+		case 'c':
+			*ctl_addr = optarg;
+			break;
 		default:
 			usage(argv[0]);
 			return -1;
@@ -118,57 +365,709 @@ static int parse_args(int argc, char *argv[], char **db_subopts,
 	if (!logfile)
 		logfile = stderr;
 
+	if (ims->mode != ILA_MAP_MODE_FULL && !ims->trap_prefix) {
+		fprintf(stderr, "Mode needs a trap prefix\n");
+		return -1;
+	}
+
 	return 0;
 }
 
-static void watch_cb(void *key, size_t key_size, void *data)
+static __u32 map_hash(struct IlaMapKey *key)
 {
-	struct ila_map_sys *ims = data;
-	struct IlaMapKey *ikey = key;
-	struct IlaMapValue value;
-	size_t value_size;
+	return qhash_bytes(key, sizeof(*key), 0);
+}
+
+struct ila_map_entry *map_lookup(struct ila_map_sys *ims,
+				 struct IlaMapKey *key)
+{
+	struct ila_map_entry *ime;
+	__u32 hash = map_hash(key);
+
+	qhash_for_each_possible(&ims->map_table, ime, node, hash)
+		if (!memcmp(&ime->key, key, sizeof(*key)))
+			return ime;
+
+	return NULL;
+}
+
+struct ila_map_entry *map_add(struct ila_map_sys *ims, struct IlaMapKey *key)
+{
+	struct ila_map_entry *ime;
+
+	ime = malloc(sizeof(*ime));
+	if (!ime)
+		return NULL;
+
+	ime->key = *key;
+	ime->gen = 0;
+	ime->staged = NULL;
+	ime->expires = 0;
+	ime->installed = false;
+	ime->routed = false;
+	INIT_LIST_HEAD(&ime->lru);
+	qhash_add(&ims->map_table, &ime->node, map_hash(key));
+	ims->map_count++;
+
+	return ime;
+}
+
+void map_unstage(struct ila_map_sys *ims, struct ila_map_entry *ime)
+{
+	if (ime->staged) {
+		ims->route_ops->free_staged(ims->route_ctx, ime->staged);
+		ime->staged = NULL;
+	}
+}
+
+void map_remove(struct ila_map_sys *ims, struct ila_map_entry *ime)
+{
+	if (ime->installed)
+		ims->installed_count--;
+	route_tree_clear(ims, ime);
+	map_unstage(ims, ime);
+	list_del(&ime->lru);
+	qhash_del(&ims->map_table, &ime->node);
+	ims->map_count--;
+	free(ime);
+}
+
+/* Count the result of a route operation that started at start */
+static int route_account(struct ila_map_sys *ims, int res, __u64 start,
+			 struct qmetric *time, struct qmetric *done)
+{
+	qmetric_observe_since(time, start);
+
+	if (res < 0)
+		qmetric_inc_vec(ims->m.route_failures, errno);
+	else if (!res)
+		qmetric_inc(done);
+
+	return res;
+}
+
+/* Stream for a component that logs to a FILE, or the log file itself if
+ * one can't be allocated
+ */
+FILE *log_file(const char *src)
+{
+	FILE *f = qlog_file(qlog, QLOG_INFO, src);
+
+	return f ? : logfile;
+}
+
+static void route_log(const char *what, struct IlaMapKey *key,
+		      struct IlaMapValue *value)
+{
+	char addr[INET6_ADDRSTRLEN], loc[ADDR64_BUF_SIZE];
+
+	inet_ntop(AF_INET6, &key->addr, addr, sizeof(addr));
+	if (value)
+		addr64_n2a(value->loc, loc, sizeof(loc));
+
+	QLOG(qlog, QLOG_DEBUG, "Route", "op=%s addr=%s%s%s", what, addr,
+	     value ? " via=" : "", value ? loc : "");
+}
+
+int route_del(struct ila_map_sys *ims, struct IlaMapKey *key)
+{
+	__u64 start = qmetrics_now();
+
+	if (ims->verbose)
+		route_log("Del", key, NULL);
+
+	return route_account(ims, ims->route_ops->del_route(ims->route_ctx,
+							    key),
+			     start, ims->m.route_del_time,
+			     ims->m.routes_deleted);
+}
+
+/* Set the route for a mapping, switching to the staged route if this
+ * is the prepared handover.
+ */
+int map_install(struct ila_map_sys *ims, struct ila_map_entry *ime)
+{
+	__u64 start = qmetrics_now();
 	int res;
 
-	value_size = sizeof(value);
+	if (ime->staged &&
+	    !memcmp(&ime->staged_value, &ime->value, sizeof(ime->value))) {
+		res = ims->route_ops->commit_route(ims->route_ctx,
+						   ime->staged);
+		ime->staged = NULL;
+	} else {
+		res = ims->route_ops->set_route(ims->route_ctx, &ime->key,
+						&ime->value);
+	}
+	if (route_account(ims, res, start, ims->m.route_set_time,
+			  ims->m.routes_added) < 0)
+		return -1;
+
+	if (ims->verbose)
+		route_log(res ? "Local" : "Set", &ime->key, &ime->value);
+
+	if (ims->notify_time)
+		qmetric_observe_since(ims->m.install_time, ims->notify_time);
+
+	/* No route is set for a local locator */
+	ime->local = res > 0;
+	if (ime->local)
+		route_tree_clear(ims, ime);
+	else
+		route_tree_set(ims, ime);
+
+	if (!ime->installed)
+		ims->installed_count++;
+	ime->installed = true;
+
+	return 0;
+}
+
+/* The prepared handover was committed, switch to the staged route */
+static void map_commit(struct ila_map_sys *ims, struct ila_map_entry *ime)
+{
+	ime->value = ime->staged_value;
+
+	if (map_install(ims, ime) < 0)
+		QLOG(qlog, QLOG_ERR, "Commit failed", "errno=%d", errno);
+}
+
+void map_uninstall(struct ila_map_sys *ims, struct ila_map_entry *ime)
+{
+	if (ime->installed) {
+		if (!ime->local && route_del(ims, &ime->key) < 0 &&
+		    errno != ESRCH)
+			QLOG(qlog, QLOG_ERR, "Del failed", "errno=%d", errno);
+		ims->installed_count--;
+	}
+
+	ime->installed = false;
+	ime->local = false;
+	route_tree_clear(ims, ime);
+	map_unstage(ims, ime);
+	list_del(&ime->lru);
+	INIT_LIST_HEAD(&ime->lru);
+}
+
+/* The value of a change carried by the feed */
+static bool feed_read(struct ila_map_sys *ims, void *key, size_t key_size,
+		      void *value, size_t *value_size, int *res)
+{
+	if (!ims->feed_key || ims->feed_key_size != key_size ||
+	    memcmp(ims->feed_key, key, key_size) ||
+	    ims->feed_value_size > *value_size)
+		return false;
+
+	*res = ims->feed_res;
+	*value_size = ims->feed_value_size;
+	memcpy(value, ims->feed_value, *value_size);
+	qmetric_inc(ims->m.feed_values);
+
+	/* Only for the first read of the change */
+	ims->feed_key = NULL;
+
+	return true;
+}
+
+/* Read a record from the database, noting it for anti-entropy */
+int db_read(struct ila_map_sys *ims, void *key, size_t key_size,
+	    void *value, size_t *value_size)
+{
+	__u64 start = qmetrics_now();
+	int res;
+
+	if (feed_read(ims, key, key_size, value, value_size, &res)) {
+		if (ims->db_tree.nodes)
+			shadow_update(ims, key, key_size, value, *value_size,
+				      res);
+		return res;
+	}
+
 	res = ims->db_ops->read(ims->db_ctx, key, key_size,
-				&value, &value_size);
+				value, value_size);
 
+	qmetric_observe_since(ims->m.db_read_time, start);
 	switch (res) {
 	case 0:
-		if (value_size != sizeof(value)) {
-			fprintf(stderr, "Unexpected value size\n");
+		qmetric_inc(ims->m.db_read_ok);
+		break;
+	case -2:
+		qmetric_inc(ims->m.db_read_missing);
+		break;
+	default:
+		qmetric_inc(ims->m.db_read_error);
+	}
+
+	if (ims->db_tree.nodes)
+		shadow_update(ims, key, key_size, value, *value_size, res);
+
+	return res;
+}
+
+/* Read a record that isn't used only to account for it */
+static void shadow_refresh(struct ila_map_sys *ims, void *key,
+			   size_t key_size)
+{
+	struct IlaMapRec rec;
+	size_t rec_size = sizeof(rec);
+
+	if (ims->db_tree.nodes)
+		db_read(ims, key, key_size, &rec, &rec_size);
+}
+
+static struct ila_sir_entry *sir_lookup(struct ila_map_sys *ims, __u16 id)
+{
+	struct ila_sir_entry *ise;
+
+	qhash_for_each_possible(&ims->sir_table, ise, node, id)
+		if (ise->id == id)
+			return ise;
+
+	return NULL;
+}
+
+/* Read a SIR prefix dictionary entry from the database into sir_table.
+ * Returns the entry or NULL if the id is not in the dictionary.
+ */
+static struct ila_sir_entry *sir_load(struct ila_map_sys *ims, __u16 id)
+{
+	struct ila_sir_entry *ise = sir_lookup(ims, id);
+	struct IlaSirKey key;
+	struct IlaSirRec rec;
+	size_t rec_size = sizeof(rec);
+
+	ila_sir_key_init(&key, id);
+
+	if (db_read(ims, &key, sizeof(key), &rec, &rec_size) < 0 ||
+	    ila_rec_normalize(&rec, rec_size, sizeof(rec),
+			      ILA_REC_TYPE_SIR) < 0) {
+		if (ise) {
+			qhash_del(&ims->sir_table, &ise->node);
+			free(ise);
+		}
+		return NULL;
+	}
+
+	if (!ise) {
+		ise = malloc(sizeof(*ise));
+		if (!ise)
+			return NULL;
+
+		ise->id = id;
+		qhash_add(&ims->sir_table, &ise->node, id);
+	}
+
+	ise->prefix = rec.value.prefix;
+
+	return ise;
+}
+
+/* Convert a compact map key to a full one */
+static int sir_expand(struct ila_map_sys *ims, struct IlaMapKeySir *skey,
+		      struct IlaMapKey *mkey)
+{
+	struct ila_sir_entry *ise;
+	__u16 id = skey->sir_id;
+
+	ise = sir_lookup(ims, id);
+	if (!ise)
+		ise = sir_load(ims, id);
+	if (!ise)
+		return -1;
+
+	ila_sir_expand(&mkey->addr, ise->prefix, skey->iid);
+
+	return 0;
+}
+
+/* Get the full map key for a full or compact key */
+static int map_key_expand(struct ila_map_sys *ims, void *key, size_t key_size,
+			  struct IlaMapKey *mkey)
+{
+	switch (key_size) {
+	case sizeof(struct IlaMapKey):
+		memcpy(mkey, key, sizeof(*mkey));
+		return 0;
+	case sizeof(struct IlaMapKeySir):
+		if (sir_expand(ims, key, mkey) < 0) {
+			QLOG(qlog, QLOG_WARN, "Unknown SIR prefix id");
+			return -1;
+		}
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+/* Prepared mapping changed. Stage the route, drop the staged one if the
+ * handover was aborted, or commit it if the prepared mapping was deleted.
+ */
+static void prep_watch_cb(struct ila_map_sys *ims, void *key,
+			  size_t key_size)
+{
+	struct IlaMapPrepKey *pkey = key;
+	struct ila_map_entry *ime;
+	struct IlaMapKey mkey;
+	struct IlaMapRec rec;
+	size_t rec_size = sizeof(rec);
+	int res;
+
+	if (!ims->route_ops->stage_route ||
+	    map_key_expand(ims, pkey->key, key_size - sizeof(pkey->tag),
+			   &mkey) < 0) {
+		shadow_refresh(ims, key, key_size);
+		return;
+	}
+
+	res = db_read(ims, key, key_size, &rec, &rec_size);
+
+	ime = map_lookup(ims, &mkey);
+
+	switch (res) {
+	case 0:
+		if (ila_rec_normalize(&rec, rec_size, sizeof(rec),
+				      ILA_REC_TYPE_MAP) < 0) {
+			QLOG(qlog, QLOG_WARN, "Unexpected prepared map record",
+			     "size=%zu", rec_size);
+			return;
+		}
+
+		if (!rec.value.loc) {
+			/* Aborted */
+			if (ime)
+				map_unstage(ims, ime);
 			return;
 		}
 
+		if (ims->mode != ILA_MAP_MODE_FULL &&
+		    (!ime || !ime->installed)) {
+			/* Only stage for routes that are in use */
+			return;
+		}
+
+		if (!ime)
+			ime = map_add(ims, &mkey);
+		if (!ime)
+			return;
+
+		map_unstage(ims, ime);
+
+		ime->staged_value = rec.value;
+		if (ims->route_ops->stage_route(ims->route_ctx, &mkey,
+						&ime->staged_value,
+						&ime->staged) < 0) {
+			QLOG(qlog, QLOG_ERR, "Stage failed", "errno=%d", errno);
+			ime->staged = NULL;
+			return;
+		}
+		break;
+	case -2:
+		if (ime && ime->staged)
+			map_commit(ims, ime);
+		break;
+	default:
+		QLOG(qlog, QLOG_ERR, "Read prepared mapping failed");
+	}
+}
+
+static __u64 trace_delta(__u64 from_us, __u64 to_us)
+{
+	/* Clocks of different hosts may be skewed */
+	return to_us > from_us ? to_us - from_us : 0;
+}
+
+/* Route for a notified map record was set. The update is traced from its
+ * origin, the identifier write recorded by ilactld, and one in
+ * trace_sample is logged, sampled by origin time as ilactld does.
+ */
+static void trace_install(struct ila_map_sys *ims, struct IlaMapKey *key,
+			  struct IlaRecHdr *hdr)
+{
+	__u64 origin = ila_rec_origin(hdr), write = hdr->timestamp / 1000;
+	__u64 notify = ims->notify_ns / 1000, read = ims->read_ns / 1000;
+	__u64 install = ila_time_ns() / 1000;
+	char buf[INET6_ADDRSTRLEN];
+
+	if (!ims->notify_ns || !ims->read_ns)
+		return;
+
+	qmetric_observe(ims->m.trace_notify, trace_delta(write, notify));
+	qmetric_observe(ims->m.trace_read, trace_delta(notify, read));
+	qmetric_observe(ims->m.trace_install, trace_delta(read, install));
+
+	if (!origin)
+		return;
+
+	qmetric_observe(ims->m.trace_map, trace_delta(origin, write));
+	qmetric_observe(ims->m.trace_total, trace_delta(origin, install));
+
+	if (ims->trace_sample && !(origin % ims->trace_sample))
+		QLOG(qlog, QLOG_INFO, "Trace", "origin=%llu addr=%s "
+		     "ident_to_map=%llu map_to_notify=%llu notify_to_read=%llu "
+		     "read_to_install=%llu total=%llu", origin,
+		     inet_ntop(AF_INET6, &key->addr, buf, sizeof(buf)),
+		     trace_delta(origin, write), trace_delta(write, notify),
+		     trace_delta(notify, read), trace_delta(read, install),
+		     trace_delta(origin, install));
+}
+
+static void apply_map(void *key, size_t key_size, void *data)
+{
+	struct ila_map_sys *ims = data;
+	struct ila_map_entry *ime;
+	struct IlaMapKey mkey, *ikey = &mkey;
+	struct IlaMapRec rec;
+	size_t rec_size;
+	int res;
+
+	if (ila_is_sir_key(key, key_size)) {
+		sir_load(ims, ((struct IlaSirKey *)key)->id);
+		return;
+	}
+
+	if (ila_is_prep_key(key, key_size)) {
+		prep_watch_cb(ims, key, key_size);
+		return;
+	}
+
+	if (map_key_expand(ims, key, key_size, &mkey) < 0) {
+		shadow_refresh(ims, key, key_size);
+		return;
+	}
+
+	if (ims->mode == ILA_MAP_MODE_RESOLVE && !map_lookup(ims, ikey)) {
+		/* Not resolved here, nothing to refresh */
+		return;
+	}
+
+	rec_size = sizeof(rec);
+	res = db_read(ims, key, key_size, &rec, &rec_size);
+
+	if (ims->notify_ns)
+		ims->read_ns = ila_time_ns();
+
+	switch (res) {
+	case 0:
+		if (ila_rec_normalize(&rec, rec_size, sizeof(rec),
+				      ILA_REC_TYPE_MAP) < 0) {
+			QLOG(qlog, QLOG_WARN, "Unexpected map record",
+			     "size=%zu", rec_size);
+			return;
+		}
+
+		ime = map_lookup(ims, ikey);
+		if (ime && ila_rec_is_stale(rec.hdr.gen, ime->gen)) {
+			/* Already applied this or a later record */
+			return;
+		}
+
+		if (!ime)
+			ime = map_add(ims, ikey);
+		if (!ime)
+			return;
+
+		if (ime->installed &&
+		    !memcmp(&ime->value, &rec.value, sizeof(rec.value))) {
+			/* Route is current, e.g. from a committed
+			 * handover
+			 */
+			ime->gen = rec.hdr.gen;
+			return;
+		}
+
+		ime->value = rec.value;
+
+		if (ims->mode == ILA_MAP_MODE_DEMAND && !ime->installed) {
+			/* Route is set when traffic shows up */
+			ime->gen = rec.hdr.gen;
+			return;
+		}
+
+		if (ims->mode == ILA_MAP_MODE_RESOLVE && !ime->installed) {
+			/* Mapping showed up for a miss */
+			ime->expires = now() + ims->ttl;
+		}
+
 		/* Found it in DB, set in forwarding table */
-		if (ims->route_ops->set_route(ims->route_ctx, ikey,
-					      &value) < 0) {
-			fprintf(stderr, "Set failed\n");
+		if (map_install(ims, ime) < 0) {
+			QLOG(qlog, QLOG_ERR, "Set failed", "errno=%d", errno);
 			return;
 		}
+
+		trace_install(ims, ikey, &rec.hdr);
+
+		ime->gen = rec.hdr.gen;
 		break;
 	case -2:
 		/* Not in DB, probably was deleted. Remove from
 		 * forwarding table if possible.
 		 */
-		if (ims->route_ops->del_route(ims->route_ctx, ikey) < 0 &&
-		    errno != ESRCH) {
-			fprintf(stderr, "Del failed\n");
+		ime = map_lookup(ims, ikey);
+		if (ime)
+			map_remove(ims, ime);
+
+		if (route_del(ims, ikey) < 0 && errno != ESRCH) {
+			QLOG(qlog, QLOG_ERR, "Del failed", "errno=%d", errno);
 			return;
 		}
 		break;
 	default:
 	case -1:
 		/* Each reading DB */
-		fprintf(stderr, "Read mapping failed\n");
+		QLOG(qlog, QLOG_ERR, "Read mapping failed");
+	}
+}
+
+void watch_cb(void *key, size_t key_size, void *data)
+{
+	QPROBE2(ilad, watch_entry, key, key_size);
+
+	apply_map(key, key_size, data);
+
+	QPROBE2(ilad, watch_return, key, key_size);
+}
+
+/* Map entry for a map or prepared map key from a scan, prep is set for
+ * a prepared map key.
+ */
+static struct ila_map_entry *scan_lookup(struct ila_map_sys *ims, void *key,
+					 size_t key_size, bool *prep)
+{
+	struct IlaMapPrepKey *pkey = key;
+	struct IlaMapKey mkey;
+
+	*prep = false;
+
+	if (ila_is_sir_key(key, key_size))
+		return NULL;
+
+	if (ila_is_prep_key(key, key_size)) {
+		key = pkey->key;
+		key_size -= sizeof(pkey->tag);
+		*prep = true;
 	}
+
+	if (map_key_expand(ims, key, key_size, &mkey) < 0)
+		return NULL;
+
+	return map_lookup(ims, &mkey);
+}
+
+/* Only a map record keeps the mapping, a prepared map record only keeps
+ * the staged route.
+ */
+static void resync_scan_cb(void *key, size_t key_size, void *data)
+{
+	struct ila_map_sys *ims = data;
+	struct ila_map_entry *ime;
+	bool prep;
+
+	watch_cb(key, key_size, data);
+
+	ime = scan_lookup(ims, key, key_size, &prep);
+	if (!ime)
+		return;
+
+	if (prep)
+		ime->prep_seen = true;
+	else
+		ime->seen = true;
+}
+
+/* Changes were lost. Resolved mappings are dropped, or the database is
+ * rescanned and mappings that are no longer in it are removed.
+ */
+void resync_cb(void *data)
+{
+	struct ila_map_sys *ims = data;
+	struct ila_shadow_entry *hse;
+	struct ila_map_entry *ime;
+	struct ila_sir_entry *ise;
+	struct hlist_node *tmp;
+	unsigned int bkt;
+
+	qmetric_inc(ims->m.resyncs);
+
+	qhash_for_each_safe(&ims->sir_table, bkt, tmp, ise, node) {
+		qhash_del(&ims->sir_table, &ise->node);
+		free(ise);
+	}
+
+	if (ims->db_tree.nodes)
+		qhash_for_each_safe(&ims->shadow_table, bkt, tmp, hse, node)
+			hse->seen = false;
+
+	if (ims->mode == ILA_MAP_MODE_RESOLVE) {
+		qhash_for_each_safe(&ims->map_table, bkt, tmp, ime, node)
+			cache_evict(ims, ime);
+		return;
+	}
+
+	qhash_for_each_safe(&ims->map_table, bkt, tmp, ime, node) {
+		ime->seen = false;
+		ime->prep_seen = false;
+	}
+
+	if (ims->db_ops->scan(ims->db_ctx, map_filter(ims), resync_scan_cb,
+			      ims) < 0) {
+		QLOG(qlog, QLOG_ERR, "Resync scan failed");
+		return;
+	}
+
+	qhash_for_each_safe(&ims->map_table, bkt, tmp, ime, node) {
+		if (!ime->seen)
+			cache_evict(ims, ime);
+		else if (!ime->prep_seen)
+			map_unstage(ims, ime);
+	}
+
+	if (ims->db_tree.nodes)
+		qhash_for_each_safe(&ims->shadow_table, bkt, tmp, hse, node)
+			if (!hse->seen)
+				shadow_remove(ims, hse);
+}
+
+/* Change notification from the database or a relay */
+static void notify_cb(void *key, size_t key_size, void *data)
+{
+	struct ila_map_sys *ims = data;
+
+	qmetric_inc(ims->m.notifications);
+
+	ims->notify_time = qmetrics_now();
+	ims->notify_ns = ila_time_ns();
+	watch_cb(key, key_size, data);
+	ims->notify_time = 0;
+	ims->notify_ns = 0;
+	ims->read_ns = 0;
+}
+
+/* Change from a relay. A value carried by the feed is taken by db_read
+ * for the key instead of reading it from the database.
+ */
+static void feed_cb(void *key, size_t key_size, int res, void *value,
+		    size_t value_size, void *data)
+{
+	struct ila_map_sys *ims = data;
+
+	if (res != -1) {
+		ims->feed_key = key;
+		ims->feed_key_size = key_size;
+		ims->feed_res = res;
+		ims->feed_value = value;
+		ims->feed_value_size = value_size;
+	}
+
+	notify_cb(key, key_size, data);
+
+	ims->feed_key = NULL;
 }
 
 static int start_watch_all(struct ila_map_sys *ims)
 {
-	if (ims->db_ops->watch_all(ims->db_ctx, watch_cb, ims,
-				   &ims->watch_all_handle,
-				    ims->event_base) < 0) {
+	if (ims->db_ops->watch_all(ims->db_ctx, map_filter(ims), notify_cb,
+				   resync_cb, ims, &ims->watch_all_handle,
+				   ims->event_base) < 0) {
 		fprintf(stderr, "Unable to start watch all\n");
 		return -1;
 	}
@@ -176,16 +1075,376 @@ static int start_watch_all(struct ila_map_sys *ims)
 	return 0;
 }
 
+static __u64 map_entries_get(void *data)
+{
+	struct ila_map_sys *ims = data;
+
+	return ims->map_count;
+}
+
+static __u64 installed_get(void *data)
+{
+	struct ila_map_sys *ims = data;
+
+	return ims->installed_count;
+}
+
+static int init_metrics(struct ila_map_sys *ims)
+{
+	struct ila_map_metrics *m = &ims->m;
+	struct qmetrics *qms;
+
+	qms = qmetrics_create();
+	if (!qms)
+		return -1;
+
+	ims->metrics = qms;
+
+	m->notifications = qmetrics_counter(qms, "ilad_notifications_total",
+			NULL, "Change notifications received");
+	m->resyncs = qmetrics_counter(qms, "ilad_resyncs_total", NULL,
+			"Resynchronizations with the map database");
+	m->db_read_ok = qmetrics_counter(qms, "ilad_db_reads_total",
+			"result=\"ok\"", "Map database reads");
+	m->db_read_missing = qmetrics_counter(qms, "ilad_db_reads_total",
+			"result=\"missing\"", "Map database reads");
+	m->db_read_error = qmetrics_counter(qms, "ilad_db_reads_total",
+			"result=\"error\"", "Map database reads");
+	m->db_read_time = qmetrics_histogram(qms, "ilad_db_read_seconds",
+			NULL, "Map database read latency");
+	m->feed_values = qmetrics_counter(qms, "ilad_feed_values_total", NULL,
+			"Records carried by the feed instead of read");
+	m->routes_added = qmetrics_counter(qms, "ilad_routes_added_total",
+			NULL, "Routes set");
+	m->routes_deleted = qmetrics_counter(qms, "ilad_routes_deleted_total",
+			NULL, "Routes deleted");
+	m->route_failures = qmetrics_counter_vec(qms,
+			"ilad_route_failures_total", "errno", 256,
+			"Failed route operations by errno");
+	m->route_set_time = qmetrics_histogram(qms, "ilad_route_seconds",
+			"op=\"set\"", "Route operation netlink round trip");
+	m->route_del_time = qmetrics_histogram(qms, "ilad_route_seconds",
+			"op=\"del\"", "Route operation netlink round trip");
+	m->install_time = qmetrics_histogram(qms, "ilad_install_seconds",
+			NULL, "Change notification to route set");
+	m->trapped = qmetrics_counter(qms, "ilad_trapped_total", NULL,
+			"Packets trapped for a missing route");
+	m->routes_kept = qmetrics_counter(qms,
+			"ilad_demand_routes_kept_total", NULL,
+			"Expired demand routes kept since they were used");
+	m->ae_repairs = qmetrics_counter(qms,
+			"ilad_anti_entropy_repairs_total", NULL,
+			"Routes repaired by anti-entropy");
+	m->trace_map = qmetrics_histogram(qms, "ilad_trace_seconds",
+			"stage=\"ident_to_map\"",
+			"Mapping update latency by stage");
+	m->trace_notify = qmetrics_histogram(qms, "ilad_trace_seconds",
+			"stage=\"map_to_notify\"",
+			"Mapping update latency by stage");
+	m->trace_read = qmetrics_histogram(qms, "ilad_trace_seconds",
+			"stage=\"notify_to_read\"",
+			"Mapping update latency by stage");
+	m->trace_install = qmetrics_histogram(qms, "ilad_trace_seconds",
+			"stage=\"read_to_install\"",
+			"Mapping update latency by stage");
+	m->trace_total = qmetrics_histogram(qms, "ilad_trace_seconds",
+			"stage=\"total\"", "Mapping update latency by stage");
+	qmetrics_gauge_func(qms, "ilad_map_entries", NULL, "Mappings held",
+			    map_entries_get, ims);
+	qmetrics_gauge_func(qms, "ilad_installed_entries", NULL,
+			    "Mappings installed in the forwarding table",
+			    installed_get, ims);
+
+	return qmetrics_failed(qms) ? -1 : 0;
+}
+
+static const char *mode_names[] = {
+	[ILA_MAP_MODE_FULL] = "full",
+	[ILA_MAP_MODE_RESOLVE] = "resolve",
+	[ILA_MAP_MODE_DEMAND] = "demand",
+};
+
+static void json_addr64_field(json_writer_t *jw, const char *name,
+			      __u64 addr)
+{
+	char buf[ADDR64_BUF_SIZE];
+
+	addr64_n2a(addr, buf, sizeof(buf));
+	jsonw_string_field(jw, name, buf);
+}
+
+static int ctl_status(struct qctl_conn *conn, int argc, char **argv,
+		      void *data)
+{
+	json_writer_t *jw = qctl_json(conn);
+	struct ila_map_sys *ims = data;
+	struct dbif_feed_status fs;
+
+	jsonw_string_field(jw, "mode", mode_names[ims->mode]);
+	jsonw_uint_field(jw, "map_entries", ims->map_count);
+	jsonw_uint_field(jw, "installed", ims->installed_count);
+	jsonw_uint_field(jw, "sir_prefixes", ims->sir_table.count);
+	if (ims->trap_prefix)
+		json_addr64_field(jw, "trap_prefix", ims->trap_prefix);
+
+	if (ims->feed) {
+		dbif_feed_get_status(ims->feed, &fs);
+		jsonw_name(jw, "feed");
+		jsonw_start_object(jw);
+		jsonw_bool_field(jw, "connected", fs.connected);
+		jsonw_uint_field(jw, "connects", fs.connects);
+		jsonw_uint_field(jw, "resyncs", fs.resyncs);
+		jsonw_lluint_field(jw, "epoch", fs.epoch);
+		jsonw_lluint_field(jw, "seq", fs.seq);
+		jsonw_end_object(jw);
+	}
+
+	if (ims->ae_interval) {
+		jsonw_name(jw, "anti_entropy");
+		jsonw_start_object(jw);
+		jsonw_uint_field(jw, "bits", ims->ae_bits);
+		jsonw_uint_field(jw, "round", ims->ae_round);
+		jsonw_uint_field(jw, "rescan_backoff",
+				 ims->ae_rescan_backoff);
+		jsonw_bool_field(jw, "db_check", !!ims->db_tree.nodes);
+		jsonw_bool_field(jw, "route_check", !!ims->route_tree.nodes);
+		if (ims->db_tree.nodes)
+			jsonw_uint_field(jw, "shadow_entries",
+					 ims->shadow_table.count);
+		jsonw_end_object(jw);
+	}
+
+	return 0;
+}
+
+static int ctl_stats(struct qctl_conn *conn, int argc, char **argv,
+		     void *data)
+{
+	json_writer_t *jw = qctl_json(conn);
+	struct ila_map_sys *ims = data;
+
+	jsonw_name(jw, "metrics");
+	qmetrics_json(ims->metrics, jw);
+
+	if (ims->db_ops->stats) {
+		jsonw_name(jw, "db");
+		jsonw_start_object(jw);
+		ims->db_ops->stats(ims->db_ctx, jw);
+		jsonw_end_object(jw);
+	}
+
+	return 0;
+}
+
+/* State of a dump in progress, bkt is the next bucket of the table */
+struct ila_dump {
+	struct ila_map_sys *ims;
+	unsigned int bkt;
+};
+
+static void dump_map_entry(json_writer_t *jw, struct ila_map_entry *ime)
+{
+	char addr[INET6_ADDRSTRLEN];
+
+	jsonw_start_object(jw);
+	jsonw_string_field(jw, "addr", inet_ntop(AF_INET6, &ime->key.addr,
+						 addr, sizeof(addr)));
+	json_addr64_field(jw, "loc", ime->value.loc);
+	jsonw_int_field(jw, "ifindex", ime->value.ifindex);
+	jsonw_uint_field(jw, "csum_mode", ime->value.csum_mode);
+	jsonw_uint_field(jw, "ident_type", ime->value.ident_type);
+	jsonw_uint_field(jw, "hook_type", ime->value.hook_type);
+	jsonw_lluint_field(jw, "gen", ime->gen);
+	jsonw_bool_field(jw, "installed", ime->installed);
+	jsonw_bool_field(jw, "local", ime->local);
+	if (ime->expires)
+		jsonw_int_field(jw, "expires", ime->expires - now());
+	if (ime->staged)
+		json_addr64_field(jw, "staged_loc", ime->staged_value.loc);
+	jsonw_end_object(jw);
+}
+
+static bool dump_map_step(json_writer_t *jw, void *arg, bool stop)
+{
+	struct ila_dump *dump = arg;
+	struct qhash *qh = &dump->ims->map_table;
+	struct ila_map_entry *ime;
+	unsigned int i;
+
+	for (i = 0; !stop && i < ILA_DUMP_BUCKETS &&
+		    dump->bkt < qhash_size(qh); i++, dump->bkt++)
+		qhash_for_each_in_bucket(qh, dump->bkt, ime, node)
+			dump_map_entry(jw, ime);
+
+	if (!stop && dump->bkt < qhash_size(qh))
+		return true;
+
+	jsonw_end_array(jw);
+	free(dump);
+
+	return false;
+}
+
+static bool dump_sir_step(json_writer_t *jw, void *arg, bool stop)
+{
+	struct ila_dump *dump = arg;
+	struct qhash *qh = &dump->ims->sir_table;
+	struct ila_sir_entry *ise;
+	unsigned int bkt;
+
+	/* The SIR dictionary is small, dump it in one go */
+	if (!stop) {
+		for (bkt = 0; bkt < qhash_size(qh); bkt++)
+			qhash_for_each_in_bucket(qh, bkt, ise, node) {
+				jsonw_start_object(jw);
+				jsonw_uint_field(jw, "id", ise->id);
+				json_addr64_field(jw, "prefix", ise->prefix);
+				jsonw_end_object(jw);
+			}
+	}
+
+	jsonw_end_array(jw);
+	free(dump);
+
+	return false;
+}
+
+static int ctl_dump(struct qctl_conn *conn, int argc, char **argv,
+		    void *data)
+{
+	json_writer_t *jw = qctl_json(conn);
+	struct ila_map_sys *ims = data;
+	const char *table = argc > 1 ? argv[1] : "map";
+	qctl_stream_fn step;
+	struct ila_dump *dump;
+
+	if (!strcmp(table, "map")) {
+		step = dump_map_step;
+	} else if (!strcmp(table, "sir")) {
+		step = dump_sir_step;
+	} else {
+		qctl_error(conn, "Unknown table %s", table);
+		return -1;
+	}
+
+	dump = calloc(1, sizeof(*dump));
+	if (!dump) {
+		qctl_error(conn, "Out of memory");
+		return -1;
+	}
+	dump->ims = ims;
+
+	jsonw_name(jw, table);
+	jsonw_start_array(jw);
+	qctl_stream(conn, step, dump);
+
+	return 0;
+}
+
+static void ae_interval_set(void *data)
+{
+	struct ila_map_sys *ims = data;
+	struct timeval tv = { .tv_sec = ims->ae_interval };
+
+	if (ims->ae_event)
+		event_add(ims->ae_event, &tv);
+}
+
+/* Route changes are logged at debug level */
+static void verbose_set(void *data)
+{
+	struct ila_map_sys *ims = data;
+
+	qlog_set_level(qlog, ims->verbose ? QLOG_DEBUG : QLOG_INFO);
+}
+
+static int init_control(struct ila_map_sys *ims, char *ctl_addr)
+{
+	struct qctl *qc;
+	int err = 0;
+
+	qc = qctl_create(ims->event_base, log_file("ctl"));
+	if (!qc)
+		return -1;
+
+	ims->ctl = qc;
+
+	err |= qctl_command(qc, "status", "Mode, table sizes, feed and "
+			    "anti-entropy state", ctl_status, ims);
+	err |= qctl_command(qc, "stats", "Metrics and database "
+			    "statistics", ctl_stats, ims);
+	err |= qctl_command(qc, "dump", "dump [map|sir], stream a table",
+			    ctl_dump, ims);
+	err |= qctl_tunable(qc, "cache_size", "Resolved mappings cached",
+			    &ims->cache_size, 1, UINT_MAX, NULL, NULL);
+	err |= qctl_tunable(qc, "ttl", "Seconds a resolved mapping is "
+			    "cached", &ims->ttl, 1, UINT_MAX, NULL, NULL);
+	err |= qctl_tunable(qc, "lifetime", "Seconds a route set on demand "
+			    "is kept after its last use", &ims->lifetime, 1,
+			    UINT_MAX, NULL, NULL);
+	err |= qctl_tunable(qc, "trace_sample", "Log a trace for one in N "
+			    "updates, 0 is off", &ims->trace_sample, 0,
+			    UINT_MAX, NULL, NULL);
+	err |= qctl_tunable(qc, "verbose", "Log route changes",
+			    &ims->verbose, 0, 1, verbose_set, ims);
+	if (ims->ae_interval)
+		err |= qctl_tunable(qc, "ae_interval", "Seconds between "
+				    "anti-entropy checks", &ims->ae_interval,
+				    1, 86400, ae_interval_set, ims);
+	if (err)
+		return -1;
+
+	return qctl_serve(qc, ctl_addr);
+}
+
+static void stop_cb(evutil_socket_t fd, short events, void *arg)
+{
+	struct ila_map_sys *ims = arg;
+
+	QLOG(qlog, QLOG_INFO, "Stopping", "signal=%d", fd);
+	event_base_loopbreak(ims->event_base);
+}
+
 int main(int argc, char *argv[])
 {
+	struct event *sigint, *sigterm;
 	struct ila_map_sys ims;
 	char *db_subopts = NULL;
 	char *route_subopts = NULL;
+	char *feed_addr = NULL;
+	char *metrics_addr = NULL;
+	char *ctl_addr = NULL;
 
 	memset(&ims, 0, sizeof(ims));
+	ims.trap_sir_id = -1;
+	ims.cache_size = ILA_CACHE_DEFAULT_SIZE;
+	ims.ttl = ILA_CACHE_DEFAULT_TTL;
+	ims.lifetime = ILA_DEMAND_DEFAULT_LIFETIME;
+	INIT_LIST_HEAD(&ims.lru);
+
+	if (qhash_init(&ims.map_table, 10) < 0 ||
+	    qhash_init(&ims.sir_table, 4) < 0) {
+		fprintf(stderr, "Unable to allocate tables\n");
+		exit(-1);
+	}
+
+	if (parse_args(argc, argv, &ims, &db_subopts, &route_subopts,
+		       &feed_addr, &metrics_addr, &ctl_addr) < 0)
+		exit(-1);
+
+	if (init_metrics(&ims) < 0) {
+		fprintf(stderr, "Unable to allocate metrics\n");
+		exit(-1);
+	}
 
-	if (parse_args(argc, argv, &db_subopts, &route_subopts) < 0)
+	qlog = qlog_create(logfile, QLOG_DEFAULT_RING);
+	if (!qlog) {
+		fprintf(stderr, "Unable to allocate log\n");
 		exit(-1);
+	}
+	if (ims.verbose > 1)
+		ims.verbose = 1;
+	verbose_set(&ims);
 
 	ims.db_ops = dbif_get_redis();
 	if (!ims.db_ops) {
@@ -193,17 +1452,18 @@ int main(int argc, char *argv[])
 		exit(-1);
 	}
 
-	ims.route_ops = ila_get_kernel();
+	if (!ims.route_ops)
+		ims.route_ops = ila_get_kernel();
 	if (!ims.route_ops) {
-		fprintf(stderr, "Unable to get Redis dbif\n");
+		fprintf(stderr, "Unable to get route backend\n");
 		exit(-1);
 	}
 
-	if (ims.db_ops->init(&ims.db_ctx, logfile, ILA_REDIS_DEFAULT_HOST,
-			      ILA_REDIS_DEFAULT_PORT) < 0)
+	if (ims.db_ops->init(&ims.db_ctx, log_file("db"),
+			     ILA_REDIS_DEFAULT_HOST, ILA_REDIS_DEFAULT_PORT) < 0)
 		exit(-1);
 
-	if (ims.route_ops->init(&ims.route_ctx, logfile) < 0)
+	if (ims.route_ops->init(&ims.route_ctx, log_file("route")) < 0)
 		exit(-1);
 
 	if (db_subopts && ims.db_ops->parse_args(ims.db_ctx, db_subopts) < 0)
@@ -213,12 +1473,27 @@ int main(int argc, char *argv[])
 	    ims.route_ops->parse_args(ims.route_ctx, route_subopts) < 0)
 		exit(-1);
 
+	if (ims.ae_interval && init_anti_entropy(&ims) < 0) {
+		fprintf(stderr, "Unable to allocate anti-entropy trees\n");
+		exit(-1);
+	}
+
 	ims.event_base = event_base_new();
 	if (!ims.event_base) {
 		perror("event_base_new");
 		exit(-1);
 	}
 
+	if (metrics_addr &&
+	    qmetrics_serve(ims.metrics, ims.event_base, metrics_addr,
+			   log_file("metrics")) < 0)
+		exit(-1);
+
+	if (ctl_addr && init_control(&ims, ctl_addr) < 0) {
+		fprintf(stderr, "Unable to start control socket\n");
+		exit(-1);
+	}
+
 	if (ims.db_ops->start(ims.db_ctx) < 0) {
 		fprintf(stderr, "Error initializing DB\n");
 		exit(-1);
@@ -229,19 +1504,65 @@ int main(int argc, char *argv[])
 		exit(-1);
 	}
 
-	if (start_watch_all(&ims) < 0) {
+	if (feed_addr) {
+		ims.feed = dbif_feed_watch(ims.event_base, feed_addr,
+					   map_filter(&ims), feed_cb,
+					   resync_cb, &ims, log_file("feed"));
+		if (!ims.feed) {
+			fprintf(stderr, "Start feed watch failed\n");
+			exit(-1);
+		}
+	} else if (start_watch_all(&ims) < 0) {
 		fprintf(stderr, "Start watch all failed\n");
 		exit(-1);
 	}
 
-	if (ims.db_ops->scan(ims.db_ctx, watch_cb, &ims)) {
-		fprintf(stderr, "Initial scan failed\n");
-		exit(-1);
+	if (ims.mode == ILA_MAP_MODE_RESOLVE) {
+		if (start_trap(&ims) < 0)
+			exit(-1);
+	} else {
+		/* A relay has the feed resynchronize once it subscribed,
+		 * which covers changes between this scan and the hello.
+		 */
+		if (ims.db_ops->scan(ims.db_ctx, map_filter(&ims), watch_cb,
+				     &ims)) {
+			fprintf(stderr, "Initial scan failed\n");
+			exit(-1);
+		}
+
+		/* Start trapping once the mappings are loaded */
+		if (ims.mode == ILA_MAP_MODE_DEMAND && start_trap(&ims) < 0)
+			exit(-1);
 	}
 
+	if (ims.ae_interval && start_anti_entropy(&ims) < 0)
+		exit(-1);
+
 	if (do_daemonize)
 		daemonize(logfile);
 
+	/* The writer thread must be started after the fork */
+	if (qlog_start(qlog) < 0) {
+		perror("Start log writer");
+		exit(-1);
+	}
+
+	/* Stop on SIGINT or SIGTERM so the route backend can finish, e.g.
+	 * write out a route log
+	 */
+	sigint = evsignal_new(ims.event_base, SIGINT, stop_cb, &ims);
+	sigterm = evsignal_new(ims.event_base, SIGTERM, stop_cb, &ims);
+	if (!sigint || !sigterm || evsignal_add(sigint, NULL) < 0 ||
+	    evsignal_add(sigterm, NULL) < 0) {
+		perror("Add signal events");
+		exit(-1);
+	}
+
 	/* Event loop */
 	event_base_dispatch(ims.event_base);
+
+	ims.route_ops->done(ims.route_ctx);
+	qlog_destroy(qlog);
+
+	return 0;
 }
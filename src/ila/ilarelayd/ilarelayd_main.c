@@ -0,0 +1,656 @@
+/*
+ * ilarelayd_main.c - Change feed relay daemon
+ *
+ * Copyright (c) 2018, Quantonium Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the Quantonium nor the names of its contributors
+ *     may be used to endorse or promote products derived from this software
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL QUANTONIUM BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <event2/listener.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "dbif.h"
+#include "dbif_feed.h"
+#include "dbif_redis.h"
+#include "list.h"
+#include "qlog.h"
+#include "qutils.h"
+
+#define ILA_REDIS_DEFAULT_PORT 6379
+#define ILA_REDIS_DEFAULT_HOST "::1"
+
+#define RELAY_DEFAULT_RING_BITS	16
+#define RELAY_MAX_RING_BITS	24
+#define RELAY_DEFAULT_CLIENT_BUF	(1 << 20)
+
+#define ARGS "dL:D:U:S:N:B:"
+
+static struct option long_options[] = {
+	{ "daemonize", no_argument, 0, 'd' },
+	{ "logfile", required_argument, 0, 'L' },
+	{ "dbopts", required_argument, 0, 'D' },
+	{ "upstream", required_argument, 0, 'U' },
+	{ "listen", required_argument, 0, 'S' },
+	{ "ring-bits", required_argument, 0, 'N' },
+	{ "client-buf", required_argument, 0, 'B' },
+	{ NULL, 0, 0, 0 },
+};
+
+bool do_daemonize;
+FILE *logfile;
+struct qlog *qlog;
+
+static void usage(char *prog_name)
+{
+	fprintf(stderr, "Usage: ilarelayd [-d] [-L logfile] [-D dbopts] "
+			"[-U upstream] [-N bits] [-B bytes] -S listen\n");
+	fprintf(stderr, "  -L, --logfile      log file\n");
+	fprintf(stderr, "  -D, --dbopts       database options\n");
+	fprintf(stderr, "  -U, --upstream     upstream relay instead of "
+			"the database\n");
+	fprintf(stderr, "  -S, --listen       feed socket, a Unix socket "
+			"path or [ADDR]:PORT\n");
+	fprintf(stderr, "  -N, --ring-bits    log2 of changes kept for "
+			"resuming clients\n");
+	fprintf(stderr, "  -B, --client-buf   bytes queued to a client "
+			"before it is paused\n");
+}
+
+/* Instance of a relay. Changes from the database watch, or from an
+ * upstream relay, are numbered and appended to ring. The ring holds the
+ * last ring_size changes and clients resume from any position in it.
+ * A change holds the key and its value, read once here when watching
+ * the database or as received from upstream, or a tombstone if the key
+ * was deleted. value_size is as in dbif_feed_event.
+ *
+ * Each client has the seq of the next change to send it. Changes are
+ * sent in batches while the client's output buffer holds less than
+ * client_buf bytes, so a slow client is paused without holding up the
+ * others and is resumed when its buffer drains. A new client, a client
+ * that falls out of the ring, or all clients when the upstream
+ * resynchronizes, are told to resynchronize and continue from the
+ * current changes.
+ */
+struct relay_change {
+	__u16 key_size;
+	__u16 value_size;
+	__u8 key[DBIF_FEED_KEY_MAX];
+	__u8 value[DBIF_FEED_VALUE_MAX];
+};
+
+struct relay_sys {
+	struct dbif_ops *db_ops;
+	void *db_ctx;
+	void *watch_handle;
+	struct dbif_feed *upstream;
+	struct event_base *event_base;
+	struct evconnlistener *listener;
+	struct relay_change *ring;
+	unsigned int ring_bits;
+	__u64 epoch;
+	__u64 next_seq;
+	size_t client_buf;
+	struct list_head clients;
+	struct event *flush_event;
+	bool flush_pending;
+};
+
+struct relay_client {
+	struct list_head list;
+	struct relay_sys *rs;
+	struct bufferevent *bev;
+	struct dbif_filter filter;
+	bool filtered;
+	bool started;
+	bool resync;
+	__u64 seq;
+};
+
+static int parse_args(int argc, char *argv[], struct relay_sys *rs,
+		      char **db_subopts, char **upstream, char **listen_addr)
+{
+	int option_index = 0;
+	unsigned long num;
+	int c;
+
+	while ((c = getopt_long(argc, argv, ARGS, long_options,
+				&option_index)) != EOF) {
+		switch (c) {
+		case 'd':
+			do_daemonize = true;
+			break;
+		case 'L':
+			if (!logfile) {
+				logfile = fopen(optarg, "w");
+				if (!logfile) {
+					perror("Open log file");
+					return -1;
+				}
+			}
+			break;
+		case 'D':
+			*db_subopts = optarg;
+			break;
+		case 'U':
+			*upstream = optarg;
+			break;
+		case 'S':
+			*listen_addr = optarg;
+			break;
+		case 'N':
+			num = strtoul(optarg, NULL, 0);
+			if (!num || num > RELAY_MAX_RING_BITS) {
+				fprintf(stderr, "Bad ring bits %s\n", optarg);
+				return -1;
+			}
+			rs->ring_bits = num;
+			break;
+		case 'B':
+			num = strtoul(optarg, NULL, 0);
+			if (!num) {
+				fprintf(stderr, "Bad client buffer %s\n",
+					optarg);
+				return -1;
+			}
+			rs->client_buf = num;
+			break;
+		default:
+			usage(argv[0]);
+			return -1;
+		}
+	}
+
+	if (!*listen_addr) {
+		usage(argv[0]);
+		return -1;
+	}
+
+	if (!logfile)
+		logfile = stderr;
+
+	return 0;
+}
+
+/* Oldest change still in the ring */
+static __u64 relay_oldest(struct relay_sys *rs)
+{
+	__u64 size = 1ULL << rs->ring_bits;
+
+	return rs->next_seq > size ? rs->next_seq - size : 1;
+}
+
+static struct relay_change *relay_change(struct relay_sys *rs, __u64 seq)
+{
+	return &rs->ring[seq & ((1ULL << rs->ring_bits) - 1)];
+}
+
+static void relay_client_free(struct relay_client *rc)
+{
+	list_del(&rc->list);
+	bufferevent_free(rc->bev);
+	free(rc);
+}
+
+/* Send batches to a client until it's caught up or its buffer is full */
+static void relay_client_flush(struct relay_client *rc)
+{
+	static __u8 buf[DBIF_FEED_BATCH_MAX *
+			(sizeof(struct dbif_feed_event) + DBIF_FEED_KEY_MAX +
+			 DBIF_FEED_VALUE_MAX)];
+	struct evbuffer *output = bufferevent_get_output(rc->bev);
+	struct relay_sys *rs = rc->rs;
+	struct dbif_feed_batch hdr;
+	struct dbif_feed_event ev;
+	struct relay_change *chg;
+	unsigned int count;
+	size_t len;
+
+	if (!rc->started)
+		return;
+
+	while (evbuffer_get_length(output) < rs->client_buf) {
+		if (rc->seq < relay_oldest(rs)) {
+			/* Fell out of the ring */
+			rc->seq = rs->next_seq;
+			rc->resync = true;
+		}
+
+		if (rc->seq == rs->next_seq && !rc->resync)
+			break;
+
+		count = 0;
+		len = 0;
+
+		for (; rc->seq < rs->next_seq &&
+		       count < DBIF_FEED_BATCH_MAX; rc->seq++) {
+			chg = relay_change(rs, rc->seq);
+
+			if (rc->filtered &&
+			    !dbif_filter_match(&rc->filter, chg->key,
+					       chg->key_size))
+				continue;
+
+			ev.key_size = htons(chg->key_size);
+			ev.value_size = htons(chg->value_size);
+			memcpy(&buf[len], &ev, sizeof(ev));
+			len += sizeof(ev);
+			memcpy(&buf[len], chg->key, chg->key_size);
+			len += chg->key_size;
+			if (chg->value_size <= DBIF_FEED_VALUE_MAX) {
+				memcpy(&buf[len], chg->value,
+				       chg->value_size);
+				len += chg->value_size;
+			}
+			count++;
+		}
+
+		/* Nothing for the client in these changes */
+		if (!count && !rc->resync)
+			continue;
+
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.version = htons(DBIF_FEED_VERSION);
+		hdr.flags = htons(rc->resync ? DBIF_FEED_F_RESYNC : 0);
+		hdr.count = htonl(count);
+		hdr.len = htonl(len);
+		hdr.epoch = htobe64(rs->epoch);
+		hdr.seq = htobe64(rc->seq);
+
+		evbuffer_add(output, &hdr, sizeof(hdr));
+		evbuffer_add(output, buf, len);
+
+		rc->resync = false;
+	}
+}
+
+static void relay_flush_cb(evutil_socket_t fd, short events, void *arg)
+{
+	struct relay_sys *rs = arg;
+	struct relay_client *rc;
+
+	rs->flush_pending = false;
+
+	list_for_each_entry(rc, &rs->clients, list)
+		relay_client_flush(rc);
+}
+
+/* Changes are batched by flushing once the current events have been
+ * processed.
+ */
+static void relay_schedule_flush(struct relay_sys *rs)
+{
+	if (!rs->flush_pending) {
+		rs->flush_pending = true;
+		event_active(rs->flush_event, EV_TIMEOUT, 0);
+	}
+}
+
+/* Append a change, res and the value are as for a feed callback */
+static void relay_append(struct relay_sys *rs, void *key, size_t key_size,
+			 int res, void *value, size_t value_size)
+{
+	struct relay_change *chg;
+
+	if (key_size > DBIF_FEED_KEY_MAX) {
+		QLOG(qlog, QLOG_WARN, "Key too long for relay",
+		     "size=%zu", key_size);
+		return;
+	}
+
+	chg = relay_change(rs, rs->next_seq++);
+	chg->key_size = key_size;
+	memcpy(chg->key, key, key_size);
+
+	switch (res) {
+	case 0:
+		if (value_size <= DBIF_FEED_VALUE_MAX) {
+			chg->value_size = value_size;
+			memcpy(chg->value, value, value_size);
+			break;
+		}
+		/* Fall through */
+	default:
+		chg->value_size = DBIF_FEED_NO_VALUE;
+		break;
+	case -2:
+		chg->value_size = DBIF_FEED_DELETED;
+	}
+
+	relay_schedule_flush(rs);
+}
+
+/* Change from the database, the value is read for the clients */
+static void relay_change_cb(void *key, size_t key_size, void *data)
+{
+	__u8 value[DBIF_FEED_VALUE_MAX];
+	size_t value_size = sizeof(value);
+	struct relay_sys *rs = data;
+	int res;
+
+	res = rs->db_ops->read(rs->db_ctx, key, key_size, value, &value_size);
+
+	relay_append(rs, key, key_size, res, value, value_size);
+}
+
+static void relay_feed_cb(void *key, size_t key_size, int res, void *value,
+			  size_t value_size, void *data)
+{
+	relay_append(data, key, key_size, res, value, value_size);
+}
+
+static __u64 relay_new_epoch(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return ((__u64)ts.tv_sec << 32 ^ ts.tv_nsec ^ getpid()) ? : 1;
+}
+
+/* Upstream lost changes. Start a new epoch so that clients resuming from
+ * the old one resynchronize, and tell the connected clients now.
+ */
+static void relay_resync_cb(void *data)
+{
+	struct relay_sys *rs = data;
+	struct relay_client *rc;
+
+	rs->epoch = relay_new_epoch();
+
+	list_for_each_entry(rc, &rs->clients, list) {
+		rc->seq = rs->next_seq;
+		rc->resync = true;
+	}
+
+	relay_schedule_flush(rs);
+}
+
+/* Read the client's hello and set its starting position */
+static int relay_client_hello(struct relay_client *rc, struct evbuffer *input)
+{
+	struct relay_sys *rs = rc->rs;
+	struct dbif_feed_prefix prefix;
+	struct dbif_feed_hello hello;
+	__u16 num;
+	__u64 seq;
+	int i;
+
+	if (evbuffer_get_length(input) < sizeof(hello))
+		return 0;
+
+	evbuffer_copyout(input, &hello, sizeof(hello));
+
+	num = ntohs(hello.num_prefixes);
+	if (ntohs(hello.version) != DBIF_FEED_VERSION ||
+	    num > DBIF_FILTER_MAX)
+		return -1;
+
+	if (evbuffer_get_length(input) < sizeof(hello) + num * sizeof(prefix))
+		return 0;
+
+	evbuffer_drain(input, sizeof(hello));
+
+	for (i = 0; i < num; i++) {
+		evbuffer_remove(input, &prefix, sizeof(prefix));
+		if (dbif_filter_add(&rc->filter, prefix.data,
+				    ntohs(prefix.len),
+				    ntohs(prefix.key_size)) < 0)
+			return -1;
+	}
+	rc->filtered = num;
+
+	seq = be64toh(hello.seq);
+
+	if (!hello.epoch) {
+		/* New client, start from the current changes. It may have
+		 * loaded the database before it subscribed, so it's told to
+		 * resynchronize now that it gets the changes.
+		 */
+		rc->seq = rs->next_seq;
+		rc->resync = true;
+	} else if (be64toh(hello.epoch) == rs->epoch &&
+		   seq >= relay_oldest(rs) && seq <= rs->next_seq) {
+		rc->seq = seq;
+	} else {
+		rc->seq = rs->next_seq;
+		rc->resync = true;
+	}
+
+	rc->started = true;
+
+	return 0;
+}
+
+static void relay_read_cb(struct bufferevent *bev, void *arg)
+{
+	struct evbuffer *input = bufferevent_get_input(bev);
+	struct relay_client *rc = arg;
+
+	/* Nothing is expected after the hello */
+	if (rc->started) {
+		evbuffer_drain(input, evbuffer_get_length(input));
+		return;
+	}
+
+	if (relay_client_hello(rc, input) < 0) {
+		QLOG(qlog, QLOG_WARN, "Bad feed hello");
+		relay_client_free(rc);
+		return;
+	}
+
+	relay_client_flush(rc);
+}
+
+/* Output drained below the low water mark, resume sending */
+static void relay_write_cb(struct bufferevent *bev, void *arg)
+{
+	relay_client_flush(arg);
+}
+
+static void relay_event_cb(struct bufferevent *bev, short events, void *arg)
+{
+	if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR))
+		relay_client_free(arg);
+}
+
+static void relay_accept_cb(struct evconnlistener *listener,
+			    evutil_socket_t fd, struct sockaddr *addr,
+			    int socklen, void *arg)
+{
+	struct relay_sys *rs = arg;
+	struct relay_client *rc;
+
+	rc = calloc(1, sizeof(*rc));
+	if (!rc) {
+		close(fd);
+		return;
+	}
+
+	rc->rs = rs;
+	rc->bev = bufferevent_socket_new(rs->event_base, fd,
+					 BEV_OPT_CLOSE_ON_FREE);
+	if (!rc->bev) {
+		close(fd);
+		free(rc);
+		return;
+	}
+
+	list_add(&rc->list, &rs->clients);
+
+	bufferevent_setwatermark(rc->bev, EV_WRITE, rs->client_buf / 2, 0);
+	bufferevent_setcb(rc->bev, relay_read_cb, relay_write_cb,
+			  relay_event_cb, rc);
+	bufferevent_enable(rc->bev, EV_READ | EV_WRITE);
+}
+
+static int start_listen(struct relay_sys *rs, char *listen_addr)
+{
+	struct sockaddr_storage ss;
+	int sslen;
+
+	if (dbif_feed_parse_addr(listen_addr, &ss, &sslen) < 0) {
+		fprintf(stderr, "Bad listen address %s\n", listen_addr);
+		return -1;
+	}
+
+	if (ss.ss_family == AF_UNIX)
+		unlink(listen_addr);
+
+	rs->listener = evconnlistener_new_bind(rs->event_base,
+					       relay_accept_cb, rs,
+					       LEV_OPT_CLOSE_ON_FREE |
+					       LEV_OPT_REUSEABLE, -1,
+					       (struct sockaddr *)&ss, sslen);
+	if (!rs->listener) {
+		fprintf(stderr, "Listen on %s: %s\n", listen_addr,
+			strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Stream for a component that logs to a FILE, or the log file itself if
+ * one can't be allocated
+ */
+static FILE *log_file(const char *src)
+{
+	FILE *f = qlog_file(qlog, QLOG_INFO, src);
+
+	return f ? : logfile;
+}
+
+static int start_db(struct relay_sys *rs, char *db_subopts)
+{
+	rs->db_ops = dbif_get_redis();
+	if (!rs->db_ops) {
+		fprintf(stderr, "Unable to get Redis dbif\n");
+		return -1;
+	}
+
+	if (rs->db_ops->init(&rs->db_ctx, log_file("db"),
+			     ILA_REDIS_DEFAULT_HOST, ILA_REDIS_DEFAULT_PORT) < 0)
+		return -1;
+
+	if (db_subopts && rs->db_ops->parse_args(rs->db_ctx, db_subopts) < 0)
+		return -1;
+
+	if (rs->db_ops->start(rs->db_ctx) < 0) {
+		fprintf(stderr, "Error initializing DB\n");
+		return -1;
+	}
+
+	if (rs->db_ops->watch_all(rs->db_ctx, NULL, relay_change_cb,
+				  relay_resync_cb, rs, &rs->watch_handle,
+				  rs->event_base) < 0) {
+		fprintf(stderr, "Unable to start watch all\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct relay_sys rs;
+	char *db_subopts = NULL;
+	char *upstream = NULL;
+	char *listen_addr = NULL;
+
+	memset(&rs, 0, sizeof(rs));
+	rs.ring_bits = RELAY_DEFAULT_RING_BITS;
+	rs.client_buf = RELAY_DEFAULT_CLIENT_BUF;
+	rs.next_seq = 1;
+	rs.epoch = relay_new_epoch();
+	INIT_LIST_HEAD(&rs.clients);
+
+	if (parse_args(argc, argv, &rs, &db_subopts, &upstream,
+		       &listen_addr) < 0)
+		exit(-1);
+
+	qlog = qlog_create(logfile, QLOG_DEFAULT_RING);
+	if (!qlog) {
+		fprintf(stderr, "Unable to allocate log\n");
+		exit(-1);
+	}
+
+	rs.ring = calloc(1ULL << rs.ring_bits, sizeof(*rs.ring));
+	if (!rs.ring) {
+		fprintf(stderr, "Unable to allocate ring\n");
+		exit(-1);
+	}
+
+	rs.event_base = event_base_new();
+	if (!rs.event_base) {
+		perror("event_base_new");
+		exit(-1);
+	}
+
+	rs.flush_event = event_new(rs.event_base, -1, 0, relay_flush_cb, &rs);
+	if (!rs.flush_event) {
+		perror("event_new");
+		exit(-1);
+	}
+
+	if (upstream) {
+		rs.upstream = dbif_feed_watch(rs.event_base, upstream, NULL,
+					      relay_feed_cb,
+					      relay_resync_cb, &rs,
+					      log_file("feed"));
+		if (!rs.upstream) {
+			fprintf(stderr, "Unable to watch upstream relay\n");
+			exit(-1);
+		}
+	} else if (start_db(&rs, db_subopts) < 0) {
+		exit(-1);
+	}
+
+	if (start_listen(&rs, listen_addr) < 0)
+		exit(-1);
+
+	if (do_daemonize)
+		daemonize(logfile);
+
+	/* The writer thread must be started after the fork */
+	if (qlog_start(qlog) < 0) {
+		perror("Start log writer");
+		exit(-1);
+	}
+
+	/* Event loop */
+	event_base_dispatch(rs.event_base);
+}
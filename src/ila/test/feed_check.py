@@ -0,0 +1,218 @@
+# mobility_bench.py - end to end convergence benchmark with synthetic mobility
+#
+# Copyright (c) 2018, Quantonium Inc. All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+#   * Redistributions of source code must retain the above copyright
+#     notice, this list of conditions and the following disclaimer.
+#   * Redistributions in binary form must reproduce the above copyright
+#     notice, this list of conditions and the following disclaimer in the
+#     documentation and/or other materials provided with the distribution.
+#   * Neither the name of the Quantonium nor the names of its contributors
+#     may be used to endorse or promote products derived from this software
+#     without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED. IN NO EVENT SHALL QUANTONIUM BE LIABLE FOR ANY DIRECT,
+# INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+# THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+
+
+# Check an ilarelayd change feed. Connect as a new client and expect a
+# resync, write test keys to the map database and expect them in order
+# with their values, then reconnect with the last epoch and seq and expect the keys written
+# while disconnected without a resync.
+
+import sys, getopt, redis, struct, socket, time
+
+FEED_VERSION = 2
+FEED_F_RESYNC = 0x1
+FEED_NO_VALUE = 0xffff
+FEED_DELETED = 0xfffe
+
+HELLO_FMT = "!HHIQQ"
+PREFIX_FMT = "!HH32s"
+BATCH_FMT = "!HHIIIQQ"
+EVENT_FMT = "!HH"
+
+TEST_PREFIX = b"FEEDCHK"
+TEST_VALUE = b"x"
+
+def usage_err(errstr):
+	if (errstr != ""):
+		print(errstr)
+		print("")
+
+	print("Usage: feed_check [ -h HOST ] [ -p PORT ] [ -n NUM ] [ -t SECS ]")
+	print("                  ADDR")
+	print("")
+	print("    ADDR          Feed socket of the relay, a path or HOST:PORT")
+	print("    -h HOST       Map database host (default ::1)")
+	print("    -p PORT       Map database port (default 6379)")
+	print("    -n NUM        Keys written in each step (default 100)")
+	print("    -t SECS       Time to wait for a batch (default 2)")
+
+	sys.exit(2)
+
+class FeedClient:
+	def __init__(self, addr, timeout):
+		if addr.startswith("/") or addr.startswith("."):
+			self.s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+			self.s.connect(addr)
+		else:
+			host, port = addr.rsplit(":", 1)
+			self.s = socket.create_connection((host.strip("[]"),
+							   int(port)))
+		self.s.settimeout(timeout)
+
+	def hello(self, epoch, seq):
+		# Only the test keys are of interest
+		data = struct.pack(HELLO_FMT, FEED_VERSION, 1, 0, epoch, seq)
+		data += struct.pack(PREFIX_FMT, len(TEST_PREFIX), 0,
+				    TEST_PREFIX)
+		self.s.sendall(data)
+
+	def recv_all(self, size):
+		data = b""
+		while len(data) < size:
+			chunk = self.s.recv(size - len(data))
+			if not chunk:
+				raise Exception("Feed closed")
+			data += chunk
+		return data
+
+	# Returns flags, epoch, seq and the list of keys and values of the
+	# next batch. The value is None if it isn't carried and b"" for a
+	# deleted key
+	def batch(self):
+		hdr = self.recv_all(struct.calcsize(BATCH_FMT))
+		version, flags, count, length, rsvd, epoch, seq = \
+			struct.unpack(BATCH_FMT, hdr)
+		if version != FEED_VERSION:
+			raise Exception("Bad feed version %d" % version)
+
+		data = self.recv_all(length)
+		keys = []
+		off = 0
+		for i in range(count):
+			size, value_size = struct.unpack(EVENT_FMT,
+							 data[off:off + 4])
+			off += 4
+			key = data[off:off + size]
+			off += size
+			if value_size == FEED_NO_VALUE:
+				value = None
+			elif value_size == FEED_DELETED:
+				value = b""
+			else:
+				value = data[off:off + value_size]
+				off += value_size
+			keys.append((key, value))
+
+		return flags, epoch, seq, keys
+
+	# Read batches until the expected keys are seen
+	def expect(self, keys):
+		got = []
+		resync = False
+		epoch = seq = 0
+		while len(got) < len(keys):
+			flags, epoch, seq, batch_keys = self.batch()
+			resync |= bool(flags & FEED_F_RESYNC)
+			got += batch_keys
+
+		if [ k for k, v in got ] != keys:
+			raise Exception("Keys out of order or missing")
+		if any(v != TEST_VALUE for k, v in got):
+			raise Exception("Values missing")
+
+		return resync, epoch, seq
+
+	def close(self):
+		self.s.close()
+
+def test_keys(step, num):
+	return [ TEST_PREFIX + struct.pack("!BI", step, i)
+		 for i in range(num) ]
+
+def write_keys(db, keys):
+	for key in keys:
+		db.set(key, TEST_VALUE)
+
+def check(cond, errstr):
+	if not cond:
+		print("FAIL: %s" % errstr)
+		sys.exit(1)
+	print("ok: %s" % errstr)
+
+def main():
+	host = "::1"
+	port = 6379
+	num = 100
+	timeout = 2.0
+
+	try:
+		opts, args = getopt.getopt(sys.argv[1:], "h:p:n:t:")
+	except getopt.GetoptError as err:
+		usage_err(str(err))
+
+	for o, a in opts:
+		if o == "-h":
+			host = a
+		elif o == "-p":
+			port = int(a)
+		elif o == "-n":
+			num = int(a)
+		elif o == "-t":
+			timeout = float(a)
+
+	if len(args) != 1:
+		usage_err("Feed address is required")
+
+	db = redis.StrictRedis(host=host, port=port)
+
+	fc = FeedClient(args[0], timeout)
+	fc.hello(0, 0)
+
+	flags, epoch, seq, keys = fc.batch()
+	check(flags & FEED_F_RESYNC and not keys,
+	      "new client is told to resync")
+
+	keys = test_keys(1, num)
+	write_keys(db, keys)
+	resync, epoch, seq = fc.expect(keys)
+	check(not resync, "changes are received in order with values")
+	fc.close()
+
+	keys = test_keys(2, num)
+	write_keys(db, keys)
+
+	# Let the relay see the changes before resuming
+	time.sleep(0.5)
+
+	fc = FeedClient(args[0], timeout)
+	fc.hello(epoch, seq)
+	resync, epoch, seq = fc.expect(keys)
+	check(not resync, "client resumes from its epoch and seq")
+	fc.close()
+
+	fc = FeedClient(args[0], timeout)
+	fc.hello(epoch + 1, seq)
+	flags, epoch, seq, keys = fc.batch()
+	check(flags & FEED_F_RESYNC, "unknown epoch is told to resync")
+	fc.close()
+
+	for key in test_keys(1, num) + test_keys(2, num):
+		db.delete(key)
+
+if __name__ == "__main__":
+	main()
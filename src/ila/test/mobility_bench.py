@@ -0,0 +1,681 @@
+# mobility_bench.py - end to end convergence benchmark with synthetic mobility
+#
+# Copyright (c) 2018, Quantonium Inc. All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+#   * Redistributions of source code must retain the above copyright
+#     notice, this list of conditions and the following disclaimer.
+#   * Redistributions in binary form must reproduce the above copyright
+#     notice, this list of conditions and the following disclaimer in the
+#     documentation and/or other materials provided with the distribution.
+#   * Neither the name of the Quantonium nor the names of its contributors
+#     may be used to endorse or promote products derived from this software
+#     without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED. IN NO EVENT SHALL QUANTONIUM BE LIABLE FOR ANY DIRECT,
+# INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+# (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+# LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+# ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+# THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+#
+
+# Generate attach, handover and unattach events for a population of UEs
+# against the identifier database and measure, per event, the time until
+# the mapping database and the kernel routes of each ilad reflect the
+# change. Events are written either directly to the identifier database
+# or in batches on the ilactld ingestion socket.
+
+import sys, getopt, redis, struct, socket, subprocess, threading, time
+import random, json, qutils, ila
+import test_conf as tc
+import mobile_emul as em
+
+def usage_err(errstr):
+	if (errstr != ""):
+		print(errstr)
+		print("")
+
+	print("Usage: mobility_bench [ -h HOST ] [ -b BITS ] [ -l LEN ] [ -g BITS ]")
+	print("            [ -S ADDR ] [ -u NUM ] [ -f NUM ] [ -m NUM ]")
+	print("            [ -p PATTERN ] [ -t SECS ] [ -w SECS ] [ -a RATE ]")
+	print("            [ -o RATE ] [ -d RATE ] [ -n NS[:NUM] ] ... [ -s ] [ -c ]")
+	print("            [ -r SEED ] [ -j ]")
+	print("")
+	print("    -h HOST       Database host (default ::1)")
+	print("    -b BITS       Bucketed layout with 2^BITS buckets")
+	print("    -l LEN        Change log of about LEN entries")
+	print("    -g BITS       Digest with 2^BITS leaves")
+	print("    -S ADDR       Send events to the ilactld ingestion socket")
+	print("                  (path or HOST:PORT) instead of the database")
+	print("    -u NUM        Number of UEs (default 100)")
+	print("    -f NUM        First identifier number (default 1)")
+	print("    -m NUM        Number of locators, 1..NUM (default 10)")
+	print("    -p PATTERN    uniform, hotspot or outage (default uniform)")
+	print("    -t SECS       Duration of the run (default 10)")
+	print("    -w SECS       Time to wait for convergence (default 5)")
+	print("    -a RATE       Attach events per second (default 0)")
+	print("    -o RATE       Handover events per second (default 100)")
+	print("    -d RATE       Unattach events per second (default 0)")
+	print("    -n NS[:NUM]   Watch ILA routes in namespace NS, NUM is its")
+	print("                  local locator number if any")
+	print("    -s            Make the identifiers and attach them first")
+	print("    -c            Unattach and destroy the identifiers after")
+	print("    -r SEED       Random seed")
+	print("    -j            JSON output")
+	print("")
+	print("    --hot-fraction=FRAC  Fraction of moves to hotspots (0.8)")
+	print("    --hot-locs=NUM       Number of hotspot locators (M / 10)")
+	print("    --outage-at=SECS     Time of the cell outage (duration / 2)")
+	print("    --outage-loc=NUM     Locator that fails (1)")
+
+	sys.exit(2)
+
+class Ue:
+	def __init__(self, num, addr, map_key, loc_num):
+		self.num = num
+		self.addr = addr
+		self.map_key = map_key
+		self.loc_num = loc_num
+		self.event = None
+
+class Event:
+	def __init__(self, kind, ue, loc_num, loc):
+		self.kind = kind
+		self.ue = ue
+		self.loc_num = loc_num
+		self.loc = loc
+		self.t0 = None
+		self.times = {}
+		self.pending = False
+		self.superseded = False
+
+# Set of UEs with constant time random choice
+class UeSet:
+	def __init__(self):
+		self.ues = []
+		self.index = {}
+
+	def __len__(self):
+		return len(self.ues)
+
+	def __contains__(self, ue):
+		return ue in self.index
+
+	def add(self, ue):
+		self.index[ue] = len(self.ues)
+		self.ues.append(ue)
+
+	def remove(self, ue):
+		i = self.index.pop(ue)
+		last = self.ues.pop()
+		if last is not ue:
+			self.ues[i] = last
+			self.index[last] = i
+
+	def choice(self):
+		return random.choice(self.ues)
+
+# Tracks outstanding events and the state observed by the watchers. An
+# event converges in a stage when the stage reports the expected locator
+# for its address, or no locator for an unattach (or when the ilad is
+# local to the new locator). An event that is replaced by a later event
+# for the same UE before converging everywhere is superseded
+class Tracker:
+	def __init__(self, stages, local_locs):
+		self.lock = threading.Lock()
+		self.stages = stages
+		self.local_locs = local_locs
+		self.events = []
+		self.outstanding = 0
+
+	def expect(self, ev, stage):
+		if ev.loc is not None and self.local_locs.get(stage) == ev.loc:
+			return None
+		return ev.loc
+
+	def issue(self, ev):
+		with self.lock:
+			old = ev.ue.event
+			if old is not None and old.pending:
+				old.pending = False
+				old.superseded = True
+				self.outstanding -= 1
+			ev.ue.event = ev
+			ev.pending = True
+			self.events.append(ev)
+			self.outstanding += 1
+			ev.t0 = time.perf_counter()
+
+	def observe(self, stage, ue, loc):
+		now = time.perf_counter()
+
+		with self.lock:
+			ev = ue.event
+			if (ev is None or ev.t0 is None or stage in ev.times or
+			    self.expect(ev, stage) != loc):
+				return
+			ev.times[stage] = now - ev.t0
+			if len(ev.times) == len(self.stages) and ev.pending:
+				ev.pending = False
+				self.outstanding -= 1
+
+	def wait(self, timeout):
+		end = time.perf_counter() + timeout
+		while self.outstanding and time.perf_counter() < end:
+			time.sleep(0.01)
+
+	# Forget the events so far
+	def reset(self):
+		with self.lock:
+			for ev in self.events:
+				ev.pending = False
+			self.events = []
+			self.outstanding = 0
+
+# Watch the mapping database for changes to the UEs' records
+def map_watcher(tracker, map_db, by_key, ready):
+	p = map_db.r.pubsub(ignore_subscribe_messages = True)
+	if map_db.bucket_bits:
+		p.subscribe(ila.ILA_CHANGE_CHANNEL)
+		prefix = None
+	else:
+		prefix = b"__keyspace@0__:"
+		p.psubscribe(prefix + b"*")
+	ready.set()
+
+	for msg in p.listen():
+		key = msg["data"] if prefix is None else msg["channel"][len(prefix):]
+		ue = by_key.get(key)
+		if ue is None:
+			continue
+
+		data = map_db.get(key)
+		if data is None:
+			loc = None
+		else:
+			loc = ila.ila_rec_unpack(ila.ILA_REC_TYPE_MAP,
+			    ila.ILA_MAP_VALUE_FMT, data)[2][0]
+		tracker.observe("map", ue, loc)
+
+# Watch the ILA routes in a namespace. Lines look like
+# "[Deleted] 3333::5 encap ila 2017:0:0:3 csum-mode ... proto ila ..."
+def route_watcher(tracker, ns, proc, by_addr):
+	for line in proc.stdout:
+		fields = line.decode("utf-8").split()
+		if len(fields) < 1:
+			continue
+
+		deleted = fields[0] == "Deleted"
+		if deleted:
+			fields = fields[1:]
+
+		try:
+			i = fields.index("encap")
+			if fields[i + 1] != "ila":
+				continue
+			addr = socket.inet_pton(socket.AF_INET6,
+			    fields[0].split("/")[0])
+			loc = struct.unpack("Q", qutils.addr64_a2n(fields[i + 2]))[0]
+		except (ValueError, IndexError, OSError, qutils.QutilsError):
+			continue
+
+		ue = by_addr.get(addr)
+		if ue is not None:
+			tracker.observe(ns, ue, None if deleted else loc)
+
+def start_route_watcher(tracker, ns, by_addr):
+	proc = subprocess.Popen([tc.IPCMD, "netns", "exec", ns, tc.IPCMD,
+	    "-6", "monitor", "route"], stdout = subprocess.PIPE)
+	threading.Thread(target = route_watcher, daemon = True,
+	    args = (tracker, ns, proc, by_addr)).start()
+	return proc
+
+# Apply events to the identifier database one at a time
+class DbSender:
+	def __init__(self, ident_db):
+		self.ident_db = ident_db
+
+	def send(self, tracker, events):
+		applied = 0
+		for ev in events:
+			tracker.issue(ev)
+			try:
+				ila.ila_ident_set_loc(self.ident_db, ev.ue.num,
+				    None, ev.loc_num)
+				applied += 1
+			except ila.IlaParseError:
+				pass
+		return applied
+
+# Send events in batches on the ilactld ingestion socket
+class IngestSender:
+	HDR_FMT = "!HHI"
+	EVENT_FMT = "!QQ"
+
+	def __init__(self, addr):
+		if addr[0] == "/":
+			self.s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+			self.s.connect(addr)
+		else:
+			host, port = addr.rsplit(":", 1)
+			self.s = socket.create_connection((host.strip("[]"),
+			    int(port)))
+
+	def send(self, tracker, events):
+		applied = 0
+		hdr_len = struct.calcsize(self.HDR_FMT)
+
+		for i in range(0, len(events), ila_ingest_max_events):
+			batch = events[i:i + ila_ingest_max_events]
+			data = [ struct.pack(self.HDR_FMT, ila_ingest_version, 0,
+			    len(batch)) ]
+			for ev in batch:
+				data.append(struct.pack(self.EVENT_FMT, ev.ue.num,
+				    ev.loc_num))
+				tracker.issue(ev)
+			self.s.sendall(b"".join(data))
+
+			reply = b""
+			while len(reply) < hdr_len:
+				chunk = self.s.recv(hdr_len - len(reply))
+				if not chunk:
+					raise ila.IlaConnectionError("Ingest socket closed")
+				reply += chunk
+			applied += struct.unpack(self.HDR_FMT, reply)[2]
+
+		return applied
+
+# Must match ILA_INGEST_VERSION and ILA_INGEST_MAX_EVENTS in ila.h
+ila_ingest_version = 1
+ila_ingest_max_events = 4096
+
+class Generator:
+	def __init__(self, ues, locs, pattern, hot_fraction, hot_locs,
+	    outage_loc):
+		self.locs = locs
+		self.live = sorted(locs.keys())
+		self.pattern = pattern
+		self.hot_fraction = hot_fraction
+		self.hot = self.live[:hot_locs]
+		self.outage_loc = outage_loc
+		self.attached = UeSet()
+		self.unattached = UeSet()
+		self.by_loc = {}
+
+		for ue in ues:
+			self.place(ue, ue.loc_num)
+
+	def place(self, ue, loc_num):
+		if ue in self.attached:
+			self.attached.remove(ue)
+			self.by_loc[ue.loc_num].discard(ue)
+		elif ue in self.unattached:
+			self.unattached.remove(ue)
+
+		if loc_num:
+			self.attached.add(ue)
+			self.by_loc.setdefault(loc_num, set()).add(ue)
+		else:
+			self.unattached.add(ue)
+		ue.loc_num = loc_num
+
+	def pick_loc(self, exclude):
+		for i in range(0, 16):
+			if (self.pattern == "hotspot" and
+			    random.random() < self.hot_fraction):
+				loc_num = random.choice(self.hot)
+			else:
+				loc_num = random.choice(self.live)
+			if loc_num != exclude:
+				return loc_num
+		return None
+
+	def event(self, kind, ue, loc_num):
+		self.place(ue, loc_num)
+		return Event(kind, ue, loc_num,
+		    self.locs[loc_num] if loc_num else None)
+
+	def next(self, kind):
+		if kind == "attach":
+			if not len(self.unattached):
+				return None
+			ue = self.unattached.choice()
+		else:
+			if not len(self.attached):
+				return None
+			ue = self.attached.choice()
+
+		if kind == "unattach":
+			return self.event(kind, ue, 0)
+
+		loc_num = self.pick_loc(ue.loc_num)
+		if loc_num is None:
+			return None
+		return self.event(kind, ue, loc_num)
+
+	# Fail a cell, all of its UEs are moved at once and the locator is
+	# not used afterwards
+	def outage(self):
+		if self.outage_loc in self.live and len(self.live) > 1:
+			self.live.remove(self.outage_loc)
+			if self.outage_loc in self.hot:
+				self.hot.remove(self.outage_loc)
+			if not self.hot:
+				self.hot = self.live[:1]
+
+		events = []
+		for ue in list(self.by_loc.get(self.outage_loc, ())):
+			loc_num = self.pick_loc(self.outage_loc)
+			if loc_num is not None:
+				events.append(self.event("outage", ue, loc_num))
+		return events
+
+# Drive the events at the given rates for the duration
+def run(tracker, sender, gen, rates, duration, outage_at):
+	total = sum(rates.values())
+	kinds = [ k for k in rates if rates[k] > 0 ]
+	weights = [ rates[k] for k in kinds ]
+	sent = applied = 0
+
+	start = time.perf_counter()
+	due = start + (random.expovariate(total) if total else duration)
+	end = start + duration
+
+	while True:
+		now = time.perf_counter()
+		if outage_at is not None and now >= start + outage_at:
+			outage_at = None
+			events = gen.outage()
+			sent += len(events)
+			applied += sender.send(tracker, events)
+			continue
+
+		wake = due if due < end else None
+		if outage_at is not None:
+			t = start + outage_at
+			wake = t if wake is None else min(wake, t)
+		if wake is None:
+			break
+		if wake > now:
+			time.sleep(wake - now)
+			continue
+
+		# Send everything that is due in one batch
+		events = []
+		while due <= now and due < end:
+			ev = gen.next(random.choices(kinds, weights)[0])
+			if ev is not None:
+				events.append(ev)
+			due += random.expovariate(total)
+
+		if events:
+			sent += len(events)
+			applied += sender.send(tracker, events)
+
+	return sent, applied, time.perf_counter() - start
+
+def quantile(values, q):
+	if not values:
+		return None
+	return values[min(len(values) - 1, int(q * len(values)))]
+
+def stage_stats(events, stage):
+	times = sorted(ev.times[stage] * 1000 for ev in events
+	    if stage in ev.times)
+	return {
+		"converged": len(times),
+		"timeout": sum(1 for ev in events
+		    if not ev.superseded and stage not in ev.times),
+		"p50": quantile(times, 0.5),
+		"p99": quantile(times, 0.99),
+		"p999": quantile(times, 0.999),
+		"max": times[-1] if times else None,
+	}
+
+def report(tracker, sent, applied, elapsed, as_json):
+	events = tracker.events
+
+	# The end to end time of an event is when it converged in the
+	# mapping database and on every watched ilad
+	for ev in events:
+		if len(ev.times) == len(tracker.stages):
+			ev.times["all"] = max(ev.times.values())
+
+	stages = {}
+	for stage in tracker.stages + [ "all" ]:
+		stages[stage] = stage_stats(events, stage)
+	for kind in ("attach", "handover", "unattach", "outage"):
+		subset = [ ev for ev in events if ev.kind == kind ]
+		if subset:
+			stages["all:" + kind] = stage_stats(subset, "all")
+
+	res = {
+		"sent": sent,
+		"applied": applied,
+		"superseded": sum(1 for ev in events if ev.superseded),
+		"seconds": elapsed,
+		"events_per_sec": sent / elapsed if elapsed else 0,
+		"converged_per_sec": stages["all"]["converged"] / elapsed
+		    if elapsed else 0,
+		"stages": stages,
+	}
+
+	if as_json:
+		print(json.dumps(res, indent = 2))
+		return
+
+	print("Sent %d events (%d applied, %d superseded) in %.2fs, "
+	    "%.0f events/s, %.0f converged/s" % (sent, applied,
+	    res["superseded"], elapsed, res["events_per_sec"],
+	    res["converged_per_sec"]))
+	print("")
+	print("%-16s %9s %7s %9s %9s %9s %9s" % ("stage", "converged",
+	    "timeout", "p50 ms", "p99 ms", "p999 ms", "max ms"))
+
+	fmt = lambda v: "-" if v is None else "%.3f" % v
+	for stage, s in stages.items():
+		print("%-16s %9d %7d %9s %9s %9s %9s" % (stage, s["converged"],
+		    s["timeout"], fmt(s["p50"]), fmt(s["p99"]), fmt(s["p999"]),
+		    fmt(s["max"])))
+
+# Load the UEs, making them first if asked
+def load_ues(ident_db, map_db, first, count, setup):
+	ues = []
+
+	for num in range(first, first + count):
+		key = struct.pack("Q", num)
+
+		if setup:
+			addr = socket.inet_pton(socket.AF_INET6, "%s::%s" %
+			    (tc.SIR_PREFIX, em.make_addr_suffix(num)))
+			a1, a2 = struct.unpack("QQ", addr)
+			ident_db.set(key, ila.ila_ident_pack(
+			    ila.IdentRec(0, None, a1, a2, 0), 0, 0),
+			    ila.ILA_REC_GEN_OFFSET)
+
+		data = ident_db.get(key)
+		if data is None:
+			raise ila.IlaParseError("Identifier %d not found" % num)
+
+		ident = ila.ila_ident_unpack(data)
+		if ident.sir_id is None:
+			addr = struct.pack("QQ", ident.addr1, ident.addr2)
+			map_key = addr
+		else:
+			prefix = ila.ila_sir_get(map_db, ident.sir_id)
+			if prefix is None:
+				raise ila.IlaParseError("Unknown SIR prefix %d" %
+				    ident.sir_id)
+			addr = struct.pack("QQ", prefix, ident.addr2)
+			map_key = ila.ila_map_key_sir(ident.sir_id, ident.addr2)
+
+		ues.append(Ue(num, addr, map_key, ident.loc_num))
+
+	return ues
+
+def load_locs(loc_db, count):
+	locs = {}
+
+	for num in range(1, count + 1):
+		data = loc_db.get(struct.pack("Q", num))
+		if data is None:
+			raise ila.IlaParseError("Locator %d not found" % num)
+		locs[num] = ila.ila_rec_unpack(ila.ILA_REC_TYPE_LOC,
+		    ila.ILA_LOC_VALUE_FMT, data)[2][0]
+
+	return locs
+
+try:
+	opts, args = getopt.getopt(sys.argv[1:], "h:b:l:g:S:u:f:m:p:t:w:a:o:d:n:scr:j",
+	    [ "hot-fraction=", "hot-locs=", "outage-at=", "outage-loc=" ])
+except getopt.GetoptError as e:
+	usage_err(str(e))
+
+host = "::1"
+ingest = None
+ue_count = 100
+first = 1
+loc_count = 10
+pattern = "uniform"
+duration = 10.0
+settle = 5.0
+rates = { "attach": 0.0, "handover": 100.0, "unattach": 0.0 }
+nodes = []
+local_locs = {}
+setup = cleanup = as_json = False
+hot_fraction = 0.8
+hot_locs = None
+outage_at = None
+outage_loc = 1
+
+try:
+	for o, a in opts:
+		if o == "-h":
+			host = a
+		elif o == "-b":
+			ila.ila_set_bucketed(int(a))
+		elif o == "-l":
+			ila.ila_set_changelog(int(a))
+		elif o == "-g":
+			ila.ila_set_digest(int(a))
+		elif o == "-S":
+			ingest = a
+		elif o == "-u":
+			ue_count = int(a)
+		elif o == "-f":
+			first = int(a)
+		elif o == "-m":
+			loc_count = int(a)
+		elif o == "-p":
+			if a not in ("uniform", "hotspot", "outage"):
+				usage_err("Unknown pattern %s" % a)
+			pattern = a
+		elif o == "-t":
+			duration = float(a)
+		elif o == "-w":
+			settle = float(a)
+		elif o == "-a":
+			rates["attach"] = float(a)
+		elif o == "-o":
+			rates["handover"] = float(a)
+		elif o == "-d":
+			rates["unattach"] = float(a)
+		elif o == "-n":
+			ns, _, num = a.partition(":")
+			nodes.append(ns)
+			if num:
+				local_locs[ns] = int(num)
+		elif o == "-s":
+			setup = True
+		elif o == "-c":
+			cleanup = True
+		elif o == "-r":
+			random.seed(int(a))
+		elif o == "-j":
+			as_json = True
+		elif o == "--hot-fraction":
+			hot_fraction = float(a)
+		elif o == "--hot-locs":
+			hot_locs = int(a)
+		elif o == "--outage-at":
+			outage_at = float(a)
+		elif o == "--outage-loc":
+			outage_loc = int(a)
+except ValueError as e:
+	usage_err("Value error in argument: %s" % str(e))
+
+if ue_count < 1 or loc_count < 1:
+	usage_err("Need at least one UE and one locator")
+
+if hot_locs is None:
+	hot_locs = max(1, loc_count // 10)
+if pattern == "outage":
+	if outage_at is None:
+		outage_at = duration / 2
+else:
+	outage_at = None
+
+try:
+	map_db = ila.IlaMapDb(host, ila.ILA_DEFAULT_MAP_PORT)
+	ident_db = ila.IlaMapDb(host, ila.ILA_DEFAULT_IDENT_PORT)
+	loc_db = ila.IlaMapDb(host, ila.ILA_DEFAULT_LOC_PORT)
+
+	locs = load_locs(loc_db, loc_count)
+	ues = load_ues(ident_db, map_db, first, ue_count, setup)
+
+	tracker = Tracker([ "map" ] + nodes, { ns: locs.get(num)
+	    for ns, num in local_locs.items() })
+	by_key = { ue.map_key: ue for ue in ues }
+	by_addr = { ue.addr: ue for ue in ues }
+
+	ready = threading.Event()
+	threading.Thread(target = map_watcher, daemon = True,
+	    args = (tracker, ila.IlaMapDb(host, ila.ILA_DEFAULT_MAP_PORT),
+	    by_key, ready)).start()
+	procs = [ start_route_watcher(tracker, ns, by_addr) for ns in nodes ]
+	ready.wait()
+	time.sleep(0.5)
+
+	sender = IngestSender(ingest) if ingest else DbSender(ident_db)
+
+	gen = Generator(ues, locs, pattern, hot_fraction, hot_locs,
+	    outage_loc)
+
+	# Attach the UEs round robin and let the system settle before the
+	# measured run
+	if setup:
+		sender.send(tracker, [ gen.event("setup", ue,
+		    ue.num % loc_count + 1) for ue in ues if not ue.loc_num ])
+		tracker.wait(settle)
+		tracker.reset()
+
+	sent, applied, elapsed = run(tracker, sender, gen, rates, duration,
+	    outage_at)
+	tracker.wait(settle)
+
+	report(tracker, sent, applied, elapsed, as_json)
+
+	if cleanup:
+		for ue in ues:
+			ila.ila_ident_set_loc(ident_db, ue.num, None, 0)
+		time.sleep(settle)
+		for ue in ues:
+			ident_db.delete(struct.pack("Q", ue.num))
+
+	for proc in procs:
+		proc.terminate()
+
+except ila.IlaParseError as e:
+	print(str(e))
+	sys.exit(2)
+except (ila.IlaConnectionError, redis.exceptions.ConnectionError,
+    OSError) as e:
+	print("Connection error: %s" % str(e))
+	sys.exit(1)
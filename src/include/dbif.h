@@ -32,6 +32,11 @@
 
 #include <event2/event.h>
 #include <linux/types.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "json_writer.h"
 
 /* dbif_ops define the operations of dbif interface.
  *
@@ -57,25 +62,173 @@
  *
  *   delete	Delete an object. Argument is a key.
  *
+ *   patch	Atomically modify 64-bit fields of an object in place.
+ *		Arguments are a key and a list of patch operations.
+ *		If value is non-NULL the resulting object is returned.
+ *		Returns 0 on success, -2 if the object does not exist,
+ *		-3 if a compare failed, and -1 on error. Nothing is
+ *		written unless all the operations succeed.
+ *
+ *   submit	Perform a batch of write, create, delete, and patch
+ *		requests. Requests are pipelined to the database and
+ *		the result of each is set in the request. Requests are
+ *		performed in order but the batch is not atomic.
+ *
  *   scan	Scan the entries in the database. For each entry
  *		a callback function is called that has the key
- *		as the object argument.
+ *		as the object argument. If filter is non-NULL only
+ *		entries with keys matching the filter are reported.
  *
  *   watch_all	Watch for changes to an object in a database.
  *		Argument is a callback function that takes a key
  *		as an argument and is called when a change is
- *		detected.
+ *		detected. If filter is non-NULL only changes to
+ *		keys matching the filter are reported. The watch
+ *		survives a lost connection, if changes may have
+ *		been missed while it was down resync_cb is called
+ *		and the caller should rescan the database.
  *
  *   watch_one	Watch for changes to key in the database.
  *		Argument is a callback function that takes a key
  *		as an arugment and is called when a change is
- *		detected.
+ *		detected. The key is also reported after the watch
+ *		recovers from a lost connection.
  *
  *   stop_watch
  *		Stop watching a database. Argument is the watch
- *		handle returned by watch_all or watch_one.
+ *		handle returned by watch_all or watch_one. The handle
+ *		is freed and the callbacks are not called again.
+ *
+ *   digest	Get the digest of the database for anti-entropy. This
+ *		is the leaf sums of a hash tree of 2^bits leaves over
+ *		all entries (see qmerkle.h), maintained by the
+ *		database as entries are updated. Fails if the
+ *		database doesn't keep a digest with that many leaves.
+ *		Optional.
+ *
+ *   stats	Write statistics of the backend, e.g. counts and
+ *		latencies of the commands it sent, as fields of the
+ *		open JSON object. Optional.
  */
 
+/* Patch operations. Offset is the byte offset of a 64-bit field in the
+ * object and arg is in host byte order.
+ *
+ *   DBIF_PATCH_SIZE	Following operations, up to the next SIZE, apply
+ *			only if the object size equals arg. If no SIZE
+ *			group matches the patch fails with an error
+ *   DBIF_PATCH_CMP	Fail unless the field equals arg
+ *   DBIF_PATCH_SET	Set field to arg
+ *   DBIF_PATCH_INC	Increment field by one
+ *   DBIF_PATCH_GEN	Set field to the next generation number of the
+ *			key. The database keeps a counter per key that
+ *			survives deletes, the next number is one more
+ *			than the larger of the counter and the field
+ */
+enum dbif_patch_op {
+	DBIF_PATCH_SIZE = 0,
+	DBIF_PATCH_CMP,
+	DBIF_PATCH_SET,
+	DBIF_PATCH_INC,
+	DBIF_PATCH_GEN,
+};
+
+struct dbif_patch {
+	enum dbif_patch_op op;
+	size_t offset;
+	__u64 arg;
+};
+
+/* Requests for the submit operation. A create fails if the key exists.
+ * For a patch, value is an optional buffer for the resulting object and
+ * value_size is its size, on return it is set to the object size. A
+ * write or create may have DBIF_PATCH_GEN patches, and no others, which
+ * are applied to the value as it is stored. On success value is then
+ * set to the stored object.
+ *
+ * Result is 0 on success, -2 if the key does not exist for a delete or
+ * patch, -3 if a patch compare failed, -4 if the key exists for a
+ * create, and -1 on other errors.
+ */
+enum dbif_req_op {
+	DBIF_REQ_WRITE = 0,
+	DBIF_REQ_CREATE,
+	DBIF_REQ_DELETE,
+	DBIF_REQ_PATCH,
+};
+
+struct dbif_req {
+	enum dbif_req_op op;
+	void *key;
+	size_t key_size;
+	void *value;
+	size_t value_size;
+	const struct dbif_patch *patches;
+	int num_patches;
+	int result;
+};
+
+/* Filter for scan and watch_all. A key matches if it starts with one of
+ * the prefixes and, if key_size in the prefix is non-zero, it is that
+ * size. The backend pushes the filter down to the database as far as it
+ * can and checks the keys it reports with dbif_filter_match. A scan may
+ * report a key more than once if it matches more than one prefix.
+ *
+ * DBIF_FILTER_MAX is also the limit of prefixes in a feed hello (see
+ * dbif_feed.h).
+ */
+#define DBIF_FILTER_MAX		64
+#define DBIF_FILTER_PREFIX_MAX	32
+
+struct dbif_filter_prefix {
+	__u8 data[DBIF_FILTER_PREFIX_MAX];
+	size_t len;
+	size_t key_size;
+};
+
+struct dbif_filter {
+	int num_prefixes;
+	struct dbif_filter_prefix prefixes[DBIF_FILTER_MAX];
+};
+
+static inline int dbif_filter_add(struct dbif_filter *filter,
+				  const void *data, size_t len,
+				  size_t key_size)
+{
+	struct dbif_filter_prefix *prefix;
+
+	if (filter->num_prefixes >= DBIF_FILTER_MAX ||
+	    len > DBIF_FILTER_PREFIX_MAX || (key_size && len > key_size))
+		return -1;
+
+	prefix = &filter->prefixes[filter->num_prefixes++];
+	memcpy(prefix->data, data, len);
+	prefix->len = len;
+	prefix->key_size = key_size;
+
+	return 0;
+}
+
+static inline bool dbif_filter_match(const struct dbif_filter *filter,
+				     const void *key, size_t key_size)
+{
+	const struct dbif_filter_prefix *prefix;
+	int i;
+
+	if (!filter)
+		return true;
+
+	for (i = 0; i < filter->num_prefixes; i++) {
+		prefix = &filter->prefixes[i];
+		if ((!prefix->key_size || prefix->key_size == key_size) &&
+		    key_size >= prefix->len &&
+		    !memcmp(key, prefix->data, prefix->len))
+			return true;
+	}
+
+	return false;
+}
+
 struct dbif_ops {
 	int (*init)(void **ctxp, FILE *logf, char *def_host, __u16 def_port);
 	int (*parse_args)(void *ctx, char *subopts);
@@ -86,11 +239,16 @@ struct dbif_ops {
 	int (*read)(void *ctx, void *key, size_t key_size,
 		    void *value, size_t *value_size);
 	int (*delete)(void *ctx, void *key, size_t key_size);
-	int (*scan)(void *ctx,
+	int (*patch)(void *ctx, void *key, size_t key_size,
+		     const struct dbif_patch *patches, int num_patches,
+		     void *value, size_t *value_size);
+	int (*submit)(void *ctx, struct dbif_req *reqs, int num_reqs);
+	int (*scan)(void *ctx, const struct dbif_filter *filter,
 		    void (*cb)(void *key, size_t key_size, void *data),
 		    void *data);
-	int (*watch_all)(void *ctx,
+	int (*watch_all)(void *ctx, const struct dbif_filter *filter,
 			 void (*cb)(void *key, size_t key_size, void *data),
+			 void (*resync_cb)(void *data),
 			 void *data, void **handlep,
 			 struct event_base *event_base);
 	int (*watch_one)(void *ctx, void *key, size_t key_size,
@@ -98,10 +256,42 @@ struct dbif_ops {
 			 void *data, void **handlep,
 			 struct event_base *event_base);
 	void (*stop_watch)(void *ctx, void *handle);
+	int (*digest)(void *ctx, unsigned int bits, __u64 *leaves);
+	int (*stats)(void *ctx, json_writer_t *jw);
 };
 
 struct dbif {
 	const struct dbif_ops db_ops;
 };
 
+/* Write value with the next generation number of the key set in the
+ * 64-bit field at offset. The stored value is returned in value.
+ */
+static inline int dbif_write_gen(const struct dbif_ops *ops, void *ctx,
+				 void *key, size_t key_size, void *value,
+				 size_t value_size, size_t offset)
+{
+	struct dbif_patch patch = {
+		.op = DBIF_PATCH_GEN,
+		.offset = offset,
+	};
+	struct dbif_req req = {
+		.op = DBIF_REQ_WRITE,
+		.key = key,
+		.key_size = key_size,
+		.value = value,
+		.value_size = value_size,
+		.patches = &patch,
+		.num_patches = 1,
+	};
+
+	if (!ops->submit)
+		return -1;
+
+	if (ops->submit(ctx, &req, 1) < 0)
+		return -1;
+
+	return req.result;
+}
+
 #endif
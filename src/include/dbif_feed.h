@@ -0,0 +1,147 @@
+/*
+ * dbif_feed.h - Change feed relay protocol and client
+ *
+ * Copyright (c) 2018, Quantonium Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the Quantonium nor the names of its contributors
+ *     may be used to endorse or promote products derived from this software
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL QUANTONIUM BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __DBIF_FEED_H__
+#define __DBIF_FEED_H__
+
+#include <event2/event.h>
+#include <linux/types.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/socket.h>
+
+#include "dbif.h"
+
+/* Change feed protocol. A relay watches a database once and serves the
+ * stream of changes to many clients over a Unix or TCP socket. A client
+ * may itself be a relay so relays can be cascaded into a tree.
+ *
+ * A client starts by sending a dbif_feed_hello followed by num_prefixes
+ * dbif_feed_prefix structures, these form a dbif_filter for the keys the
+ * client wants. The relay then sends batches, each a dbif_feed_batch
+ * followed by len bytes holding count events. An event is a
+ * dbif_feed_event followed by the key and the value.
+ *
+ * The value is what the relay read after the change so that clients
+ * don't each read it back. value_size is DBIF_FEED_DELETED if the key
+ * was gone, or DBIF_FEED_NO_VALUE if the value isn't carried, e.g. it's
+ * larger than DBIF_FEED_VALUE_MAX or the read failed, and the client
+ * reads it from the database.
+ *
+ * Every change is numbered by the relay. The seq in a batch is the
+ * number following the last change in the batch and the epoch
+ * identifies the relay's numbering. A client resumes after reconnecting
+ * by sending the last epoch and seq it received. If the relay can't
+ * resume from that point, because the client fell too far behind or the
+ * relay restarted, the next batch has DBIF_FEED_F_RESYNC set and the
+ * client must resynchronize with the database before applying it. A
+ * client without an epoch starts from the current changes and is sent a
+ * batch with DBIF_FEED_F_RESYNC right away, so changes made before it
+ * subscribed aren't missed.
+ *
+ * All fields are in network byte order.
+ */
+
+#define DBIF_FEED_VERSION	2
+#define DBIF_FEED_KEY_MAX	64
+#define DBIF_FEED_VALUE_MAX	64
+#define DBIF_FEED_BATCH_MAX	1024
+
+#define DBIF_FEED_NO_VALUE	0xffff
+#define DBIF_FEED_DELETED	0xfffe
+
+#define DBIF_FEED_F_RESYNC	0x1
+
+struct dbif_feed_hello {
+	__u16 version;
+	__u16 num_prefixes;
+	__u32 rsvd;
+	__u64 epoch;
+	__u64 seq;
+};
+
+struct dbif_feed_prefix {
+	__u16 len;
+	__u16 key_size;
+	__u8 data[DBIF_FILTER_PREFIX_MAX];
+};
+
+struct dbif_feed_batch {
+	__u16 version;
+	__u16 flags;
+	__u32 count;
+	__u32 len;
+	__u32 rsvd;
+	__u64 epoch;
+	__u64 seq;
+};
+
+struct dbif_feed_event {
+	__u16 key_size;
+	__u16 value_size;
+};
+
+/* Parse a feed address, a Unix socket path or [ADDR]:PORT */
+int dbif_feed_parse_addr(const char *addr, struct sockaddr_storage *ss,
+			 int *sslen);
+
+/* Watch the change feed from a relay. The callback is called for each
+ * changed key matching filter and resync_cb when the client has to
+ * resynchronize. The callback's res is 0 if the value is carried, -2 if
+ * the key was deleted, and -1 if the value isn't carried. The
+ * connection is retried if it fails or is closed.
+ */
+struct dbif_feed;
+
+typedef void (*dbif_feed_cb)(void *key, size_t key_size, int res,
+			     void *value, size_t value_size, void *data);
+
+struct dbif_feed *dbif_feed_watch(struct event_base *event_base,
+				  const char *addr,
+				  const struct dbif_filter *filter,
+				  dbif_feed_cb cb,
+				  void (*resync_cb)(void *data),
+				  void *data, FILE *logf);
+void dbif_feed_stop(struct dbif_feed *feed);
+
+/* Connection state of a feed client, connects and resyncs count since
+ * the watch started, epoch and seq are where it would resume.
+ */
+struct dbif_feed_status {
+	bool connected;
+	unsigned int connects;
+	unsigned int resyncs;
+	__u64 epoch;
+	__u64 seq;
+};
+
+void dbif_feed_get_status(struct dbif_feed *feed,
+			  struct dbif_feed_status *status);
+
+#endif /* __DBIF_FEED_H__ */
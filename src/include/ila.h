@@ -32,6 +32,9 @@
 
 #include <arpa/inet.h>
 #include <linux/types.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
 
 typedef __u64 Locator;
 typedef __u64 Identifier;
@@ -66,6 +69,288 @@ struct IlaLocValue {
 	Locator locator;
 };
 
+/* Values in the map, ident, and loc databases are stored as fixed size
+ * packed records, 22 bytes of header and the value. The header fields
+ * are:
+ *
+ *   version	Format of the record, readers drop other versions
+ *   type	Record type, checked against the database it is read from
+ *   origin_us	For a record written as the result of another change,
+ *		e.g. a mapping written for an identifier update, the
+ *		time of that change as the low 32 bits of microseconds
+ *		since the epoch, zero if unknown. The full time is
+ *		recovered from timestamp as long as the two are within
+ *		about 35 minutes of each other, which they are for a
+ *		change that is propagated at all, so the high bits would
+ *		only add size. It identifies the change in latency
+ *		traces
+ *   gen	Generation number of the key, stamped by the database
+ *		with DBIF_PATCH_GEN on every write. The database keeps
+ *		the counter across deletes so a key that is created
+ *		again continues to increase. Readers use it to discard
+ *		stale or duplicate updates
+ *   timestamp	Time of the write in nanoseconds since the epoch
+ *
+ * Records are packed and have the same layout as the Python "="
+ * struct formats in ila.py.
+ *
+ * Values written before records were introduced are the bare value
+ * structures above, these are accepted by readers with a generation
+ * number of zero (always applied).
+ */
+
+#define ILA_REC_VERSION		1
+
+enum {
+	ILA_REC_TYPE_MAP = 1,
+	ILA_REC_TYPE_IDENT,
+	ILA_REC_TYPE_LOC,
+	ILA_REC_TYPE_SIR,
+	ILA_REC_TYPE_IDENT_SIR,
+	ILA_REC_TYPE_PREP,
+};
+
+struct IlaRecHdr {
+	__u8 version;
+	__u8 type;
+	__u32 origin_us;
+	__u64 gen;
+	__u64 timestamp;
+} __attribute__((packed));
+
+#define ILA_REC_GEN_OFFSET	offsetof(struct IlaRecHdr, gen)
+
+struct IlaMapRec {
+	struct IlaRecHdr hdr;
+	struct IlaMapValue value;
+} __attribute__((packed));
+
+struct IlaIdentRec {
+	struct IlaRecHdr hdr;
+	struct IlaIdentValue value;
+} __attribute__((packed));
+
+struct IlaLocRec {
+	struct IlaRecHdr hdr;
+	struct IlaLocValue value;
+} __attribute__((packed));
+
+/* SIR prefix dictionary. SIR prefixes are registered in the map database
+ * under an IlaSirKey with a small numeric id. In the compact encoding map
+ * keys and identifier values carry only the SIR prefix id and the low
+ * order 64 bits of the address (the identifier) instead of a full IPv6
+ * address. The key sizes of the full, compact, and dictionary entries
+ * are all different so the encodings can be mixed in one database.
+ *
+ * An id must not be reassigned to a different prefix while mappings that
+ * use it exist.
+ */
+
+#define ILA_SIR_KEY_TAG		"SIR"
+
+struct IlaSirKey {
+	char tag[4];
+	__u16 id;
+	__u16 rsvd;
+};
+
+struct IlaSirValue {
+	__u64 prefix;
+};
+
+struct IlaSirRec {
+	struct IlaRecHdr hdr;
+	struct IlaSirValue value;
+} __attribute__((packed));
+
+struct IlaMapKeySir {
+	__u16 sir_id;
+	__u64 iid;
+} __attribute__((packed));
+
+struct IlaIdentValueSir {
+	__u64 loc_num;
+	__u64 iid;
+	__u16 sir_id;
+} __attribute__((packed));
+
+struct IlaIdentSirRec {
+	struct IlaRecHdr hdr;
+	struct IlaIdentValueSir value;
+} __attribute__((packed));
+
+static inline void ila_sir_key_init(struct IlaSirKey *key, __u16 id)
+{
+	memset(key, 0, sizeof(*key));
+	memcpy(key->tag, ILA_SIR_KEY_TAG, sizeof(ILA_SIR_KEY_TAG));
+	key->id = id;
+}
+
+static inline int ila_is_sir_key(void *key, size_t key_size)
+{
+	return key_size == sizeof(struct IlaSirKey) &&
+	       !memcmp(key, ILA_SIR_KEY_TAG, sizeof(ILA_SIR_KEY_TAG));
+}
+
+/* Make a full address from a SIR prefix and an identifier */
+static inline void ila_sir_expand(struct in6_addr *addr, __u64 prefix,
+				  __u64 iid)
+{
+	memcpy(&addr->s6_addr[0], &prefix, sizeof(prefix));
+	memcpy(&addr->s6_addr[8], &iid, sizeof(iid));
+}
+
+/* Make-before-break handover. A move is prepared by writing an
+ * IlaIdentPrepRec with the target locator number under the identifier's
+ * IlaIdentPrepKey in the identifier database. ilactld then writes the
+ * map record that the move will produce under an IlaMapPrepKey in the
+ * map database, and ilad stages the route for it without installing it.
+ * The move is committed by setting the identifier's locator number to
+ * the prepared one and deleting the prepare record. ilactld then deletes
+ * the map prepare key before writing the new map record, and ilad
+ * installs the staged route with a single route replace when it sees the
+ * deletion. An aborted move's map prepare record is overwritten with a
+ * zero locator instead so that it isn't taken for a commit.
+ *
+ * A map prepare key is the tag followed by a full or compact map key.
+ */
+
+#define ILA_PREP_KEY_TAG	"PRP"
+
+struct IlaIdentPrepKey {
+	char tag[4];
+	__u32 rsvd;
+	__u64 num;
+};
+
+struct IlaIdentPrepRec {
+	struct IlaRecHdr hdr;
+	__u64 loc_num;
+} __attribute__((packed));
+
+struct IlaMapPrepKey {
+	char tag[4];
+	__u8 key[sizeof(struct IlaMapKey)];
+};
+
+static inline void ila_ident_prep_key_init(struct IlaIdentPrepKey *key,
+					   __u64 num)
+{
+	memset(key, 0, sizeof(*key));
+	memcpy(key->tag, ILA_PREP_KEY_TAG, sizeof(ILA_PREP_KEY_TAG));
+	key->num = num;
+}
+
+/* Make a map prepare key from a map key. Returns the key size */
+static inline size_t ila_map_prep_key_init(struct IlaMapPrepKey *key,
+					   const void *mkey, size_t mkey_size)
+{
+	memcpy(key->tag, ILA_PREP_KEY_TAG, sizeof(ILA_PREP_KEY_TAG));
+	memcpy(key->key, mkey, mkey_size);
+
+	return sizeof(key->tag) + mkey_size;
+}
+
+static inline int ila_is_prep_key(void *key, size_t key_size)
+{
+	return key_size > sizeof(((struct IlaMapPrepKey *)0)->tag) &&
+	       key_size <= sizeof(struct IlaMapPrepKey) &&
+	       !memcmp(key, ILA_PREP_KEY_TAG, sizeof(ILA_PREP_KEY_TAG));
+}
+
+static inline __u64 ila_time_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+
+	return (__u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void ila_rec_hdr_init(struct IlaRecHdr *hdr, __u8 type,
+				    __u64 gen)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->version = ILA_REC_VERSION;
+	hdr->type = type;
+	hdr->gen = gen;
+	hdr->timestamp = ila_time_ns();
+}
+
+/* Origin is the time of the causing change in nanoseconds */
+static inline void ila_rec_set_origin(struct IlaRecHdr *hdr, __u64 origin)
+{
+	__u32 origin_us = origin / 1000;
+
+	hdr->origin_us = origin ? (origin_us ? : 1) : 0;
+}
+
+/* Returns the origin time in microseconds, zero if not known */
+static inline __u64 ila_rec_origin(const struct IlaRecHdr *hdr)
+{
+	__u64 ts_us = hdr->timestamp / 1000;
+
+	if (!hdr->origin_us)
+		return 0;
+
+	return ts_us - (__s32)((__u32)ts_us - hdr->origin_us);
+}
+
+/* Validate a record of size bytes that was read into a buffer of
+ * rec_size bytes. A legacy value without a header is converted in place
+ * to a record with generation number zero. Returns zero if the record
+ * is usable.
+ */
+static inline int ila_rec_normalize(void *rec, size_t size, size_t rec_size,
+				    __u8 type)
+{
+	struct IlaRecHdr *hdr = rec;
+
+	if (size == rec_size - sizeof(*hdr)) {
+		memmove(hdr + 1, rec, size);
+		memset(hdr, 0, sizeof(*hdr));
+		hdr->version = ILA_REC_VERSION;
+		hdr->type = type;
+		return 0;
+	}
+
+	if (size != rec_size || hdr->version != ILA_REC_VERSION ||
+	    hdr->type != type)
+		return -1;
+
+	return 0;
+}
+
+/* Returns true if a record with generation number gen should not be
+ * applied given that last_gen was the last one applied.
+ */
+static inline int ila_rec_is_stale(__u64 gen, __u64 last_gen)
+{
+	return gen && gen <= last_gen;
+}
+
+/* ilactld ingestion protocol. A client streams batches of attach events
+ * over a Unix or TCP socket, each batch is an IlaIngestHdr followed by
+ * count IlaIngestEvent structures. ilactld answers each batch with an
+ * IlaIngestHdr where count is the number of events that were applied.
+ * A loc_num of zero unattaches the identifier. All fields are in network
+ * byte order.
+ */
+
+#define ILA_INGEST_VERSION	1
+#define ILA_INGEST_MAX_EVENTS	4096
+
+struct IlaIngestHdr {
+	__u16 version;
+	__u16 flags;
+	__u32 count;
+};
+
+struct IlaIngestEvent {
+	__u64 ident_num;
+	__u64 loc_num;
+};
+
 /* ila_route_ops define an interface to set ILA routes (e.g.
  * setting kernel LWT routes).
  *
@@ -85,8 +370,33 @@ struct IlaLocValue {
  *   done	Done with routing system, any resources can be released.
  *
  *   set_route	Set an ILA route. Input is an ILA map key and value.
+ *		Returns 1 if the mapping needs no route, e.g. the
+ *		locator is local.
  *
  *   del_route	Delete an ILA route. Input is a ILA map key.
+ *
+ *   stage_route
+ *		Prepare setting an ILA route without changing the
+ *		forwarding state. Input is an ILA map key and value, a
+ *		handle for the staged route is returned. Optional.
+ *
+ *   commit_route
+ *		Apply a staged route atomically. The handle is released.
+ *		Returns 1 if the mapping needs no route.
+ *
+ *   free_staged
+ *		Release a staged route that won't be committed.
+ *
+ *   dump_routes
+ *		Report each route that was set as its map key and the
+ *		value fields that the route carries. Optional.
+ *
+ *   dump_use	Report each route that was set as its map key and the
+ *		seconds since it last forwarded a packet. Routes whose
+ *		use isn't known aren't reported. Optional.
+ *
+ *   flush_routes
+ *		Remove all routes that were set. Optional.
  */
 struct ila_route_ops {
 	int (*init)(void **context, FILE *logf);
@@ -96,8 +406,55 @@ struct ila_route_ops {
 	int (*set_route)(void *context, struct IlaMapKey *key,
 			 struct IlaMapValue *value);
 	int (*del_route)(void *context, struct IlaMapKey *key);
+	int (*stage_route)(void *context, struct IlaMapKey *key,
+			   struct IlaMapValue *value, void **stagedp);
+	int (*commit_route)(void *context, void *staged);
+	void (*free_staged)(void *context, void *staged);
+	int (*dump_routes)(void *context,
+			   void (*cb)(struct IlaMapKey *key,
+				      struct IlaMapValue *value, void *data),
+			   void *data);
+	int (*dump_use)(void *context,
+			void (*cb)(struct IlaMapKey *key, unsigned int age,
+				   void *data),
+			void *data);
+	int (*flush_routes)(void *context);
 };
 
 struct ila_route_ops *ila_get_kernel(void);
+struct ila_route_ops *ila_get_null(void);
+struct ila_route_ops *ila_get_record(void);
+
+/* Route log written by the record route backend. The log is a header
+ * followed by fixed size records in host byte order, each is a route
+ * change at usecs since the start. Replaying the records in order gives
+ * the routes that were set.
+ */
+#define ILA_ROUTE_LOG_MAGIC	0x52414c49	/* "ILAR" */
+#define ILA_ROUTE_LOG_VERSION	1
+
+struct ila_route_log_hdr {
+	__u32 magic;
+	__u16 version;
+	__u16 rec_size;
+	__u64 start_ns;		/* Realtime at the start */
+};
+
+enum {
+	ILA_ROUTE_LOG_SET = 1,
+	ILA_ROUTE_LOG_DEL,
+	ILA_ROUTE_LOG_FLUSH,
+};
+
+#define ILA_ROUTE_LOG_F_STAGED	0x1	/* Committed staged route */
+
+struct ila_route_log_rec {
+	__u64 usecs;
+	__u8 op;
+	__u8 flags;
+	__u8 rsvd[6];
+	struct in6_addr addr;
+	struct IlaMapValue value;
+};
 
 #endif
@@ -0,0 +1,143 @@
+/*
+ * libila.h - ILA database client library
+ *
+ * Copyright (c) 2018, Quantonium Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the Quantonium nor the names of its contributors
+ *     may be used to endorse or promote products derived from this software
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL QUANTONIUM BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __LIBILA_H__
+#define __LIBILA_H__
+
+#include <event2/event.h>
+#include <linux/types.h>
+#include <netinet/in.h>
+
+#include "dbif.h"
+#include "ila.h"
+
+/* Client interface for mobility managers and other programs that
+ * manipulate the identifier database. Operations are performed through
+ * a dbif instance that the caller has initialized and started.
+ *
+ * The attach, unattach, and move operations update the locator number
+ * of an identifier record in place in a single atomic operation and
+ * stamp the record's next generation number. They work on both the full
+ * and compact (SIR prefix id) identifier encodings.
+ *
+ * Return values are zero on success, ILA_ERR_NOENT if the identifier
+ * does not exist, ILA_ERR_STALE if the identifier is not attached to
+ * the expected locator, and -1 on other errors. If genp is non-NULL the
+ * new generation number of the record is returned on success.
+ */
+
+#define ILA_ERR_NOENT	-2
+#define ILA_ERR_STALE	-3
+#define ILA_ERR_EXIST	-4
+
+/* Attach identifier to a locator regardless of its current locator */
+int ila_ident_attach(struct dbif_ops *ops, void *ctx, __u64 ident_num,
+		     __u64 loc_num, __u64 *genp);
+
+/* Unattach identifier. If loc_num is non-zero the identifier must be
+ * attached to that locator, this allows a stale detach from an old
+ * locator to be rejected after the identifier has moved.
+ */
+int ila_ident_unattach(struct dbif_ops *ops, void *ctx, __u64 ident_num,
+		       __u64 loc_num, __u64 *genp);
+
+/* Move identifier from one locator to another. Fails with ILA_ERR_STALE
+ * if the identifier is not attached to from_loc.
+ */
+int ila_ident_move(struct dbif_ops *ops, void *ctx, __u64 ident_num,
+		   __u64 from_loc, __u64 to_loc, __u64 *genp);
+
+/* Make-before-break handover. Prepare sets up the move of an identifier
+ * to a target locator so that the new mapping is staged throughout the
+ * system. Commit performs the move from from_loc to to_loc and removes
+ * the prepared state in one round trip, the prepared state is removed
+ * even if the move fails. Abort just removes the prepared state.
+ */
+int ila_ident_prepare(struct dbif_ops *ops, void *ctx, __u64 ident_num,
+		      __u64 loc_num);
+int ila_ident_commit(struct dbif_ops *ops, void *ctx, __u64 ident_num,
+		     __u64 from_loc, __u64 to_loc, __u64 *genp);
+int ila_ident_abort(struct dbif_ops *ops, void *ctx, __u64 ident_num);
+
+/* Asynchronous client. Operations are queued and then submitted to the
+ * database as a pipelined batch, each operation completes by calling its
+ * callback with the result (as above, or ILA_ERR_EXIST if a make finds
+ * an existing entry) and the new generation number of the record.
+ *
+ * A batch is submitted when batch_max operations are queued, when
+ * ila_client_flush is called, or, if an event base is given, from the
+ * event loop once the current callbacks have run. So operations issued
+ * from one event handler go in one batch and one round trip.
+ *
+ * ila_client_set_batch lowers the batch size below batch_max, or
+ * raises it back. ila_client_set_window sets a coalescing window, the
+ * first operation queued then waits up to that many microseconds for
+ * more to join its batch. Both can be changed at any time.
+ *
+ * A client uses a single dbif instance so identifier operations need a
+ * client on the identifier database and locator operations one on the
+ * locator database. Callbacks may queue new operations. Functions
+ * return -1 if the operation can't be queued. ila_client_pending
+ * returns the number of operations queued and not yet submitted.
+ */
+
+struct ila_client;
+
+typedef void (*ila_done_cb)(int result, __u64 gen, void *data);
+
+struct ila_client *ila_client_create(struct dbif_ops *ops, void *ctx,
+				     struct event_base *event_base,
+				     unsigned int batch_max);
+void ila_client_destroy(struct ila_client *cl);
+int ila_client_flush(struct ila_client *cl);
+unsigned int ila_client_pending(struct ila_client *cl);
+int ila_client_set_batch(struct ila_client *cl, unsigned int batch);
+void ila_client_set_window(struct ila_client *cl, unsigned int usecs);
+
+int ila_ident_make_async(struct ila_client *cl, __u64 ident_num,
+			 const struct in6_addr *addr,
+			 ila_done_cb cb, void *data);
+int ila_ident_make_sir_async(struct ila_client *cl, __u64 ident_num,
+			     __u16 sir_id, Identifier iid,
+			     ila_done_cb cb, void *data);
+int ila_ident_attach_async(struct ila_client *cl, __u64 ident_num,
+			   __u64 loc_num, ila_done_cb cb, void *data);
+int ila_ident_unattach_async(struct ila_client *cl, __u64 ident_num,
+			     __u64 loc_num, ila_done_cb cb, void *data);
+int ila_ident_move_async(struct ila_client *cl, __u64 ident_num,
+			 __u64 from_loc, __u64 to_loc,
+			 ila_done_cb cb, void *data);
+int ila_ident_destroy_async(struct ila_client *cl, __u64 ident_num,
+			    ila_done_cb cb, void *data);
+int ila_loc_make_async(struct ila_client *cl, __u64 loc_num,
+		       Locator locator, ila_done_cb cb, void *data);
+int ila_loc_destroy_async(struct ila_client *cl, __u64 loc_num,
+			  ila_done_cb cb, void *data);
+
+#endif /* __LIBILA_H__ */
@@ -49,6 +49,11 @@ static inline void list_del(struct list_head *entry)
 	__list_del(entry->prev, entry->next);
 }
 
+static inline int list_empty(const struct list_head *head)
+{
+	return head->next == head;
+}
+
 #define list_entry(ptr, type, member) \
 	container_of(ptr, type, member)
 
@@ -88,6 +93,8 @@ struct hlist_node {
 	struct hlist_node *next, **pprev;
 };
 
+#define hlist_entry(ptr, type, member) container_of(ptr, type, member)
+
 static inline void hlist_del(struct hlist_node *n)
 {
 	struct hlist_node *next = n->next;
@@ -0,0 +1,70 @@
+/*
+ * qbench.h - Helpers for the benchmark tools
+ *
+ * Copyright (c) 2018, Quantonium Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the Quantonium nor the names of its contributors
+ *     may be used to endorse or promote products derived from this software
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL QUANTONIUM BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __QBENCH_H__
+#define __QBENCH_H__
+
+#include <linux/types.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "json_writer.h"
+
+/* Latency samples of a benchmark phase in usecs. Samples past size are
+ * dropped.
+ */
+struct qbench_lat {
+	__u64 *samples;
+	size_t count;
+	size_t size;
+};
+
+int qbench_lat_init(struct qbench_lat *lat, size_t size);
+void qbench_lat_free(struct qbench_lat *lat);
+
+static inline void qbench_lat_add(struct qbench_lat *lat, __u64 usecs)
+{
+	if (lat->count < lat->size)
+		lat->samples[lat->count++] = usecs;
+}
+
+/* Write the common fields of a result to the open JSON object: ops,
+ * errors, seconds, ops_per_sec, and the latency percentiles if there
+ * are samples (these are sorted).
+ */
+void qbench_json_fields(json_writer_t *jw, unsigned long ops,
+			unsigned long errors, __u64 usecs,
+			struct qbench_lat *lat);
+
+/* Parse a comma separated list of non-zero sizes. Returns the number of
+ * sizes or -1 on error.
+ */
+int qbench_parse_sizes(const char *list, unsigned long *sizes, int max);
+
+#endif /* __QBENCH_H__ */
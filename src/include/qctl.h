@@ -0,0 +1,90 @@
+/*
+ * qctl.h - Control socket for daemons
+ *
+ * Copyright (c) 2018, Quantonium Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the Quantonium nor the names of its contributors
+ *     may be used to endorse or promote products derived from this software
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL QUANTONIUM BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __QCTL_H__
+#define __QCTL_H__
+
+#include <event2/event.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "json_writer.h"
+
+/* Control socket of a daemon for inspecting its state and tuning it
+ * while it runs.
+ *
+ * A client sends commands as lines of words separated by white space
+ * and each command is answered with a JSON object on one line. An
+ * error is reported as an object with an "error" string. The control
+ * socket has these commands itself:
+ *
+ *   help		List the commands and tunables
+ *   get [NAME]		Report the value of tunables
+ *   set NAME VALUE	Change a tunable
+ *
+ * Other commands are registered by the daemon. A command handler writes
+ * its reply into the object with the json_writer from qctl_json. A
+ * reply that may be large, such as a dump of a table, is streamed: the
+ * handler opens what the reply needs, e.g. an array, and calls
+ * qctl_stream with a function that writes the next part of the reply
+ * each time it's called and returns true while there is more. It's
+ * called from the event loop as the client takes the output so a dump
+ * of millions of entries neither stalls the loop nor is held in memory.
+ * If the client goes away the function is called with stop set and
+ * must close what it opened and release its state. Commands that arrive
+ * while a reply is streamed are processed when it's done.
+ *
+ * A tunable is an unsigned int of the daemon with a range of allowed
+ * values. The set callback, if given, is called after the value is
+ * changed so the daemon can apply it.
+ */
+
+struct qctl;
+struct qctl_conn;
+
+typedef int (*qctl_cmd_fn)(struct qctl_conn *conn, int argc, char **argv,
+			   void *data);
+typedef bool (*qctl_stream_fn)(json_writer_t *jw, void *arg, bool stop);
+
+struct qctl *qctl_create(struct event_base *event_base, FILE *logf);
+void qctl_destroy(struct qctl *qc);
+
+int qctl_command(struct qctl *qc, const char *name, const char *help,
+		 qctl_cmd_fn fn, void *data);
+int qctl_tunable(struct qctl *qc, const char *name, const char *help,
+		 unsigned int *value, unsigned int min, unsigned int max,
+		 void (*set_cb)(void *data), void *data);
+
+int qctl_serve(struct qctl *qc, const char *addr);
+
+json_writer_t *qctl_json(struct qctl_conn *conn);
+void qctl_error(struct qctl_conn *conn, const char *format, ...);
+void qctl_stream(struct qctl_conn *conn, qctl_stream_fn fn, void *arg);
+
+#endif /* __QCTL_H__ */
@@ -0,0 +1,88 @@
+/*
+ * qhash.h - Simple resizable hash table
+ *
+ * Copyright (c) 2018, Quantonium Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the Quantonium nor the names of its contributors
+ *     may be used to endorse or promote products derived from this software
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL QUANTONIUM BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __QHASH_H__
+#define __QHASH_H__
+
+#include <linux/types.h>
+#include <stddef.h>
+
+#include "list.h"
+
+/* An intrusive hash table in the style of the kernel hashtable. Objects
+ * embed a struct qhash_node and the caller computes the hash of the key.
+ * Lookups iterate over the objects with a matching hash value and the
+ * caller compares keys. The table doubles in size when the number of
+ * objects exceeds the number of buckets.
+ */
+
+struct qhash_node {
+	struct hlist_node hlist;
+	__u32 hash;
+};
+
+struct qhash {
+	struct hlist_head *buckets;
+	unsigned int order;
+	unsigned int count;
+};
+
+int qhash_init(struct qhash *qh, unsigned int order);
+void qhash_destroy(struct qhash *qh);
+void qhash_add(struct qhash *qh, struct qhash_node *node, __u32 hash);
+void qhash_del(struct qhash *qh, struct qhash_node *node);
+__u32 qhash_bytes(const void *data, size_t len, __u32 seed);
+
+#define qhash_size(qh) (1U << (qh)->order)
+
+#define qhash_bucket(qh, _hash)						\
+	(&(qh)->buckets[(_hash) & (qhash_size(qh) - 1)])
+
+/* Iterate over objects whose hash matches _hash */
+#define qhash_for_each_possible(qh, pos, member, _hash)			\
+	hlist_for_each_entry(pos, qhash_bucket(qh, _hash), member.hlist)	\
+		if ((pos)->member.hash != (_hash)) {} else
+
+/* Iterate over the objects in bucket bkt. A walk that is resumed at a
+ * bucket index reports every object that stays in the table, objects
+ * may be reported twice if the table grew in between.
+ */
+#define qhash_for_each_in_bucket(qh, bkt, pos, member)			\
+	hlist_for_each_entry(pos, &(qh)->buckets[bkt], member.hlist)
+
+/* Iterate over all objects, pos may be removed from the table */
+#define qhash_for_each_safe(qh, bkt, tmp, pos, member)			\
+	for ((bkt) = 0; (bkt) < qhash_size(qh); (bkt)++)		\
+		for (pos = hlist_entry_safe((qh)->buckets[bkt].first,	\
+					    typeof(*(pos)), member.hlist);	\
+		     pos && ({ tmp = (pos)->member.hlist.next; 1; });	\
+		     pos = hlist_entry_safe(tmp, typeof(*(pos)),		\
+					    member.hlist))
+
+#endif
@@ -0,0 +1,114 @@
+/*
+ * qlog.h - Asynchronous rate limited logging
+ *
+ * Copyright (c) 2018, Quantonium Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the Quantonium nor the names of its contributors
+ *     may be used to endorse or promote products derived from this software
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL QUANTONIUM BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __QLOG_H__
+#define __QLOG_H__
+
+#include <linux/types.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+/* Logging for daemons that must not stall on their log.
+ *
+ * A record is formatted into a slot of a fixed size ring by the caller
+ * and written out by a background thread, so logging costs a bounded
+ * amount of formatting and never waits on I/O. If the ring is full the
+ * record is dropped and the writer reports how many were dropped. The
+ * ring is lock free, records may be logged from any thread.
+ *
+ * Records are lines of key=value fields (logfmt):
+ *
+ *   ts=2018-06-01T12:00:00.123456Z level=err msg="Set failed" addr=...
+ *
+ * QLOG takes the message, which must be a constant string, and
+ * optionally a format for more fields and its arguments, e.g.
+ *
+ *   QLOG(ql, QLOG_ERR, "Set failed", "addr=%s errno=%d", addr, errno);
+ *
+ * Each QLOG call site is rate limited by a token bucket of burst
+ * records refilled at rate per second. Records over the limit are
+ * counted and the count is reported as suppressed=N with the next
+ * record of the site that is written. The limit is per site so a storm
+ * of one message doesn't hide others. Debug records are only logged
+ * when asked for and aren't limited, a storm of them is bounded by the
+ * ring. Site state is updated atomically, a site may be shared by
+ * threads.
+ *
+ * Records above the level of the log are dropped before they are
+ * formatted.
+ *
+ * Components that log to a FILE, e.g. dbif and the route backends, are
+ * given one from qlog_file. Each line written to it is a record whose
+ * msg is the line, at the given level and with src set to the name. The
+ * stream is one site for rate limiting.
+ *
+ * The writer thread is started by qlog_start, which must be after the
+ * daemon forks since threads don't survive a fork. Until then records
+ * are held in the ring. At exit the writer drains the ring.
+ */
+
+enum qlog_level {
+	QLOG_ERR = 0,
+	QLOG_WARN,
+	QLOG_INFO,
+	QLOG_DEBUG,
+};
+
+#define QLOG_DEFAULT_RING	4096	/* Records, a power of two */
+#define QLOG_DEFAULT_BURST	10
+#define QLOG_DEFAULT_RATE	10	/* Records per second */
+
+struct qlog_site {
+	const char *msg;
+	__u64 full;		/* Time the bucket is full again, usecs */
+	unsigned long suppressed;
+};
+
+struct qlog;
+
+struct qlog *qlog_create(FILE *out, unsigned int ring_size);
+int qlog_start(struct qlog *ql);
+void qlog_destroy(struct qlog *ql);
+
+void qlog_set_level(struct qlog *ql, enum qlog_level level);
+enum qlog_level qlog_get_level(struct qlog *ql);
+void qlog_set_rate(struct qlog *ql, unsigned int burst, unsigned int rate);
+FILE *qlog_file(struct qlog *ql, enum qlog_level level, const char *src);
+
+void qlog_log(struct qlog *ql, struct qlog_site *site, enum qlog_level level,
+	      const char *fmt, ...) __attribute__((format(printf, 4, 5)));
+
+/* Fields are pasted to a leading space so that they are optional */
+#define QLOG(ql, level, m, ...) do {					\
+	static struct qlog_site __qlog_site = { .msg = m };		\
+									\
+	qlog_log(ql, &__qlog_site, level, " " __VA_ARGS__);		\
+} while (0)
+
+#endif /* __QLOG_H__ */
@@ -0,0 +1,81 @@
+/*
+ * qmerkle.h - Incremental hash tree for anti-entropy
+ *
+ * Copyright (c) 2018, Quantonium Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the Quantonium nor the names of its contributors
+ *     may be used to endorse or promote products derived from this software
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL QUANTONIUM BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __QMERKLE_H__
+#define __QMERKLE_H__
+
+#include <linux/types.h>
+#include <stddef.h>
+
+/* A hash tree over a set of keyed entries for comparing two copies of
+ * the set. Each key falls in one of 2^bits leaves, a leaf is the sum of
+ * the hashes of its entries and an inner node is the sum of its two
+ * children, all modulo 2^48. Sums are order independent so an entry is
+ * added or removed in O(bits) without touching the other entries, and
+ * two trees are compared by descending only into the subtrees whose
+ * sums differ.
+ *
+ * The entry hash is two polynomial hashes with moduli small enough that
+ * it can be computed exactly with the doubles of a Redis Lua script. It
+ * is for detecting drift, not tampering.
+ *
+ * nodes[1] is the root, the children of node i are 2i and 2i + 1, and
+ * the leaves are nodes[2^bits] to nodes[2^(bits + 1) - 1].
+ */
+
+#define QMERKLE_MAX_BITS	20
+#define QMERKLE_MASK		((1ULL << 48) - 1)
+
+struct qmerkle {
+	unsigned int bits;
+	__u64 *nodes;
+};
+
+int qmerkle_init(struct qmerkle *qm, unsigned int bits);
+void qmerkle_destroy(struct qmerkle *qm);
+void qmerkle_clear(struct qmerkle *qm);
+void qmerkle_add(struct qmerkle *qm, unsigned int leaf, __u64 hash);
+void qmerkle_sub(struct qmerkle *qm, unsigned int leaf, __u64 hash);
+void qmerkle_set_leaves(struct qmerkle *qm, const __u64 *leaves);
+unsigned int qmerkle_diff(const struct qmerkle *a, const struct qmerkle *b,
+			  void (*cb)(unsigned int leaf, void *data),
+			  void *data);
+__u64 qmerkle_hash(const void *key, size_t key_size,
+		   const void *value, size_t value_size);
+unsigned int qmerkle_leaf(const struct qmerkle *qm, const void *key,
+			  size_t key_size);
+
+#define qmerkle_num_leaves(qm) (1U << (qm)->bits)
+
+static inline __u64 qmerkle_root(const struct qmerkle *qm)
+{
+	return qm->nodes[1];
+}
+
+#endif
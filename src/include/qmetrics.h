@@ -0,0 +1,169 @@
+/*
+ * qmetrics.h - Runtime metrics in Prometheus text format
+ *
+ * Copyright (c) 2018, Quantonium Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the Quantonium nor the names of its contributors
+ *     may be used to endorse or promote products derived from this software
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL QUANTONIUM BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __QMETRICS_H__
+#define __QMETRICS_H__
+
+#include <event2/event.h>
+#include <linux/types.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "json_writer.h"
+
+/* Runtime metrics of a daemon, served in the Prometheus text format.
+ *
+ * A registry holds the metrics of a daemon in the order they were
+ * created. Samples that share a name, e.g. a counter with a label for
+ * each result, are created with the same name and help and different
+ * labels, they must be created one after the other. Labels are given
+ * already formatted, e.g. "result=\"ok\"".
+ *
+ * A counter vector is a counter with a numeric label, e.g. errno, whose
+ * values aren't known up front. Only values that have counts are
+ * reported.
+ *
+ * Creating a metric doesn't fail, if memory runs out a placeholder that
+ * isn't reported is returned and qmetrics_failed is true afterwards.
+ *
+ * A gauge either holds a value that is set by the daemon or calls a
+ * function when scraped, the latter is for depths and sizes that the
+ * daemon already tracks.
+ *
+ * Histograms are recorded in microseconds in log-linear buckets as in
+ * HDR histograms, each power of two is split in QMETRICS_SUB_BUCKETS
+ * so the bucket bounds are within 25% of the value. Bounds are reported
+ * in seconds.
+ *
+ * qmetrics_json writes the metrics as an array of objects for the
+ * control socket, a histogram is reported as its count, sum and
+ * quantiles, each the upper bound of the bucket it falls in.
+ *
+ * A library can keep a histogram outside of a registry in a zeroed
+ * struct qmetric whose counts point to QMETRICS_NUM_BUCKETS + 1
+ * counters, qmetric_json_histogram writes it into an open object.
+ *
+ * Metrics are plain variables updated from the event loop, there is no
+ * locking.
+ */
+
+#define QMETRICS_SUB_BITS	2
+#define QMETRICS_SUB_BUCKETS	(1 << QMETRICS_SUB_BITS)
+#define QMETRICS_MAX_BITS	26	/* Up to 2^26 usecs, about 67 secs */
+#define QMETRICS_NUM_BUCKETS	((QMETRICS_MAX_BITS - QMETRICS_SUB_BITS + \
+				  1) * QMETRICS_SUB_BUCKETS)
+
+enum qmetric_type {
+	QMETRIC_COUNTER,
+	QMETRIC_COUNTER_VEC,
+	QMETRIC_GAUGE,
+	QMETRIC_HISTOGRAM,
+};
+
+struct qmetric {
+	const char *name;
+	const char *help;
+	const char *labels;
+	enum qmetric_type type;
+	__u64 value;
+	__u64 (*get)(void *data);
+	void *data;
+	const char *vec_label;
+	unsigned int vec_size;
+	__u64 *counts;
+	__u64 sum;
+	struct qmetric *next;
+};
+
+struct qmetrics;
+
+struct qmetrics *qmetrics_create(void);
+void qmetrics_destroy(struct qmetrics *qms);
+bool qmetrics_failed(struct qmetrics *qms);
+
+struct qmetric *qmetrics_counter(struct qmetrics *qms, const char *name,
+				 const char *labels, const char *help);
+struct qmetric *qmetrics_counter_vec(struct qmetrics *qms, const char *name,
+				     const char *vec_label,
+				     unsigned int vec_size,
+				     const char *help);
+struct qmetric *qmetrics_gauge(struct qmetrics *qms, const char *name,
+			       const char *labels, const char *help);
+struct qmetric *qmetrics_gauge_func(struct qmetrics *qms, const char *name,
+				    const char *labels, const char *help,
+				    __u64 (*get)(void *data), void *data);
+struct qmetric *qmetrics_histogram(struct qmetrics *qms, const char *name,
+				   const char *labels, const char *help);
+
+void qmetric_observe(struct qmetric *qm, __u64 usecs);
+
+int qmetrics_serve(struct qmetrics *qms, struct event_base *event_base,
+		   const char *addr, FILE *logf);
+int qmetrics_print(struct qmetrics *qms, FILE *f);
+void qmetrics_json(struct qmetrics *qms, json_writer_t *jw);
+void qmetric_json_histogram(json_writer_t *jw, struct qmetric *qm);
+
+static inline void qmetric_inc(struct qmetric *qm)
+{
+	qm->value++;
+}
+
+static inline void qmetric_add(struct qmetric *qm, __u64 n)
+{
+	qm->value += n;
+}
+
+static inline void qmetric_set(struct qmetric *qm, __u64 value)
+{
+	qm->value = value;
+}
+
+/* Values at or beyond vec_size are counted at vec_size - 1 */
+static inline void qmetric_inc_vec(struct qmetric *qm, unsigned int i)
+{
+	qm->counts[i < qm->vec_size ? i : qm->vec_size - 1]++;
+}
+
+static inline __u64 qmetrics_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* Observe the time since start as returned by qmetrics_now */
+static inline void qmetric_observe_since(struct qmetric *qm, __u64 start)
+{
+	qmetric_observe(qm, qmetrics_now() - start);
+}
+
+#endif /* __QMETRICS_H__ */
@@ -0,0 +1,71 @@
+/*
+ * qprobe.h - Static tracepoints
+ *
+ * Copyright (c) 2018, Quantonium Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the Quantonium nor the names of its contributors
+ *     may be used to endorse or promote products derived from this software
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL QUANTONIUM BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __QPROBE_H__
+#define __QPROBE_H__
+
+/* User level statically defined tracepoints (USDT). With HAVE_SDT, set
+ * by configure when <sys/sdt.h> is available, a probe is a nop in the
+ * code plus a note in the ELF file so a tracer such as bpftrace or perf
+ * can attach to it in a running process. Otherwise probes compile to
+ * nothing and their arguments are not evaluated.
+ *
+ * The provider is the component, e.g. dbif_redis, the probes and their
+ * arguments are listed in ila/probes/README.
+ */
+
+#ifdef HAVE_SDT
+
+#include <sys/sdt.h>
+
+#define QPROBE(provider, name)						\
+	DTRACE_PROBE(provider, name)
+#define QPROBE1(provider, name, a1)					\
+	DTRACE_PROBE1(provider, name, a1)
+#define QPROBE2(provider, name, a1, a2)					\
+	DTRACE_PROBE2(provider, name, a1, a2)
+#define QPROBE3(provider, name, a1, a2, a3)				\
+	DTRACE_PROBE3(provider, name, a1, a2, a3)
+#define QPROBE4(provider, name, a1, a2, a3, a4)				\
+	DTRACE_PROBE4(provider, name, a1, a2, a3, a4)
+#define QPROBE5(provider, name, a1, a2, a3, a4, a5)			\
+	DTRACE_PROBE5(provider, name, a1, a2, a3, a4, a5)
+
+#else
+
+#define QPROBE(provider, name) do { } while (0)
+#define QPROBE1(provider, name, a1) do { } while (0)
+#define QPROBE2(provider, name, a1, a2) do { } while (0)
+#define QPROBE3(provider, name, a1, a2, a3) do { } while (0)
+#define QPROBE4(provider, name, a1, a2, a3, a4) do { } while (0)
+#define QPROBE5(provider, name, a1, a2, a3, a4, a5) do { } while (0)
+
+#endif
+
+#endif /* __QPROBE_H__ */
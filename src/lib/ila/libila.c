@@ -0,0 +1,586 @@
+/*
+ * libila.c - ILA database client library
+ *
+ * Copyright (c) 2018, Quantonium Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the Quantonium nor the names of its contributors
+ *     may be used to endorse or promote products derived from this software
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL QUANTONIUM BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <event2/event.h>
+#include <linux/types.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dbif.h"
+#include "ila.h"
+#include "libila.h"
+#include "qprobe.h"
+
+#define ILA_IDENT_PATCH_MAX	10
+
+/* Add patch operations for one identifier encoding to set the locator
+ * number, optionally comparing the current one first, and to stamp the
+ * next generation number and the timestamp.
+ */
+static int ila_ident_patch_rec(struct dbif_patch *patches, size_t rec_size,
+			       size_t loc_offset, bool cmp, __u64 from_loc,
+			       __u64 to_loc, __u64 now)
+{
+	int n = 0;
+
+	patches[n].op = DBIF_PATCH_SIZE;
+	patches[n++].arg = rec_size;
+
+	if (cmp) {
+		patches[n].op = DBIF_PATCH_CMP;
+		patches[n].offset = loc_offset;
+		patches[n++].arg = from_loc;
+	}
+
+	patches[n].op = DBIF_PATCH_SET;
+	patches[n].offset = loc_offset;
+	patches[n++].arg = to_loc;
+
+	patches[n].op = DBIF_PATCH_GEN;
+	patches[n++].offset = ILA_REC_GEN_OFFSET;
+
+	patches[n].op = DBIF_PATCH_SET;
+	patches[n].offset = offsetof(struct IlaRecHdr, timestamp);
+	patches[n++].arg = now;
+
+	return n;
+}
+
+/* Patch operations to set the locator number in either encoding */
+static int ila_ident_set_loc_patches(struct dbif_patch *patches, bool cmp,
+				     __u64 from_loc, __u64 to_loc)
+{
+	__u64 now = ila_time_ns();
+	int n;
+
+	n = ila_ident_patch_rec(patches, sizeof(struct IlaIdentRec),
+				offsetof(struct IlaIdentRec, value.loc_num),
+				cmp, from_loc, to_loc, now);
+	n += ila_ident_patch_rec(&patches[n], sizeof(struct IlaIdentSirRec),
+				 offsetof(struct IlaIdentSirRec, value.loc_num),
+				 cmp, from_loc, to_loc, now);
+
+	return n;
+}
+
+static int ila_ident_set_loc(struct dbif_ops *ops, void *ctx,
+			     __u64 ident_num, bool cmp, __u64 from_loc,
+			     __u64 to_loc, __u64 *genp)
+{
+	struct dbif_patch patches[ILA_IDENT_PATCH_MAX];
+	struct IlaIdentKey key = { .num = ident_num };
+	union {
+		struct IlaIdentRec full;
+		struct IlaIdentSirRec sir;
+	} rec;
+	size_t size = sizeof(rec);
+	int n, ret;
+
+	if (!ops->patch)
+		return -1;
+
+	n = ila_ident_set_loc_patches(patches, cmp, from_loc, to_loc);
+
+	ret = ops->patch(ctx, &key, sizeof(key), patches, n, &rec, &size);
+	if (ret)
+		return ret;
+
+	if (genp)
+		*genp = rec.full.hdr.gen;
+
+	return 0;
+}
+
+int ila_ident_attach(struct dbif_ops *ops, void *ctx, __u64 ident_num,
+		     __u64 loc_num, __u64 *genp)
+{
+	return ila_ident_set_loc(ops, ctx, ident_num, false, 0, loc_num,
+				 genp);
+}
+
+int ila_ident_unattach(struct dbif_ops *ops, void *ctx, __u64 ident_num,
+		       __u64 loc_num, __u64 *genp)
+{
+	return ila_ident_set_loc(ops, ctx, ident_num, !!loc_num, loc_num, 0,
+				 genp);
+}
+
+int ila_ident_move(struct dbif_ops *ops, void *ctx, __u64 ident_num,
+		   __u64 from_loc, __u64 to_loc, __u64 *genp)
+{
+	return ila_ident_set_loc(ops, ctx, ident_num, true, from_loc, to_loc,
+				 genp);
+}
+
+int ila_ident_prepare(struct dbif_ops *ops, void *ctx, __u64 ident_num,
+		      __u64 loc_num)
+{
+	struct IlaIdentPrepKey key;
+	struct IlaIdentPrepRec rec;
+
+	ila_ident_prep_key_init(&key, ident_num);
+
+	/* The generation number orders prepares of the same identifier */
+	ila_rec_hdr_init(&rec.hdr, ILA_REC_TYPE_PREP, 0);
+	rec.loc_num = loc_num;
+
+	return dbif_write_gen(ops, ctx, &key, sizeof(key), &rec, sizeof(rec),
+			      ILA_REC_GEN_OFFSET);
+}
+
+int ila_ident_commit(struct dbif_ops *ops, void *ctx, __u64 ident_num,
+		     __u64 from_loc, __u64 to_loc, __u64 *genp)
+{
+	struct dbif_patch patches[ILA_IDENT_PATCH_MAX];
+	struct IlaIdentKey key = { .num = ident_num };
+	struct IlaIdentPrepKey pkey;
+	struct dbif_req reqs[2];
+	union {
+		struct IlaIdentRec full;
+		struct IlaIdentSirRec sir;
+	} rec;
+
+	if (!ops->submit)
+		return -1;
+
+	ila_ident_prep_key_init(&pkey, ident_num);
+
+	memset(reqs, 0, sizeof(reqs));
+
+	/* Move first so that the map update is seen before the prepared
+	 * mapping is removed.
+	 */
+	reqs[0].op = DBIF_REQ_PATCH;
+	reqs[0].key = &key;
+	reqs[0].key_size = sizeof(key);
+	reqs[0].patches = patches;
+	reqs[0].num_patches = ila_ident_set_loc_patches(patches, true,
+							from_loc, to_loc);
+	reqs[0].value = &rec;
+	reqs[0].value_size = sizeof(rec);
+
+	reqs[1].op = DBIF_REQ_DELETE;
+	reqs[1].key = &pkey;
+	reqs[1].key_size = sizeof(pkey);
+
+	if (ops->submit(ctx, reqs, 2) < 0)
+		return -1;
+
+	if (reqs[0].result)
+		return reqs[0].result;
+
+	if (genp)
+		*genp = rec.full.hdr.gen;
+
+	return 0;
+}
+
+int ila_ident_abort(struct dbif_ops *ops, void *ctx, __u64 ident_num)
+{
+	struct IlaIdentPrepKey key;
+
+	ila_ident_prep_key_init(&key, ident_num);
+
+	return ops->delete(ctx, &key, sizeof(key));
+}
+
+/* Queued operation. The request points into the key, record, and patch
+ * storage here.
+ */
+struct ila_op {
+	union {
+		struct IlaIdentKey ident;
+		struct IlaLocKey loc;
+	} key;
+	union {
+		struct IlaRecHdr hdr;
+		struct IlaIdentRec ident;
+		struct IlaIdentSirRec ident_sir;
+		struct IlaLocRec loc;
+	} rec;
+	struct dbif_patch patches[ILA_IDENT_PATCH_MAX];
+	ila_done_cb cb;
+	void *data;
+};
+
+/* Two queues are used so that callbacks of a batch being completed can
+ * queue operations for the next one.
+ */
+struct ila_client {
+	struct dbif_ops *ops;
+	void *ctx;
+	struct event *flush_event;
+	unsigned int batch_max;
+	unsigned int batch;
+	unsigned int window;
+	unsigned int num_ops;
+	int cur;
+	bool flushing;
+	struct ila_op *queue[2];
+	struct dbif_req *reqs[2];
+};
+
+static void ila_client_flush_cb(evutil_socket_t fd, short events, void *arg)
+{
+	ila_client_flush(arg);
+}
+
+struct ila_client *ila_client_create(struct dbif_ops *ops, void *ctx,
+				     struct event_base *event_base,
+				     unsigned int batch_max)
+{
+	struct ila_client *cl;
+	int i;
+
+	if (!ops->submit || !batch_max)
+		return NULL;
+
+	cl = calloc(1, sizeof(*cl));
+	if (!cl)
+		return NULL;
+
+	cl->ops = ops;
+	cl->ctx = ctx;
+	cl->batch_max = batch_max;
+	cl->batch = batch_max;
+
+	for (i = 0; i < 2; i++) {
+		cl->queue[i] = calloc(batch_max, sizeof(*cl->queue[i]));
+		cl->reqs[i] = calloc(batch_max, sizeof(*cl->reqs[i]));
+		if (!cl->queue[i] || !cl->reqs[i])
+			goto err;
+	}
+
+	if (event_base) {
+		cl->flush_event = event_new(event_base, -1, 0,
+					    ila_client_flush_cb, cl);
+		if (!cl->flush_event)
+			goto err;
+	}
+
+	return cl;
+
+err:
+	ila_client_destroy(cl);
+	return NULL;
+}
+
+/* Queued operations are discarded without calling their callbacks */
+void ila_client_destroy(struct ila_client *cl)
+{
+	int i;
+
+	if (cl->flush_event)
+		event_free(cl->flush_event);
+
+	for (i = 0; i < 2; i++) {
+		free(cl->queue[i]);
+		free(cl->reqs[i]);
+	}
+
+	free(cl);
+}
+
+int ila_client_flush(struct ila_client *cl)
+{
+	struct ila_op *queue = cl->queue[cl->cur];
+	struct dbif_req *reqs = cl->reqs[cl->cur];
+	unsigned int i, num_ops = cl->num_ops;
+	int ret;
+
+	if (!num_ops || cl->flushing)
+		return 0;
+
+	if (cl->flush_event)
+		event_del(cl->flush_event);
+
+	cl->cur = !cl->cur;
+	cl->num_ops = 0;
+
+	QPROBE1(libila, flush_begin, num_ops);
+
+	ret = cl->ops->submit(cl->ctx, reqs, num_ops);
+
+	QPROBE2(libila, flush_end, num_ops, ret);
+
+	cl->flushing = true;
+
+	for (i = 0; i < num_ops; i++) {
+		struct ila_op *op = &queue[i];
+		int result = ret ? -1 : reqs[i].result;
+		__u64 gen = 0;
+
+		if (!result && reqs[i].op != DBIF_REQ_DELETE)
+			gen = op->rec.hdr.gen;
+
+		if (op->cb)
+			op->cb(result, gen, op->data);
+	}
+
+	cl->flushing = false;
+
+	/* Operations queued by callbacks go out on the next pass of the
+	 * event loop, or now if there is none.
+	 */
+	if (cl->num_ops && !cl->flush_event)
+		return ila_client_flush(cl);
+
+	return ret;
+}
+
+unsigned int ila_client_pending(struct ila_client *cl)
+{
+	return cl->num_ops;
+}
+
+int ila_client_set_batch(struct ila_client *cl, unsigned int batch)
+{
+	if (!batch || batch > cl->batch_max)
+		return -1;
+
+	cl->batch = batch;
+
+	return 0;
+}
+
+void ila_client_set_window(struct ila_client *cl, unsigned int usecs)
+{
+	cl->window = usecs;
+}
+
+/* Get a slot for a new operation, submitting the current batch if it is
+ * full.
+ */
+static struct ila_op *ila_client_queue(struct ila_client *cl,
+				       enum dbif_req_op req_op,
+				       ila_done_cb cb, void *data)
+{
+	struct dbif_req *req;
+	struct ila_op *op;
+
+	if (cl->num_ops >= cl->batch && !cl->flushing)
+		ila_client_flush(cl);
+
+	/* Still full when called from a completion callback, or when the
+	 * callbacks of the flush filled the queue again
+	 */
+	if (cl->num_ops >= cl->batch) {
+		errno = EBUSY;
+		return NULL;
+	}
+
+	op = &cl->queue[cl->cur][cl->num_ops];
+	req = &cl->reqs[cl->cur][cl->num_ops];
+	cl->num_ops++;
+
+	memset(op, 0, sizeof(*op));
+	op->cb = cb;
+	op->data = data;
+
+	memset(req, 0, sizeof(*req));
+	req->op = req_op;
+	req->key = &op->key;
+	req->value = &op->rec;
+
+	if (cl->flush_event && cl->num_ops == 1) {
+		struct timeval tv = {
+			.tv_sec = cl->window / 1000000,
+			.tv_usec = cl->window % 1000000,
+		};
+
+		event_add(cl->flush_event, &tv);
+	}
+
+	return op;
+}
+
+static struct dbif_req *ila_op_req(struct ila_client *cl, struct ila_op *op)
+{
+	return &cl->reqs[cl->cur][op - cl->queue[cl->cur]];
+}
+
+/* Have the database stamp the generation number of a new record */
+static void ila_op_stamp_gen(struct ila_op *op, struct dbif_req *req)
+{
+	op->patches[0].op = DBIF_PATCH_GEN;
+	op->patches[0].offset = ILA_REC_GEN_OFFSET;
+
+	req->patches = op->patches;
+	req->num_patches = 1;
+}
+
+/* New records are created with the next generation number of the key,
+ * the entry must not exist.
+ */
+int ila_ident_make_async(struct ila_client *cl, __u64 ident_num,
+			 const struct in6_addr *addr,
+			 ila_done_cb cb, void *data)
+{
+	struct ila_op *op = ila_client_queue(cl, DBIF_REQ_CREATE, cb, data);
+	struct dbif_req *req;
+
+	if (!op)
+		return -1;
+
+	req = ila_op_req(cl, op);
+
+	op->key.ident.num = ident_num;
+	req->key_size = sizeof(op->key.ident);
+
+	ila_rec_hdr_init(&op->rec.ident.hdr, ILA_REC_TYPE_IDENT, 0);
+	op->rec.ident.value.addr = *addr;
+	req->value_size = sizeof(op->rec.ident);
+	ila_op_stamp_gen(op, req);
+
+	return 0;
+}
+
+int ila_ident_make_sir_async(struct ila_client *cl, __u64 ident_num,
+			     __u16 sir_id, Identifier iid,
+			     ila_done_cb cb, void *data)
+{
+	struct ila_op *op = ila_client_queue(cl, DBIF_REQ_CREATE, cb, data);
+	struct dbif_req *req;
+
+	if (!op)
+		return -1;
+
+	req = ila_op_req(cl, op);
+
+	op->key.ident.num = ident_num;
+	req->key_size = sizeof(op->key.ident);
+
+	ila_rec_hdr_init(&op->rec.hdr, ILA_REC_TYPE_IDENT_SIR, 0);
+	op->rec.ident_sir.value.iid = iid;
+	op->rec.ident_sir.value.sir_id = sir_id;
+	req->value_size = sizeof(op->rec.ident_sir);
+	ila_op_stamp_gen(op, req);
+
+	return 0;
+}
+
+static int ila_ident_set_loc_async(struct ila_client *cl, __u64 ident_num,
+				   bool cmp, __u64 from_loc, __u64 to_loc,
+				   ila_done_cb cb, void *data)
+{
+	struct ila_op *op = ila_client_queue(cl, DBIF_REQ_PATCH, cb, data);
+	struct dbif_req *req;
+
+	if (!op)
+		return -1;
+
+	req = ila_op_req(cl, op);
+
+	op->key.ident.num = ident_num;
+	req->key_size = sizeof(op->key.ident);
+
+	req->patches = op->patches;
+	req->num_patches = ila_ident_set_loc_patches(op->patches, cmp,
+						     from_loc, to_loc);
+	req->value_size = sizeof(op->rec);
+
+	return 0;
+}
+
+int ila_ident_attach_async(struct ila_client *cl, __u64 ident_num,
+			   __u64 loc_num, ila_done_cb cb, void *data)
+{
+	return ila_ident_set_loc_async(cl, ident_num, false, 0, loc_num,
+				       cb, data);
+}
+
+int ila_ident_unattach_async(struct ila_client *cl, __u64 ident_num,
+			     __u64 loc_num, ila_done_cb cb, void *data)
+{
+	return ila_ident_set_loc_async(cl, ident_num, !!loc_num, loc_num, 0,
+				       cb, data);
+}
+
+int ila_ident_move_async(struct ila_client *cl, __u64 ident_num,
+			 __u64 from_loc, __u64 to_loc,
+			 ila_done_cb cb, void *data)
+{
+	return ila_ident_set_loc_async(cl, ident_num, true, from_loc, to_loc,
+				       cb, data);
+}
+
+int ila_ident_destroy_async(struct ila_client *cl, __u64 ident_num,
+			    ila_done_cb cb, void *data)
+{
+	struct ila_op *op = ila_client_queue(cl, DBIF_REQ_DELETE, cb, data);
+
+	if (!op)
+		return -1;
+
+	op->key.ident.num = ident_num;
+	ila_op_req(cl, op)->key_size = sizeof(op->key.ident);
+
+	return 0;
+}
+
+int ila_loc_make_async(struct ila_client *cl, __u64 loc_num,
+		       Locator locator, ila_done_cb cb, void *data)
+{
+	struct ila_op *op = ila_client_queue(cl, DBIF_REQ_CREATE, cb, data);
+	struct dbif_req *req;
+
+	if (!op)
+		return -1;
+
+	req = ila_op_req(cl, op);
+
+	op->key.loc.num = loc_num;
+	req->key_size = sizeof(op->key.loc);
+
+	ila_rec_hdr_init(&op->rec.loc.hdr, ILA_REC_TYPE_LOC, 0);
+	op->rec.loc.value.locator = locator;
+	req->value_size = sizeof(op->rec.loc);
+	ila_op_stamp_gen(op, req);
+
+	return 0;
+}
+
+int ila_loc_destroy_async(struct ila_client *cl, __u64 loc_num,
+			  ila_done_cb cb, void *data)
+{
+	struct ila_op *op = ila_client_queue(cl, DBIF_REQ_DELETE, cb, data);
+
+	if (!op)
+		return -1;
+
+	op->key.loc.num = loc_num;
+	ila_op_req(cl, op)->key_size = sizeof(op->key.loc);
+
+	return 0;
+}
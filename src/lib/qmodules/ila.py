@@ -43,9 +43,181 @@ ILA_DEFAULT_MAP_PORT = 6379
 ILA_DEFAULT_IDENT_PORT = 6380
 ILA_DEFAULT_LOC_PORT = 6381
 
-import sys, getopt, redis, struct, socket, qutils
+import sys, getopt, redis, struct, socket, time, qutils
 from collections import namedtuple
 
+# ILA database records. Must match struct IlaRecHdr and the record
+# structures in ila.h
+ILA_REC_VERSION = 1
+
+ILA_REC_TYPE_MAP = 1
+ILA_REC_TYPE_IDENT = 2
+ILA_REC_TYPE_LOC = 3
+ILA_REC_TYPE_SIR = 4
+ILA_REC_TYPE_IDENT_SIR = 5
+ILA_REC_TYPE_PREP = 6
+
+ILA_REC_HDR_FMT = "=BBIQQ"
+ILA_MAP_VALUE_FMT = "QiBBBB"
+ILA_IDENT_VALUE_FMT = "QQQ"
+ILA_LOC_VALUE_FMT = "Q"
+
+# SIR prefix dictionary and compact encoding. Must match ila.h
+ILA_SIR_KEY_TAG = b"SIR\0"
+ILA_SIR_KEY_FMT = "=4sHH"
+ILA_SIR_VALUE_FMT = "Q"
+ILA_MAP_KEY_SIR_FMT = "=HQ"
+ILA_IDENT_SIR_VALUE_FMT = "QQH"
+
+# Prepared handover. Must match ila.h
+ILA_PREP_KEY_TAG = b"PRP\0"
+ILA_IDENT_PREP_KEY_FMT = "=4sIQ"
+ILA_PREP_VALUE_FMT = "Q"
+
+# Route log of the record route backend. Must match struct
+# ila_route_log_hdr and struct ila_route_log_rec in ila.h
+ILA_ROUTE_LOG_MAGIC = 0x52414c49
+ILA_ROUTE_LOG_VERSION = 1
+ILA_ROUTE_LOG_HDR_FMT = "=IHHQ"
+ILA_ROUTE_LOG_REC_FMT = "=QBB6x16s" + ILA_MAP_VALUE_FMT
+
+ILA_ROUTE_LOG_SET = 1
+ILA_ROUTE_LOG_DEL = 2
+ILA_ROUTE_LOG_FLUSH = 3
+
+# Offsets of header fields. Must match ila.h
+ILA_REC_GEN_OFFSET = 6
+ILA_REC_TIMESTAMP_OFFSET = 14
+
+# Pack a record with a header given record type, generation number, value
+# format and value fields. The generation number of a record that is
+# written is stamped by the database, see IlaMapDb.set
+def ila_rec_pack(rec_type, gen, value_fmt, *fields):
+	return struct.pack(ILA_REC_HDR_FMT + value_fmt, ILA_REC_VERSION,
+	    rec_type, 0, gen, time.time_ns(), *fields)
+
+# Unpack a record. Returns a tuple of generation number, timestamp, and the
+# value fields. Legacy values without a header have generation number zero
+def ila_rec_unpack(rec_type, value_fmt, data):
+	if (len(data) == struct.calcsize("=" + value_fmt)):
+		return (0, 0, struct.unpack("=" + value_fmt, data))
+
+	fmt = ILA_REC_HDR_FMT + value_fmt
+	if (len(data) != struct.calcsize(fmt)):
+		raise IlaParseError("Bad record size %d" % len(data))
+		return
+
+	fields = struct.unpack(fmt, data)
+	if (fields[0] != ILA_REC_VERSION or fields[1] != rec_type):
+		raise IlaParseError("Bad record version %d type %d" %
+		    (fields[0], fields[1]))
+		return
+
+	return (fields[3], fields[4], fields[5:])
+
+# Identifier record in either encoding. sir_id is None for a full address,
+# else addr2 is the identifier and addr1 is unused
+IdentRec = namedtuple('IdentRec', 'gen, sir_id, addr1, addr2, loc_num')
+
+def ila_ident_unpack(data):
+	if (len(data) == struct.calcsize(ILA_REC_HDR_FMT +
+	    ILA_IDENT_SIR_VALUE_FMT)):
+		gen, ts, fields = ila_rec_unpack(ILA_REC_TYPE_IDENT_SIR,
+		    ILA_IDENT_SIR_VALUE_FMT, data)
+		return IdentRec(gen, fields[2], 0, fields[1], fields[0])
+
+	gen, ts, fields = ila_rec_unpack(ILA_REC_TYPE_IDENT,
+	    ILA_IDENT_VALUE_FMT, data)
+	return IdentRec(gen, None, fields[0], fields[1], fields[2])
+
+def ila_ident_pack(ident, gen, loc_num):
+	if ident.sir_id is None:
+		return ila_rec_pack(ILA_REC_TYPE_IDENT, gen,
+		    ILA_IDENT_VALUE_FMT, ident.addr1, ident.addr2, loc_num)
+	else:
+		return ila_rec_pack(ILA_REC_TYPE_IDENT_SIR, gen,
+		    ILA_IDENT_SIR_VALUE_FMT, loc_num, ident.addr2, ident.sir_id)
+
+def ila_sir_key(sir_id):
+	return struct.pack(ILA_SIR_KEY_FMT, ILA_SIR_KEY_TAG, sir_id, 0)
+
+def ila_is_sir_key(key):
+	return (len(key) == struct.calcsize(ILA_SIR_KEY_FMT) and
+	    key[0:4] == ILA_SIR_KEY_TAG)
+
+def ila_map_key_sir(sir_id, iid):
+	return struct.pack(ILA_MAP_KEY_SIR_FMT, sir_id, iid)
+
+# Get the SIR prefix for an id from the dictionary in the map database
+def ila_sir_get(map_db, sir_id):
+	data = map_db.get(ila_sir_key(sir_id))
+	if data is None:
+		return None
+
+	return ila_rec_unpack(ILA_REC_TYPE_SIR, ILA_SIR_VALUE_FMT, data)[2][0]
+
+# Build the SIR prefix index from the dictionary. Only needed for a
+# database written before the index was kept
+def ila_sir_index_build(map_db):
+	map_db.sir_index_flush()
+
+	for key in map_db.iter_all():
+		if not ila_is_sir_key(key):
+			continue
+		sir_id = struct.unpack(ILA_SIR_KEY_FMT, key)[1]
+		prefix = ila_sir_get(map_db, sir_id)
+		if prefix is not None:
+			map_db.sir_index_set(prefix, sir_id)
+
+# Get the SIR prefix id for an address. The id is looked up in the SIR
+# prefix index and checked against the dictionary
+def ila_sir_find(map_db, addr):
+	prefix = struct.unpack("QQ", addr)[0]
+
+	if not map_db.sir_index_exists():
+		ila_sir_index_build(map_db)
+
+	sir_id = map_db.sir_index_get(prefix)
+	if sir_id is None or ila_sir_get(map_db, sir_id) != prefix:
+		return None
+
+	return sir_id
+
+# Set the SIR prefix of an id in the dictionary and the index
+def ila_sir_set(map_db, sir_id, prefix):
+	key = ila_sir_key(sir_id)
+
+	old_prefix = ila_sir_get(map_db, sir_id)
+	map_db.set(key, ila_rec_pack(ILA_REC_TYPE_SIR, 0,
+	    ILA_SIR_VALUE_FMT, prefix), ILA_REC_GEN_OFFSET)
+
+	if old_prefix is not None and old_prefix != prefix:
+		map_db.sir_index_del(old_prefix)
+	map_db.sir_index_set(prefix, sir_id)
+
+# Delete a SIR prefix from the dictionary and the index
+def ila_sir_del(map_db, sir_id):
+	prefix = ila_sir_get(map_db, sir_id)
+
+	map_db.delete(ila_sir_key(sir_id))
+
+	if prefix is not None and map_db.sir_index_get(prefix) == sir_id:
+		map_db.sir_index_del(prefix)
+
+# Parse a --sir-id option value
+def ila_parse_sir_id(str):
+	try:
+		sir_id = int(str)
+	except ValueError:
+		raise IlaParseError("Bad SIR prefix id %s" % str)
+		return
+
+	if (sir_id < 0 or sir_id > 0xffff):
+		raise IlaParseError("Bad SIR prefix id %s" % str)
+		return
+
+	return sir_id
+
 # ILA checksum types. Must matchs uapi/linux/ila.h
 ILA_CSUM_ADJUST_TRANSPORT = 0
 ILA_CSUM_NEUTRAL_MAP = 1
@@ -148,25 +320,430 @@ def ila_hook_name2type(str):
 	else:
 		return -1
 
+# Bucketed database layout. Must match dbif_redis.c
+ILA_BUCKET_PREFIX = b"ila:b:"
+ILA_CHANGE_CHANNEL = "ila:change"
+ILA_LOG_KEY = "ila:log"
+
+ILA_DIGEST_KEY = "ila:digest"
+
+# SIR prefix index, a hash from SIR prefix to id. Must match
+# REDIS_SIR_INDEX_KEY in dbif_redis.c
+ILA_SIR_INDEX_KEY = "ila:sir"
+
+# Generation counters. Must match REDIS_GEN_KEY in dbif_redis.c
+ILA_GEN_KEY = "ila:gen"
+
+# Parts of the server side scripts. Must match REDIS_SCRIPT_FUNCS,
+# REDIS_SCRIPT_ARGS and REDIS_SCRIPT_COMMIT in dbif_redis.c
+ILA_SCRIPT_FUNCS = """local function hash(s)
+  local a, b = 0, 0
+  for i = 1, #s do
+    local c = s:byte(i)
+    a = (a * 131 + c) %% 2147483647
+    b = (b * 137 + c) %% 131071
+  end
+  return a, b
+end
+local function digest(key, old, new)
+  local d = 0
+  if old then
+    local a, b = hash(key .. old)
+    d = d - (a * 131072 + b)
+  end
+  if new then
+    local a, b = hash(key .. new)
+    d = d + (a * 131072 + b)
+  end
+  if d == 0 then return end
+  local leaf = string.format('%%d',
+                             hash(key) %% 2 ^ tonumber(ARGV[4]))
+  local v = tonumber(redis.call('HGET', '%s',
+                                leaf) or '0')
+  redis.call('HSET', '%s', leaf,
+             string.format('%%.0f', (v + d) %% 2 ^ 48),
+             'bits', ARGV[4])
+end
+local function inc(f, order)
+  local b = {f:byte(1, 8)}
+  local s, e, d = 1, 8, 1
+  if order == 'be' then s, e, d = 8, 1, -1 end
+  for j = s, e, d do
+    if b[j] < 255 then b[j] = b[j] + 1 break end
+    b[j] = 0
+  end
+  return string.char(unpack(b))
+end
+local function less(a, b, order)
+  local s, e, d = 8, 1, -1
+  if order == 'be' then s, e, d = 1, 8, 1 end
+  for j = s, e, d do
+    local x, y = a:byte(j), b:byte(j)
+    if x ~= y then return x < y end
+  end
+  return false
+end
+local function gen(key, f, order)
+  local c = redis.call('HGET', '%s', key)
+  if not c or (f and less(c, f, order)) then c = f end
+  c = inc(c or string.char(0, 0, 0, 0, 0, 0, 0, 0), order)
+  redis.call('HSET', '%s', key, c)
+  return c
+end
+""" % (ILA_DIGEST_KEY, ILA_DIGEST_KEY, ILA_GEN_KEY, ILA_GEN_KEY)
+
+ILA_SCRIPT_ARGS = """local field = ARGV[2]
+local key = KEYS[1]
+if field ~= '' then key = field end
+local old
+if field ~= '' then old = redis.call('HGET', KEYS[1], field)
+else old = redis.call('GET', KEYS[1]) end
+"""
+
+ILA_SCRIPT_COMMIT = """if field ~= '' then
+  redis.call('PUBLISH', '%s', field)
+end
+if ARGV[3] ~= '' then
+  redis.call('XADD', '%s', 'MAXLEN', '~', ARGV[3],
+             '*', 'k', key)
+end
+if ARGV[4] ~= '' then digest(key, old, new) end
+""" % (ILA_CHANGE_CHANNEL, ILA_LOG_KEY)
+
+# Server side script for atomic in place updates. Must match
+# redis_patch_script in dbif_redis.c
+ILA_PATCH_SCRIPT = ILA_SCRIPT_FUNCS + ILA_SCRIPT_ARGS + """if not old then return false end
+local v = old
+local active, sized, matched = true, false, false
+for i = 5, #ARGV, 3 do
+  local op, off, arg = ARGV[i], tonumber(ARGV[i + 1]), ARGV[i + 2]
+  if op == 'size' then
+    sized = true
+    active = (#v == off)
+    matched = matched or active
+  elseif active then
+    if off + 8 > #v then return redis.error_reply('bad offset') end
+    local f = v:sub(off + 1, off + 8)
+    if op == 'cmp' then
+      if f ~= arg then return 0 end
+    else
+      if op == 'inc' then arg = inc(f, ARGV[1])
+      elseif op == 'gen' then arg = gen(key, f, ARGV[1]) end
+      v = v:sub(1, off) .. arg .. v:sub(off + 9)
+    end
+  end
+end
+if sized and not matched then return redis.error_reply('bad size') end
+local new = v
+if field ~= '' then redis.call('HSET', KEYS[1], field, new)
+else redis.call('SET', KEYS[1], new) end
+""" + ILA_SCRIPT_COMMIT + """return new
+"""
+
+# Server side script for updates when the digest is kept or the value is
+# stamped with a generation number. Must match redis_update_script in
+# dbif_redis.c
+ILA_UPDATE_SCRIPT = ILA_SCRIPT_FUNCS + ILA_SCRIPT_ARGS + """local new
+if ARGV[1] == 'create' and old then return 0 end
+if ARGV[1] == 'del' then
+  if not old then return 0 end
+  if field ~= '' then redis.call('HDEL', KEYS[1], field)
+  else redis.call('DEL', KEYS[1]) end
+else
+  new = ARGV[5]
+  for i = 7, #ARGV do
+    local o, f = tonumber(ARGV[i])
+    if old and o + 8 <= #old then f = old:sub(o + 1, o + 8) end
+    new = new:sub(1, o) .. gen(key, f, ARGV[6]) .. new:sub(o + 9)
+  end
+  if field ~= '' then redis.call('HSET', KEYS[1], field, new)
+  else redis.call('SET', KEYS[1], new) end
+end
+""" + ILA_SCRIPT_COMMIT + """if ARGV[7] then return new end
+return 1
+"""
+
+# Log2 of number of buckets, zero for the flat layout
+ila_db_bucket_bits = 0
+
+def ila_set_bucketed(bucket_bits):
+	global ila_db_bucket_bits
+
+	ila_db_bucket_bits = bucket_bits
+
+# Approximate length of the change log, zero for no change log
+ila_db_changelog = 0
+
+def ila_set_changelog(maxlen):
+	global ila_db_changelog
+
+	ila_db_changelog = maxlen
+
+# Log2 of the number of digest leaves, zero for no digest
+ila_db_digest_bits = 0
+
+def ila_set_digest(bits):
+	global ila_db_digest_bits
+
+	ila_db_digest_bits = bits
+
+# FNV-1a as in qhash_bytes
+def ila_hash_bytes(data, seed = 0):
+	hash = 2166136261 ^ seed
+
+	for byte in bytearray(data):
+		hash ^= byte
+		hash = (hash * 16777619) & 0xffffffff
+
+	return hash
+
 # Mapping database (currently Redis specific)
 class IlaMapDb:
 	def __init__(self, host, port):
 		self.r = redis.Redis(host = host, port = port, db = 0)
+		self.bucket_bits = ila_db_bucket_bits
+		self.changelog = ila_db_changelog
+		self.digest_bits = ila_db_digest_bits
+		self.patch_script = self.r.register_script(ILA_PATCH_SCRIPT)
+		self.update_script = self.r.register_script(ILA_UPDATE_SCRIPT)
+
+	def bucket(self, key):
+		return ILA_BUCKET_PREFIX + b"%x" % (ila_hash_bytes(key) &
+		    ((1 << self.bucket_bits) - 1))
+
+	# Arguments common to the scripts after the first
+	def script_args(self, key):
+		return [ key if self.bucket_bits else b"",
+		    self.changelog if self.changelog else b"",
+		    self.digest_bits if self.digest_bits else b"" ]
+
+	# Updates are transactions when the bucketed layout publishes the
+	# change or the change log is kept, or a script when the digest is
+	# kept or gen_offset is given, as done in dbif_redis.c. The script
+	# sets the 64-bit field at gen_offset to the next generation number
+	# of the key and returns the stored value. If pipe is given the
+	# commands are queued in that transaction instead
+	def update(self, key, data, pipe = None, gen_offset = None):
+		client = self.r if pipe is None else pipe
+
+		if self.digest_bits or gen_offset is not None:
+			keys = [ self.bucket(key) if self.bucket_bits else key ]
+			args = [ "del" if data is None else "set" ]
+			args += self.script_args(key)
+			args.append(b"" if data is None else data)
+			args.append("le" if sys.byteorder == "little" else "be")
+			if gen_offset is not None:
+				args.append(gen_offset)
+			return self.update_script(keys = keys, args = args,
+			    client = client)
+
+		if not self.bucket_bits and not self.changelog:
+			if data is None:
+				client.delete(key)
+			else:
+				client.set(key, data)
+			return
 
-	def set(self, key, data):
-		self.r.set(key, data)
+		outer = pipe
+		if pipe is None:
+			pipe = self.r.pipeline(transaction = True)
+		if self.bucket_bits:
+			if data is None:
+				pipe.hdel(self.bucket(key), key)
+			else:
+				pipe.hset(self.bucket(key), key, data)
+			pipe.publish(ILA_CHANGE_CHANNEL, key)
+		elif data is None:
+			pipe.delete(key)
+		else:
+			pipe.set(key, data)
+		if self.changelog:
+			pipe.xadd(ILA_LOG_KEY, { "k": key },
+			    maxlen = self.changelog, approximate = True)
+		if outer is None:
+			pipe.execute()
+
+	def set(self, key, data, gen_offset = None):
+		return self.update(key, data, gen_offset = gen_offset)
 
 	def get(self, key):
-		return self.r.get(key)
+		if self.bucket_bits:
+			return self.r.hget(self.bucket(key), key)
+		else:
+			return self.r.get(key)
+
+	def delete(self, key, pipe = None):
+		self.update(key, None, pipe)
+
+	# Atomically apply a list of (op, offset, arg) patch operations, see
+	# dbif.h. Returns the new value, None if the key does not exist, or
+	# 0 if a compare failed. If pipe is given the patch is queued in
+	# that transaction and its result is returned by execute
+	def patch(self, key, ops, pipe = None):
+		keys = [ self.bucket(key) if self.bucket_bits else key ]
+		args = [ "le" if sys.byteorder == "little" else "be" ]
+		args += self.script_args(key)
+
+		for op, offset, arg in ops:
+			args += [ op, offset, struct.pack("Q", arg) ]
+
+		return self.patch_script(keys = keys, args = args,
+		    client = self.r if pipe is None else pipe)
 
-	def delete(self, key):
-		self.r.delete(key)
+	def transaction(self):
+		return self.r.pipeline(transaction = True)
 
 	def iter_all(self):
-		return self.r.scan_iter("*")
+		if self.bucket_bits:
+			return (key for bucket in
+			    self.r.scan_iter(ILA_BUCKET_PREFIX + b"*", 1000)
+			    for key in self.r.hkeys(bucket))
+		else:
+			return (key for key in self.r.scan_iter("*")
+			    if key not in (ILA_LOG_KEY.encode(),
+			    ILA_DIGEST_KEY.encode(),
+			    ILA_SIR_INDEX_KEY.encode(),
+			    ILA_GEN_KEY.encode()))
+
+	# The SIR prefix index is kept outside of the buckets. An empty
+	# field marks an index that exists but has no prefixes
+	def sir_index_get(self, prefix):
+		sir_id = self.r.hget(ILA_SIR_INDEX_KEY,
+		    struct.pack("Q", prefix))
+		return None if sir_id is None else int(sir_id)
+
+	def sir_index_set(self, prefix, sir_id):
+		self.r.hset(ILA_SIR_INDEX_KEY, struct.pack("Q", prefix), sir_id)
+
+	def sir_index_del(self, prefix):
+		self.r.hdel(ILA_SIR_INDEX_KEY, struct.pack("Q", prefix))
+
+	def sir_index_exists(self):
+		return self.r.exists(ILA_SIR_INDEX_KEY)
+
+	def sir_index_flush(self):
+		pipe = self.r.pipeline(transaction = True)
+		pipe.delete(ILA_SIR_INDEX_KEY)
+		pipe.hset(ILA_SIR_INDEX_KEY, b"", b"")
+		pipe.execute()
+
+# Replay a route log. Returns a dictionary of address to the route's map
+# value fields and the number of records
+def ila_route_log_replay(path):
+	rec_size = struct.calcsize(ILA_ROUTE_LOG_REC_FMT)
+	routes = {}
+	count = 0
+
+	try:
+		f = open(path, "rb")
+	except IOError as e:
+		raise IlaParseError("Open route log: " + str(e))
+		return
+
+	with f:
+		data = f.read(struct.calcsize(ILA_ROUTE_LOG_HDR_FMT))
+		if len(data) != struct.calcsize(ILA_ROUTE_LOG_HDR_FMT):
+			raise IlaParseError("Route log too short")
+			return
+
+		magic, version, size, start = struct.unpack(
+		    ILA_ROUTE_LOG_HDR_FMT, data)
+		if (magic != ILA_ROUTE_LOG_MAGIC or
+		    version != ILA_ROUTE_LOG_VERSION or size != rec_size):
+			raise IlaParseError("Bad route log header")
+			return
+
+		while True:
+			data = f.read(rec_size * 4096)
+			if not data:
+				break
+
+			# A log of an ilad that was killed may end in a
+			# partial record
+			end = len(data) - len(data) % rec_size
+			for rec in struct.iter_unpack(ILA_ROUTE_LOG_REC_FMT,
+			    data[:end]):
+				op, addr = rec[1], rec[3]
+				if op == ILA_ROUTE_LOG_SET:
+					routes[addr] = rec[4:9]
+				elif op == ILA_ROUTE_LOG_DEL:
+					routes.pop(addr, None)
+				elif op == ILA_ROUTE_LOG_FLUSH:
+					routes.clear()
+				count += 1
+
+			if end != len(data):
+				print("Route log ends in a partial record")
+				break
+
+	return routes, count
+
+# Compare the final routes of a route log with the mappings in the
+# database. Mappings to the local locator have no route, prefixes
+# restricts the mappings to those in the SIR prefixes. Returns the
+# number of differences
+def ila_check_routes(map_db, path, local_loc, prefixes):
+	routes, count = ila_route_log_replay(path)
+	sir_prefixes = {}
+	mappings = 0
+	missing = 0
+	wrong = 0
+
+	for key in map_db.iter_all():
+		if ila_is_sir_key(key) or key[0:4] == ILA_PREP_KEY_TAG:
+			continue
+
+		if len(key) == struct.calcsize(ILA_MAP_KEY_SIR_FMT):
+			sir_id, iid = struct.unpack(ILA_MAP_KEY_SIR_FMT, key)
+			if sir_id not in sir_prefixes:
+				sir_prefixes[sir_id] = ila_sir_get(map_db,
+				    sir_id)
+			if sir_prefixes[sir_id] is None:
+				print("No SIR prefix for id %d" % sir_id)
+				continue
+			addr = struct.pack("QQ", sir_prefixes[sir_id], iid)
+		elif len(key) == 16:
+			addr = key
+		else:
+			continue
+
+		if prefixes and addr[0:8] not in prefixes:
+			continue
+
+		data = map_db.get(key)
+		if data is None:
+			continue
+
+		value = ila_rec_unpack(ILA_REC_TYPE_MAP, ILA_MAP_VALUE_FMT,
+		    data)[2]
+		if value[0] == local_loc:
+			continue
+
+		mappings += 1
+		name = socket.inet_ntop(socket.AF_INET6, addr)
+		route = routes.pop(addr, None)
+		if route is None:
+			print("Missing %s" % name)
+			missing += 1
+		elif route != tuple(value[0:5]):
+			print("Wrong %s %s expected %s" % (name,
+			    qutils.addr64_n2a(route[0]),
+			    qutils.addr64_n2a(value[0])))
+			wrong += 1
+
+	for addr in routes:
+		print("Extra %s" % socket.inet_ntop(socket.AF_INET6, addr))
+
+	print("%d records, %d mappings, %d missing, %d wrong, %d extra" %
+	    (count, mappings, missing, wrong, len(routes)))
+
+	return missing + wrong + len(routes)
 
 # Display map entry given database and key
 def ila_process_get_map(Map, map_db, key):
+	if ila_is_sir_key(key) or key[0:4] == ILA_PREP_KEY_TAG:
+		return
+
 	try:
 		data = map_db.get(key)
 	except redis.exceptions.ConnectionError:
@@ -176,7 +753,8 @@ def ila_process_get_map(Map, map_db, key):
 		print("Not found")
 		return
 
-	map_tuple = Map._make(struct.unpack("QiBBBB", data))
+	map_tuple = Map._make(ila_rec_unpack(ILA_REC_TYPE_MAP,
+	    ILA_MAP_VALUE_FMT, data)[2])
 
 	try:
 		loc = qutils.addr64_n2a(map_tuple.locator)
@@ -184,8 +762,18 @@ def ila_process_get_map(Map, map_db, key):
 		raise IlaParseError("Format locator: " + str(e))
 		return
 
+	if (len(key) == struct.calcsize(ILA_MAP_KEY_SIR_FMT)):
+		sir_id, iid = struct.unpack(ILA_MAP_KEY_SIR_FMT, key)
+		prefix = ila_sir_get(map_db, sir_id)
+		if prefix is None:
+			addr = "%d/%s" % (sir_id, qutils.addr64_n2a(iid))
+		else:
+			addr = qutils.quads2ip(prefix, iid)
+	else:
+		addr = socket.inet_ntop(socket.AF_INET6, key)
+
 	print("%s %s %s %s %s %s" % (
-	    socket.inet_ntop(socket.AF_INET6, key), loc,
+	    addr, loc,
 	    qutils.llindex2name(map_tuple.ifindex),
 	    ila_csum_mode2name(map_tuple.csum_mode),
 	    ila_ident_type2name(map_tuple.ident_type),
@@ -222,6 +810,12 @@ def ila_process_map(host, port, cmd, args):
 			return
 
 		try:
+			if map_db.get(key) is None:
+				# Try compact encoding
+				sir_id = ila_sir_find(map_db, key)
+				if sir_id is not None:
+					key = ila_map_key_sir(sir_id,
+					    struct.unpack("QQ", key)[1])
 			ila_process_get_map(Map, map_db, key)
 		except redis.exceptions.ConnectionError as e:
 			raise IlaConnectionError("Error connecting to DB: %s" % str(e))
@@ -232,10 +826,12 @@ def ila_process_map(host, port, cmd, args):
 		ident_type = ILA_ATYPE_LUID
 		csum_mode = ILA_CSUM_NEUTRAL_MAP_AUTO
 		hook_type = ILA_HOOK_ROUTE_OUTPUT
+		sir_id = None
 
 		try:
 			opts, args = getopt.getopt(args, "",
-			    [ "ident-type=", "csum-mode=", "hook-type=" ])
+			    [ "ident-type=", "csum-mode=", "hook-type=",
+			      "sir-id=" ])
 		except getopt.GetoptError as err:
 			raise IlaParseError("Parse opts: " + str(err))
 			return
@@ -256,6 +852,8 @@ def ila_process_map(host, port, cmd, args):
 				if (hook_type < 0):
 					raise IlaParseError("Bad hook type %s" % a)
 					return
+			elif o == "--sir-id":
+				sir_id = ila_parse_sir_id(a)
 
 		if (len(args) < 2):
 			raise IlaParseError("Need more args")
@@ -277,9 +875,13 @@ def ila_process_map(host, port, cmd, args):
 
 		loc = struct.unpack("Q", anum)
 
+		if sir_id is not None:
+			key = ila_map_key_sir(sir_id, struct.unpack("QQ", key)[1])
+
 		try:
-			map_db.set(key, struct.pack("QiBBBB", loc[0], 0, csum_mode,
-			    ident_type, hook_type, 0))
+			map_db.set(key, ila_rec_pack(ILA_REC_TYPE_MAP, 0,
+			    ILA_MAP_VALUE_FMT, loc[0], 0, csum_mode,
+			    ident_type, hook_type, 0), ILA_REC_GEN_OFFSET)
 		except redis.exceptions.ConnectionError as e:
 			raise IlaConnectionError("Error connecting to DB: %s" % str(e))
 			return
@@ -287,7 +889,8 @@ def ila_process_map(host, port, cmd, args):
 	elif cmd == "flush":
 		try:
 			for key in map_db.iter_all():
-				map_db.delete(key)
+				if not ila_is_sir_key(key):
+					map_db.delete(key)
 		except redis.exceptions.ConnectionError as e:
 			raise IlaConnectionError("Error connecting to DB: %s" % str(e))
 			return
@@ -305,6 +908,44 @@ def ila_process_map(host, port, cmd, args):
 
 		try:
 			map_db.delete(key)
+			sir_id = ila_sir_find(map_db, key)
+			if sir_id is not None:
+				map_db.delete(ila_map_key_sir(sir_id,
+				    struct.unpack("QQ", key)[1]))
+		except redis.exceptions.ConnectionError as e:
+			raise IlaConnectionError("Error connecting to DB: %s" % str(e))
+			return
+
+	elif cmd == "check":
+		local_loc = None
+		prefixes = []
+
+		try:
+			opts, args = getopt.getopt(args, "",
+			    [ "local-locator=", "prefix=" ])
+		except getopt.GetoptError as err:
+			raise IlaParseError("Parse opts: " + str(err))
+			return
+
+		try:
+			for o, a in opts:
+				if o == "--local-locator":
+					local_loc = struct.unpack("Q",
+					    qutils.addr64_a2n(a))[0]
+				elif o == "--prefix":
+					prefixes.append(qutils.addr64_a2n(a))
+		except qutils.QutilsError as e:
+			raise IlaParseError("Parse locator: " + str(e))
+			return
+
+		if (len(args) < 1):
+			raise IlaParseError("Need more args")
+			return
+
+		try:
+			if ila_check_routes(map_db, args[0], local_loc,
+			    prefixes):
+				sys.exit(1)
 		except redis.exceptions.ConnectionError as e:
 			raise IlaConnectionError("Error connecting to DB: %s" % str(e))
 			return
@@ -313,8 +954,132 @@ def ila_process_map(host, port, cmd, args):
 		raise IlaParseError("Unknown command '%s'" % cmd)
 		return
 
+# Display SIR prefix dictionary entry given database and key
+def ila_process_get_sir(map_db, key):
+	data = map_db.get(key)
+	if data is None:
+		print("Not found")
+		return
+
+	prefix = ila_rec_unpack(ILA_REC_TYPE_SIR, ILA_SIR_VALUE_FMT, data)[2][0]
+
+	print("%d %s" % (struct.unpack(ILA_SIR_KEY_FMT, key)[1],
+	    qutils.addr64_n2a(prefix)))
+
+# Process a SIR prefix dictionary manipulation. The dictionary is kept in
+# the map database. Args is normal argv[] list
+def ila_process_sir(host, port, cmd, args):
+	try:
+		map_db = IlaMapDb(host, port)
+	except redis.exceptions.ConnectionError as e:
+		raise IlaConnectionError("Error connecting to DB: %s" % str(e))
+		return
+
+	try:
+		if cmd == 'list':
+			for key in map_db.iter_all():
+				if ila_is_sir_key(key):
+					ila_process_get_sir(map_db, key)
+
+		elif cmd == 'get':
+			if (len(args) < 1):
+				raise IlaParseError("Need more args")
+				return
+
+			ila_process_get_sir(map_db,
+			    ila_sir_key(ila_parse_sir_id(args[0])))
+
+		elif cmd == 'add':
+			if (len(args) < 2):
+				raise IlaParseError("Need more args")
+				return
+
+			sir_id = ila_parse_sir_id(args[0])
+
+			try:
+				prefix = struct.unpack("Q",
+				    qutils.addr64_a2n(args[1]))[0]
+			except qutils.QutilsError as e:
+				raise IlaParseError("Parse prefix: " + str(e))
+				return
+
+			ila_sir_set(map_db, sir_id, prefix)
+
+		elif cmd == 'del':
+			if (len(args) < 1):
+				raise IlaParseError("Need more args")
+				return
+
+			ila_sir_del(map_db, ila_parse_sir_id(args[0]))
+
+		elif cmd == 'flush':
+			for key in map_db.iter_all():
+				if ila_is_sir_key(key):
+					map_db.delete(key)
+			map_db.sir_index_flush()
+
+		else:
+			raise IlaParseError("Unknown command '%s'" % cmd)
+			return
+
+	except redis.exceptions.ConnectionError as e:
+		raise IlaConnectionError("Error connecting to DB: %s" % str(e))
+		return
+
+# Atomically set the locator number of an identifier record in either
+# encoding, stamping the next generation number. If from_loc is not None
+# the identifier must currently be attached to that locator
+# If pipe is given the update is queued in that transaction and
+# ila_ident_set_loc_result checks the result
+def ila_ident_set_loc(map_db, ident_num, from_loc, to_loc, pipe = None):
+	try:
+		key = struct.pack("Q", int(ident_num))
+		to_loc = int(to_loc)
+		if from_loc is not None:
+			from_loc = int(from_loc)
+	except ValueError:
+		raise IlaParseError("Value error in argument")
+		return
+
+	hdr_size = struct.calcsize(ILA_REC_HDR_FMT)
+	now = time.time_ns()
+	ops = []
+
+	# Locator number is after the address in the full encoding and
+	# first in the compact one
+	for value_fmt, loc_offset in ((ILA_IDENT_VALUE_FMT, hdr_size + 16),
+	    (ILA_IDENT_SIR_VALUE_FMT, hdr_size)):
+		ops.append(("size", hdr_size + struct.calcsize("=" + value_fmt), 0))
+		if from_loc is not None:
+			ops.append(("cmp", loc_offset, from_loc))
+		ops.append(("set", loc_offset, to_loc))
+		ops.append(("gen", ILA_REC_GEN_OFFSET, 0))
+		ops.append(("set", ILA_REC_TIMESTAMP_OFFSET, now))
+
+	try:
+		ret = map_db.patch(key, ops, pipe)
+	except redis.exceptions.ConnectionError as e:
+		raise IlaConnectionError("Error connecting to DB: %s" % str(e))
+		return
+	except redis.exceptions.ResponseError as e:
+		raise IlaParseError("Update identifier %s: %s" % (ident_num, str(e)))
+		return
+
+	if pipe is None:
+		ila_ident_set_loc_result(ret, ident_num, from_loc)
+
+def ila_ident_set_loc_result(ret, ident_num, from_loc):
+	if isinstance(ret, redis.exceptions.ResponseError):
+		raise IlaParseError("Update identifier %s: %s" %
+		    (ident_num, str(ret)))
+	elif ret is None:
+		raise IlaParseError("Identifier %s not found" % ident_num)
+	elif ret == 0:
+		raise IlaParseError("Identifier %s not attached to %d" %
+		    (ident_num, from_loc))
+
 # Display identifier entry given database and key
-def ila_process_get_ident(Map, map_db, key):
+def ila_process_get_ident(map_db, key):
 	try:
 		data = map_db.get(key)
 	except redis.exceptions.ConnectionError as e:
@@ -325,17 +1090,21 @@ def ila_process_get_ident(Map, map_db, key):
 		print("Not found")
 		return
 
-	map_tuple = Map._make(struct.unpack("QQQ", data))
+	ident = ila_ident_unpack(data)
 
-	if (map_tuple.loc_num == 0):
+	if (ident.loc_num == 0):
 		loc_str = "unattached"
 	else:
-		loc_str = str(map_tuple.loc_num)
+		loc_str = str(ident.loc_num)
+
+	if ident.sir_id is None:
+		addr_str = qutils.quads2ip(ident.addr1, ident.addr2)
+	else:
+		addr_str = "%d/%s" % (ident.sir_id,
+		    qutils.addr64_n2a(ident.addr2))
 
 	print("%d %s %s" % (
-	    struct.unpack("Q", key)[0],
-	    qutils.quads2ip(map_tuple.addr1, map_tuple.addr2),
-	    loc_str))
+	    struct.unpack("Q", key)[0], addr_str, loc_str))
 
 # Process an identifier manipulation. Args is normal argv[] list
 def ila_process_ident(host, port, cmd, args):
@@ -345,12 +1114,11 @@ def ila_process_ident(host, port, cmd, args):
 		raise IlaConnectionError("Error connecting to DB: %s" % str(e))
 		return
 
-	Map = namedtuple('Ident', 'addr1, addr2, loc_num')
-
 	if cmd == 'list':
 		try:
 			for key in map_db.iter_all():
-				ila_process_get_ident(Map, map_db, key)
+				if len(key) == struct.calcsize("Q"):
+					ila_process_get_ident(map_db, key)
 		except redis.exceptions.ConnectionError as e:
 			raise IlaConnectionError("Error connecting to DB: %s" % str(e))
 			return
@@ -362,7 +1130,7 @@ def ila_process_ident(host, port, cmd, args):
 
 		try:
 			key = struct.pack("Q", int(args[0]))
-			ila_process_get_ident(Map, map_db, key)
+			ila_process_get_ident(map_db, key)
 		except redis.exceptions.ConnectionError as e:
 			raise IlaConnectionError("Error connecting to DB: %s" % str(e))
 			return
@@ -371,6 +1139,18 @@ def ila_process_ident(host, port, cmd, args):
 			return
 
 	elif cmd == "make":
+		sir_id = None
+
+		try:
+			opts, args = getopt.getopt(args, "", [ "sir-id=" ])
+		except getopt.GetoptError as err:
+			raise IlaParseError(str(err))
+			return
+
+		for o, a in opts:
+			if o == "--sir-id":
+				sir_id = ila_parse_sir_id(a)
+
 		if (len(args) < 2):
 			raise IlaParseError("Need more args")
 			return
@@ -378,7 +1158,7 @@ def ila_process_ident(host, port, cmd, args):
 		try:
 			key = struct.pack("Q", int(args[0]))
 			addr = qutils.parse_address(args[1])
-		except qutils.Qutils.Error as e:
+		except qutils.QutilsError as e:
 			raise IlaParseError("Parse address: " + str(e))
 			return
 		except ValueError:
@@ -386,8 +1166,10 @@ def ila_process_ident(host, port, cmd, args):
 			return
 
 		data = struct.unpack("QQ", addr)
+		ident = IdentRec(0, sir_id, data[0], data[1], 0)
 		try:
-			map_db.set(key, struct.pack("QQQ", data[0], data[1], 0))
+			map_db.set(key, ila_ident_pack(ident, 0, 0),
+			    ILA_REC_GEN_OFFSET)
 		except redis.exceptions.ConnectionError as e:
 			raise IlaConnectionError("Error connecting to DB: %s" % str(e))
 			return
@@ -411,42 +1193,70 @@ def ila_process_ident(host, port, cmd, args):
 			raise IlaParseError("Need more args")
 			return
 
-		key = struct.pack("Q", int(args[0]))
-		try:
-			data = map_db.get(key)
-		except redis.exceptions.ConnectionError as e:
-			raise IlaConnectionError("Error connecting to DB: %s" % str(e))
+		ila_ident_set_loc(map_db, args[0], None, args[1])
+
+	elif cmd == "unattach":
+		if (len(args) < 1):
+			raise IlaParseError("Need more args")
 			return
-		map_tuple = Map._make(struct.unpack("QQQ", data))
 
-		try:
-			map_db.set(key, struct.pack("QQQ", map_tuple.addr1,
-			    map_tuple.addr2, int(args[1])))
-		except redis.exceptions.ConnectionError as e:
-			raise IlaConnectionError("Error connecting to DB: %s" % str(e))
+		ila_ident_set_loc(map_db, args[0],
+		    args[1] if len(args) > 1 else None, "0")
+
+	elif cmd == "move":
+		if (len(args) < 3):
+			raise IlaParseError("Need more args")
 			return
 
+		ila_ident_set_loc(map_db, args[0], args[1], args[2])
 
-	elif cmd == "unattach":
-		if (len(args) < 1):
+	elif cmd == "prepare":
+		if (len(args) < 2):
 			raise IlaParseError("Need more args")
 			return
 
-		key = struct.pack("Q", int(args[0]))
 		try:
-			data = map_db.get(key)
+			key = struct.pack(ILA_IDENT_PREP_KEY_FMT, ILA_PREP_KEY_TAG,
+			    0, int(args[0]))
+			map_db.set(key, ila_rec_pack(ILA_REC_TYPE_PREP, 0,
+			    ILA_PREP_VALUE_FMT, int(args[1])), ILA_REC_GEN_OFFSET)
 		except redis.exceptions.ConnectionError as e:
 			raise IlaConnectionError("Error connecting to DB: %s" % str(e))
 			return
-		map_tuple = Map._make(struct.unpack("QQQ", data))
+		except ValueError:
+			raise IlaParseError("Value error in argument")
+			return
+
+	elif cmd == "commit" or cmd == "abort":
+		if (len(args) < (3 if cmd == "commit" else 1)):
+			raise IlaParseError("Need more args")
+			return
 
 		try:
-			map_db.set(key, struct.pack("QQQ", map_tuple.addr1,
-			    map_tuple.addr2, 0))
+			key = struct.pack(ILA_IDENT_PREP_KEY_FMT, ILA_PREP_KEY_TAG,
+			    0, int(args[0]))
+			from_loc = int(args[1]) if cmd == "commit" else None
+		except ValueError:
+			raise IlaParseError("Value error in argument")
+			return
+
+		# The move and the removal of the prepare record are one
+		# transaction. The prepare record is removed even if the
+		# move fails
+		try:
+			pipe = map_db.transaction()
+			if cmd == "commit":
+				ila_ident_set_loc(map_db, args[0], from_loc,
+				    args[2], pipe)
+			map_db.delete(key, pipe)
+			ret = pipe.execute(raise_on_error = False)
 		except redis.exceptions.ConnectionError as e:
 			raise IlaConnectionError("Error connecting to DB: %s" % str(e))
 			return
 
+		if cmd == "commit":
+			ila_ident_set_loc_result(ret[0], args[0], from_loc)
+
 	elif cmd == "flush":
 		try:
 			for key in map_db.iter_all():
@@ -469,7 +1279,8 @@ def ila_process_get_loc(Map, map_db, key):
 		print("Not found")
 		return
 
-	map_tuple = Map._make(struct.unpack("Q", data))
+	map_tuple = Map._make(ila_rec_unpack(ILA_REC_TYPE_LOC,
+	    ILA_LOC_VALUE_FMT, data)[2])
 
 	try:
 		loc = qutils.addr64_n2a(map_tuple.locator)
@@ -511,7 +1322,8 @@ def ila_process_loc(host, port, cmd, args):
 
 		data = struct.unpack("Q", loc)
 		try:
-			map_db.set(key, struct.pack("Q", data[0]))
+			map_db.set(key, ila_rec_pack(ILA_REC_TYPE_LOC, 0,
+			    ILA_LOC_VALUE_FMT, data[0]), ILA_REC_GEN_OFFSET)
 		except redis.exceptions.ConnectionError as e:
 			raise IlaConnectionError("Error set key: %s" % str(e))
 			return
@@ -0,0 +1,322 @@
+/*
+ * dbif_feed.c - Change feed relay client
+ *
+ * Copyright (c) 2018, Quantonium Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the Quantonium nor the names of its contributors
+ *     may be used to endorse or promote products derived from this software
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL QUANTONIUM BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <endian.h>
+#include <errno.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/event.h>
+#include <event2/util.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "dbif.h"
+#include "dbif_feed.h"
+
+#define DBIF_FEED_RETRY_SECS	1
+
+struct dbif_feed {
+	struct event_base *event_base;
+	struct bufferevent *bev;
+	struct event *retry_event;
+	struct sockaddr_storage ss;
+	int sslen;
+	struct dbif_filter filter;
+	bool filtered;
+	dbif_feed_cb cb;
+	void (*resync_cb)(void *data);
+	void *data;
+	__u64 epoch;
+	__u64 seq;
+	bool connected;
+	unsigned int connects;
+	unsigned int resyncs;
+	FILE *logf;
+};
+
+#define FDPRINTF(feed, format, ...) do {			\
+	if (feed->logf)						\
+		fprintf(feed->logf, format, ##__VA_ARGS__);	\
+} while (0)
+
+int dbif_feed_parse_addr(const char *addr, struct sockaddr_storage *ss,
+			 int *sslen)
+{
+	struct sockaddr_un *sun = (struct sockaddr_un *)ss;
+
+	memset(ss, 0, sizeof(*ss));
+
+	if (addr[0] == '/') {
+		if (strlen(addr) >= sizeof(sun->sun_path))
+			return -1;
+		sun->sun_family = AF_UNIX;
+		strcpy(sun->sun_path, addr);
+		*sslen = sizeof(*sun);
+		return 0;
+	}
+
+	*sslen = sizeof(*ss);
+
+	return evutil_parse_sockaddr_port(addr, (struct sockaddr *)ss, sslen);
+}
+
+static void dbif_feed_send_hello(struct dbif_feed *feed)
+{
+	struct dbif_feed_prefix prefix;
+	struct dbif_feed_hello hello;
+	int i, num = feed->filtered ? feed->filter.num_prefixes : 0;
+
+	memset(&hello, 0, sizeof(hello));
+	hello.version = htons(DBIF_FEED_VERSION);
+	hello.num_prefixes = htons(num);
+	hello.epoch = htobe64(feed->epoch);
+	hello.seq = htobe64(feed->seq);
+
+	bufferevent_write(feed->bev, &hello, sizeof(hello));
+
+	for (i = 0; i < num; i++) {
+		memset(&prefix, 0, sizeof(prefix));
+		prefix.len = htons(feed->filter.prefixes[i].len);
+		prefix.key_size = htons(feed->filter.prefixes[i].key_size);
+		memcpy(prefix.data, feed->filter.prefixes[i].data,
+		       feed->filter.prefixes[i].len);
+		bufferevent_write(feed->bev, &prefix, sizeof(prefix));
+	}
+}
+
+/* Process one batch. Returns -1 if the batch is malformed */
+static int dbif_feed_batch(struct dbif_feed *feed, struct dbif_feed_batch *hdr,
+			   __u8 *events)
+{
+	__u32 count = ntohl(hdr->count), len = ntohl(hdr->len);
+	__u8 *end = events + len, *key;
+	struct dbif_feed_event ev;
+	__u16 key_size, value_size;
+	int res;
+
+	if (ntohs(hdr->flags) & DBIF_FEED_F_RESYNC) {
+		FDPRINTF(feed, "dbif_feed: Resync\n");
+		feed->resyncs++;
+		if (feed->resync_cb)
+			feed->resync_cb(feed->data);
+	}
+
+	while (count--) {
+		if (end - events < sizeof(ev))
+			return -1;
+		memcpy(&ev, events, sizeof(ev));
+		key_size = ntohs(ev.key_size);
+		value_size = ntohs(ev.value_size);
+		events += sizeof(ev);
+
+		switch (value_size) {
+		case DBIF_FEED_NO_VALUE:
+			res = -1;
+			value_size = 0;
+			break;
+		case DBIF_FEED_DELETED:
+			res = -2;
+			value_size = 0;
+			break;
+		default:
+			res = 0;
+		}
+
+		if (end - events < key_size + value_size)
+			return -1;
+		key = events;
+		events += key_size;
+		feed->cb(key, key_size, res, value_size ? events : NULL,
+			 value_size, feed->data);
+		events += value_size;
+	}
+
+	feed->epoch = be64toh(hdr->epoch);
+	feed->seq = be64toh(hdr->seq);
+
+	return 0;
+}
+
+static void dbif_feed_retry(struct dbif_feed *feed)
+{
+	struct timeval tv = { .tv_sec = DBIF_FEED_RETRY_SECS };
+
+	feed->connected = false;
+
+	if (feed->bev) {
+		bufferevent_free(feed->bev);
+		feed->bev = NULL;
+	}
+
+	event_add(feed->retry_event, &tv);
+}
+
+static void dbif_feed_read_cb(struct bufferevent *bev, void *arg)
+{
+	struct evbuffer *input = bufferevent_get_input(bev);
+	struct dbif_feed *feed = arg;
+	struct dbif_feed_batch hdr;
+	size_t len;
+
+	while (evbuffer_get_length(input) >= sizeof(hdr)) {
+		evbuffer_copyout(input, &hdr, sizeof(hdr));
+
+		if (ntohs(hdr.version) != DBIF_FEED_VERSION) {
+			FDPRINTF(feed, "dbif_feed: Bad feed version\n");
+			dbif_feed_retry(feed);
+			return;
+		}
+
+		len = sizeof(hdr) + ntohl(hdr.len);
+		if (evbuffer_get_length(input) < len)
+			break;
+
+		if (dbif_feed_batch(feed, &hdr,
+				    evbuffer_pullup(input, len) +
+				    sizeof(hdr)) < 0) {
+			FDPRINTF(feed, "dbif_feed: Bad feed batch\n");
+			dbif_feed_retry(feed);
+			return;
+		}
+
+		evbuffer_drain(input, len);
+	}
+}
+
+static void dbif_feed_event_cb(struct bufferevent *bev, short events,
+			       void *arg)
+{
+	struct dbif_feed *feed = arg;
+
+	if (events & BEV_EVENT_CONNECTED) {
+		feed->connected = true;
+		feed->connects++;
+		dbif_feed_send_hello(feed);
+	} else if (events & (BEV_EVENT_EOF | BEV_EVENT_ERROR)) {
+		FDPRINTF(feed, "dbif_feed: Connection lost: %s\n",
+			 evutil_socket_error_to_string(
+					EVUTIL_SOCKET_ERROR()));
+		dbif_feed_retry(feed);
+	}
+}
+
+static int dbif_feed_connect(struct dbif_feed *feed)
+{
+	feed->bev = bufferevent_socket_new(feed->event_base, -1,
+					   BEV_OPT_CLOSE_ON_FREE);
+	if (!feed->bev)
+		return -1;
+
+	bufferevent_setcb(feed->bev, dbif_feed_read_cb, NULL,
+			  dbif_feed_event_cb, feed);
+	bufferevent_enable(feed->bev, EV_READ | EV_WRITE);
+
+	if (bufferevent_socket_connect(feed->bev,
+				       (struct sockaddr *)&feed->ss,
+				       feed->sslen) < 0) {
+		bufferevent_free(feed->bev);
+		feed->bev = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void dbif_feed_retry_cb(evutil_socket_t fd, short events, void *arg)
+{
+	struct dbif_feed *feed = arg;
+
+	if (dbif_feed_connect(feed) < 0)
+		dbif_feed_retry(feed);
+}
+
+struct dbif_feed *dbif_feed_watch(struct event_base *event_base,
+				  const char *addr,
+				  const struct dbif_filter *filter,
+				  dbif_feed_cb cb,
+				  void (*resync_cb)(void *data),
+				  void *data, FILE *logf)
+{
+	struct dbif_feed *feed;
+
+	feed = calloc(1, sizeof(*feed));
+	if (!feed)
+		return NULL;
+
+	feed->event_base = event_base;
+	feed->cb = cb;
+	feed->resync_cb = resync_cb;
+	feed->data = data;
+	feed->logf = logf;
+
+	if (filter) {
+		feed->filter = *filter;
+		feed->filtered = true;
+	}
+
+	if (dbif_feed_parse_addr(addr, &feed->ss, &feed->sslen) < 0) {
+		FDPRINTF(feed, "dbif_feed: Bad feed address %s\n", addr);
+		goto err;
+	}
+
+	feed->retry_event = evtimer_new(event_base, dbif_feed_retry_cb, feed);
+	if (!feed->retry_event)
+		goto err;
+
+	if (dbif_feed_connect(feed) < 0)
+		dbif_feed_retry(feed);
+
+	return feed;
+
+err:
+	free(feed);
+	return NULL;
+}
+
+void dbif_feed_stop(struct dbif_feed *feed)
+{
+	if (feed->bev)
+		bufferevent_free(feed->bev);
+	event_free(feed->retry_event);
+	free(feed);
+}
+
+void dbif_feed_get_status(struct dbif_feed *feed,
+			  struct dbif_feed_status *status)
+{
+	status->connected = feed->connected;
+	status->connects = feed->connects;
+	status->resyncs = feed->resyncs;
+	status->epoch = feed->epoch;
+	status->seq = feed->seq;
+}
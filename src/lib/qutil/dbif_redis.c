@@ -31,10 +31,16 @@
  * access a Redis database.
  */
 
+#include <endian.h>
+#include <errno.h>
 #include <linux/types.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <event2/event.h>
 #include <hiredis/async.h>
 #include <hiredis/hiredis.h>
@@ -42,35 +48,462 @@
 
 #include "dbif.h"
 #include "dbif_redis.h"
+#include "list.h"
+#include "qhash.h"
+#include "qmerkle.h"
+#include "qmetrics.h"
+#include "qprobe.h"
+
+#define REDIS_MAX_PREFIXES	16
+
+/* Bucketed layout. Logical keys are fields of a Redis hash named by the
+ * bucket prefix and the bucket number. Redis does not generate keyspace
+ * notifications per hash field so changes are published on the change
+ * channel with the logical key as the message.
+ */
+#define REDIS_BUCKET_PREFIX	"ila:b:"
+#define REDIS_BUCKET_NAME_LEN	(sizeof(REDIS_BUCKET_PREFIX) + 8)
+#define REDIS_CHANGE_CHANNEL	"ila:change"
+#define REDIS_KEYSPACE_PREFIX	"__keyspace@*__:"
+#define REDIS_MAX_BUCKET_BITS	24
+
+/* Unless the number of buckets is given it is chosen from the expected
+ * number of entries so that buckets average about REDIS_BUCKET_ENTRIES,
+ * well under the default hash-max-ziplist-entries of 128.
+ */
+#define REDIS_BUCKET_ENTRIES		64
+#define REDIS_DEFAULT_EXPECTED_ENTRIES	(1 << 20)
+
+#define REDIS_MAX_PATCHES	16
+
+#define REDIS_SCAN_MATCH_MAX	4
+
+/* Change log. With the changelog option every update also appends the
+ * key to a capped stream in the same transaction. watch_all then reads
+ * the stream instead of subscribing to notifications, so after a lost
+ * connection it resumes from the last entry read and only the keys
+ * changed in the gap are reported. A full resync is only needed if the
+ * gap was trimmed from the stream.
+ */
+#define REDIS_LOG_KEY		"ila:log"
+#define REDIS_LOG_ID_LEN	48
+#define REDIS_LOG_READ_COUNT	1000
+
+/* Backoff for reconnecting a watch */
+#define REDIS_RETRY_MIN_MS	100
+#define REDIS_RETRY_MAX_MS	10000
+
+/* Digest. With the digest option the database keeps the leaf sums of a
+ * hash tree (see qmerkle.h) over all entries in a hash, updated by the
+ * scripts below in the same step as the entry. Readers compare it with
+ * the tree of what they have loaded to find divergent ranges without
+ * reading the database. Every writer must use the same number of bits,
+ * these are recorded in the bits field.
+ */
+#define REDIS_DIGEST_KEY	"ila:digest"
+
+/* SIR prefix index. A hash from SIR prefix to id kept by the tools that
+ * write the SIR prefix dictionary so that the id of an address can be
+ * found without a scan. It isn't an entry.
+ */
+#define REDIS_SIR_INDEX_KEY	"ila:sir"
+
+/* Generation counters. A hash from key to the last generation number
+ * stamped in the key's value by DBIF_PATCH_GEN, eight bytes in the byte
+ * order of the fields. Counters are kept when the key is deleted so that
+ * a key that is created again continues from its old generation.
+ */
+#define REDIS_GEN_KEY		"ila:gen"
+
+/* Functions common to the scripts. hash() is qmerkle_hash and digest()
+ * moves the entry for key from the hash of its old value to that of its
+ * new value. A missing value is false. Fields are eight byte strings,
+ * inc() and less() work on them bytewise since Lua numbers are doubles.
+ * gen() returns the next generation number of key given the field f of
+ * its current value, if any.
+ */
+#define REDIS_SCRIPT_FUNCS						\
+	"local function hash(s)\n"					\
+	"  local a, b = 0, 0\n"						\
+	"  for i = 1, #s do\n"						\
+	"    local c = s:byte(i)\n"					\
+	"    a = (a * 131 + c) % 2147483647\n"				\
+	"    b = (b * 137 + c) % 131071\n"				\
+	"  end\n"							\
+	"  return a, b\n"						\
+	"end\n"								\
+	"local function digest(key, old, new)\n"			\
+	"  local d = 0\n"						\
+	"  if old then\n"						\
+	"    local a, b = hash(key .. old)\n"				\
+	"    d = d - (a * 131072 + b)\n"				\
+	"  end\n"							\
+	"  if new then\n"						\
+	"    local a, b = hash(key .. new)\n"				\
+	"    d = d + (a * 131072 + b)\n"				\
+	"  end\n"							\
+	"  if d == 0 then return end\n"					\
+	"  local leaf = string.format('%d',\n"				\
+	"                             hash(key) % 2 ^ tonumber(ARGV[4]))\n" \
+	"  local v = tonumber(redis.call('HGET', '" REDIS_DIGEST_KEY "',\n" \
+	"                                leaf) or '0')\n"		\
+	"  redis.call('HSET', '" REDIS_DIGEST_KEY "', leaf,\n"		\
+	"             string.format('%.0f', (v + d) % 2 ^ 48),\n"	\
+	"             'bits', ARGV[4])\n"					\
+	"end\n"								\
+	"local function inc(f, order)\n"				\
+	"  local b = {f:byte(1, 8)}\n"					\
+	"  local s, e, d = 1, 8, 1\n"					\
+	"  if order == 'be' then s, e, d = 8, 1, -1 end\n"		\
+	"  for j = s, e, d do\n"					\
+	"    if b[j] < 255 then b[j] = b[j] + 1 break end\n"		\
+	"    b[j] = 0\n"						\
+	"  end\n"							\
+	"  return string.char(unpack(b))\n"				\
+	"end\n"								\
+	"local function less(a, b, order)\n"				\
+	"  local s, e, d = 8, 1, -1\n"					\
+	"  if order == 'be' then s, e, d = 1, 8, 1 end\n"		\
+	"  for j = s, e, d do\n"					\
+	"    local x, y = a:byte(j), b:byte(j)\n"			\
+	"    if x ~= y then return x < y end\n"				\
+	"  end\n"							\
+	"  return false\n"						\
+	"end\n"								\
+	"local function gen(key, f, order)\n"				\
+	"  local c = redis.call('HGET', '" REDIS_GEN_KEY "', key)\n"	\
+	"  if not c or (f and less(c, f, order)) then c = f end\n"	\
+	"  c = inc(c or string.char(0, 0, 0, 0, 0, 0, 0, 0), order)\n"	\
+	"  redis.call('HSET', '" REDIS_GEN_KEY "', key, c)\n"		\
+	"  return c\n"							\
+	"end\n"
+
+/* Report a change to key: publish it in the bucketed layout, log it,
+ * and update the digest.
+ */
+#define REDIS_SCRIPT_COMMIT						\
+	"if field ~= '' then\n"						\
+	"  redis.call('PUBLISH', '" REDIS_CHANGE_CHANNEL "', field)\n"	\
+	"end\n"								\
+	"if ARGV[3] ~= '' then\n"					\
+	"  redis.call('XADD', '" REDIS_LOG_KEY "', 'MAXLEN', '~', ARGV[3],\n" \
+	"             '*', 'k', key)\n"					\
+	"end\n"								\
+	"if ARGV[4] ~= '' then digest(key, old, new) end\n"
+
+/* Both scripts take KEYS[1] as the key or the bucket, ARGV[2] as the
+ * field in the bucket or empty for the flat layout, ARGV[3] as the
+ * maximum length of the change log or empty if there is none, and
+ * ARGV[4] as the digest bits or empty if there is no digest.
+ */
+#define REDIS_SCRIPT_ARGS						\
+	"local field = ARGV[2]\n"					\
+	"local key = KEYS[1]\n"						\
+	"if field ~= '' then key = field end\n"				\
+	"local old\n"							\
+	"if field ~= '' then old = redis.call('HGET', KEYS[1], field)\n" \
+	"else old = redis.call('GET', KEYS[1]) end\n"
+
+/* Server side script for the patch operation. ARGV[1] is the byte order
+ * of the fields and then each operation is three arguments: name, offset
+ * (size for a size operation), and the eight byte operand. Returns the
+ * new value, nil if the key does not exist, or zero if a compare failed.
+ */
+static const char redis_patch_script[] =
+	REDIS_SCRIPT_FUNCS
+	REDIS_SCRIPT_ARGS
+	"if not old then return false end\n"
+	"local v = old\n"
+	"local active, sized, matched = true, false, false\n"
+	"for i = 5, #ARGV, 3 do\n"
+	"  local op, off, arg = ARGV[i], tonumber(ARGV[i + 1]), ARGV[i + 2]\n"
+	"  if op == 'size' then\n"
+	"    sized = true\n"
+	"    active = (#v == off)\n"
+	"    matched = matched or active\n"
+	"  elseif active then\n"
+	"    if off + 8 > #v then return redis.error_reply('bad offset') end\n"
+	"    local f = v:sub(off + 1, off + 8)\n"
+	"    if op == 'cmp' then\n"
+	"      if f ~= arg then return 0 end\n"
+	"    else\n"
+	"      if op == 'inc' then arg = inc(f, ARGV[1])\n"
+	"      elseif op == 'gen' then arg = gen(key, f, ARGV[1]) end\n"
+	"      v = v:sub(1, off) .. arg .. v:sub(off + 9)\n"
+	"    end\n"
+	"  end\n"
+	"end\n"
+	"if sized and not matched then return redis.error_reply('bad size') end\n"
+	"local new = v\n"
+	"if field ~= '' then redis.call('HSET', KEYS[1], field, new)\n"
+	"else redis.call('SET', KEYS[1], new) end\n"
+	REDIS_SCRIPT_COMMIT
+	"return new\n";
+
+/* Server side script for updates when the digest is kept or the value
+ * is stamped with a generation number. ARGV[1] is set, create, or del,
+ * ARGV[5] the value to set, ARGV[6] the byte order of the fields, and
+ * any further arguments are the offsets of fields to set to the next
+ * generation number. Returns the new value if it was stamped, else one,
+ * or zero if the key exists for a create or doesn't exist for a delete.
+ */
+static const char redis_update_script[] =
+	REDIS_SCRIPT_FUNCS
+	REDIS_SCRIPT_ARGS
+	"local new\n"
+	"if ARGV[1] == 'create' and old then return 0 end\n"
+	"if ARGV[1] == 'del' then\n"
+	"  if not old then return 0 end\n"
+	"  if field ~= '' then redis.call('HDEL', KEYS[1], field)\n"
+	"  else redis.call('DEL', KEYS[1]) end\n"
+	"else\n"
+	"  new = ARGV[5]\n"
+	"  for i = 7, #ARGV do\n"
+	"    local o, f = tonumber(ARGV[i])\n"
+	"    if old and o + 8 <= #old then f = old:sub(o + 1, o + 8) end\n"
+	"    new = new:sub(1, o) .. gen(key, f, ARGV[6]) .. new:sub(o + 9)\n"
+	"  end\n"
+	"  if field ~= '' then redis.call('HSET', KEYS[1], field, new)\n"
+	"  else redis.call('SET', KEYS[1], new) end\n"
+	"end\n"
+	REDIS_SCRIPT_COMMIT
+	"if ARGV[7] then return new end\n"
+	"return 1\n";
+
+/* Command statistics. Each operation that goes to the server is counted
+ * with the payload bytes sent and received, key and value but not the
+ * protocol, and its round trip time as seen by the caller including any
+ * reconnect. A scan is counted per page. Messages received by watches
+ * are counted with their keys, they have no latency. Errors are commands
+ * that failed, not answers such as a missing key.
+ *
+ * With the slowlog option commands that take at least that many usecs
+ * are logged with their key, up to REDIS_SLOW_KEY_MAX bytes in hex.
+ */
+enum redis_stat {
+	REDIS_STAT_READ = 0,
+	REDIS_STAT_WRITE,
+	REDIS_STAT_DELETE,
+	REDIS_STAT_PATCH,
+	REDIS_STAT_SUBMIT,
+	REDIS_STAT_SCAN,
+	REDIS_STAT_DIGEST,
+	REDIS_STAT_MESSAGE,
+	REDIS_STAT_MAX,
+};
+
+static const char *redis_stat_names[] = {
+	[REDIS_STAT_READ] = "read",
+	[REDIS_STAT_WRITE] = "write",
+	[REDIS_STAT_DELETE] = "delete",
+	[REDIS_STAT_PATCH] = "patch",
+	[REDIS_STAT_SUBMIT] = "submit",
+	[REDIS_STAT_SCAN] = "scan",
+	[REDIS_STAT_DIGEST] = "digest",
+	[REDIS_STAT_MESSAGE] = "message",
+};
+
+#define REDIS_SLOW_KEY_MAX	32
+
+struct redis_stats {
+	__u64 count;
+	__u64 errors;
+	__u64 slow;
+	__u64 bytes_out;
+	__u64 bytes_in;
+	struct qmetric time;
+	__u64 buckets[QMETRICS_NUM_BUCKETS + 1];
+};
 
+enum redis_layout {
+	REDIS_LAYOUT_FLAT = 0,
+	REDIS_LAYOUT_BUCKETED,
+};
+
+struct redis_prefix {
+	unsigned char *data;
+	size_t len;
+};
+
+/* Connection parameters. If path is set then a Unix domain socket is
+ * used, else TCP to host and port. Socket options that are zero are
+ * left at the system default; nodelay is only applied to TCP sockets.
+ *
+ * When tracking is set, watch_all uses Redis server-assisted client
+ * side caching (CLIENT TRACKING in broadcast mode for the configured
+ * key prefixes) instead of keyspace notifications. If cache_max is
+ * non-zero, values read are then held in a local cache that is
+ * invalidated by the tracking messages.
+ *
+ * In the bucketed layout entries are grouped into 2^bucket_bits hashes
+ * so that small records are held in the compact hash encoding instead of
+ * as individual top level keys. bucket_bits is derived from
+ * expected_entries if it isn't set.
+ *
+ * If changelog_max is non-zero updates are logged in a stream capped at
+ * about that many entries. If digest_bits is non-zero updates go through
+ * a script that also maintains the digest.
+ *
+ * Reconnects of the synchronous connection and lost watch connections
+ * are counted with the command statistics.
+ */
 struct redis_context {
 	redisContext *ctx;
 	char *host;
 	__u16 port;
+	char *path;
+	struct timeval connect_timeout;
+	struct timeval cmd_timeout;
+	int nodelay;
+	int keepalive;
+	int sndbuf;
+	int rcvbuf;
+	bool tracking;
+	bool tracking_active;
+	int num_prefixes;
+	struct redis_prefix prefixes[REDIS_MAX_PREFIXES];
+	unsigned int cache_max;
+	struct qhash cache;
+	struct list_head cache_lru;
+	enum redis_layout layout;
+	unsigned int bucket_bits;
+	bool bucket_bits_set;
+	unsigned long expected_entries;
+	unsigned int changelog_max;
+	unsigned int digest_bits;
+	struct redis_scan_data *tracking_watch;
+	char patch_sha[41];
+	char update_sha[41];
+	unsigned int slowlog_usecs;
+	struct redis_stats stats[REDIS_STAT_MAX];
+	__u64 cache_hits;
+	__u64 reconnects;
+	__u64 reconnect_failures;
+	__u64 watch_lost;
 	FILE *logf;
 };
 
+/* Cached value. Data holds the key followed by the value */
+struct redis_cache_entry {
+	struct qhash_node node;
+	struct list_head lru;
+	size_t key_size;
+	size_t value_size;
+	unsigned char data[];
+};
+
+#define REDIS_DEFAULT_CONNECT_TIMEOUT_MS	1500
+
 #define DBPRINTF(rdc, format, ...) do {				\
 	if (rdc->logf)						\
 		fprintf(rdc->logf, format, ##__VA_ARGS__);	\
 } while (0)
 
+static void redis_log_slow(struct redis_context *rdc, enum redis_stat stat,
+			   __u64 usecs, const void *key, size_t key_size)
+{
+	char hex[2 * REDIS_SLOW_KEY_MAX + 1] = "-";
+	size_t i, len = key_size;
+
+	if (len > REDIS_SLOW_KEY_MAX)
+		len = REDIS_SLOW_KEY_MAX;
+
+	for (i = 0; key && i < len; i++)
+		sprintf(&hex[2 * i], "%02x", ((const __u8 *)key)[i]);
+
+	DBPRINTF(rdc, "dbif_redis: Slow %s %llu usecs key %s%s\n",
+		 redis_stat_names[stat], (unsigned long long)usecs, hex,
+		 key && len < key_size ? "..." : "");
+}
+
+/* Account a command that took usecs. Key is for the slow log and may be
+ * NULL, a result of -1 is an error.
+ */
+static void redis_stat(struct redis_context *rdc, enum redis_stat stat,
+		       __u64 usecs, int ret, const void *key, size_t key_size,
+		       size_t bytes_out, size_t bytes_in)
+{
+	struct redis_stats *st = &rdc->stats[stat];
+
+	st->count++;
+	st->bytes_out += bytes_out;
+	st->bytes_in += bytes_in;
+	if (ret == -1)
+		st->errors++;
+
+	qmetric_observe(&st->time, usecs);
+
+	if (rdc->slowlog_usecs && usecs >= rdc->slowlog_usecs) {
+		st->slow++;
+		redis_log_slow(rdc, stat, usecs, key, key_size);
+	}
+}
+
+static void redis_stat_message(struct redis_context *rdc, size_t key_size)
+{
+	rdc->stats[REDIS_STAT_MESSAGE].count++;
+	rdc->stats[REDIS_STAT_MESSAGE].bytes_in += key_size;
+}
+
+/* Bytes of the keys in a reply array */
+static size_t redis_keys_len(redisReply *keys)
+{
+	size_t i, len = 0;
+
+	if (keys->type == REDIS_REPLY_ARRAY)
+		for (i = 0; i < keys->elements; i++)
+			len += keys->element[i]->len;
+
+	return len;
+}
+
+/* State of a watch. The watch has its own connection that is
+ * reestablished with exponential backoff if it is lost. Once it is back
+ * a watch on one key reports the key, and a watch on all keys resumes
+ * reading the change log from log_id or else calls resync_cb since
+ * changes may have been missed.
+ */
 struct redis_scan_data {
 	void (*cb)(void *key, size_t key_size, void *data);
+	void (*resync_cb)(void *data);
 	void *data;
+	struct redis_context *rdc;
+	struct event_base *event_base;
+	redisAsyncContext *c;
+	struct event *retry_event;
+	unsigned int retry_ms;
+	bool lost;
+	long long client_id;
+	void *key;
+	size_t key_size;
+	struct dbif_filter *filter;
+	char log_id[REDIS_LOG_ID_LEN];
 };
 
 /* Initialize dbif database instance. Context is returned in ctxp */
 static int redis_init(void **ctxp, FILE *logf, char *def_host, __u16 def_port)
 {
 	struct redis_context *rdc;
+	int i;
 
 	rdc = malloc(sizeof(*rdc));
 	if (!rdc)
 		return -1;
 
+	memset(rdc, 0, sizeof(*rdc));
+
+	for (i = 0; i < REDIS_STAT_MAX; i++) {
+		rdc->stats[i].time.type = QMETRIC_HISTOGRAM;
+		rdc->stats[i].time.counts = rdc->stats[i].buckets;
+	}
+
 	rdc->host = def_host;
 	rdc->port = def_port;
+	rdc->connect_timeout.tv_sec = REDIS_DEFAULT_CONNECT_TIMEOUT_MS / 1000;
+	rdc->connect_timeout.tv_usec =
+			(REDIS_DEFAULT_CONNECT_TIMEOUT_MS % 1000) * 1000;
+	rdc->nodelay = 1;
+	rdc->expected_entries = REDIS_DEFAULT_EXPECTED_ENTRIES;
 	rdc->logf = logf;
 
 	*ctxp = rdc;
@@ -78,35 +511,266 @@ static int redis_init(void **ctxp, FILE *logf, char *def_host, __u16 def_port)
 	return 0;
 }
 
+/* Smallest number of bucket bits for buckets of REDIS_BUCKET_ENTRIES */
+static unsigned int redis_bucket_bits(unsigned long entries)
+{
+	unsigned int bits = 0;
+
+	while (bits < REDIS_MAX_BUCKET_BITS &&
+	       (entries >> bits) > REDIS_BUCKET_ENTRIES)
+		bits++;
+
+	return bits;
+}
+
+/* Redis subopts:
+ *
+ *   host=HOST, port=PORT	TCP address of the Redis server
+ *   path=PATH			Unix domain socket of the Redis server, takes
+ *				precedence over host and port
+ *   connect-timeout=MSECS	Connect timeout (default 1500)
+ *   timeout=MSECS		Timeout for synchronous commands (default none)
+ *   nodelay=0|1		TCP_NODELAY on TCP connections (default 1)
+ *   keepalive=SECS		Enable TCP keepalive with the given idle time
+ *   sndbuf=BYTES, rcvbuf=BYTES	Socket buffer sizes
+ *   tracking			Watch with CLIENT TRACKING (Redis 6 or later)
+ *				instead of keyspace notifications
+ *   prefix=HEX			Key prefix to track, may be repeated. If none
+ *				are given all keys are tracked
+ *   cache=ENTRIES		Size of local read cache, requires tracking
+ *   layout=flat|bucketed	Store each entry as a top level key (default)
+ *				or as a field in a bucket hash
+ *   bucket-bits=BITS		Log2 of the number of buckets. Buckets
+ *				should average well under the server's
+ *				hash-max-ziplist-entries. Every reader and
+ *				writer must use the same number
+ *   entries=NUM		Expected number of entries, sets the default
+ *				bucket bits for buckets of about 64 entries
+ *				(default 1048576, i.e. 14 bits)
+ *   changelog=ENTRIES		Log updates in a stream of about this many
+ *				entries and watch the log. Should cover the
+ *				changes in the longest outage to be
+ *				recovered incrementally
+ *   digest=BITS		Maintain a digest of the entries for
+ *				anti-entropy, a hash tree with 2^BITS
+ *				leaves
+ *   slowlog=USECS		Log commands that take at least USECS with
+ *				their key
+ */
 enum {
 	OPT_HOST = 0,
 	OPT_PORT,
+	OPT_PATH,
+	OPT_CONNECT_TIMEOUT,
+	OPT_TIMEOUT,
+	OPT_NODELAY,
+	OPT_KEEPALIVE,
+	OPT_SNDBUF,
+	OPT_RCVBUF,
+	OPT_TRACKING,
+	OPT_PREFIX,
+	OPT_CACHE,
+	OPT_LAYOUT,
+	OPT_BUCKET_BITS,
+	OPT_ENTRIES,
+	OPT_CHANGELOG,
+	OPT_DIGEST,
+	OPT_SLOWLOG,
 	THE_END
 };
 
 static char *token[] = {
 	[OPT_HOST] = "host",
 	[OPT_PORT] = "port",
+	[OPT_PATH] = "path",
+	[OPT_CONNECT_TIMEOUT] = "connect-timeout",
+	[OPT_TIMEOUT] = "timeout",
+	[OPT_NODELAY] = "nodelay",
+	[OPT_KEEPALIVE] = "keepalive",
+	[OPT_SNDBUF] = "sndbuf",
+	[OPT_RCVBUF] = "rcvbuf",
+	[OPT_TRACKING] = "tracking",
+	[OPT_PREFIX] = "prefix",
+	[OPT_CACHE] = "cache",
+	[OPT_LAYOUT] = "layout",
+	[OPT_BUCKET_BITS] = "bucket-bits",
+	[OPT_ENTRIES] = "entries",
+	[OPT_CHANGELOG] = "changelog",
+	[OPT_DIGEST] = "digest",
+	[OPT_SLOWLOG] = "slowlog",
 	[THE_END] = NULL
 };
 
+static void ms_to_timeval(struct timeval *tv, unsigned long ms)
+{
+	tv->tv_sec = ms / 1000;
+	tv->tv_usec = (ms % 1000) * 1000;
+}
+
+static int parse_num_opt(struct redis_context *rdc, const char *name,
+			 char *value, long *num)
+{
+	char *end;
+
+	if (!value) {
+		DBPRINTF(rdc, "dbif_redis: Missing value for '%s'\n", name);
+		return -1;
+	}
+
+	*num = strtol(value, &end, 10);
+	if (*end != '\0' || *num < 0) {
+		DBPRINTF(rdc, "dbif_redis: Bad value '%s' for '%s'\n",
+			 value, name);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Parse a hex string key prefix */
+static int parse_prefix_opt(struct redis_context *rdc, char *value)
+{
+	struct redis_prefix *prefix;
+	size_t i, len;
+	unsigned int byte;
+
+	if (!value || (len = strlen(value)) % 2) {
+		DBPRINTF(rdc, "dbif_redis: Bad prefix '%s'\n",
+			 value ? value : "");
+		return -1;
+	}
+
+	if (rdc->num_prefixes >= REDIS_MAX_PREFIXES) {
+		DBPRINTF(rdc, "dbif_redis: Too many prefixes\n");
+		return -1;
+	}
+
+	prefix = &rdc->prefixes[rdc->num_prefixes];
+	prefix->len = len / 2;
+	prefix->data = malloc(prefix->len ? : 1);
+	if (!prefix->data)
+		return -1;
+
+	for (i = 0; i < prefix->len; i++) {
+		if (sscanf(&value[2 * i], "%2x", &byte) != 1) {
+			DBPRINTF(rdc, "dbif_redis: Bad prefix '%s'\n", value);
+			free(prefix->data);
+			return -1;
+		}
+		prefix->data[i] = byte;
+	}
+
+	rdc->num_prefixes++;
+
+	return 0;
+}
+
 /* Parse Redis specific arguments as subopts */
 static int redis_parse_args(void *ctx, char *subopts)
 {
 	struct redis_context *rdc = ctx;
 	char *value;
+	long num;
+	int opt;
 
 	if (!subopts)
 		return 0;
 
 	while (*subopts != '\0') {
-		switch (getsubopt(&subopts, token, &value)) {
+		opt = getsubopt(&subopts, token, &value);
+		switch (opt) {
 		case OPT_HOST:
 			rdc->host = strdup(value);
 			break;
 		case OPT_PORT:
 			rdc->port = strtol(value, NULL, 10);
 			break;
+		case OPT_PATH:
+			rdc->path = strdup(value);
+			break;
+		case OPT_TRACKING:
+			rdc->tracking = true;
+			break;
+		case OPT_PREFIX:
+			if (parse_prefix_opt(rdc, value) < 0)
+				return -1;
+			break;
+		case OPT_LAYOUT:
+			if (value && !strcmp(value, "flat")) {
+				rdc->layout = REDIS_LAYOUT_FLAT;
+			} else if (value && !strcmp(value, "bucketed")) {
+				rdc->layout = REDIS_LAYOUT_BUCKETED;
+			} else {
+				DBPRINTF(rdc, "dbif_redis: Bad layout '%s'\n",
+					 value ? value : "");
+				return -1;
+			}
+			break;
+		case OPT_CONNECT_TIMEOUT:
+		case OPT_TIMEOUT:
+		case OPT_NODELAY:
+		case OPT_KEEPALIVE:
+		case OPT_SNDBUF:
+		case OPT_RCVBUF:
+		case OPT_CACHE:
+		case OPT_BUCKET_BITS:
+		case OPT_ENTRIES:
+		case OPT_CHANGELOG:
+		case OPT_DIGEST:
+		case OPT_SLOWLOG:
+			if (parse_num_opt(rdc, token[opt], value, &num) < 0)
+				return -1;
+
+			switch (opt) {
+			case OPT_CONNECT_TIMEOUT:
+				ms_to_timeval(&rdc->connect_timeout, num);
+				break;
+			case OPT_TIMEOUT:
+				ms_to_timeval(&rdc->cmd_timeout, num);
+				break;
+			case OPT_NODELAY:
+				rdc->nodelay = !!num;
+				break;
+			case OPT_KEEPALIVE:
+				rdc->keepalive = num;
+				break;
+			case OPT_SNDBUF:
+				rdc->sndbuf = num;
+				break;
+			case OPT_RCVBUF:
+				rdc->rcvbuf = num;
+				break;
+			case OPT_CACHE:
+				rdc->cache_max = num;
+				break;
+			case OPT_BUCKET_BITS:
+				if (num > REDIS_MAX_BUCKET_BITS) {
+					DBPRINTF(rdc, "dbif_redis: Too many "
+						      "bucket bits\n");
+					return -1;
+				}
+				rdc->bucket_bits = num;
+				rdc->bucket_bits_set = true;
+				break;
+			case OPT_ENTRIES:
+				rdc->expected_entries = num;
+				break;
+			case OPT_CHANGELOG:
+				rdc->changelog_max = num;
+				break;
+			case OPT_DIGEST:
+				if (!num || num > QMERKLE_MAX_BITS) {
+					DBPRINTF(rdc, "dbif_redis: Bad digest "
+						 "bits %ld\n", num);
+					return -1;
+				}
+				rdc->digest_bits = num;
+				break;
+			case OPT_SLOWLOG:
+				rdc->slowlog_usecs = num;
+				break;
+			}
+			break;
 		default:
 			DBPRINTF(rdc, "dbif_redis: Bad redis opt '%s'\n",
 				 value);
@@ -114,19 +778,86 @@ static int redis_parse_args(void *ctx, char *subopts)
 		}
 	}
 
+	if (rdc->cache_max && !rdc->tracking) {
+		DBPRINTF(rdc, "dbif_redis: cache requires tracking\n");
+		return -1;
+	}
+
+	/* Tracking watches with invalidations, not the change log */
+	if (rdc->tracking && rdc->changelog_max) {
+		DBPRINTF(rdc, "dbif_redis: tracking excludes changelog\n");
+		return -1;
+	}
+
+	/* Tracking works on top level keys so would report buckets */
+	if (rdc->tracking && rdc->layout == REDIS_LAYOUT_BUCKETED) {
+		DBPRINTF(rdc, "dbif_redis: tracking requires flat layout\n");
+		return -1;
+	}
+
+	if (!rdc->bucket_bits_set)
+		rdc->bucket_bits = redis_bucket_bits(rdc->expected_entries);
+
 	return 0;
 }
 
-/* Start redis database instance. Open a connection to given host
- * and port.
+/* Apply configured socket options to a connected socket. Failure to set
+ * an option is logged but is not fatal.
+ */
+static void redis_set_sockopts(struct redis_context *rdc, int fd)
+{
+	int val, intvl;
+
+	if (!rdc->path) {
+		val = rdc->nodelay;
+		if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY,
+			       &val, sizeof(val)) < 0)
+			DBPRINTF(rdc, "dbif_redis: Set TCP_NODELAY: %s\n",
+				 strerror(errno));
+
+		if (rdc->keepalive) {
+			intvl = rdc->keepalive > 3 ? rdc->keepalive / 3 : 1;
+			val = 1;
+			if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE,
+				       &val, sizeof(val)) < 0 ||
+			    setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE,
+				       &rdc->keepalive,
+				       sizeof(rdc->keepalive)) < 0 ||
+			    setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL,
+				       &intvl, sizeof(intvl)) < 0)
+				DBPRINTF(rdc, "dbif_redis: Set keepalive: "
+					      "%s\n", strerror(errno));
+		}
+	}
+
+	if (rdc->sndbuf && setsockopt(fd, SOL_SOCKET, SO_SNDBUF,
+				      &rdc->sndbuf, sizeof(rdc->sndbuf)) < 0)
+		DBPRINTF(rdc, "dbif_redis: Set SO_SNDBUF: %s\n",
+			 strerror(errno));
+
+	if (rdc->rcvbuf && setsockopt(fd, SOL_SOCKET, SO_RCVBUF,
+				      &rdc->rcvbuf, sizeof(rdc->rcvbuf)) < 0)
+		DBPRINTF(rdc, "dbif_redis: Set SO_RCVBUF: %s\n",
+			 strerror(errno));
+}
+
+static int redis_load_scripts(struct redis_context *rdc);
+
+/* Start redis database instance. Open a connection to the Unix socket
+ * path if one is configured, else to the given host and port. The
+ * scripts are loaded once per connection, requests only send their SHA.
  */
 static int redis_start(void *ctx)
 {
 	struct redis_context *rdc = ctx;
-	struct timeval timeout = { 1, 500000 }; // 1.5 seconds
 	redisContext *dbctx;
 
-	dbctx = redisConnectWithTimeout(rdc->host, rdc->port, timeout);
+	if (rdc->path)
+		dbctx = redisConnectUnixWithTimeout(rdc->path,
+						    rdc->connect_timeout);
+	else
+		dbctx = redisConnectWithTimeout(rdc->host, rdc->port,
+						rdc->connect_timeout);
 	if (dbctx == NULL || dbctx->err) {
 		if (dbctx) {
 			DBPRINTF(rdc, "redis: Connection error: %s\n",
@@ -139,202 +870,1979 @@ static int redis_start(void *ctx)
 		return -1;
 	}
 
-	rdc->ctx = dbctx;
-
-	return 0;
-}
-
-static void redis_done(void *ctx)
-{
-	struct redis_context *rdc = ctx;
-
-	redisContext *dbctx = rdc->ctx;
-
-	rdc->ctx = NULL;
+	redis_set_sockopts(rdc, dbctx->fd);
 
-	/* Disconnects and frees the context */
-	redisFree(dbctx);
-}
+	if (rdc->cache_max) {
+		if (qhash_init(&rdc->cache, 10) < 0) {
+			DBPRINTF(rdc, "dbif_redis: Can't allocate cache\n");
+			redisFree(dbctx);
+			return -1;
+		}
+		INIT_LIST_HEAD(&rdc->cache_lru);
+	}
 
-static int redis_write(void *ctx, void *key, size_t key_size,
-		       void *value, size_t value_size)
-{
-	struct redis_context *rdc = ctx;
-	redisReply *reply;
+	if ((rdc->cmd_timeout.tv_sec || rdc->cmd_timeout.tv_usec) &&
+	    redisSetTimeout(dbctx, rdc->cmd_timeout) != REDIS_OK)
+		DBPRINTF(rdc, "dbif_redis: Set command timeout failed\n");
 
-	reply = redisCommand(rdc->ctx, "SET %b %b", key, key_size,
-			     value, value_size);
+	rdc->ctx = dbctx;
 
-	freeReplyObject(reply);
+	/* Loaded when first used if this fails */
+	if (redis_load_scripts(rdc) < 0) {
+		rdc->patch_sha[0] = '\0';
+		rdc->update_sha[0] = '\0';
+	}
 
 	return 0;
 }
 
-static int redis_read(void *ctx, void *key, size_t key_size,
-		      void *value, size_t *value_size)
+/* hiredis doesn't reestablish the synchronous connection. Reconnect if
+ * it failed, e.g. the server restarted.
+ */
+static int redis_sync_check(struct redis_context *rdc)
 {
-	struct redis_context *rdc = ctx;
-	redisContext *dbctx = rdc->ctx;
-	redisReply *reply;
+	if (!rdc->ctx->err)
+		return 0;
 
-	reply = redisCommand(dbctx, "GET %b", key, key_size);
+	if (redisReconnect(rdc->ctx) != REDIS_OK) {
+		DBPRINTF(rdc, "dbif_redis: Reconnect failed: %s\n",
+			 rdc->ctx->errstr);
+		rdc->reconnect_failures++;
+		return -1;
+	}
 
-	if (!reply->str)
-		return -2;
+	rdc->reconnects++;
 
-	if (reply->len > *value_size)
-		return -1;
+	redis_set_sockopts(rdc, rdc->ctx->fd);
 
-	*value_size = reply->len;
-	memcpy(value, reply->str, *value_size);
+	if ((rdc->cmd_timeout.tv_sec || rdc->cmd_timeout.tv_usec) &&
+	    redisSetTimeout(rdc->ctx, rdc->cmd_timeout) != REDIS_OK)
+		DBPRINTF(rdc, "dbif_redis: Set command timeout failed\n");
 
-	freeReplyObject(reply);
+	/* The server may have restarted and lost the scripts */
+	if (redis_load_scripts(rdc) < 0) {
+		rdc->patch_sha[0] = '\0';
+		rdc->update_sha[0] = '\0';
+	}
+
+	/* Tracking was on the old connection. Drop the watch so that it
+	 * reenables tracking and resyncs.
+	 */
+	if (rdc->tracking_watch && rdc->tracking_watch->c)
+		redisAsyncDisconnect(rdc->tracking_watch->c);
 
 	return 0;
 }
 
-static int redis_delete(void *ctx, void *key, size_t key_size)
+static __u32 redis_cache_hash(void *key, size_t key_size)
 {
-	struct redis_context *rdc = ctx;
-	redisReply *reply;
+	return qhash_bytes(key, key_size, 0);
+}
 
-	reply = redisCommand(rdc->ctx, "DEL %b", key, key_size);
+static struct redis_cache_entry *redis_cache_lookup(struct redis_context *rdc,
+						    void *key, size_t key_size)
+{
+	struct redis_cache_entry *rce;
+	__u32 hash = redis_cache_hash(key, key_size);
 
-	freeReplyObject(reply);
+	qhash_for_each_possible(&rdc->cache, rce, node, hash)
+		if (rce->key_size == key_size &&
+		    !memcmp(rce->data, key, key_size))
+			return rce;
 
-	return 0;
+	return NULL;
 }
 
-static int redis_scan(void *ctx,
-		      void (*cb)(void *key, size_t key_size, void *data),
-		      void *data)
+static void redis_cache_remove(struct redis_context *rdc,
+			       struct redis_cache_entry *rce)
 {
-	struct redis_context *rdc = ctx;
-	redisReply *reply;
-	int i, index = 0;
+	qhash_del(&rdc->cache, &rce->node);
+	list_del(&rce->lru);
+	free(rce);
+}
 
-	do {
-		reply = redisCommand(rdc->ctx, "SCAN %u", index);
+static void redis_cache_insert(struct redis_context *rdc,
+			       void *key, size_t key_size,
+			       void *value, size_t value_size)
+{
+	struct redis_cache_entry *rce;
 
-		if (reply->type != REDIS_REPLY_ARRAY ||
-		    reply->elements < 1)
-			return -1;
+	rce = redis_cache_lookup(rdc, key, key_size);
+	if (rce)
+		redis_cache_remove(rdc, rce);
 
-		index = strtol(reply->element[0]->str, NULL, 10);
+	if (rdc->cache.count >= rdc->cache_max)
+		redis_cache_remove(rdc, list_last_entry(&rdc->cache_lru,
+							struct redis_cache_entry,
+							lru));
 
-		for (i = 0; i < reply->element[1]->elements; i++)
-			cb(reply->element[1]->element[i]->str,
-			   reply->element[1]->element[i]->len, data);
+	rce = malloc(sizeof(*rce) + key_size + value_size);
+	if (!rce)
+		return;
 
-	} while (index);
+	rce->key_size = key_size;
+	rce->value_size = value_size;
+	memcpy(rce->data, key, key_size);
+	memcpy(&rce->data[key_size], value, value_size);
 
-	return 0;
+	qhash_add(&rdc->cache, &rce->node, redis_cache_hash(key, key_size));
+	list_add(&rce->lru, &rdc->cache_lru);
 }
 
-static void redis_callback(redisAsyncContext *c, void *r, void *data)
+static void redis_cache_invalidate(struct redis_context *rdc,
+				   void *key, size_t key_size)
 {
-	struct redis_scan_data *rdsd = data;
-
-	redisReply *reply = r;
+	struct redis_cache_entry *rce;
 
-	if (reply == NULL)
+	if (!rdc->cache_max)
 		return;
 
-	/* Three element in array? */
+	rce = redis_cache_lookup(rdc, key, key_size);
+	if (rce)
+		redis_cache_remove(rdc, rce);
+}
+
+static void redis_cache_flush(struct redis_context *rdc)
+{
+	struct redis_cache_entry *rce, *tmp;
 
-	if (reply->type != REDIS_REPLY_ARRAY || reply->elements != 4)
+	if (!rdc->cache_max)
 		return;
 
-	rdsd->cb(reply->element[3]->str, reply->element[3]->len, rdsd->data);
+	list_for_each_entry_safe(rce, tmp, &rdc->cache_lru, lru)
+		redis_cache_remove(rdc, rce);
 }
 
-static redisAsyncContext *redis_async_connect(struct redis_context *rdc,
-					      void (*cb)(void *key,
-							 size_t key_size,
-							 void *data),
-					      void *data,
-					      struct redis_scan_data **rdsdp,
-					      struct event_base *event_base)
+static void redis_done(void *ctx)
 {
-	struct redis_scan_data *rdsd;
+	struct redis_context *rdc = ctx;
 
-	redisAsyncContext *c;
+	redisContext *dbctx = rdc->ctx;
 
-	rdsd = malloc(sizeof(*rdsd));
-	if (!rdsd) {
-		perror("malloc sync context");
-		return NULL;
-	}
+	rdc->ctx = NULL;
 
-	c = redisAsyncConnect(rdc->host, rdc->port);
-	if (c->err) {
-		DBPRINTF(rdc, "dbif_redis: Async connect error: %s\n",
-			 c->errstr);
-		free(rdsd);
-		return NULL;
+	if (rdc->cache_max) {
+		redis_cache_flush(rdc);
+		qhash_destroy(&rdc->cache);
 	}
 
-	rdsd->cb = cb;
-	rdsd->data = data;
-	*rdsdp = rdsd;
+	/* Disconnects and frees the context */
+	redisFree(dbctx);
+}
 
-	redisLibeventAttach(c, event_base);
+/* Bucket name for a logical key. Buckets are selected by a hash over the
+ * whole key so that map, identifier and locator keys spread evenly.
+ */
+static void redis_bucket_name(struct redis_context *rdc, void *key,
+			      size_t key_size, char *name)
+{
+	__u32 bucket = qhash_bytes(key, key_size, 0) &
+		       ((1U << rdc->bucket_bits) - 1);
 
-	return c;
+	sprintf(name, REDIS_BUCKET_PREFIX "%x", bucket);
 }
 
-static int redis_watch_all(void *ctx,
-			   void (*cb)(void *key, size_t key_size, void *data),
-			   void *data, void **handlep,
-			   struct event_base *event_base)
+static int redis_load_script(struct redis_context *rdc, const char *script,
+			     char *sha, size_t sha_size)
 {
-	struct redis_context *rdc = ctx;
-	struct redis_scan_data *rdsd;
+	redisReply *reply;
+	int ret = 0;
+
+	reply = redisCommand(rdc->ctx, "SCRIPT LOAD %s", script);
+	if (!reply || reply->type != REDIS_REPLY_STRING ||
+	    reply->len >= sha_size) {
+		DBPRINTF(rdc, "dbif_redis: Load script failed: %s\n",
+			 reply ? reply->str : rdc->ctx->errstr);
+		ret = -1;
+	} else {
+		memcpy(sha, reply->str, reply->len);
+		sha[reply->len] = '\0';
+	}
 
-	redisAsyncContext *c = redis_async_connect(rdc, cb, data,
-						   &rdsd, event_base);
+	freeReplyObject(reply);
 
-	if (!c)
-		return -1;
+	return ret;
+}
 
-	redisAsyncCommand(c, redis_callback, rdsd, "PSUBSCRIBE __key*__:*");
+static int redis_load_scripts(struct redis_context *rdc)
+{
+	if (redis_load_script(rdc, redis_patch_script, rdc->patch_sha,
+			      sizeof(rdc->patch_sha)) < 0)
+		return -1;
 
-	*handlep = rdsd;
+	if (redis_load_script(rdc, redis_update_script, rdc->update_sha,
+			      sizeof(rdc->update_sha)) < 0)
+		return -1;
 
 	return 0;
 }
 
-static int redis_watch_one(void *ctx,  void *key, size_t key_size,
-			   void (*cb)(void *key, size_t key_size, void *data),
-			   void *data, void **handlep,
-			   struct event_base *event_base)
+/* The script cache is lost if the server restarts */
+static bool redis_is_noscript(redisReply *reply)
 {
-	struct redis_context *rdc = ctx;
-	struct redis_scan_data *rdsd;
+	return reply->type == REDIS_REPLY_ERROR &&
+	       !strncmp(reply->str, "NOSCRIPT", 8);
+}
 
-	redisAsyncContext *c = redis_async_connect(rdc, cb, data, &rdsd,
-						   event_base);
+/* Result of a pipelined request whose script must be loaded first */
+#define REDIS_SUBMIT_RETRY	-5
 
-	if (!c)
-		return -1;
+/* An update is a transaction if the bucketed layout publishes the change
+ * or the change log is kept. With the digest, or to stamp generation
+ * numbers, it is a script.
+ */
+static bool redis_update_is_eval(struct redis_context *rdc, int num_patches)
+{
+	return rdc->digest_bits || num_patches;
+}
 
-	redisAsyncCommand(c, redis_callback, rdsd, "SUBSCRIBE %b",
-			  key, key_size);
+static bool redis_update_is_multi(struct redis_context *rdc,
+				  int num_patches)
+{
+	return !redis_update_is_eval(rdc, num_patches) &&
+	       (rdc->layout == REDIS_LAYOUT_BUCKETED || rdc->changelog_max);
+}
 
-	*handlep = rdsd;
+static int redis_update_cmds(struct redis_context *rdc, int num_patches)
+{
+	if (!redis_update_is_multi(rdc, num_patches))
+		return 1;
 
-	return 0;
+	return 3 + (rdc->layout == REDIS_LAYOUT_BUCKETED) +
+	       !!rdc->changelog_max;
 }
 
-static void redis_stop_watch(void *ctx, void *handle)
+/* Queue the update script. Arguments are described with the script, the
+ * only patches are DBIF_PATCH_GEN on the value of a write or create.
+ */
+static int redis_update_eval(struct redis_context *rdc, enum dbif_req_op op,
+			     void *key, size_t key_size, void *value,
+			     size_t value_size,
+			     const struct dbif_patch *patches, int num_patches)
 {
-	/* NOTE: can only find Redis UNWATCH that cancels all watches.
-	 * This will need to be fixed somehow.
-	 */
+	static const char *op_names[] = {
+		[DBIF_REQ_WRITE] = "set",
+		[DBIF_REQ_CREATE] = "create",
+		[DBIF_REQ_DELETE] = "del",
+	};
+	char name[REDIS_BUCKET_NAME_LEN], log_max[16], bits[12];
+	char offsets[REDIS_MAX_PATCHES][24];
+	const char *argv[10 + REDIS_MAX_PATCHES];
+	size_t argvlen[10 + REDIS_MAX_PATCHES];
+	int i, argc = 0;
+
+	if (num_patches > REDIS_MAX_PATCHES ||
+	    (num_patches && op == DBIF_REQ_DELETE))
+		return -1;
 
-	struct redis_context *rdc = ctx;
+	for (i = 0; i < num_patches; i++)
+		if (patches[i].op != DBIF_PATCH_GEN ||
+		    patches[i].offset + sizeof(__u64) > value_size)
+			return -1;
+
+	if (!rdc->update_sha[0] && redis_load_scripts(rdc) < 0)
+		return -1;
+
+	snprintf(log_max, sizeof(log_max), "%u", rdc->changelog_max);
+	snprintf(bits, sizeof(bits), "%u", rdc->digest_bits);
 
-	redisCommand(rdc->ctx, "UNWATCH");
+#define ADD_ARG(s, l) do {		\
+	argv[argc] = (s);		\
+	argvlen[argc++] = (l);		\
+} while (0)
+
+	ADD_ARG("EVALSHA", 7);
+	ADD_ARG(rdc->update_sha, strlen(rdc->update_sha));
+	ADD_ARG("1", 1);
+	if (rdc->layout == REDIS_LAYOUT_BUCKETED) {
+		redis_bucket_name(rdc, key, key_size, name);
+		ADD_ARG(name, strlen(name));
+	} else {
+		ADD_ARG(key, key_size);
+	}
+	ADD_ARG(op_names[op], strlen(op_names[op]));
+	if (rdc->layout == REDIS_LAYOUT_BUCKETED)
+		ADD_ARG(key, key_size);
+	else
+		ADD_ARG("", 0);
+	ADD_ARG(log_max, rdc->changelog_max ? strlen(log_max) : 0);
+	ADD_ARG(bits, rdc->digest_bits ? strlen(bits) : 0);
+	ADD_ARG(value ? value : "", value ? value_size : 0);
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+	ADD_ARG("le", 2);
+#else
+	ADD_ARG("be", 2);
+#endif
+	for (i = 0; i < num_patches; i++) {
+		snprintf(offsets[i], sizeof(offsets[i]), "%zu",
+			 patches[i].offset);
+		ADD_ARG(offsets[i], strlen(offsets[i]));
+	}
+
+#undef ADD_ARG
+
+	/* Arguments are copied into the output buffer */
+	redisAppendCommandArgv(rdc->ctx, argc, argv, argvlen);
+
+	return 0;
+}
+
+/* Queue commands to set or delete an entry. In the bucketed layout the
+ * change is published since Redis has no notifications for hash fields,
+ * and with the change log the key is logged. These are done in a
+ * transaction with the update so watchers can't miss a change. A create
+ * only sets the entry if it doesn't exist.
+ */
+static int redis_update_append(struct redis_context *rdc,
+			       enum dbif_req_op op, void *key,
+			       size_t key_size, void *value,
+			       size_t value_size,
+			       const struct dbif_patch *patches,
+			       int num_patches)
+{
+	char name[REDIS_BUCKET_NAME_LEN];
+	bool multi = redis_update_is_multi(rdc, num_patches);
+	bool create = op == DBIF_REQ_CREATE;
+
+	if (redis_update_is_eval(rdc, num_patches))
+		return redis_update_eval(rdc, op, key, key_size,
+					 value, value_size,
+					 patches, num_patches);
+
+	if (multi)
+		redisAppendCommand(rdc->ctx, "MULTI");
+
+	if (rdc->layout == REDIS_LAYOUT_BUCKETED) {
+		redis_bucket_name(rdc, key, key_size, name);
+
+		if (op != DBIF_REQ_DELETE)
+			redisAppendCommand(rdc->ctx, create ?
+					   "HSETNX %s %b %b" : "HSET %s %b %b",
+					   name, key, key_size,
+					   value, value_size);
+		else
+			redisAppendCommand(rdc->ctx, "HDEL %s %b", name,
+					   key, key_size);
+
+		redisAppendCommand(rdc->ctx,
+				   "PUBLISH " REDIS_CHANGE_CHANNEL " %b",
+				   key, key_size);
+	} else if (op != DBIF_REQ_DELETE) {
+		redisAppendCommand(rdc->ctx, create ? "SET %b %b NX" :
+						      "SET %b %b",
+				   key, key_size, value, value_size);
+	} else {
+		redisAppendCommand(rdc->ctx, "DEL %b", key, key_size);
+	}
+
+	if (rdc->changelog_max)
+		redisAppendCommand(rdc->ctx, "XADD " REDIS_LOG_KEY
+				   " MAXLEN ~ %u * k %b",
+				   rdc->changelog_max, key, key_size);
+
+	if (multi)
+		redisAppendCommand(rdc->ctx, "EXEC");
+
+	return 0;
+}
+
+/* Result of the update command, for SET and DEL, HSET and HDEL, or the
+ * update script
+ */
+static int redis_update_result(enum dbif_req_op op, redisReply *reply)
+{
+	switch (op) {
+	case DBIF_REQ_WRITE:
+		return reply->type == REDIS_REPLY_ERROR ? -1 : 0;
+	case DBIF_REQ_CREATE:
+		if (reply->type == REDIS_REPLY_NIL ||
+		    (reply->type == REDIS_REPLY_INTEGER && !reply->integer))
+			return -4;
+		return reply->type == REDIS_REPLY_ERROR ? -1 : 0;
+	case DBIF_REQ_DELETE:
+		if (reply->type != REDIS_REPLY_INTEGER)
+			return -1;
+		return reply->integer ? 0 : -2;
+	default:
+		return -1;
+	}
+}
+
+/* Get the replies of a queued update and return its result. For a
+ * transaction only the result of the EXEC matters. A value stamped by
+ * the script is copied back to value.
+ */
+static int redis_update_reply(struct redis_context *rdc, enum dbif_req_op op,
+			      void *value, size_t value_size,
+			      int num_patches)
+{
+	int i, ret, num_cmds = redis_update_cmds(rdc, num_patches);
+	redisReply *reply = NULL, *prev;
+
+	for (i = 0; i < num_cmds; i++) {
+		prev = reply;
+		if (redisGetReply(rdc->ctx, (void **)&reply) != REDIS_OK) {
+			DBPRINTF(rdc, "dbif_redis: Update failed: %s\n",
+				 rdc->ctx->errstr);
+			freeReplyObject(prev);
+			return -1;
+		}
+		freeReplyObject(prev);
+	}
+
+	if (num_cmds == 1) {
+		ret = redis_is_noscript(reply) ? REDIS_SUBMIT_RETRY :
+						  redis_update_result(op, reply);
+		if (!ret && reply->type == REDIS_REPLY_STRING &&
+		    reply->len == value_size)
+			memcpy(value, reply->str, value_size);
+	} else if (reply->type == REDIS_REPLY_ARRAY && reply->elements) {
+		ret = redis_update_result(op, reply->element[0]);
+	} else {
+		DBPRINTF(rdc, "dbif_redis: Update failed: %s\n",
+			 reply->str ? reply->str : "aborted");
+		ret = -1;
+	}
+
+	freeReplyObject(reply);
+
+	return ret;
+}
+
+/* Do one update, reloading the scripts if the server lost them */
+static int redis_update(struct redis_context *rdc, enum dbif_req_op op,
+			void *key, size_t key_size, void *value,
+			size_t value_size,
+			const struct dbif_patch *patches, int num_patches)
+{
+	int ret;
+
+	redis_cache_invalidate(rdc, key, key_size);
+
+	if (redis_update_append(rdc, op, key, key_size, value, value_size,
+				patches, num_patches) < 0)
+		return -1;
+
+	ret = redis_update_reply(rdc, op, value, value_size, num_patches);
+	if (ret != REDIS_SUBMIT_RETRY)
+		return ret;
+
+	if (redis_load_scripts(rdc) < 0 ||
+	    redis_update_append(rdc, op, key, key_size, value, value_size,
+				patches, num_patches) < 0)
+		return -1;
+
+	ret = redis_update_reply(rdc, op, value, value_size, num_patches);
+
+	return ret == REDIS_SUBMIT_RETRY ? -1 : ret;
+}
+
+/* Scan buckets and report each field as a key. Buckets are selected by a
+ * hash over the whole key so a filter can't be pushed down and is
+ * applied here. The HKEYS of the buckets in a page are pipelined, all
+ * the replies are read before the callbacks since these may use the
+ * connection.
+ */
+static int redis_bucket_scan(struct redis_context *rdc,
+			     const struct dbif_filter *filter,
+			     void (*cb)(void *key, size_t key_size,
+					void *data),
+			     void *data)
+{
+	redisReply *reply, *fields, *keys, **replies = NULL;
+	unsigned long long index = 0;
+	size_t i, j, max_replies = 0, bytes_in;
+	__u64 start;
+	int ret = 0;
+
+	do {
+		start = qmetrics_now();
+		reply = redisCommand(rdc->ctx, "SCAN %llu MATCH "
+				     REDIS_BUCKET_PREFIX "* COUNT 1000",
+				     index);
+		if (!reply || reply->type != REDIS_REPLY_ARRAY ||
+		    reply->elements < 2) {
+			redis_stat(rdc, REDIS_STAT_SCAN,
+				   qmetrics_now() - start, -1, NULL, 0, 0, 0);
+			freeReplyObject(reply);
+			free(replies);
+			return -1;
+		}
+
+		index = strtoull(reply->element[0]->str, NULL, 10);
+		keys = reply->element[1];
+
+		redis_stat(rdc, REDIS_STAT_SCAN, qmetrics_now() - start, 0,
+			   NULL, 0, 0, redis_keys_len(keys));
+
+		QPROBE2(dbif_redis, scan_page, index, keys->elements);
+
+		if (keys->elements > max_replies) {
+			free(replies);
+			max_replies = keys->elements;
+			replies = calloc(max_replies, sizeof(*replies));
+			if (!replies) {
+				freeReplyObject(reply);
+				return -1;
+			}
+		}
+
+		start = qmetrics_now();
+
+		for (i = 0; i < keys->elements; i++)
+			redisAppendCommand(rdc->ctx, "HKEYS %b",
+					   keys->element[i]->str,
+					   keys->element[i]->len);
+
+		/* Every reply is read to keep the connection in step */
+		bytes_in = 0;
+		for (i = 0; i < keys->elements; i++) {
+			if (redisGetReply(rdc->ctx, (void **)&replies[i]) !=
+			    REDIS_OK || !replies[i]) {
+				replies[i] = NULL;
+				ret = -1;
+			} else {
+				bytes_in += redis_keys_len(replies[i]);
+			}
+		}
+
+		redis_stat(rdc, REDIS_STAT_SCAN, qmetrics_now() - start,
+			   ret, NULL, 0, 0, bytes_in);
+
+		for (i = 0; i < keys->elements; i++) {
+			fields = replies[i];
+			if (!fields)
+				continue;
+
+			if (!ret && fields->type == REDIS_REPLY_ARRAY)
+				for (j = 0; j < fields->elements; j++)
+					if (dbif_filter_match(filter,
+						fields->element[j]->str,
+						fields->element[j]->len))
+						cb(fields->element[j]->str,
+						   fields->element[j]->len,
+						   data);
+
+			freeReplyObject(fields);
+		}
+
+		freeReplyObject(reply);
+	} while (index && !ret);
+
+	free(replies);
+
+	return ret;
+}
+
+static int redis_write(void *ctx, void *key, size_t key_size,
+		       void *value, size_t value_size)
+{
+	struct redis_context *rdc = ctx;
+	__u64 start = qmetrics_now();
+	int ret;
+
+	QPROBE4(dbif_redis, write_begin, key, key_size, value, value_size);
+
+	if (redis_sync_check(rdc) < 0)
+		ret = -1;
+	else
+		ret = redis_update(rdc, DBIF_REQ_WRITE, key, key_size,
+				   value, value_size, NULL, 0);
+
+	redis_stat(rdc, REDIS_STAT_WRITE, qmetrics_now() - start, ret,
+		   key, key_size, key_size + value_size, 0);
+
+	QPROBE3(dbif_redis, write_end, key, key_size, ret);
+
+	return ret;
+}
+
+static int __redis_read(struct redis_context *rdc, void *key,
+			size_t key_size, void *value, size_t *value_size)
+{
+	redisContext *dbctx = rdc->ctx;
+	struct redis_cache_entry *rce;
+	redisReply *reply = NULL;
+	__u64 start = qmetrics_now();
+	int ret = 0;
+
+	if (redis_sync_check(rdc) < 0) {
+		ret = -1;
+		goto out;
+	}
+
+	/* A hit in the cache isn't a command */
+	if (rdc->cache_max && rdc->tracking_active) {
+		rce = redis_cache_lookup(rdc, key, key_size);
+		if (rce) {
+			if (rce->value_size > *value_size)
+				return -1;
+
+			*value_size = rce->value_size;
+			memcpy(value, &rce->data[key_size], *value_size);
+
+			/* Move to head of LRU list */
+			list_del(&rce->lru);
+			list_add(&rce->lru, &rdc->cache_lru);
+
+			rdc->cache_hits++;
+
+			return 0;
+		}
+	}
+
+	if (rdc->layout == REDIS_LAYOUT_BUCKETED) {
+		char name[REDIS_BUCKET_NAME_LEN];
+
+		redis_bucket_name(rdc, key, key_size, name);
+		reply = redisCommand(dbctx, "HGET %s %b", name,
+				     key, key_size);
+	} else {
+		reply = redisCommand(dbctx, "GET %b", key, key_size);
+	}
+	if (!reply) {
+		ret = -1;
+		goto out;
+	}
+
+	if (!reply->str) {
+		ret = -2;
+		goto out;
+	}
+
+	if (reply->len > *value_size) {
+		ret = -1;
+		goto out;
+	}
+
+	*value_size = reply->len;
+	memcpy(value, reply->str, *value_size);
+
+	/* Only cache once tracking is on, otherwise we could miss an
+	 * invalidation.
+	 */
+	if (rdc->cache_max && rdc->tracking_active)
+		redis_cache_insert(rdc, key, key_size, value, *value_size);
+
+out:
+	freeReplyObject(reply);
+
+	redis_stat(rdc, REDIS_STAT_READ, qmetrics_now() - start, ret,
+		   key, key_size, key_size, ret ? 0 : *value_size);
+
+	return ret;
+}
+
+static int redis_read(void *ctx, void *key, size_t key_size,
+		      void *value, size_t *value_size)
+{
+	int ret;
+
+	QPROBE2(dbif_redis, read_begin, key, key_size);
+
+	ret = __redis_read(ctx, key, key_size, value, value_size);
+
+	QPROBE5(dbif_redis, read_end, key, key_size, value,
+		ret ? 0 : *value_size, ret);
+
+	return ret;
+}
+
+static int redis_delete(void *ctx, void *key, size_t key_size)
+{
+	struct redis_context *rdc = ctx;
+	__u64 start = qmetrics_now();
+	int ret;
+
+	QPROBE2(dbif_redis, delete_begin, key, key_size);
+
+	if (redis_sync_check(rdc) < 0)
+		ret = -1;
+	else
+		ret = redis_update(rdc, DBIF_REQ_DELETE, key, key_size,
+				   NULL, 0, NULL, 0);
+	if (ret == -2)
+		ret = 0;
+
+	redis_stat(rdc, REDIS_STAT_DELETE, qmetrics_now() - start, ret,
+		   key, key_size, key_size, 0);
+
+	QPROBE3(dbif_redis, delete_end, key, key_size, ret);
+
+	return ret;
+}
+
+/* Load the patch script, its SHA1 is used for EVALSHA */
+
+static const char *redis_patch_names[] = {
+	[DBIF_PATCH_SIZE] = "size",
+	[DBIF_PATCH_CMP] = "cmp",
+	[DBIF_PATCH_SET] = "set",
+	[DBIF_PATCH_INC] = "inc",
+	[DBIF_PATCH_GEN] = "gen",
+};
+
+/* Arguments of an EVALSHA of the patch script. The operands are kept
+ * here since the argument vector points to them.
+ */
+struct redis_patch_args {
+	const char *argv[8 + 3 * REDIS_MAX_PATCHES];
+	size_t argvlen[8 + 3 * REDIS_MAX_PATCHES];
+	int argc;
+	char name[REDIS_BUCKET_NAME_LEN];
+	char log_max[16];
+	char digest_bits[12];
+	char offsets[REDIS_MAX_PATCHES][24];
+	__u64 args[REDIS_MAX_PATCHES];
+};
+
+static int redis_patch_args(struct redis_context *rdc,
+			    struct redis_patch_args *rpa, void *key,
+			    size_t key_size,
+			    const struct dbif_patch *patches, int num_patches)
+{
+	int i;
+
+	if (num_patches > REDIS_MAX_PATCHES ||
+	    (!rdc->patch_sha[0] && redis_load_scripts(rdc) < 0))
+		return -1;
+
+	rpa->argc = 0;
+
+#define ADD_ARG(s, l) do {			\
+	rpa->argv[rpa->argc] = (s);		\
+	rpa->argvlen[rpa->argc++] = (l);	\
+} while (0)
+
+	ADD_ARG("EVALSHA", 7);
+	ADD_ARG(rdc->patch_sha, strlen(rdc->patch_sha));
+	ADD_ARG("1", 1);
+	if (rdc->layout == REDIS_LAYOUT_BUCKETED) {
+		redis_bucket_name(rdc, key, key_size, rpa->name);
+		ADD_ARG(rpa->name, strlen(rpa->name));
+	} else {
+		ADD_ARG(key, key_size);
+	}
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+	ADD_ARG("le", 2);
+#else
+	ADD_ARG("be", 2);
+#endif
+	if (rdc->layout == REDIS_LAYOUT_BUCKETED)
+		ADD_ARG(key, key_size);
+	else
+		ADD_ARG("", 0);
+	if (rdc->changelog_max) {
+		snprintf(rpa->log_max, sizeof(rpa->log_max), "%u",
+			 rdc->changelog_max);
+		ADD_ARG(rpa->log_max, strlen(rpa->log_max));
+	} else {
+		ADD_ARG("", 0);
+	}
+	if (rdc->digest_bits) {
+		snprintf(rpa->digest_bits, sizeof(rpa->digest_bits), "%u",
+			 rdc->digest_bits);
+		ADD_ARG(rpa->digest_bits, strlen(rpa->digest_bits));
+	} else {
+		ADD_ARG("", 0);
+	}
+
+	for (i = 0; i < num_patches; i++) {
+		snprintf(rpa->offsets[i], sizeof(rpa->offsets[i]), "%llu",
+			 (unsigned long long)(patches[i].op == DBIF_PATCH_SIZE ?
+					      patches[i].arg :
+					      patches[i].offset));
+		rpa->args[i] = patches[i].arg;
+
+		ADD_ARG(redis_patch_names[patches[i].op],
+			strlen(redis_patch_names[patches[i].op]));
+		ADD_ARG(rpa->offsets[i], strlen(rpa->offsets[i]));
+		ADD_ARG((char *)&rpa->args[i], sizeof(rpa->args[i]));
+	}
+
+#undef ADD_ARG
+
+	return 0;
+}
+
+/* Convert the reply of the patch script to a dbif return value */
+static int redis_patch_result(struct redis_context *rdc, redisReply *reply,
+			      void *value, size_t *value_size)
+{
+	switch (reply->type) {
+	case REDIS_REPLY_STRING:
+		if (value) {
+			if (reply->len > *value_size)
+				return -1;
+			*value_size = reply->len;
+			memcpy(value, reply->str, reply->len);
+		}
+		return 0;
+	case REDIS_REPLY_NIL:
+		return -2;
+	case REDIS_REPLY_INTEGER:
+		return -3;
+	case REDIS_REPLY_ERROR:
+		DBPRINTF(rdc, "dbif_redis: Patch failed: %s\n", reply->str);
+		return -1;
+	default:
+		return -1;
+	}
+}
+
+static int __redis_patch(struct redis_context *rdc, void *key,
+			 size_t key_size, const struct dbif_patch *patches,
+			 int num_patches, void *value, size_t *value_size)
+{
+	struct redis_patch_args rpa;
+	redisReply *reply;
+	int ret;
+
+	if (redis_sync_check(rdc) < 0 ||
+	    redis_patch_args(rdc, &rpa, key, key_size, patches,
+			     num_patches) < 0)
+		return -1;
+
+	redis_cache_invalidate(rdc, key, key_size);
+
+	reply = redisCommandArgv(rdc->ctx, rpa.argc, rpa.argv, rpa.argvlen);
+	if (!reply)
+		return -1;
+
+	if (redis_is_noscript(reply) && !redis_load_scripts(rdc)) {
+		freeReplyObject(reply);
+		reply = redisCommandArgv(rdc->ctx, rpa.argc, rpa.argv,
+					 rpa.argvlen);
+		if (!reply)
+			return -1;
+	}
+
+	ret = redis_patch_result(rdc, reply, value, value_size);
+
+	freeReplyObject(reply);
+
+	return ret;
+}
+
+static int redis_patch(void *ctx, void *key, size_t key_size,
+		       const struct dbif_patch *patches, int num_patches,
+		       void *value, size_t *value_size)
+{
+	struct redis_context *rdc = ctx;
+	__u64 start = qmetrics_now();
+	int ret;
+
+	ret = __redis_patch(rdc, key, key_size, patches, num_patches,
+			    value, value_size);
+
+	redis_stat(rdc, REDIS_STAT_PATCH, qmetrics_now() - start, ret,
+		   key, key_size, key_size + num_patches * sizeof(__u64),
+		   !ret && value ? *value_size : 0);
+
+	return ret;
+}
+
+/* Get the result of one request in a pipeline */
+static int redis_submit_result(struct redis_context *rdc,
+			       struct dbif_req *req)
+{
+	redisReply *reply;
+	int ret;
+
+	if (req->op != DBIF_REQ_PATCH)
+		return redis_update_reply(rdc, req->op, req->value,
+					  req->value_size, req->num_patches);
+
+	if (redisGetReply(rdc->ctx, (void **)&reply) != REDIS_OK)
+		return -1;
+
+	/* The script can't be loaded until the pipeline is drained, the
+	 * caller retries the request.
+	 */
+	if (redis_is_noscript(reply))
+		ret = REDIS_SUBMIT_RETRY;
+	else
+		ret = redis_patch_result(rdc, reply, req->value,
+					 &req->value_size);
+
+	freeReplyObject(reply);
+
+	return ret;
+}
+
+static int __redis_submit(struct redis_context *rdc, struct dbif_req *reqs,
+			  int num_reqs)
+{
+	struct redis_patch_args rpa;
+	struct dbif_req *req;
+	bool retry = false;
+	int i;
+
+	if (redis_sync_check(rdc) < 0)
+		return -1;
+
+	for (i = 0; i < num_reqs; i++) {
+		req = &reqs[i];
+
+		redis_cache_invalidate(rdc, req->key, req->key_size);
+
+		switch (req->op) {
+		case DBIF_REQ_PATCH:
+			req->result = redis_patch_args(rdc, &rpa, req->key,
+						       req->key_size,
+						       req->patches,
+						       req->num_patches);
+			if (req->result < 0)
+				continue;
+			/* Arguments are copied into the output buffer */
+			redisAppendCommandArgv(rdc->ctx, rpa.argc, rpa.argv,
+					       rpa.argvlen);
+			break;
+		case DBIF_REQ_WRITE:
+		case DBIF_REQ_CREATE:
+		case DBIF_REQ_DELETE:
+			req->result = redis_update_append(rdc, req->op,
+							  req->key,
+							  req->key_size,
+							  req->value,
+							  req->value_size,
+							  req->patches,
+							  req->num_patches);
+			if (req->result < 0)
+				continue;
+			break;
+		default:
+			req->result = -1;
+			continue;
+		}
+
+		req->result = 0;
+	}
+
+	for (i = 0; i < num_reqs; i++) {
+		req = &reqs[i];
+
+		if (req->result < 0)
+			continue;
+
+		req->result = redis_submit_result(rdc, req);
+		if (req->result == REDIS_SUBMIT_RETRY)
+			retry = true;
+	}
+
+	if (!retry)
+		return 0;
+
+	/* The scripts are loaded with the connection, so this only
+	 * happens if they were flushed on the server. Requests later in
+	 * the batch have then been applied before the retried ones.
+	 */
+	for (i = 0; i < num_reqs; i++) {
+		req = &reqs[i];
+
+		if (req->result != REDIS_SUBMIT_RETRY)
+			continue;
+
+		if (req->op == DBIF_REQ_PATCH)
+			req->result = __redis_patch(rdc, req->key,
+						    req->key_size,
+						    req->patches,
+						    req->num_patches,
+						    req->value,
+						    &req->value_size);
+		else
+			req->result = redis_update(rdc, req->op, req->key,
+						   req->key_size, req->value,
+						   req->value_size,
+						   req->patches,
+						   req->num_patches);
+	}
+
+	return 0;
+}
+
+/* The batch is one command in the statistics, failed requests in it are
+ * counted as errors.
+ */
+static int redis_submit(void *ctx, struct dbif_req *reqs, int num_reqs)
+{
+	struct redis_context *rdc = ctx;
+	size_t bytes_out = 0, bytes_in = 0;
+	__u64 start = qmetrics_now();
+	struct dbif_req *req;
+	int i, ret;
+
+	ret = __redis_submit(rdc, reqs, num_reqs);
+
+	for (i = 0; i < num_reqs; i++) {
+		req = &reqs[i];
+
+		if (req->op == DBIF_REQ_PATCH) {
+			bytes_out += req->key_size +
+				     req->num_patches * sizeof(__u64);
+			if (!req->result && req->value)
+				bytes_in += req->value_size;
+		} else {
+			bytes_out += req->key_size + req->value_size;
+		}
+
+		if (!ret && req->result == -1)
+			rdc->stats[REDIS_STAT_SUBMIT].errors++;
+	}
+
+	redis_stat(rdc, REDIS_STAT_SUBMIT, qmetrics_now() - start, ret,
+		   NULL, 0, bytes_out, bytes_in);
+
+	return ret;
+}
+
+/* Make a glob pattern that matches keys starting with a prefix, and of
+ * key_size bytes if that is non-zero, following a literal lead string.
+ * Glob special characters in the prefix are escaped. Returns a malloced
+ * pattern with its length in lenp.
+ */
+static char *redis_glob_pattern(const char *lead, const void *prefix,
+				size_t len, size_t key_size, size_t *lenp)
+{
+	size_t lead_len = strlen(lead);
+	const __u8 *data = prefix;
+	char *pattern, *p;
+	size_t i;
+
+	pattern = malloc(lead_len + 2 * len +
+			 (key_size ? key_size - len : 1));
+	if (!pattern)
+		return NULL;
+
+	memcpy(pattern, lead, lead_len);
+	p = pattern + lead_len;
+
+	for (i = 0; i < len; i++) {
+		if (data[i] && strchr("*?[]\\", data[i]))
+			*p++ = '\\';
+		*p++ = data[i];
+	}
+
+	if (key_size) {
+		memset(p, '?', key_size - len);
+		p += key_size - len;
+	} else {
+		*p++ = '*';
+	}
+
+	*lenp = p - pattern;
+
+	return pattern;
+}
+
+/* The change log, the digest, and the SIR index are not entries */
+static bool redis_is_meta_key(const char *key, size_t key_size)
+{
+	return (key_size == sizeof(REDIS_LOG_KEY) - 1 &&
+		!memcmp(key, REDIS_LOG_KEY, key_size)) ||
+	       (key_size == sizeof(REDIS_DIGEST_KEY) - 1 &&
+		!memcmp(key, REDIS_DIGEST_KEY, key_size)) ||
+	       (key_size == sizeof(REDIS_SIR_INDEX_KEY) - 1 &&
+		!memcmp(key, REDIS_SIR_INDEX_KEY, key_size)) ||
+	       (key_size == sizeof(REDIS_GEN_KEY) - 1 &&
+		!memcmp(key, REDIS_GEN_KEY, key_size));
+}
+
+static int redis_scan_match(struct redis_context *rdc, const char *pattern,
+			    size_t len, const struct dbif_filter *filter,
+			    void (*cb)(void *key, size_t key_size,
+				       void *data),
+			    void *data)
+{
+	unsigned long long index = 0;
+	redisReply *reply, *keys;
+	__u64 start;
+	size_t i;
+
+	do {
+		start = qmetrics_now();
+		reply = redisCommand(rdc->ctx, "SCAN %llu MATCH %b COUNT 1000",
+				     index, pattern, len);
+		if (!reply || reply->type != REDIS_REPLY_ARRAY ||
+		    reply->elements < 2) {
+			redis_stat(rdc, REDIS_STAT_SCAN,
+				   qmetrics_now() - start, -1, NULL, 0, 0, 0);
+			freeReplyObject(reply);
+			return -1;
+		}
+
+		index = strtoull(reply->element[0]->str, NULL, 10);
+		keys = reply->element[1];
+
+		redis_stat(rdc, REDIS_STAT_SCAN, qmetrics_now() - start, 0,
+			   NULL, 0, 0, redis_keys_len(keys));
+
+		QPROBE2(dbif_redis, scan_page, index, keys->elements);
+
+		for (i = 0; i < keys->elements; i++)
+			if (!redis_is_meta_key(keys->element[i]->str,
+					      keys->element[i]->len) &&
+			    dbif_filter_match(filter, keys->element[i]->str,
+					      keys->element[i]->len))
+				cb(keys->element[i]->str,
+				   keys->element[i]->len, data);
+
+		freeReplyObject(reply);
+	} while (index);
+
+	return 0;
+}
+
+/* Scan keys. Each filter prefix is scanned with a MATCH pattern so that
+ * the server only returns matching keys. Each of those walks the whole
+ * keyspace, so with more than REDIS_SCAN_MATCH_MAX prefixes all keys are
+ * scanned once and filtered here.
+ */
+static int redis_scan(void *ctx, const struct dbif_filter *filter,
+		      void (*cb)(void *key, size_t key_size, void *data),
+		      void *data)
+{
+	struct redis_context *rdc = ctx;
+	const struct dbif_filter_prefix *prefix;
+	char *pattern;
+	size_t len;
+	int i, ret;
+
+	if (redis_sync_check(rdc) < 0)
+		return -1;
+
+	if (rdc->layout == REDIS_LAYOUT_BUCKETED)
+		return redis_bucket_scan(rdc, filter, cb, data);
+
+	if (!filter || filter->num_prefixes > REDIS_SCAN_MATCH_MAX)
+		return redis_scan_match(rdc, "*", 1, filter, cb, data);
+
+	for (i = 0; i < filter->num_prefixes; i++) {
+		prefix = &filter->prefixes[i];
+
+		pattern = redis_glob_pattern("", prefix->data, prefix->len,
+					     prefix->key_size, &len);
+		if (!pattern)
+			return -1;
+
+		ret = redis_scan_match(rdc, pattern, len, filter, cb, data);
+		free(pattern);
+		if (ret < 0)
+			return ret;
+	}
+
+	return 0;
+}
+
+static void redis_watch_up(struct redis_scan_data *rdsd);
+
+/* Keyspace notifications. The key is in the channel name following the
+ * __keyspace@<db>__: prefix, the message is the command.
+ */
+static void redis_callback(redisAsyncContext *c, void *r, void *data)
+{
+	struct redis_scan_data *rdsd = data;
+	redisReply *reply = r;
+	redisReply *channel;
+	char *key;
+	size_t key_size;
+
+	if (reply == NULL || reply->type != REDIS_REPLY_ARRAY)
+		return;
+
+	if (reply->elements == 3 &&
+	    !strcmp(reply->element[0]->str, "psubscribe")) {
+		redis_watch_up(rdsd);
+		return;
+	}
+
+	if (reply->elements != 4 || strcmp(reply->element[0]->str, "pmessage"))
+		return;
+
+	channel = reply->element[2];
+
+	key = memchr(channel->str, ':', channel->len);
+	if (!key)
+		return;
+	key++;
+	key_size = channel->len - (key - channel->str);
+
+	redis_stat_message(rdsd->rdc, key_size);
+
+	if (redis_is_meta_key(key, key_size) ||
+	    !dbif_filter_match(rdsd->filter, key, key_size))
+		return;
+
+	rdsd->cb(key, key_size, rdsd->data);
+}
+
+/* Subscribe to keyspace notifications for keys matching a filter, or
+ * all keys if filter is NULL. Only the keyspace channels are subscribed,
+ * matching keyevent channels as well would report each change twice.
+ */
+static int redis_keyspace_subscribe(redisAsyncContext *c,
+				    struct redis_scan_data *rdsd,
+				    const struct dbif_filter *filter)
+{
+	static const struct dbif_filter_prefix all;
+	const struct dbif_filter_prefix *prefix;
+	const char *argv[1 + DBIF_FILTER_MAX];
+	size_t argvlen[1 + DBIF_FILTER_MAX];
+	int i, argc = 1;
+	int ret = 0;
+
+	argv[0] = "PSUBSCRIBE";
+	argvlen[0] = strlen(argv[0]);
+
+	for (i = 0; i < (filter ? filter->num_prefixes : 1); i++) {
+		prefix = filter ? &filter->prefixes[i] : &all;
+
+		argv[argc] = redis_glob_pattern(REDIS_KEYSPACE_PREFIX,
+						prefix->data, prefix->len,
+						prefix->key_size,
+						&argvlen[argc]);
+		if (!argv[argc]) {
+			ret = -1;
+			goto out;
+		}
+		argc++;
+	}
+
+	if (argc > 1)
+		redisAsyncCommandArgv(c, redis_callback, rdsd,
+				      argc, argv, argvlen);
+	else
+		redis_watch_up(rdsd);
+
+out:
+	for (i = 1; i < argc; i++)
+		free((char *)argv[i]);
+
+	return ret;
+}
+
+/* Change channel messages in bucketed layout. The message is the logical
+ * key. A watch on one key filters for that key.
+ */
+static void redis_change_callback(redisAsyncContext *c, void *r, void *data)
+{
+	struct redis_scan_data *rdsd = data;
+	redisReply *reply = r;
+	redisReply *key;
+
+	if (reply == NULL || reply->type != REDIS_REPLY_ARRAY ||
+	    reply->elements != 3)
+		return;
+
+	if (!strcmp(reply->element[0]->str, "subscribe")) {
+		redis_watch_up(rdsd);
+		return;
+	}
+
+	if (strcmp(reply->element[0]->str, "message"))
+		return;
+
+	key = reply->element[2];
+
+	redis_stat_message(rdsd->rdc, key->len);
+
+	if (rdsd->key && (key->len != rdsd->key_size ||
+			  memcmp(key->str, rdsd->key, key->len)))
+		return;
+
+	if (!dbif_filter_match(rdsd->filter, key->str, key->len))
+		return;
+
+	rdsd->cb(key->str, key->len, rdsd->data);
+}
+
+/* Compare change log entry IDs, these are <ms>-<seq> */
+static int redis_log_id_cmp(const char *a, const char *b)
+{
+	unsigned long long ams, aseq = 0, bms, bseq = 0;
+	char *end;
+
+	ams = strtoull(a, &end, 10);
+	if (*end == '-')
+		aseq = strtoull(end + 1, NULL, 10);
+
+	bms = strtoull(b, &end, 10);
+	if (*end == '-')
+		bseq = strtoull(end + 1, NULL, 10);
+
+	if (ams != bms)
+		return ams < bms ? -1 : 1;
+	if (aseq != bseq)
+		return aseq < bseq ? -1 : 1;
+
+	return 0;
+}
+
+/* ID of a stream entry reply, or NULL */
+static const char *redis_log_entry_id(redisReply *entry)
+{
+	if (entry->type != REDIS_REPLY_ARRAY || entry->elements != 2 ||
+	    entry->element[0]->type != REDIS_REPLY_STRING ||
+	    entry->element[0]->len >= REDIS_LOG_ID_LEN)
+		return NULL;
+
+	return entry->element[0]->str;
+}
+
+static void redis_log_read(redisAsyncContext *c, struct redis_scan_data *rdsd);
+
+/* Entries read from the change log. Each entry holds one key, report
+ * the ones that match the filter and read on from the last one. An error
+ * drops the connection so the watch restarts.
+ */
+static void redis_log_callback(redisAsyncContext *c, void *r, void *data)
+{
+	struct redis_scan_data *rdsd = data;
+	redisReply *reply = r;
+	redisReply *entries, *fields, *key;
+	const char *id;
+	size_t i;
+
+	if (reply == NULL)
+		return;
+
+	if (reply->type == REDIS_REPLY_ERROR) {
+		DBPRINTF(rdsd->rdc, "dbif_redis: Change log read failed: %s\n",
+			 reply->str);
+		redisAsyncDisconnect(c);
+		return;
+	}
+
+	/* [[stream, [[id, [k, key]], ...]]], nil if nothing to read */
+	if (reply->type == REDIS_REPLY_ARRAY && reply->elements == 1 &&
+	    reply->element[0]->type == REDIS_REPLY_ARRAY &&
+	    reply->element[0]->elements == 2) {
+		entries = reply->element[0]->element[1];
+
+		for (i = 0; i < entries->elements; i++) {
+			id = redis_log_entry_id(entries->element[i]);
+			if (!id)
+				continue;
+
+			strcpy(rdsd->log_id, id);
+
+			fields = entries->element[i]->element[1];
+			if (fields->type != REDIS_REPLY_ARRAY ||
+			    fields->elements != 2)
+				continue;
+
+			key = fields->element[1];
+			redis_stat_message(rdsd->rdc, key->len);
+			if (dbif_filter_match(rdsd->filter, key->str,
+					      key->len))
+				rdsd->cb(key->str, key->len, rdsd->data);
+		}
+	}
+
+	redis_log_read(c, rdsd);
+}
+
+static void redis_log_read(redisAsyncContext *c, struct redis_scan_data *rdsd)
+{
+	redisAsyncCommand(c, redis_log_callback, rdsd,
+			  "XREAD COUNT %d BLOCK 0 STREAMS " REDIS_LOG_KEY " %s",
+			  REDIS_LOG_READ_COUNT, rdsd->log_id);
+}
+
+/* Position in the change log when the watch connects. The first time
+ * reading starts from the end of the log. After a lost connection it
+ * resumes from the last entry read if the log still covers it. If not
+ * then unread entries were trimmed, or the log itself was lost, so
+ * reading restarts from the end and the watcher resyncs.
+ */
+static void redis_log_info_callback(redisAsyncContext *c, void *r,
+				    void *data)
+{
+	struct redis_scan_data *rdsd = data;
+	redisReply *reply = r;
+	const char *first = NULL, *last = NULL;
+	long long length = 0;
+	bool resync = false;
+	redisReply *val;
+	size_t i;
+
+	if (reply == NULL)
+		return;
+
+	/* XINFO STREAM fails if the log doesn't exist yet */
+	if (reply->type == REDIS_REPLY_ARRAY) {
+		for (i = 0; i + 1 < reply->elements; i += 2) {
+			if (reply->element[i]->type != REDIS_REPLY_STRING)
+				continue;
+
+			val = reply->element[i + 1];
+
+			if (!strcmp(reply->element[i]->str, "length") &&
+			    val->type == REDIS_REPLY_INTEGER)
+				length = val->integer;
+			else if (!strcmp(reply->element[i]->str,
+					 "first-entry"))
+				first = redis_log_entry_id(val);
+			else if (!strcmp(reply->element[i]->str,
+					 "last-entry"))
+				last = redis_log_entry_id(val);
+		}
+	}
+
+	if (!rdsd->log_id[0]) {
+		/* First connect */
+	} else if (!strcmp(rdsd->log_id, "0-0")) {
+		/* Log was empty, it may have been trimmed since */
+		resync = length >= rdsd->rdc->changelog_max;
+	} else {
+		resync = !first || !last ||
+			 redis_log_id_cmp(first, rdsd->log_id) > 0 ||
+			 redis_log_id_cmp(last, rdsd->log_id) < 0;
+	}
+
+	if (!rdsd->log_id[0] || resync)
+		strcpy(rdsd->log_id, last ? last : "0-0");
+
+	rdsd->retry_ms = REDIS_RETRY_MIN_MS;
+	rdsd->lost = false;
+
+	if (resync) {
+		DBPRINTF(rdsd->rdc, "dbif_redis: Change log gap, resync\n");
+		if (rdsd->resync_cb)
+			rdsd->resync_cb(rdsd->data);
+	}
+
+	redis_log_read(c, rdsd);
+}
+
+/* Invalidation messages for tracked keys. The message payload is an
+ * array of keys, or nil when the whole database was flushed. Keys that
+ * weren't cached aren't known then, so the cache is dropped and the
+ * watch resyncs, or without a resync callback every cached key is
+ * reported.
+ */
+static void redis_invalidate_cb(struct redis_scan_data *rdsd,
+				redisReply *keys)
+{
+	struct redis_context *rdc = rdsd->rdc;
+	struct redis_cache_entry *rce, *tmp;
+	size_t i;
+
+	if (keys->type == REDIS_REPLY_ARRAY) {
+		for (i = 0; i < keys->elements; i++) {
+			redis_stat_message(rdc, keys->element[i]->len);
+			redis_cache_invalidate(rdc, keys->element[i]->str,
+					       keys->element[i]->len);
+			if (dbif_filter_match(rdsd->filter,
+					      keys->element[i]->str,
+					      keys->element[i]->len))
+				rdsd->cb(keys->element[i]->str,
+					 keys->element[i]->len, rdsd->data);
+		}
+		return;
+	}
+
+	if (rdsd->resync_cb) {
+		redis_cache_flush(rdc);
+		rdsd->resync_cb(rdsd->data);
+		return;
+	}
+
+	if (!rdc->cache_max)
+		return;
+
+	list_for_each_entry_safe(rce, tmp, &rdc->cache_lru, lru) {
+		qhash_del(&rdc->cache, &rce->node);
+		list_del(&rce->lru);
+		if (dbif_filter_match(rdsd->filter, rce->data, rce->key_size))
+			rdsd->cb(rce->data, rce->key_size, rdsd->data);
+		free(rce);
+	}
+}
+
+/* Enable broadcast tracking on the synchronous connection redirecting
+ * invalidations to the watch connection.
+ */
+static int redis_enable_tracking(struct redis_scan_data *rdsd)
+{
+	struct redis_context *rdc = rdsd->rdc;
+	const char *argv[5 + 2 * REDIS_MAX_PREFIXES];
+	size_t argvlen[5 + 2 * REDIS_MAX_PREFIXES];
+	char idbuf[32];
+	redisReply *reply;
+	int i, argc = 0;
+	int ret = 0;
+
+	snprintf(idbuf, sizeof(idbuf), "%lld", rdsd->client_id);
+
+#define ADD_ARG(s, l) do {		\
+	argv[argc] = (s);		\
+	argvlen[argc++] = (l);		\
+} while (0)
+
+	ADD_ARG("CLIENT", 6);
+	ADD_ARG("TRACKING", 8);
+	ADD_ARG("on", 2);
+	ADD_ARG("REDIRECT", 8);
+	ADD_ARG(idbuf, strlen(idbuf));
+	ADD_ARG("BCAST", 5);
+	for (i = 0; i < rdc->num_prefixes; i++) {
+		ADD_ARG("PREFIX", 6);
+		ADD_ARG((char *)rdc->prefixes[i].data, rdc->prefixes[i].len);
+	}
+
+#undef ADD_ARG
+
+	reply = redisCommandArgv(rdc->ctx, argc, argv, argvlen);
+	if (!reply || reply->type == REDIS_REPLY_ERROR) {
+		DBPRINTF(rdc, "dbif_redis: Enable tracking failed: %s\n",
+			 reply ? reply->str : rdc->ctx->errstr);
+		ret = -1;
+	}
+
+	freeReplyObject(reply);
+
+	return ret;
+}
+
+static void redis_tracking_callback(redisAsyncContext *c, void *r, void *data)
+{
+	struct redis_scan_data *rdsd = data;
+	redisReply *reply = r;
+
+	if (reply == NULL || reply->type != REDIS_REPLY_ARRAY ||
+	    reply->elements != 3)
+		return;
+
+	if (!strcmp(reply->element[0]->str, "subscribe")) {
+		/* Subscribed so now it's safe to start tracking. Without
+		 * it changes would be missed, so retry from the start.
+		 */
+		if (redis_enable_tracking(rdsd) < 0) {
+			redisAsyncDisconnect(c);
+			return;
+		}
+		rdsd->rdc->tracking_active = true;
+		redis_watch_up(rdsd);
+	} else if (!strcmp(reply->element[0]->str, "message")) {
+		redis_invalidate_cb(rdsd, reply->element[2]);
+	}
+}
+
+static void redis_client_id_callback(redisAsyncContext *c, void *r,
+				     void *data)
+{
+	struct redis_scan_data *rdsd = data;
+	redisReply *reply = r;
+
+	if (reply == NULL)
+		return;
+
+	if (reply->type != REDIS_REPLY_INTEGER) {
+		DBPRINTF(rdsd->rdc, "dbif_redis: CLIENT ID failed\n");
+		redisAsyncDisconnect(c);
+		return;
+	}
+
+	rdsd->client_id = reply->integer;
+
+	redisAsyncCommand(c, redis_tracking_callback, rdsd,
+			  "SUBSCRIBE __redis__:invalidate");
+}
+
+/* The watch is subscribed. If the connection had been lost changes may
+ * have been missed, so a watch on one key reports the key and a watch
+ * on all keys asks for a resync.
+ */
+static void redis_watch_up(struct redis_scan_data *rdsd)
+{
+	rdsd->retry_ms = REDIS_RETRY_MIN_MS;
+
+	if (!rdsd->lost)
+		return;
+
+	rdsd->lost = false;
+
+	if (rdsd->key)
+		rdsd->cb(rdsd->key, rdsd->key_size, rdsd->data);
+	else if (rdsd->resync_cb)
+		rdsd->resync_cb(rdsd->data);
+}
+
+/* Issue the commands that start a watch on a new connection */
+static int redis_watch_subscribe(struct redis_scan_data *rdsd)
+{
+	struct redis_context *rdc = rdsd->rdc;
+	redisAsyncContext *c = rdsd->c;
+	char *pattern;
+	size_t len;
+
+	if (!rdsd->key && rdc->changelog_max) {
+		redisAsyncCommand(c, redis_log_info_callback, rdsd,
+				  "XINFO STREAM " REDIS_LOG_KEY);
+	} else if (rdc->layout == REDIS_LAYOUT_BUCKETED) {
+		redisAsyncCommand(c, redis_change_callback, rdsd,
+				  "SUBSCRIBE " REDIS_CHANGE_CHANNEL);
+	} else if (rdsd->key) {
+		pattern = redis_glob_pattern(REDIS_KEYSPACE_PREFIX, rdsd->key,
+					     rdsd->key_size, rdsd->key_size,
+					     &len);
+		if (!pattern)
+			return -1;
+
+		redisAsyncCommand(c, redis_callback, rdsd, "PSUBSCRIBE %b",
+				  pattern, len);
+		free(pattern);
+	} else if (rdc->tracking) {
+		redisAsyncCommand(c, redis_client_id_callback, rdsd,
+				  "CLIENT ID");
+	} else {
+		return redis_keyspace_subscribe(c, rdsd, rdsd->filter);
+	}
+
+	return 0;
+}
+
+/* The watch connection is gone, hiredis frees the context. Reconnect
+ * with exponential backoff, jittered so that watchers don't all
+ * reconnect at once after a server restart.
+ */
+static void redis_watch_lost(struct redis_scan_data *rdsd)
+{
+	struct redis_context *rdc = rdsd->rdc;
+	struct timeval tv;
+	unsigned int ms;
+
+	rdsd->c = NULL;
+	rdsd->lost = true;
+	rdc->watch_lost++;
+
+	/* Invalidations are lost with the connection */
+	if (rdc->tracking_watch == rdsd) {
+		rdc->tracking_active = false;
+		redis_cache_flush(rdc);
+	}
+
+	ms = rdsd->retry_ms / 2 + random() % (rdsd->retry_ms / 2 + 1);
+	rdsd->retry_ms *= 2;
+	if (rdsd->retry_ms > REDIS_RETRY_MAX_MS)
+		rdsd->retry_ms = REDIS_RETRY_MAX_MS;
+
+	ms_to_timeval(&tv, ms);
+	evtimer_add(rdsd->retry_event, &tv);
+}
+
+static void redis_watch_connect_cb(const redisAsyncContext *c, int status)
+{
+	struct redis_scan_data *rdsd = c->data;
+
+	if (status == REDIS_OK || !rdsd)
+		return;
+
+	DBPRINTF(rdsd->rdc, "dbif_redis: Watch connect failed: %s\n",
+		 c->errstr);
+
+	redis_watch_lost(rdsd);
+}
+
+static void redis_watch_disconnect_cb(const redisAsyncContext *c,
+				      int status)
+{
+	struct redis_scan_data *rdsd = c->data;
+
+	if (!rdsd)
+		return;
+
+	DBPRINTF(rdsd->rdc, "dbif_redis: Watch connection lost: %s\n",
+		 status == REDIS_OK ? "closed" : c->errstr);
+
+	redis_watch_lost(rdsd);
+}
+
+static int redis_watch_connect(struct redis_scan_data *rdsd)
+{
+	struct redis_context *rdc = rdsd->rdc;
+	redisAsyncContext *c;
+
+	if (rdc->path)
+		c = redisAsyncConnectUnix(rdc->path);
+	else
+		c = redisAsyncConnect(rdc->host, rdc->port);
+	if (!c || c->err) {
+		DBPRINTF(rdc, "dbif_redis: Async connect error: %s\n",
+			 c ? c->errstr : "can't allocate redis context");
+		if (c)
+			redisAsyncFree(c);
+		return -1;
+	}
+
+	/* The async connect is non-blocking but the socket already
+	 * exists so options can be applied now.
+	 */
+	redis_set_sockopts(rdc, c->c.fd);
+
+	c->data = rdsd;
+	rdsd->c = c;
+
+	redisLibeventAttach(c, rdsd->event_base);
+	redisAsyncSetConnectCallback(c, redis_watch_connect_cb);
+	redisAsyncSetDisconnectCallback(c, redis_watch_disconnect_cb);
+
+	if (redis_watch_subscribe(rdsd) < 0) {
+		c->data = NULL;
+		rdsd->c = NULL;
+		redisAsyncFree(c);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void redis_watch_retry_cb(evutil_socket_t fd, short what, void *arg)
+{
+	struct redis_scan_data *rdsd = arg;
+
+	if (redis_watch_connect(rdsd) < 0)
+		redis_watch_lost(rdsd);
+}
+
+static struct redis_scan_data *redis_watch_alloc(struct redis_context *rdc,
+		void (*cb)(void *key, size_t key_size, void *data),
+		void (*resync_cb)(void *data), void *data,
+		struct event_base *event_base)
+{
+	struct redis_scan_data *rdsd;
+
+	rdsd = calloc(1, sizeof(*rdsd));
+	if (!rdsd) {
+		perror("malloc sync context");
+		return NULL;
+	}
+
+	rdsd->retry_event = evtimer_new(event_base, redis_watch_retry_cb,
+					rdsd);
+	if (!rdsd->retry_event) {
+		free(rdsd);
+		return NULL;
+	}
+
+	rdsd->cb = cb;
+	rdsd->resync_cb = resync_cb;
+	rdsd->data = data;
+	rdsd->rdc = rdc;
+	rdsd->event_base = event_base;
+	rdsd->retry_ms = REDIS_RETRY_MIN_MS;
+
+	return rdsd;
+}
+
+static void redis_watch_free(struct redis_scan_data *rdsd)
+{
+	if (rdsd->rdc->tracking_watch == rdsd)
+		rdsd->rdc->tracking_watch = NULL;
+
+	event_free(rdsd->retry_event);
+	free(rdsd->filter);
+	free(rdsd->key);
+	free(rdsd);
+}
+
+/* Watch all keys matching filter. With keyspace notifications the
+ * filter is pushed down as channel patterns. The change log, the
+ * bucketed layout's change channel, and tracking cover all keys, so for
+ * those the filter is applied to the changes received.
+ */
+static int redis_watch_all(void *ctx, const struct dbif_filter *filter,
+			   void (*cb)(void *key, size_t key_size, void *data),
+			   void (*resync_cb)(void *data),
+			   void *data, void **handlep,
+			   struct event_base *event_base)
+{
+	struct redis_context *rdc = ctx;
+	struct redis_scan_data *rdsd;
+
+	rdsd = redis_watch_alloc(rdc, cb, resync_cb, data, event_base);
+	if (!rdsd)
+		return -1;
+
+	if (filter) {
+		rdsd->filter = malloc(sizeof(*filter));
+		if (!rdsd->filter)
+			goto err;
+		*rdsd->filter = *filter;
+	}
+
+	if (rdc->tracking)
+		rdc->tracking_watch = rdsd;
+
+	if (redis_watch_connect(rdsd) < 0)
+		goto err;
+
+	*handlep = rdsd;
+
+	return 0;
+
+err:
+	redis_watch_free(rdsd);
+
+	return -1;
+}
+
+static int redis_watch_one(void *ctx,  void *key, size_t key_size,
+			   void (*cb)(void *key, size_t key_size, void *data),
+			   void *data, void **handlep,
+			   struct event_base *event_base)
+{
+	struct redis_context *rdc = ctx;
+	struct redis_scan_data *rdsd;
+
+	rdsd = redis_watch_alloc(rdc, cb, NULL, data, event_base);
+	if (!rdsd)
+		return -1;
+
+	rdsd->key = malloc(key_size);
+	if (!rdsd->key)
+		goto err;
+	memcpy(rdsd->key, key, key_size);
+	rdsd->key_size = key_size;
+
+	if (redis_watch_connect(rdsd) < 0)
+		goto err;
+
+	*handlep = rdsd;
+
+	return 0;
+
+err:
+	redis_watch_free(rdsd);
+
+	return -1;
+}
+
+/* Read the digest leaf sums for a tree of 2^bits leaves. Fails if the
+ * database doesn't keep a digest of that size.
+ */
+static int redis_digest(void *ctx, unsigned int bits, __u64 *leaves)
+{
+	struct redis_context *rdc = ctx;
+	__u64 start = qmetrics_now();
+	unsigned long long leaf;
+	redisReply *reply;
+	bool found = false;
+	int ret = 0;
+	char *end;
+	size_t i;
+
+	if (redis_sync_check(rdc) < 0)
+		return -1;
+
+	reply = redisCommand(rdc->ctx, "HGETALL " REDIS_DIGEST_KEY);
+	if (!reply || reply->type != REDIS_REPLY_ARRAY) {
+		redis_stat(rdc, REDIS_STAT_DIGEST, qmetrics_now() - start, -1,
+			   NULL, 0, 0, 0);
+		freeReplyObject(reply);
+		return -1;
+	}
+
+	redis_stat(rdc, REDIS_STAT_DIGEST, qmetrics_now() - start, 0,
+		   NULL, 0, 0, redis_keys_len(reply));
+
+	memset(leaves, 0, sizeof(*leaves) << bits);
+
+	for (i = 0; i + 1 < reply->elements; i += 2) {
+		if (!strcmp(reply->element[i]->str, "bits")) {
+			found = strtoul(reply->element[i + 1]->str,
+					NULL, 10) == bits;
+			continue;
+		}
+
+		leaf = strtoull(reply->element[i]->str, &end, 10);
+		if (*end || leaf >= (1ULL << bits)) {
+			ret = -1;
+			break;
+		}
+
+		leaves[leaf] = strtoull(reply->element[i + 1]->str, NULL, 10);
+	}
+
+	freeReplyObject(reply);
+
+	return found ? ret : -1;
+}
+
+/* Close the watch connection and cancel a pending reconnect. Pending
+ * replies are completed with NULL and the disconnect callback sees no
+ * watch, so nothing is reported once this returns.
+ */
+static void redis_stop_watch(void *ctx, void *handle)
+{
+	struct redis_context *rdc = ctx;
+	struct redis_scan_data *rdsd = handle;
+	redisAsyncContext *c;
+
+	if (!rdsd)
+		return;
+
+	c = rdsd->c;
+	if (c) {
+		c->data = NULL;
+		rdsd->c = NULL;
+		redisAsyncFree(c);
+	}
+
+	evtimer_del(rdsd->retry_event);
+
+	/* Invalidations stop with the watch */
+	if (rdc->tracking_watch == rdsd) {
+		rdc->tracking_active = false;
+		redis_cache_flush(rdc);
+	}
+
+	redis_watch_free(rdsd);
+}
+
+static int redis_stats(void *ctx, json_writer_t *jw)
+{
+	struct redis_context *rdc = ctx;
+	struct redis_stats *st;
+	int i;
+
+	jsonw_lluint_field(jw, "reconnects", rdc->reconnects);
+	jsonw_lluint_field(jw, "reconnect_failures", rdc->reconnect_failures);
+	jsonw_lluint_field(jw, "watch_lost", rdc->watch_lost);
+	if (rdc->cache_max) {
+		jsonw_lluint_field(jw, "cache_hits", rdc->cache_hits);
+		jsonw_uint_field(jw, "cache_entries", rdc->cache.count);
+	}
+	if (rdc->slowlog_usecs)
+		jsonw_uint_field(jw, "slowlog_usecs", rdc->slowlog_usecs);
+
+	jsonw_name(jw, "commands");
+	jsonw_start_object(jw);
+
+	for (i = 0; i < REDIS_STAT_MAX; i++) {
+		st = &rdc->stats[i];
+
+		jsonw_name(jw, redis_stat_names[i]);
+		jsonw_start_object(jw);
+		jsonw_lluint_field(jw, "count", st->count);
+		jsonw_lluint_field(jw, "errors", st->errors);
+		jsonw_lluint_field(jw, "bytes_out", st->bytes_out);
+		jsonw_lluint_field(jw, "bytes_in", st->bytes_in);
+		if (rdc->slowlog_usecs)
+			jsonw_lluint_field(jw, "slow", st->slow);
+		if (st->time.value) {
+			jsonw_name(jw, "latency");
+			jsonw_start_object(jw);
+			qmetric_json_histogram(jw, &st->time);
+			jsonw_end_object(jw);
+		}
+		jsonw_end_object(jw);
+	}
+
+	jsonw_end_object(jw);
+
+	return 0;
 }
 
 static struct dbif_ops redis_ops = {
@@ -345,10 +2853,14 @@ static struct dbif_ops redis_ops = {
 	.write = redis_write,
 	.read = redis_read,
 	.delete = redis_delete,
+	.patch = redis_patch,
+	.submit = redis_submit,
 	.scan = redis_scan,
 	.watch_all = redis_watch_all,
 	.watch_one = redis_watch_one,
 	.stop_watch = redis_stop_watch,
+	.digest = redis_digest,
+	.stats = redis_stats,
 };
 
 struct dbif_ops *dbif_get_redis(void)
@@ -0,0 +1,106 @@
+/*
+ * qbench.c - Helpers for the benchmark tools
+ *
+ * Copyright (c) 2018, Quantonium Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the Quantonium nor the names of its contributors
+ *     may be used to endorse or promote products derived from this software
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL QUANTONIUM BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+
+#include "qbench.h"
+
+int qbench_lat_init(struct qbench_lat *lat, size_t size)
+{
+	lat->samples = malloc((size ? : 1) * sizeof(*lat->samples));
+	lat->count = 0;
+	lat->size = size;
+
+	return lat->samples ? 0 : -1;
+}
+
+void qbench_lat_free(struct qbench_lat *lat)
+{
+	free(lat->samples);
+	lat->samples = NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	__u64 x = *(const __u64 *)a, y = *(const __u64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static __u64 qbench_lat_quantile(struct qbench_lat *lat, double q)
+{
+	size_t i = q * lat->count;
+
+	return lat->samples[i < lat->count ? i : lat->count - 1];
+}
+
+void qbench_json_fields(json_writer_t *jw, unsigned long ops,
+			unsigned long errors, __u64 usecs,
+			struct qbench_lat *lat)
+{
+	jsonw_uint_field(jw, "ops", ops);
+	jsonw_uint_field(jw, "errors", errors);
+	jsonw_float_field_fmt(jw, "seconds", "%.6f", usecs / 1e6);
+	jsonw_float_field_fmt(jw, "ops_per_sec", "%.1f",
+			      usecs ? ops * 1e6 / usecs : 0);
+
+	if (!lat || !lat->count)
+		return;
+
+	qsort(lat->samples, lat->count, sizeof(*lat->samples), cmp_u64);
+
+	jsonw_name(jw, "latency_us");
+	jsonw_start_object(jw);
+	jsonw_uint_field(jw, "samples", lat->count);
+	jsonw_uint_field(jw, "p50", qbench_lat_quantile(lat, 0.5));
+	jsonw_uint_field(jw, "p90", qbench_lat_quantile(lat, 0.9));
+	jsonw_uint_field(jw, "p99", qbench_lat_quantile(lat, 0.99));
+	jsonw_uint_field(jw, "p999", qbench_lat_quantile(lat, 0.999));
+	jsonw_uint_field(jw, "max", lat->samples[lat->count - 1]);
+	jsonw_end_object(jw);
+}
+
+int qbench_parse_sizes(const char *list, unsigned long *sizes, int max)
+{
+	const char *p = list;
+	int num = 0;
+	char *end;
+
+	do {
+		if (num >= max)
+			return -1;
+		sizes[num] = strtoul(p, &end, 0);
+		if (end == p || !sizes[num] || (*end && *end != ','))
+			return -1;
+		num++;
+		p = end + 1;
+	} while (*end);
+
+	return num;
+}
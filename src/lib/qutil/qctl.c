@@ -0,0 +1,595 @@
+/*
+ * qctl.c - Control socket for daemons
+ *
+ * Copyright (c) 2018, Quantonium Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the Quantonium nor the names of its contributors
+ *     may be used to endorse or promote products derived from this software
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL QUANTONIUM BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <event2/buffer.h>
+#include <event2/bufferevent.h>
+#include <event2/listener.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "dbif_feed.h"
+#include "list.h"
+#include "qctl.h"
+
+#define QCTL_MAX_ARGS	8
+#define QCTL_LINE_MAX	1024
+
+/* A streamed reply is written while the output held for the client is
+ * below high water and resumes once it has drained to low water.
+ */
+#define QCTL_HIGH_WATER	(64 * 1024)
+#define QCTL_LOW_WATER	(16 * 1024)
+
+struct qctl_cmd {
+	const char *name;
+	const char *help;
+	qctl_cmd_fn fn;
+	void *data;
+	struct qctl_cmd *next;
+};
+
+struct qctl_tunable {
+	const char *name;
+	const char *help;
+	unsigned int *value;
+	unsigned int min;
+	unsigned int max;
+	void (*set_cb)(void *data);
+	void *data;
+	struct qctl_tunable *next;
+};
+
+struct qctl {
+	struct event_base *event_base;
+	struct evconnlistener *listener;
+	struct qctl_cmd *cmds;
+	struct qctl_cmd **cmds_tail;
+	struct qctl_tunable *tunables;
+	struct qctl_tunable **tunables_tail;
+	struct list_head conns;
+	FILE *logf;
+};
+
+/* A reply is written through a stdio stream whose writes go to the
+ * output of the bufferevent, or nowhere once the client has gone.
+ */
+struct qctl_conn {
+	struct qctl *qc;
+	struct list_head list;
+	struct bufferevent *bev;
+	FILE *f;
+	json_writer_t *jw;
+	qctl_stream_fn stream;
+	void *stream_arg;
+	bool eof;
+};
+
+#define QCPRINTF(qc, format, ...) do {				\
+	if (qc->logf)						\
+		fprintf(qc->logf, format, ##__VA_ARGS__);	\
+} while (0)
+
+struct qctl *qctl_create(struct event_base *event_base, FILE *logf)
+{
+	struct qctl *qc;
+
+	qc = calloc(1, sizeof(*qc));
+	if (!qc)
+		return NULL;
+
+	qc->event_base = event_base;
+	qc->logf = logf;
+	qc->cmds_tail = &qc->cmds;
+	qc->tunables_tail = &qc->tunables;
+	INIT_LIST_HEAD(&qc->conns);
+
+	return qc;
+}
+
+int qctl_command(struct qctl *qc, const char *name, const char *help,
+		 qctl_cmd_fn fn, void *data)
+{
+	struct qctl_cmd *cmd;
+
+	cmd = calloc(1, sizeof(*cmd));
+	if (!cmd)
+		return -1;
+
+	cmd->name = name;
+	cmd->help = help;
+	cmd->fn = fn;
+	cmd->data = data;
+
+	*qc->cmds_tail = cmd;
+	qc->cmds_tail = &cmd->next;
+
+	return 0;
+}
+
+int qctl_tunable(struct qctl *qc, const char *name, const char *help,
+		 unsigned int *value, unsigned int min, unsigned int max,
+		 void (*set_cb)(void *data), void *data)
+{
+	struct qctl_tunable *qt;
+
+	qt = calloc(1, sizeof(*qt));
+	if (!qt)
+		return -1;
+
+	qt->name = name;
+	qt->help = help;
+	qt->value = value;
+	qt->min = min;
+	qt->max = max;
+	qt->set_cb = set_cb;
+	qt->data = data;
+
+	*qc->tunables_tail = qt;
+	qc->tunables_tail = &qt->next;
+
+	return 0;
+}
+
+static ssize_t qctl_write(void *cookie, const char *buf, size_t size)
+{
+	struct qctl_conn *conn = cookie;
+
+	if (conn->bev &&
+	    evbuffer_add(bufferevent_get_output(conn->bev), buf, size) < 0)
+		return -1;
+
+	return size;
+}
+
+static int qctl_reply_start(struct qctl_conn *conn)
+{
+	cookie_io_functions_t io = { .write = qctl_write };
+
+	conn->f = fopencookie(conn, "w", io);
+	if (!conn->f)
+		return -1;
+
+	conn->jw = jsonw_new(conn->f);
+	if (!conn->jw) {
+		fclose(conn->f);
+		conn->f = NULL;
+		return -1;
+	}
+
+	jsonw_start_object(conn->jw);
+
+	return 0;
+}
+
+static void qctl_reply_end(struct qctl_conn *conn)
+{
+	jsonw_end_object(conn->jw);
+	jsonw_destroy(&conn->jw);
+	fclose(conn->f);
+	conn->f = NULL;
+}
+
+json_writer_t *qctl_json(struct qctl_conn *conn)
+{
+	return conn->jw;
+}
+
+void qctl_error(struct qctl_conn *conn, const char *format, ...)
+{
+	char buf[256];
+	va_list ap;
+
+	va_start(ap, format);
+	vsnprintf(buf, sizeof(buf), format, ap);
+	va_end(ap);
+
+	jsonw_string_field(conn->jw, "error", buf);
+}
+
+void qctl_stream(struct qctl_conn *conn, qctl_stream_fn fn, void *arg)
+{
+	conn->stream = fn;
+	conn->stream_arg = arg;
+}
+
+/* Write more of a streamed reply. Returns true when the reply is done */
+static bool qctl_stream_run(struct qctl_conn *conn)
+{
+	struct evbuffer *output = bufferevent_get_output(conn->bev);
+
+	while (evbuffer_get_length(output) < QCTL_HIGH_WATER) {
+		bool more = conn->stream(conn->jw, conn->stream_arg, false);
+
+		fflush(conn->f);
+
+		if (!more) {
+			conn->stream = NULL;
+			qctl_reply_end(conn);
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static void qctl_conn_free(struct qctl_conn *conn)
+{
+	struct bufferevent *bev = conn->bev;
+
+	/* Output from here on is discarded */
+	conn->bev = NULL;
+
+	if (conn->stream) {
+		conn->stream(conn->jw, conn->stream_arg, true);
+		conn->stream = NULL;
+	}
+	if (conn->jw)
+		qctl_reply_end(conn);
+
+	list_del(&conn->list);
+	bufferevent_free(bev);
+	free(conn);
+}
+
+static void qctl_help(struct qctl_conn *conn)
+{
+	json_writer_t *jw = conn->jw;
+	struct qctl_tunable *qt;
+	struct qctl_cmd *cmd;
+
+	jsonw_name(jw, "commands");
+	jsonw_start_array(jw);
+	jsonw_start_object(jw);
+	jsonw_string_field(jw, "name", "help");
+	jsonw_string_field(jw, "help", "List commands and tunables");
+	jsonw_end_object(jw);
+	jsonw_start_object(jw);
+	jsonw_string_field(jw, "name", "get");
+	jsonw_string_field(jw, "help", "get [NAME], report tunables");
+	jsonw_end_object(jw);
+	jsonw_start_object(jw);
+	jsonw_string_field(jw, "name", "set");
+	jsonw_string_field(jw, "help", "set NAME VALUE, change a tunable");
+	jsonw_end_object(jw);
+	for (cmd = conn->qc->cmds; cmd; cmd = cmd->next) {
+		jsonw_start_object(jw);
+		jsonw_string_field(jw, "name", cmd->name);
+		jsonw_string_field(jw, "help", cmd->help);
+		jsonw_end_object(jw);
+	}
+	jsonw_end_array(jw);
+
+	jsonw_name(jw, "tunables");
+	jsonw_start_array(jw);
+	for (qt = conn->qc->tunables; qt; qt = qt->next) {
+		jsonw_start_object(jw);
+		jsonw_string_field(jw, "name", qt->name);
+		jsonw_string_field(jw, "help", qt->help);
+		jsonw_uint_field(jw, "value", *qt->value);
+		jsonw_uint_field(jw, "min", qt->min);
+		jsonw_uint_field(jw, "max", qt->max);
+		jsonw_end_object(jw);
+	}
+	jsonw_end_array(jw);
+}
+
+static struct qctl_tunable *qctl_tunable_find(struct qctl *qc,
+					      const char *name)
+{
+	struct qctl_tunable *qt;
+
+	for (qt = qc->tunables; qt; qt = qt->next)
+		if (!strcmp(qt->name, name))
+			return qt;
+
+	return NULL;
+}
+
+static void qctl_get(struct qctl_conn *conn, int argc, char **argv)
+{
+	struct qctl_tunable *qt;
+
+	if (argc > 1) {
+		qt = qctl_tunable_find(conn->qc, argv[1]);
+		if (!qt) {
+			qctl_error(conn, "Unknown tunable %s", argv[1]);
+			return;
+		}
+		jsonw_uint_field(conn->jw, qt->name, *qt->value);
+		return;
+	}
+
+	for (qt = conn->qc->tunables; qt; qt = qt->next)
+		jsonw_uint_field(conn->jw, qt->name, *qt->value);
+}
+
+static void qctl_set(struct qctl_conn *conn, int argc, char **argv)
+{
+	struct qctl_tunable *qt;
+	unsigned long value;
+	char *end;
+
+	if (argc != 3) {
+		qctl_error(conn, "Usage: set NAME VALUE");
+		return;
+	}
+
+	qt = qctl_tunable_find(conn->qc, argv[1]);
+	if (!qt) {
+		qctl_error(conn, "Unknown tunable %s", argv[1]);
+		return;
+	}
+
+	errno = 0;
+	value = strtoul(argv[2], &end, 0);
+	if (errno || *end || end == argv[2] || value < qt->min ||
+	    value > qt->max) {
+		qctl_error(conn, "Bad value %s for %s, range is %u to %u",
+			   argv[2], qt->name, qt->min, qt->max);
+		return;
+	}
+
+	*qt->value = value;
+	if (qt->set_cb)
+		qt->set_cb(qt->data);
+
+	QCPRINTF(conn->qc, "qctl: Set %s to %lu\n", qt->name, value);
+
+	jsonw_uint_field(conn->jw, qt->name, *qt->value);
+}
+
+static void qctl_dispatch(struct qctl_conn *conn, int argc, char **argv)
+{
+	struct qctl_cmd *cmd;
+
+	if (!strcmp(argv[0], "help")) {
+		qctl_help(conn);
+		return;
+	} else if (!strcmp(argv[0], "get")) {
+		qctl_get(conn, argc, argv);
+		return;
+	} else if (!strcmp(argv[0], "set")) {
+		qctl_set(conn, argc, argv);
+		return;
+	}
+
+	for (cmd = conn->qc->cmds; cmd; cmd = cmd->next)
+		if (!strcmp(cmd->name, argv[0]))
+			break;
+
+	if (!cmd) {
+		qctl_error(conn, "Unknown command %s", argv[0]);
+		return;
+	}
+
+	cmd->fn(conn, argc, argv, cmd->data);
+}
+
+static void qctl_run(struct qctl_conn *conn, char *line)
+{
+	char *argv[QCTL_MAX_ARGS];
+	char *tok, *save;
+	int argc = 0;
+
+	for (tok = strtok_r(line, " \t\r", &save); tok;
+	     tok = strtok_r(NULL, " \t\r", &save)) {
+		if (argc == QCTL_MAX_ARGS)
+			break;
+		argv[argc++] = tok;
+	}
+
+	if (!argc)
+		return;
+
+	if (qctl_reply_start(conn) < 0) {
+		QCPRINTF(conn->qc, "qctl: Unable to start reply\n");
+		return;
+	}
+
+	qctl_dispatch(conn, argc, argv);
+
+	if (conn->stream)
+		qctl_stream_run(conn);
+	else
+		qctl_reply_end(conn);
+}
+
+/* Close once the client has sent everything and taken all replies */
+static void qctl_conn_check_done(struct qctl_conn *conn)
+{
+	if (!conn->eof || conn->stream)
+		return;
+
+	if (!evbuffer_get_length(bufferevent_get_output(conn->bev)))
+		qctl_conn_free(conn);
+	else
+		bufferevent_setwatermark(conn->bev, EV_WRITE, 0, 0);
+}
+
+static void qctl_process(struct qctl_conn *conn)
+{
+	struct evbuffer *input = bufferevent_get_input(conn->bev);
+	size_t len;
+	char *line;
+
+	while (!conn->stream) {
+		line = evbuffer_readln(input, &len, EVBUFFER_EOL_LF);
+		if (!line) {
+			len = evbuffer_get_length(input);
+			if (len > QCTL_LINE_MAX) {
+				QCPRINTF(conn->qc, "qctl: Line too long\n");
+				qctl_conn_free(conn);
+				return;
+			}
+			if (!conn->eof || !len)
+				break;
+
+			/* The last command may not have a newline */
+			line = malloc(len + 1);
+			if (!line)
+				break;
+			evbuffer_remove(input, line, len);
+			line[len] = '\0';
+		}
+
+		qctl_run(conn, line);
+		free(line);
+	}
+
+	qctl_conn_check_done(conn);
+}
+
+static void qctl_read_cb(struct bufferevent *bev, void *arg)
+{
+	qctl_process(arg);
+}
+
+static void qctl_write_cb(struct bufferevent *bev, void *arg)
+{
+	struct qctl_conn *conn = arg;
+
+	if (conn->stream) {
+		if (qctl_stream_run(conn))
+			qctl_process(conn);
+		return;
+	}
+
+	qctl_conn_check_done(conn);
+}
+
+static void qctl_event_cb(struct bufferevent *bev, short events, void *arg)
+{
+	struct qctl_conn *conn = arg;
+
+	if (events & BEV_EVENT_ERROR) {
+		qctl_conn_free(conn);
+		return;
+	}
+
+	if (events & BEV_EVENT_EOF) {
+		conn->eof = true;
+		qctl_process(conn);
+	}
+}
+
+static void qctl_accept_cb(struct evconnlistener *listener,
+			   evutil_socket_t fd, struct sockaddr *addr,
+			   int socklen, void *arg)
+{
+	struct qctl *qc = arg;
+	struct qctl_conn *conn;
+
+	conn = calloc(1, sizeof(*conn));
+	if (!conn) {
+		close(fd);
+		return;
+	}
+
+	conn->qc = qc;
+	conn->bev = bufferevent_socket_new(qc->event_base, fd,
+					   BEV_OPT_CLOSE_ON_FREE);
+	if (!conn->bev) {
+		free(conn);
+		close(fd);
+		return;
+	}
+
+	list_add(&conn->list, &qc->conns);
+
+	bufferevent_setcb(conn->bev, qctl_read_cb, qctl_write_cb,
+			  qctl_event_cb, conn);
+	bufferevent_setwatermark(conn->bev, EV_WRITE, QCTL_LOW_WATER, 0);
+	bufferevent_enable(conn->bev, EV_READ | EV_WRITE);
+}
+
+/* Listen on a Unix socket path or [ADDR]:PORT */
+int qctl_serve(struct qctl *qc, const char *addr)
+{
+	struct sockaddr_storage ss;
+	int sslen;
+
+	if (dbif_feed_parse_addr(addr, &ss, &sslen) < 0) {
+		QCPRINTF(qc, "qctl: Bad address %s\n", addr);
+		return -1;
+	}
+
+	if (ss.ss_family == AF_UNIX)
+		unlink(((struct sockaddr_un *)&ss)->sun_path);
+
+	/* A client that goes away in the middle of a reply must not take
+	 * the daemon with it.
+	 */
+	signal(SIGPIPE, SIG_IGN);
+
+	qc->listener = evconnlistener_new_bind(qc->event_base,
+					       qctl_accept_cb, qc,
+					       LEV_OPT_CLOSE_ON_FREE |
+					       LEV_OPT_REUSEABLE, -1,
+					       (struct sockaddr *)&ss, sslen);
+	if (!qc->listener) {
+		QCPRINTF(qc, "qctl: Listen on %s: %s\n", addr,
+			 strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+void qctl_destroy(struct qctl *qc)
+{
+	struct qctl_conn *conn, *tmp;
+	struct qctl_tunable *qt;
+	struct qctl_cmd *cmd;
+
+	list_for_each_entry_safe(conn, tmp, &qc->conns, list)
+		qctl_conn_free(conn);
+
+	if (qc->listener)
+		evconnlistener_free(qc->listener);
+
+	while ((cmd = qc->cmds)) {
+		qc->cmds = cmd->next;
+		free(cmd);
+	}
+
+	while ((qt = qc->tunables)) {
+		qc->tunables = qt->next;
+		free(qt);
+	}
+
+	free(qc);
+}
@@ -0,0 +1,115 @@
+/*
+ * qhash.c - Simple resizable hash table
+ *
+ * Copyright (c) 2018, Quantonium Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the Quantonium nor the names of its contributors
+ *     may be used to endorse or promote products derived from this software
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL QUANTONIUM BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "qhash.h"
+
+int qhash_init(struct qhash *qh, unsigned int order)
+{
+	qh->buckets = calloc(1U << order, sizeof(*qh->buckets));
+	if (!qh->buckets)
+		return -1;
+
+	qh->order = order;
+	qh->count = 0;
+
+	return 0;
+}
+
+/* Free the bucket array. Objects are owned by the caller */
+void qhash_destroy(struct qhash *qh)
+{
+	free(qh->buckets);
+	qh->buckets = NULL;
+	qh->count = 0;
+}
+
+/* Double the number of buckets. If memory can't be allocated the table
+ * stays as it is, lookups are then just slower.
+ */
+static void qhash_grow(struct qhash *qh)
+{
+	struct hlist_head *buckets;
+	struct hlist_node *pos, *tmp;
+	unsigned int i, size = qhash_size(qh);
+
+	buckets = calloc(size << 1, sizeof(*buckets));
+	if (!buckets)
+		return;
+
+	for (i = 0; i < size; i++) {
+		hlist_for_each_safe(pos, tmp, &qh->buckets[i]) {
+			struct qhash_node *node = hlist_entry(pos,
+							struct qhash_node,
+							hlist);
+
+			hlist_add_head(pos,
+				       &buckets[node->hash & ((size << 1) - 1)]);
+		}
+	}
+
+	free(qh->buckets);
+	qh->buckets = buckets;
+	qh->order++;
+}
+
+void qhash_add(struct qhash *qh, struct qhash_node *node, __u32 hash)
+{
+	if (qh->count >= qhash_size(qh))
+		qhash_grow(qh);
+
+	node->hash = hash;
+	hlist_add_head(&node->hlist, qhash_bucket(qh, hash));
+	qh->count++;
+}
+
+void qhash_del(struct qhash *qh, struct qhash_node *node)
+{
+	hlist_del(&node->hlist);
+	qh->count--;
+}
+
+/* FNV-1a over a byte string. The seed allows different tables to use
+ * independent hash functions.
+ */
+__u32 qhash_bytes(const void *data, size_t len, __u32 seed)
+{
+	const unsigned char *p = data;
+	__u32 hash = 2166136261U ^ seed;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 16777619U;
+	}
+
+	return hash;
+}
@@ -0,0 +1,539 @@
+/*
+ * qlog.c - Asynchronous rate limited logging
+ *
+ * Copyright (c) 2018, Quantonium Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the Quantonium nor the names of its contributors
+ *     may be used to endorse or promote products derived from this software
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL QUANTONIUM BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Records are passed to the writer in a bounded ring of slots, each with
+ * a sequence number that says whose turn it is (D. Vyukov's bounded
+ * queue). A producer claims the slot at head by advancing head when the
+ * slot's sequence equals it, fills the slot, and sets the sequence one
+ * past head to hand it to the writer. The writer takes the slot at tail
+ * when its sequence is one past tail and hands it back to producers for
+ * the next lap by setting it to tail plus the ring size. A producer
+ * that finds the slot at head not yet written out drops its record.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "qlog.h"
+
+#define QLOG_TEXT_MAX	240
+#define QLOG_IDLE_MS	10
+
+struct qlog_rec {
+	unsigned long seq;
+	enum qlog_level level;
+	struct timespec ts;
+	const char *src;
+	const char *msg;
+	unsigned long suppressed;
+	char text[QLOG_TEXT_MAX];
+};
+
+/* Stream from qlog_file. Line holds a line until its newline is written */
+struct qlog_stream {
+	struct qlog *ql;
+	struct qlog_site site;
+	enum qlog_level level;
+	char *src;
+	size_t len;
+	char line[QLOG_TEXT_MAX];
+	struct qlog_stream *next;
+};
+
+struct qlog {
+	struct qlog_rec *ring;
+	unsigned long mask;
+	unsigned long head;
+	unsigned long tail;
+	unsigned long dropped;
+	unsigned long dropped_reported;
+	enum qlog_level level;
+	unsigned int burst;
+	unsigned int rate;
+	FILE *out;
+	pthread_t thread;
+	bool running;
+	bool stop;
+	struct qlog_stream *streams;
+};
+
+static const char *qlog_level_names[] = {
+	[QLOG_ERR] = "err",
+	[QLOG_WARN] = "warn",
+	[QLOG_INFO] = "info",
+	[QLOG_DEBUG] = "debug",
+};
+
+/* Log drained at exit */
+static struct qlog *qlog_exit_log;
+
+static void qlog_stop(struct qlog *ql);
+
+static void qlog_atexit(void)
+{
+	if (qlog_exit_log)
+		qlog_stop(qlog_exit_log);
+}
+
+struct qlog *qlog_create(FILE *out, unsigned int ring_size)
+{
+	struct qlog *ql;
+	unsigned long i;
+
+	if (!ring_size || (ring_size & (ring_size - 1)))
+		return NULL;
+
+	ql = calloc(1, sizeof(*ql));
+	if (!ql)
+		return NULL;
+
+	ql->ring = calloc(ring_size, sizeof(*ql->ring));
+	if (!ql->ring) {
+		free(ql);
+		return NULL;
+	}
+
+	for (i = 0; i < ring_size; i++)
+		ql->ring[i].seq = i;
+
+	ql->mask = ring_size - 1;
+	ql->out = out;
+	ql->level = QLOG_INFO;
+	ql->burst = QLOG_DEFAULT_BURST;
+	ql->rate = QLOG_DEFAULT_RATE;
+
+	if (!qlog_exit_log)
+		atexit(qlog_atexit);
+	qlog_exit_log = ql;
+
+	return ql;
+}
+
+void qlog_set_level(struct qlog *ql, enum qlog_level level)
+{
+	__atomic_store_n(&ql->level, level, __ATOMIC_RELAXED);
+}
+
+enum qlog_level qlog_get_level(struct qlog *ql)
+{
+	return __atomic_load_n(&ql->level, __ATOMIC_RELAXED);
+}
+
+/* A rate of zero turns off rate limiting */
+void qlog_set_rate(struct qlog *ql, unsigned int burst, unsigned int rate)
+{
+	ql->burst = burst ? : 1;
+	ql->rate = rate;
+}
+
+static __u64 qlog_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+/* Token bucket kept as the time in usecs at which the bucket of the site
+ * is full again, one word so that sites shared by threads are updated
+ * with a compare and swap. Each record costs 1/rate seconds and the
+ * bucket holds burst records.
+ */
+static bool qlog_allow(struct qlog *ql, struct qlog_site *site,
+		       enum qlog_level level, unsigned long *suppressed)
+{
+	__u64 now, cost, max, full, next;
+
+	*suppressed = 0;
+
+	if (!ql->rate || level == QLOG_DEBUG)
+		return true;
+
+	now = qlog_now();
+	cost = 1000000 / ql->rate;
+	max = cost * ql->burst;
+
+	full = __atomic_load_n(&site->full, __ATOMIC_RELAXED);
+	do {
+		next = (full > now ? full : now) + cost;
+		if (next - now > max) {
+			__atomic_fetch_add(&site->suppressed, 1,
+					   __ATOMIC_RELAXED);
+			return false;
+		}
+	} while (!__atomic_compare_exchange_n(&site->full, &full, next, true,
+					      __ATOMIC_RELAXED,
+					      __ATOMIC_RELAXED));
+
+	*suppressed = __atomic_exchange_n(&site->suppressed, 0,
+					  __ATOMIC_RELAXED);
+
+	return true;
+}
+
+/* Claim the slot at head, or count a drop if the ring is full */
+static struct qlog_rec *qlog_reserve(struct qlog *ql, unsigned long *posp)
+{
+	unsigned long pos = __atomic_load_n(&ql->head, __ATOMIC_RELAXED);
+	struct qlog_rec *rec;
+	long diff;
+
+	for (;;) {
+		rec = &ql->ring[pos & ql->mask];
+		diff = (long)(__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) -
+			      pos);
+		if (!diff) {
+			if (__atomic_compare_exchange_n(&ql->head, &pos,
+							pos + 1, true,
+							__ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+				break;
+		} else if (diff < 0) {
+			__atomic_fetch_add(&ql->dropped, 1, __ATOMIC_RELAXED);
+			return NULL;
+		} else {
+			pos = __atomic_load_n(&ql->head, __ATOMIC_RELAXED);
+		}
+	}
+
+	*posp = pos;
+	clock_gettime(CLOCK_REALTIME, &rec->ts);
+
+	return rec;
+}
+
+static void qlog_commit(struct qlog_rec *rec, unsigned long pos)
+{
+	__atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+void qlog_log(struct qlog *ql, struct qlog_site *site, enum qlog_level level,
+	      const char *fmt, ...)
+{
+	unsigned long suppressed, pos;
+	struct qlog_rec *rec;
+	va_list ap;
+
+	if (level > qlog_get_level(ql) ||
+	    !qlog_allow(ql, site, level, &suppressed))
+		return;
+
+	rec = qlog_reserve(ql, &pos);
+	if (!rec) {
+		/* Report them with the next record that fits */
+		__atomic_fetch_add(&site->suppressed, suppressed,
+				   __ATOMIC_RELAXED);
+		return;
+	}
+
+	rec->level = level;
+	rec->src = NULL;
+	rec->msg = site->msg;
+	rec->suppressed = suppressed;
+
+	va_start(ap, fmt);
+	vsnprintf(rec->text, sizeof(rec->text), fmt, ap);
+	va_end(ap);
+
+	qlog_commit(rec, pos);
+}
+
+/* Write s as a quoted logfmt value */
+static void qlog_write_quoted(FILE *f, const char *s)
+{
+	fputc('"', f);
+
+	for (; *s; s++) {
+		switch (*s) {
+		case '"':
+		case '\\':
+			fputc('\\', f);
+			fputc(*s, f);
+			break;
+		case '\n':
+			fputs("\\n", f);
+			break;
+		case '\t':
+			fputs("\\t", f);
+			break;
+		default:
+			if ((unsigned char)*s < ' ')
+				fprintf(f, "\\x%02x", (unsigned char)*s);
+			else
+				fputc(*s, f);
+		}
+	}
+
+	fputc('"', f);
+}
+
+static void qlog_write_head(FILE *f, const struct timespec *ts,
+			    enum qlog_level level)
+{
+	char buf[32];
+	struct tm tm;
+
+	gmtime_r(&ts->tv_sec, &tm);
+	strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &tm);
+
+	fprintf(f, "ts=%s.%06ldZ level=%s", buf, ts->tv_nsec / 1000,
+		qlog_level_names[level]);
+}
+
+static void qlog_write_rec(struct qlog *ql, struct qlog_rec *rec)
+{
+	FILE *f = ql->out;
+
+	qlog_write_head(f, &rec->ts, rec->level);
+
+	if (rec->src)
+		fprintf(f, " src=%s", rec->src);
+
+	fputs(" msg=", f);
+	if (rec->msg) {
+		qlog_write_quoted(f, rec->msg);
+		if (rec->text[strspn(rec->text, " ")])
+			fputs(rec->text, f);
+	} else {
+		qlog_write_quoted(f, rec->text);
+	}
+
+	if (rec->suppressed)
+		fprintf(f, " suppressed=%lu", rec->suppressed);
+
+	fputc('\n', f);
+}
+
+/* Write out the records in the ring, returns the number written */
+static unsigned long qlog_drain(struct qlog *ql)
+{
+	unsigned long n = 0, dropped;
+	struct qlog_rec *rec;
+	struct timespec ts;
+
+	for (;;) {
+		rec = &ql->ring[ql->tail & ql->mask];
+		if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) !=
+		    ql->tail + 1)
+			break;
+
+		qlog_write_rec(ql, rec);
+
+		__atomic_store_n(&rec->seq, ql->tail + ql->mask + 1,
+				 __ATOMIC_RELEASE);
+		ql->tail++;
+		n++;
+	}
+
+	dropped = __atomic_load_n(&ql->dropped, __ATOMIC_RELAXED);
+	if (dropped != ql->dropped_reported) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		qlog_write_head(ql->out, &ts, QLOG_WARN);
+		fprintf(ql->out, " msg=\"Log ring full\" dropped=%lu\n",
+			dropped - ql->dropped_reported);
+		ql->dropped_reported = dropped;
+		n++;
+	}
+
+	return n;
+}
+
+static void *qlog_writer(void *arg)
+{
+	struct timespec idle = {
+		.tv_nsec = QLOG_IDLE_MS * 1000000,
+	};
+	struct qlog *ql = arg;
+	bool stop;
+
+	for (;;) {
+		stop = __atomic_load_n(&ql->stop, __ATOMIC_ACQUIRE);
+		if (qlog_drain(ql))
+			continue;
+		if (stop)
+			break;
+		fflush(ql->out);
+		nanosleep(&idle, NULL);
+	}
+
+	fflush(ql->out);
+
+	return NULL;
+}
+
+int qlog_start(struct qlog *ql)
+{
+	int err;
+
+	err = pthread_create(&ql->thread, NULL, qlog_writer, ql);
+	if (err) {
+		errno = err;
+		return -1;
+	}
+
+	ql->running = true;
+
+	return 0;
+}
+
+/* Write out what's left, by the writer if it's running */
+static void qlog_stop(struct qlog *ql)
+{
+	if (ql->running) {
+		__atomic_store_n(&ql->stop, true, __ATOMIC_RELEASE);
+		pthread_join(ql->thread, NULL);
+		ql->running = false;
+	} else {
+		qlog_drain(ql);
+		fflush(ql->out);
+	}
+}
+
+void qlog_destroy(struct qlog *ql)
+{
+	struct qlog_stream *qs;
+
+	qlog_stop(ql);
+
+	if (qlog_exit_log == ql)
+		qlog_exit_log = NULL;
+
+	while ((qs = ql->streams)) {
+		ql->streams = qs->next;
+		free(qs->src);
+		free(qs);
+	}
+
+	free(ql->ring);
+	free(ql);
+}
+
+static void qlog_stream_put(struct qlog_stream *qs)
+{
+	struct qlog *ql = qs->ql;
+	unsigned long suppressed, pos;
+	struct qlog_rec *rec;
+
+	qs->line[qs->len] = '\0';
+	qs->len = 0;
+
+	if (qs->level > qlog_get_level(ql) ||
+	    !qlog_allow(ql, &qs->site, qs->level, &suppressed))
+		return;
+
+	rec = qlog_reserve(ql, &pos);
+	if (!rec) {
+		__atomic_fetch_add(&qs->site.suppressed, suppressed,
+				   __ATOMIC_RELAXED);
+		return;
+	}
+
+	rec->level = qs->level;
+	rec->src = qs->src;
+	rec->msg = NULL;
+	rec->suppressed = suppressed;
+	strcpy(rec->text, qs->line);
+
+	qlog_commit(rec, pos);
+}
+
+/* Lines longer than a record are split */
+static ssize_t qlog_stream_write(void *cookie, const char *buf, size_t size)
+{
+	struct qlog_stream *qs = cookie;
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		if (buf[i] == '\n') {
+			qlog_stream_put(qs);
+			continue;
+		}
+
+		qs->line[qs->len++] = buf[i];
+		if (qs->len == sizeof(qs->line) - 1)
+			qlog_stream_put(qs);
+	}
+
+	return size;
+}
+
+/* The stream is freed with the log */
+static int qlog_stream_close(void *cookie)
+{
+	struct qlog_stream *qs = cookie;
+
+	if (qs->len)
+		qlog_stream_put(qs);
+
+	return 0;
+}
+
+FILE *qlog_file(struct qlog *ql, enum qlog_level level, const char *src)
+{
+	cookie_io_functions_t io = {
+		.write = qlog_stream_write,
+		.close = qlog_stream_close,
+	};
+	struct qlog_stream *qs;
+	FILE *f;
+
+	qs = calloc(1, sizeof(*qs));
+	if (!qs)
+		return NULL;
+
+	qs->src = strdup(src);
+	if (!qs->src) {
+		free(qs);
+		return NULL;
+	}
+
+	qs->ql = ql;
+	qs->level = level;
+
+	f = fopencookie(qs, "w", io);
+	if (!f) {
+		free(qs->src);
+		free(qs);
+		return NULL;
+	}
+
+	setvbuf(f, NULL, _IOLBF, 0);
+
+	qs->next = ql->streams;
+	ql->streams = qs;
+
+	return f;
+}
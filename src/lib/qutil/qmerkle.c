@@ -0,0 +1,160 @@
+/*
+ * qmerkle.c - Incremental hash tree for anti-entropy
+ *
+ * Copyright (c) 2018, Quantonium Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the Quantonium nor the names of its contributors
+ *     may be used to endorse or promote products derived from this software
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL QUANTONIUM BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "qmerkle.h"
+
+/* Moduli of the entry hash. Products stay below 2^53 */
+#define QMERKLE_MOD_A	2147483647ULL
+#define QMERKLE_MOD_B	131071ULL
+
+int qmerkle_init(struct qmerkle *qm, unsigned int bits)
+{
+	if (bits > QMERKLE_MAX_BITS)
+		return -1;
+
+	qm->nodes = calloc(2U << bits, sizeof(*qm->nodes));
+	if (!qm->nodes)
+		return -1;
+
+	qm->bits = bits;
+
+	return 0;
+}
+
+void qmerkle_destroy(struct qmerkle *qm)
+{
+	free(qm->nodes);
+	qm->nodes = NULL;
+}
+
+void qmerkle_clear(struct qmerkle *qm)
+{
+	memset(qm->nodes, 0, (2U << qm->bits) * sizeof(*qm->nodes));
+}
+
+void qmerkle_add(struct qmerkle *qm, unsigned int leaf, __u64 hash)
+{
+	unsigned int i;
+
+	for (i = qmerkle_num_leaves(qm) + leaf; i; i >>= 1)
+		qm->nodes[i] = (qm->nodes[i] + hash) & QMERKLE_MASK;
+}
+
+void qmerkle_sub(struct qmerkle *qm, unsigned int leaf, __u64 hash)
+{
+	unsigned int i;
+
+	for (i = qmerkle_num_leaves(qm) + leaf; i; i >>= 1)
+		qm->nodes[i] = (qm->nodes[i] - hash) & QMERKLE_MASK;
+}
+
+/* Build the tree from leaf sums, e.g. as kept by the database */
+void qmerkle_set_leaves(struct qmerkle *qm, const __u64 *leaves)
+{
+	unsigned int i, n = qmerkle_num_leaves(qm);
+
+	for (i = 0; i < n; i++)
+		qm->nodes[n + i] = leaves[i] & QMERKLE_MASK;
+
+	for (i = n - 1; i; i--)
+		qm->nodes[i] = (qm->nodes[2 * i] + qm->nodes[2 * i + 1]) &
+			       QMERKLE_MASK;
+}
+
+static unsigned int qmerkle_diff_node(const struct qmerkle *a,
+				      const struct qmerkle *b,
+				      unsigned int i,
+				      void (*cb)(unsigned int leaf,
+						 void *data),
+				      void *data)
+{
+	unsigned int n = qmerkle_num_leaves(a);
+
+	if (a->nodes[i] == b->nodes[i])
+		return 0;
+
+	if (i >= n) {
+		cb(i - n, data);
+		return 1;
+	}
+
+	return qmerkle_diff_node(a, b, 2 * i, cb, data) +
+	       qmerkle_diff_node(a, b, 2 * i + 1, cb, data);
+}
+
+/* Call cb for each leaf that differs between two trees of the same size
+ * and return the number of those leaves. Equal trees cost one compare.
+ */
+unsigned int qmerkle_diff(const struct qmerkle *a, const struct qmerkle *b,
+			  void (*cb)(unsigned int leaf, void *data),
+			  void *data)
+{
+	if (a->bits != b->bits)
+		return 0;
+
+	return qmerkle_diff_node(a, b, 1, cb, data);
+}
+
+static void qmerkle_poly(const void *data, size_t len,
+			 __u64 *a, __u64 *b)
+{
+	const __u8 *p = data;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		*a = (*a * 131 + p[i]) % QMERKLE_MOD_A;
+		*b = (*b * 137 + p[i]) % QMERKLE_MOD_B;
+	}
+}
+
+/* Hash of an entry over its key followed by its value */
+__u64 qmerkle_hash(const void *key, size_t key_size,
+		   const void *value, size_t value_size)
+{
+	__u64 a = 0, b = 0;
+
+	qmerkle_poly(key, key_size, &a, &b);
+	qmerkle_poly(value, value_size, &a, &b);
+
+	return a * (QMERKLE_MOD_B + 1) + b;
+}
+
+/* Leaf of a key */
+unsigned int qmerkle_leaf(const struct qmerkle *qm, const void *key,
+			  size_t key_size)
+{
+	__u64 a = 0, b = 0;
+
+	qmerkle_poly(key, key_size, &a, &b);
+
+	return a & (qmerkle_num_leaves(qm) - 1);
+}
@@ -0,0 +1,497 @@
+/*
+ * qmetrics.c - Runtime metrics in Prometheus text format
+ *
+ * Copyright (c) 2018, Quantonium Inc. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of the Quantonium nor the names of its contributors
+ *     may be used to endorse or promote products derived from this software
+ *     without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL QUANTONIUM BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <event2/buffer.h>
+#include <event2/http.h>
+#include <event2/listener.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "dbif_feed.h"
+#include "qmetrics.h"
+
+struct qmetrics {
+	struct qmetric *head;
+	struct qmetric **tail;
+	struct qmetric sink;
+	bool failed;
+	struct evhttp *http;
+	FILE *logf;
+};
+
+#define QMPRINTF(qms, format, ...) do {				\
+	if (qms->logf)						\
+		fprintf(qms->logf, format, ##__VA_ARGS__);	\
+} while (0)
+
+struct qmetrics *qmetrics_create(void)
+{
+	struct qmetrics *qms;
+
+	qms = calloc(1, sizeof(*qms));
+	if (!qms)
+		return NULL;
+
+	qms->sink.counts = calloc(QMETRICS_NUM_BUCKETS + 1,
+				  sizeof(*qms->sink.counts));
+	if (!qms->sink.counts) {
+		free(qms);
+		return NULL;
+	}
+	qms->sink.vec_size = 1;
+	qms->tail = &qms->head;
+
+	return qms;
+}
+
+/* Creating a metric returns the sink if allocation fails so that the
+ * daemon can update it regardless, failure is checked once after all
+ * metrics are created.
+ */
+static struct qmetric *qmetrics_fail(struct qmetrics *qms,
+				     struct qmetric *qm)
+{
+	if (qm) {
+		free(qm->counts);
+		free(qm);
+	}
+	qms->failed = true;
+
+	return &qms->sink;
+}
+
+bool qmetrics_failed(struct qmetrics *qms)
+{
+	return qms->failed;
+}
+
+void qmetrics_destroy(struct qmetrics *qms)
+{
+	struct qmetric *qm, *next;
+
+	for (qm = qms->head; qm; qm = next) {
+		next = qm->next;
+		free(qm->counts);
+		free(qm);
+	}
+
+	free(qms->sink.counts);
+
+	if (qms->http)
+		evhttp_free(qms->http);
+
+	free(qms);
+}
+
+static struct qmetric *qmetrics_add(struct qmetrics *qms, const char *name,
+				    const char *labels, const char *help,
+				    enum qmetric_type type, unsigned int ncounts)
+{
+	struct qmetric *qm;
+
+	qm = calloc(1, sizeof(*qm));
+	if (!qm)
+		return qmetrics_fail(qms, NULL);
+
+	if (ncounts) {
+		qm->counts = calloc(ncounts, sizeof(*qm->counts));
+		if (!qm->counts)
+			return qmetrics_fail(qms, qm);
+	}
+
+	qm->name = name;
+	qm->labels = labels;
+	qm->help = help;
+	qm->type = type;
+
+	*qms->tail = qm;
+	qms->tail = &qm->next;
+
+	return qm;
+}
+
+struct qmetric *qmetrics_counter(struct qmetrics *qms, const char *name,
+				 const char *labels, const char *help)
+{
+	return qmetrics_add(qms, name, labels, help, QMETRIC_COUNTER, 0);
+}
+
+struct qmetric *qmetrics_counter_vec(struct qmetrics *qms, const char *name,
+				     const char *vec_label,
+				     unsigned int vec_size,
+				     const char *help)
+{
+	struct qmetric *qm;
+
+	if (!vec_size)
+		return qmetrics_fail(qms, NULL);
+
+	qm = qmetrics_add(qms, name, NULL, help, QMETRIC_COUNTER_VEC,
+			  vec_size);
+	if (qm == &qms->sink)
+		return qm;
+
+	qm->vec_label = vec_label;
+	qm->vec_size = vec_size;
+
+	return qm;
+}
+
+struct qmetric *qmetrics_gauge(struct qmetrics *qms, const char *name,
+			       const char *labels, const char *help)
+{
+	return qmetrics_add(qms, name, labels, help, QMETRIC_GAUGE, 0);
+}
+
+struct qmetric *qmetrics_gauge_func(struct qmetrics *qms, const char *name,
+				    const char *labels, const char *help,
+				    __u64 (*get)(void *data), void *data)
+{
+	struct qmetric *qm;
+
+	qm = qmetrics_add(qms, name, labels, help, QMETRIC_GAUGE, 0);
+	if (qm == &qms->sink)
+		return qm;
+
+	qm->get = get;
+	qm->data = data;
+
+	return qm;
+}
+
+struct qmetric *qmetrics_histogram(struct qmetrics *qms, const char *name,
+				   const char *labels, const char *help)
+{
+	/* Last count is for values beyond the buckets */
+	return qmetrics_add(qms, name, labels, help, QMETRIC_HISTOGRAM,
+			    QMETRICS_NUM_BUCKETS + 1);
+}
+
+/* Values below QMETRICS_SUB_BUCKETS have a bucket each, above that
+ * each power of two has QMETRICS_SUB_BUCKETS buckets of equal width.
+ */
+static unsigned int qmetrics_bucket(__u64 v)
+{
+	unsigned int msb;
+
+	if (v < QMETRICS_SUB_BUCKETS)
+		return v;
+
+	msb = 63 - __builtin_clzll(v);
+	if (msb >= QMETRICS_MAX_BITS)
+		return QMETRICS_NUM_BUCKETS;
+
+	return (msb - QMETRICS_SUB_BITS + 1) * QMETRICS_SUB_BUCKETS +
+	    ((v >> (msb - QMETRICS_SUB_BITS)) & (QMETRICS_SUB_BUCKETS - 1));
+}
+
+/* Largest value that falls in a bucket */
+static __u64 qmetrics_bucket_max(unsigned int i)
+{
+	unsigned int e = i / QMETRICS_SUB_BUCKETS;
+	unsigned int sub = i % QMETRICS_SUB_BUCKETS;
+
+	if (!e)
+		return i;
+
+	return ((__u64)(QMETRICS_SUB_BUCKETS + sub + 1) << (e - 1)) - 1;
+}
+
+void qmetric_observe(struct qmetric *qm, __u64 usecs)
+{
+	qm->counts[qmetrics_bucket(usecs)]++;
+	qm->sum += usecs;
+	qm->value++;
+}
+
+static void qmetrics_print_labels(FILE *f, const char *labels,
+				  const char *extra)
+{
+	if (!labels && !extra)
+		return;
+
+	fprintf(f, "{%s%s%s}", labels ? : "", labels && extra ? "," : "",
+		extra ? : "");
+}
+
+static void qmetrics_print_histogram(FILE *f, struct qmetric *qm)
+{
+	char le[32];
+	__u64 cum = 0;
+	unsigned int i;
+
+	for (i = 0; i < QMETRICS_NUM_BUCKETS; i++) {
+		cum += qm->counts[i];
+		snprintf(le, sizeof(le), "le=\"%.6f\"",
+			 qmetrics_bucket_max(i) / 1000000.0);
+		fprintf(f, "%s_bucket", qm->name);
+		qmetrics_print_labels(f, qm->labels, le);
+		fprintf(f, " %llu\n", cum);
+	}
+
+	fprintf(f, "%s_bucket", qm->name);
+	qmetrics_print_labels(f, qm->labels, "le=\"+Inf\"");
+	fprintf(f, " %llu\n", qm->value);
+
+	fprintf(f, "%s_sum", qm->name);
+	qmetrics_print_labels(f, qm->labels, NULL);
+	fprintf(f, " %.6f\n", qm->sum / 1000000.0);
+
+	fprintf(f, "%s_count", qm->name);
+	qmetrics_print_labels(f, qm->labels, NULL);
+	fprintf(f, " %llu\n", qm->value);
+}
+
+static const char *qmetrics_type_name(enum qmetric_type type)
+{
+	switch (type) {
+	case QMETRIC_COUNTER:
+	case QMETRIC_COUNTER_VEC:
+		return "counter";
+	case QMETRIC_GAUGE:
+		return "gauge";
+	case QMETRIC_HISTOGRAM:
+		return "histogram";
+	}
+
+	return "untyped";
+}
+
+int qmetrics_print(struct qmetrics *qms, FILE *f)
+{
+	const char *last = NULL;
+	struct qmetric *qm;
+	char label[64];
+	unsigned int i;
+
+	for (qm = qms->head; qm; qm = qm->next) {
+		if (!last || strcmp(last, qm->name)) {
+			fprintf(f, "# HELP %s %s\n", qm->name, qm->help);
+			fprintf(f, "# TYPE %s %s\n", qm->name,
+				qmetrics_type_name(qm->type));
+			last = qm->name;
+		}
+
+		switch (qm->type) {
+		case QMETRIC_COUNTER:
+		case QMETRIC_GAUGE:
+			fprintf(f, "%s", qm->name);
+			qmetrics_print_labels(f, qm->labels, NULL);
+			fprintf(f, " %llu\n",
+				qm->get ? qm->get(qm->data) : qm->value);
+			break;
+		case QMETRIC_COUNTER_VEC:
+			for (i = 0; i < qm->vec_size; i++) {
+				if (!qm->counts[i])
+					continue;
+				snprintf(label, sizeof(label), "%s=\"%u\"",
+					 qm->vec_label, i);
+				fprintf(f, "%s", qm->name);
+				qmetrics_print_labels(f, NULL, label);
+				fprintf(f, " %llu\n", qm->counts[i]);
+			}
+			break;
+		case QMETRIC_HISTOGRAM:
+			qmetrics_print_histogram(f, qm);
+			break;
+		}
+	}
+
+	return ferror(f) ? -1 : 0;
+}
+
+/* Upper bound of the bucket that holds quantile q of the observations */
+static double qmetrics_quantile(struct qmetric *qm, double q)
+{
+	__u64 rank = q * qm->value, cum = 0;
+	unsigned int i;
+
+	for (i = 0; i < QMETRICS_NUM_BUCKETS; i++) {
+		cum += qm->counts[i];
+		if (cum > rank)
+			return qmetrics_bucket_max(i) / 1000000.0;
+	}
+
+	return qmetrics_bucket_max(QMETRICS_NUM_BUCKETS - 1) / 1000000.0;
+}
+
+void qmetric_json_histogram(json_writer_t *jw, struct qmetric *qm)
+{
+	static const struct {
+		const char *name;
+		double q;
+	} quantiles[] = {
+		{ "p50", 0.5 },
+		{ "p90", 0.9 },
+		{ "p99", 0.99 },
+		{ "p999", 0.999 },
+	};
+	unsigned int i;
+
+	jsonw_lluint_field(jw, "count", qm->value);
+	jsonw_float_field_fmt(jw, "sum", "%.6f", qm->sum / 1000000.0);
+
+	if (!qm->value)
+		return;
+
+	for (i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++)
+		jsonw_float_field_fmt(jw, quantiles[i].name, "%.6f",
+				      qmetrics_quantile(qm, quantiles[i].q));
+}
+
+void qmetrics_json(struct qmetrics *qms, json_writer_t *jw)
+{
+	struct qmetric *qm;
+	unsigned int i;
+
+	jsonw_start_array(jw);
+
+	for (qm = qms->head; qm; qm = qm->next) {
+		jsonw_start_object(jw);
+		jsonw_string_field(jw, "name", qm->name);
+		if (qm->labels)
+			jsonw_string_field(jw, "labels", qm->labels);
+		jsonw_string_field(jw, "type", qmetrics_type_name(qm->type));
+
+		switch (qm->type) {
+		case QMETRIC_COUNTER:
+		case QMETRIC_GAUGE:
+			jsonw_lluint_field(jw, "value",
+					   qm->get ? qm->get(qm->data) :
+						     qm->value);
+			break;
+		case QMETRIC_COUNTER_VEC:
+			jsonw_name(jw, "values");
+			jsonw_start_object(jw);
+			for (i = 0; i < qm->vec_size; i++) {
+				char label[16];
+
+				if (!qm->counts[i])
+					continue;
+				snprintf(label, sizeof(label), "%u", i);
+				jsonw_lluint_field(jw, label, qm->counts[i]);
+			}
+			jsonw_end_object(jw);
+			break;
+		case QMETRIC_HISTOGRAM:
+			qmetric_json_histogram(jw, qm);
+			break;
+		}
+
+		jsonw_end_object(jw);
+	}
+
+	jsonw_end_array(jw);
+}
+
+static void qmetrics_request_cb(struct evhttp_request *req, void *arg)
+{
+	struct qmetrics *qms = arg;
+	struct evbuffer *evb;
+	size_t len = 0;
+	char *buf = NULL;
+	FILE *f;
+
+	if (evhttp_request_get_command(req) != EVHTTP_REQ_GET) {
+		evhttp_send_error(req, HTTP_BADMETHOD, NULL);
+		return;
+	}
+
+	f = open_memstream(&buf, &len);
+	if (!f) {
+		evhttp_send_error(req, HTTP_INTERNAL, NULL);
+		return;
+	}
+
+	if (qmetrics_print(qms, f) < 0 || fclose(f)) {
+		free(buf);
+		evhttp_send_error(req, HTTP_INTERNAL, NULL);
+		return;
+	}
+
+	evb = evhttp_request_get_output_buffer(req);
+	evbuffer_add(evb, buf, len);
+	free(buf);
+
+	evhttp_add_header(evhttp_request_get_output_headers(req),
+			  "Content-Type", "text/plain; version=0.0.4");
+	evhttp_send_reply(req, HTTP_OK, "OK", NULL);
+}
+
+/* Serve /metrics over HTTP on a Unix socket path or [ADDR]:PORT */
+int qmetrics_serve(struct qmetrics *qms, struct event_base *event_base,
+		   const char *addr, FILE *logf)
+{
+	struct evconnlistener *listener;
+	struct sockaddr_storage ss;
+	int sslen;
+
+	qms->logf = logf;
+
+	if (dbif_feed_parse_addr(addr, &ss, &sslen) < 0) {
+		QMPRINTF(qms, "qmetrics: Bad address %s\n", addr);
+		return -1;
+	}
+
+	if (ss.ss_family == AF_UNIX)
+		unlink(((struct sockaddr_un *)&ss)->sun_path);
+
+	qms->http = evhttp_new(event_base);
+	if (!qms->http) {
+		QMPRINTF(qms, "qmetrics: evhttp_new failed\n");
+		return -1;
+	}
+
+	evhttp_set_allowed_methods(qms->http, EVHTTP_REQ_GET);
+	evhttp_set_cb(qms->http, "/metrics", qmetrics_request_cb, qms);
+
+	listener = evconnlistener_new_bind(event_base, NULL, NULL,
+					   LEV_OPT_CLOSE_ON_FREE |
+					   LEV_OPT_REUSEABLE, -1,
+					   (struct sockaddr *)&ss, sslen);
+	if (!listener) {
+		QMPRINTF(qms, "qmetrics: Listen on %s: %s\n", addr,
+			 strerror(errno));
+		return -1;
+	}
+
+	if (!evhttp_bind_listener(qms->http, listener)) {
+		QMPRINTF(qms, "qmetrics: Bind HTTP on %s failed\n", addr);
+		evconnlistener_free(listener);
+		return -1;
+	}
+
+	return 0;
+}